@@ -25,6 +25,7 @@
 #include "common/Common.h"
 #include "common/Array.h"
 #include "common/Map.h"
+#include "common/FrameCache.h"
 #include "common/FileTree.h"
 #include "common/FileStream.h"
 #include "common/Directory.h"
@@ -222,6 +223,9 @@ typedef struct _CASC_FILE_SPAN
     DWORD ArchiveOffs;                              // Offset in the archive
     DWORD HeaderSize;                               // Size of encoded frame headers
     DWORD FrameCount;                               // Number of frames in this span
+    DWORD ContentSize;                              // Content size of the span (CASC_INVALID_SIZE if not known yet)
+    DWORD EncodedSize;                              // Encoded size of the span (CASC_INVALID_SIZE if not known yet)
+    bool bPlainData;                                // The span data is not BLTE encoded, but in plain format
 
 } CASC_FILE_SPAN, *PCASC_FILE_SPAN;
 
@@ -289,6 +293,7 @@ struct TCascStorage
     DWORD dwBuildNumber;                            // Product build number
     DWORD dwRefCount;                               // Number of references
     DWORD dwFeatures;                               // List of CASC features. See CASC_FEATURE_XXX
+    DWORD dwOpenFlags;                              // Flags from CASC_OPEN_STORAGE_ARGS::dwFlags. See CASC_STORAGE_XXX
 
     CBLD_TYPE BuildFileType;                        // Type of the build file
 
@@ -301,9 +306,11 @@ struct TCascStorage
     QUERY_KEY PatchArchivesGroup;                   // Key array of the "patch-archive-group"
     QUERY_KEY BuildFiles;                           // List of supported build files
 
+    CASC_LOCK StorageLock;                          // Guards opening of data files and the other members changed after the storage is open
     TFileStream * DataFiles[CASC_MAX_DATA_FILES];   // Array of open data files
     CASC_INDEX IndexFiles[CASC_INDEX_COUNT];        // Array of found index files
-    CASC_MAP IndexEKeyMap;
+    CASC_KEY_MAP IndexEKeyMap;
+    LPBYTE pbIndexSnapshot;                         // Index entries loaded from the storage snapshot. IndexEKeyMap points to them
 
     CASC_CKEY_ENTRY EncodingCKey;                   // Information about ENCODING file
     CASC_CKEY_ENTRY DownloadCKey;                   // Information about DOWNLOAD file
@@ -318,9 +325,9 @@ struct TCascStorage
     CASC_ARRAY IndexArray;                          // Array of CASC_EKEY_ENTRY, loaded from online indexes
     CASC_ARRAY CKeyArray;                           // Array of CASC_CKEY_ENTRY, loaded from ENCODING file
     CASC_ARRAY TagsArray;                           // Array of CASC_DOWNLOAD_TAG2
-    CASC_MAP IndexMap;                              // Map of EKey -> IndexArray (for online archives)
-    CASC_MAP CKeyMap;                               // Map of CKey -> CKeyArray
-    CASC_MAP EKeyMap;                               // Map of EKey -> CKeyArray
+    CASC_KEY_MAP IndexMap;                          // Map of EKey -> IndexArray (for online archives)
+    CASC_KEY_MAP CKeyMap;                           // Map of CKey -> CKeyArray
+    CASC_KEY_MAP EKeyMap;                           // Map of EKey -> CKeyArray
     size_t LocalFiles;                              // Number of files that are present locally
     size_t TotalFiles;                              // Total number of files in the storage, some may not be present locally
     size_t EKeyEntries;                             // Number of CKeyEntry-ies loaded from text build file
@@ -328,7 +335,8 @@ struct TCascStorage
     DWORD FileOffsetBits;                           // Number of bits in the storage offset which mean data segent offset
 
     CASC_ARRAY ExtraKeysList;                       // List additional encryption keys
-    CASC_MAP   EncryptionKeys;                      // Map of encryption keys
+    CASC_KEY_MAP EncryptionKeys;                    // Map of encryption keys
+    CASC_FRAME_CACHE FrameCache;                    // Decoded file frames, shared by all file handles
     ULONGLONG  LastFailKeyName;                     // The value of the encryption key that recently was NOT found.
 };
 
@@ -479,6 +487,8 @@ DWORD CascDecrypt(TCascStorage * hs, LPBYTE pbOutBuffer, PDWORD pcbOutBuffer, LP
 
 bool CopyEKeyEntry(TCascStorage * hs, PCASC_CKEY_ENTRY pCKeyEntry);
 
+DWORD ScanIndexFiles(TCascStorage * hs);
+LPTSTR GetIndexFileName(TCascStorage * hs, DWORD IndexValue);
 DWORD LoadIndexFiles(TCascStorage * hs);
 void  FreeIndexFiles(TCascStorage * hs);
 
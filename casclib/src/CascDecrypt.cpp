@@ -17,6 +17,13 @@
 
 #define CASC_EXTRA_KEYS 0x80
 
+// Salsa20 generates four key stream blocks at once by SSE2 where available
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define CASC_SALSA20_SSE2
+#define CASC_SALSA20_BLOCKS 4
+#endif
+
 typedef struct _CASC_ENCRYPTION_KEY
 {
     ULONGLONG KeyName;                  // "Name" of the key
@@ -288,6 +295,88 @@ static void Initialize(PCASC_SALSA20 pState, LPBYTE pbKey, DWORD cbKeyLength, LP
     pState->dwRounds = 20;
 }
 
+#ifdef CASC_SALSA20_SSE2
+
+#define SALSA20_ROL(x, n)   _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n))
+
+#define SALSA20_QUARTER_ROUND(a, b, c, d)                                   \
+    b = _mm_xor_si128(b, SALSA20_ROL(_mm_add_epi32(a, d), 0x07));           \
+    c = _mm_xor_si128(c, SALSA20_ROL(_mm_add_epi32(b, a), 0x09));           \
+    d = _mm_xor_si128(d, SALSA20_ROL(_mm_add_epi32(c, b), 0x0D));           \
+    a = _mm_xor_si128(a, SALSA20_ROL(_mm_add_epi32(d, c), 0x12));
+
+// Decrypts CASC_SALSA20_BLOCKS consecutive 64-byte blocks. Each vector holds
+// the same word of the state for all four blocks, so the rounds are performed
+// on all blocks at once. The result is transposed back to the block order.
+static void DecryptBlocks_SSE2(PCASC_SALSA20 pState, LPBYTE pbOutBuffer, LPBYTE pbInBuffer)
+{
+    __m128i Input[0x10];
+    __m128i X[0x10];
+    DWORD CounterLo[CASC_SALSA20_BLOCKS];
+    DWORD CounterHi[CASC_SALSA20_BLOCKS];
+    DWORD i, j;
+
+    // Prepare the block counters. The counter is 64-bit and occupies words 8 and 9
+    for(j = 0; j < CASC_SALSA20_BLOCKS; j++)
+    {
+        CounterLo[j] = pState->Key[8] + j;
+        CounterHi[j] = pState->Key[9] + ((CounterLo[j] < pState->Key[8]) ? 1 : 0);
+    }
+
+    // Spread the state to the vectors
+    for(i = 0; i < 0x10; i++)
+        Input[i] = _mm_set1_epi32((int)pState->Key[i]);
+    Input[8] = _mm_loadu_si128((const __m128i *)CounterLo);
+    Input[9] = _mm_loadu_si128((const __m128i *)CounterHi);
+    memcpy(X, Input, sizeof(X));
+
+    // Shuffle the key
+    for(i = 0; i < pState->dwRounds; i += 2)
+    {
+        SALSA20_QUARTER_ROUND(X[0x00], X[0x04], X[0x08], X[0x0C]);
+        SALSA20_QUARTER_ROUND(X[0x05], X[0x09], X[0x0D], X[0x01]);
+        SALSA20_QUARTER_ROUND(X[0x0A], X[0x0E], X[0x02], X[0x06]);
+        SALSA20_QUARTER_ROUND(X[0x0F], X[0x03], X[0x07], X[0x0B]);
+
+        SALSA20_QUARTER_ROUND(X[0x00], X[0x01], X[0x02], X[0x03]);
+        SALSA20_QUARTER_ROUND(X[0x05], X[0x06], X[0x07], X[0x04]);
+        SALSA20_QUARTER_ROUND(X[0x0A], X[0x0B], X[0x08], X[0x09]);
+        SALSA20_QUARTER_ROUND(X[0x0F], X[0x0C], X[0x0D], X[0x0E]);
+    }
+
+    // Add the input state and decrypt 16 bytes of each block at a time
+    for(i = 0; i < 0x10; i += 4)
+    {
+        __m128i T0 = _mm_add_epi32(X[i + 0], Input[i + 0]);
+        __m128i T1 = _mm_add_epi32(X[i + 1], Input[i + 1]);
+        __m128i T2 = _mm_add_epi32(X[i + 2], Input[i + 2]);
+        __m128i T3 = _mm_add_epi32(X[i + 3], Input[i + 3]);
+        __m128i L0 = _mm_unpacklo_epi32(T0, T1);
+        __m128i L1 = _mm_unpacklo_epi32(T2, T3);
+        __m128i H0 = _mm_unpackhi_epi32(T0, T1);
+        __m128i H1 = _mm_unpackhi_epi32(T2, T3);
+        __m128i XorValue[CASC_SALSA20_BLOCKS];
+
+        // Transpose, so that each vector has four consecutive words of one block
+        XorValue[0] = _mm_unpacklo_epi64(L0, L1);
+        XorValue[1] = _mm_unpackhi_epi64(L0, L1);
+        XorValue[2] = _mm_unpacklo_epi64(H0, H1);
+        XorValue[3] = _mm_unpackhi_epi64(H0, H1);
+
+        for(j = 0; j < CASC_SALSA20_BLOCKS; j++)
+        {
+            __m128i Data = _mm_loadu_si128((const __m128i *)(pbInBuffer + j * 0x40 + i * 4));
+            _mm_storeu_si128((__m128i *)(pbOutBuffer + j * 0x40 + i * 4), _mm_xor_si128(Data, XorValue[j]));
+        }
+    }
+
+    // Move the counter past the decrypted blocks
+    pState->Key[8] = pState->Key[8] + CASC_SALSA20_BLOCKS;
+    if(pState->Key[8] < CASC_SALSA20_BLOCKS)
+        pState->Key[9] = pState->Key[9] + 1;
+}
+#endif
+
 static int Decrypt(PCASC_SALSA20 pState, LPBYTE pbOutBuffer, LPBYTE pbInBuffer, size_t cbInBuffer)
 {
     LPBYTE pbXorValue;
@@ -296,6 +385,17 @@ static int Decrypt(PCASC_SALSA20 pState, LPBYTE pbOutBuffer, LPBYTE pbInBuffer,
     DWORD BlockSize;
     DWORD i;
 
+#ifdef CASC_SALSA20_SSE2
+    // Decrypt as many blocks as possible by SSE2
+    while(cbInBuffer >= (CASC_SALSA20_BLOCKS * 0x40))
+    {
+        DecryptBlocks_SSE2(pState, pbOutBuffer, pbInBuffer);
+        pbOutBuffer += (CASC_SALSA20_BLOCKS * 0x40);
+        pbInBuffer += (CASC_SALSA20_BLOCKS * 0x40);
+        cbInBuffer -= (CASC_SALSA20_BLOCKS * 0x40);
+    }
+#endif
+
     // Repeat until we have data to read
     while(cbInBuffer > 0)
     {
@@ -468,7 +568,9 @@ DWORD CascDecrypt(TCascStorage * hs, LPBYTE pbOutBuffer, PDWORD pcbOutBuffer, LP
     pbKey = CascFindKey(hs, KeyName);
     if(pbKey == NULL)
     {
+        CascLock(hs->StorageLock);
         hs->LastFailKeyName = KeyName;
+        CascUnlock(hs->StorageLock);
         return ERROR_FILE_ENCRYPTED;
     }
 
@@ -605,14 +707,18 @@ bool WINAPI CascGetNotFoundEncryptionKey(HANDLE hStorage, ULONGLONG * KeyName)
         return false;
     }
 
+    // The key name may be set by another thread at the same time
+    CascLock(hs->StorageLock);
+    KeyName[0] = hs->LastFailKeyName;
+    CascUnlock(hs->StorageLock);
+
     // If there was no decryption key error, just return false with ERROR_SUCCESS
-    if(hs->LastFailKeyName == 0)
+    if(KeyName[0] == 0)
     {
         SetLastError(ERROR_SUCCESS);
         return false;
     }
 
     // Give the name of the key that failed most recently
-    KeyName[0] = hs->LastFailKeyName;
     return true;
 }
@@ -22,7 +22,26 @@ static LPCTSTR szIndexFormat_V2 = _T("%02x%08x.idx");
 // Limit for "orphaned" items - those that are in index files, but are not in ENCODING manifest
 #define CASC_MAX_ORPHANED_ITEMS 0x100
 
-typedef bool (*EKEY_ENTRY_CALLBACK)(TCascStorage * hs, CASC_INDEX_HEADER & InHeader, LPBYTE pbEKeyEntry);
+typedef bool (*EKEY_ENTRY_CALLBACK)(void * pvContext, CASC_INDEX_HEADER & InHeader, LPBYTE pbEKeyEntry);
+
+//-----------------------------------------------------------------------------
+// Local structures
+
+// Result of loading one local index file
+typedef struct _CASC_INDEX_BUCKET
+{
+    CASC_INDEX_HEADER InHeader;                     // Header of the index file
+    CASC_ARRAY EKeyEntries;                         // Pointers to the EKey entries in the loaded index file
+    DWORD dwErrCode;                                // Result of loading the index file
+} CASC_INDEX_BUCKET, *PCASC_INDEX_BUCKET;
+
+// Local index files are loaded and parsed by multiple threads
+typedef struct _CASC_INDEX_LOAD_JOB
+{
+    TCascStorage * hs;                              // The storage being open
+    CASC_INDEX_BUCKET Buckets[CASC_INDEX_COUNT];    // Result for each index file
+    DWORD NextIndex;                                // Index of the next file to be taken by a worker
+} CASC_INDEX_LOAD_JOB, *PCASC_INDEX_LOAD_JOB;
 
 //-----------------------------------------------------------------------------
 // Local functions
@@ -280,7 +299,7 @@ static void InsertCKeyEntry(TCascStorage * hs, CASC_EKEY_ENTRY & EKeyEntry, DWOR
     pCKeyEntry->Flags |= Flags;
 }
 */
-static DWORD LoadIndexItems(TCascStorage * hs, CASC_INDEX_HEADER & InHeader, EKEY_ENTRY_CALLBACK PfnEKeyEntry, LPBYTE pbEKeyEntry, LPBYTE pbEKeyEnd)
+static DWORD LoadIndexItems(CASC_INDEX_HEADER & InHeader, EKEY_ENTRY_CALLBACK PfnEKeyEntry, void * pvContext, LPBYTE pbEKeyEntry, LPBYTE pbEKeyEnd)
 {
     size_t EntryLength = InHeader.EntryLength;
 
@@ -289,7 +308,7 @@ static DWORD LoadIndexItems(TCascStorage * hs, CASC_INDEX_HEADER & InHeader, EKE
         // DOWNLOAD in HOTS
         //BREAK_ON_XKEY3(pbEKeyEntry, 0x09, 0xF3, 0xCD);
 
-        if(!PfnEKeyEntry(hs, InHeader, pbEKeyEntry))
+        if(!PfnEKeyEntry(pvContext, InHeader, pbEKeyEntry))
             return ERROR_INDEX_PARSING_DONE;
 
         pbEKeyEntry += EntryLength;
@@ -392,18 +411,15 @@ static DWORD CaptureIndexHeader_V2(CASC_INDEX_HEADER & InHeader, LPBYTE pbFileDa
     return ERROR_SUCCESS;
 }    
 
-static DWORD LoadIndexFile_V1(TCascStorage * hs, CASC_INDEX_HEADER & InHeader, EKEY_ENTRY_CALLBACK PfnEKeyEntry, LPBYTE pbFileData, size_t cbFileData)
+static DWORD LoadIndexFile_V1(CASC_INDEX_HEADER & InHeader, EKEY_ENTRY_CALLBACK PfnEKeyEntry, void * pvContext, LPBYTE pbFileData, size_t cbFileData)
 {
     LPBYTE pbEKeyEntries = pbFileData + InHeader.HeaderLength + InHeader.HeaderPadding;
 
-    // Remember the values from the index header
-    SaveFileOffsetBitsAndEKeyLength(hs, InHeader.FileOffsetBits, InHeader.EKeyLength);
-
     // Load the entries from a continuous array
-    return LoadIndexItems(hs, InHeader, PfnEKeyEntry, pbEKeyEntries, pbFileData + cbFileData);
+    return LoadIndexItems(InHeader, PfnEKeyEntry, pvContext, pbEKeyEntries, pbFileData + cbFileData);
 }
 
-static DWORD LoadIndexFile_V2(TCascStorage * hs, CASC_INDEX_HEADER & InHeader, EKEY_ENTRY_CALLBACK PfnEKeyEntry, LPBYTE pbFileData, size_t cbFileData)
+static DWORD LoadIndexFile_V2(CASC_INDEX_HEADER & InHeader, EKEY_ENTRY_CALLBACK PfnEKeyEntry, void * pvContext, LPBYTE pbFileData, size_t cbFileData)
 {
     LPBYTE pbEKeyEntry;
     LPBYTE pbFileEnd = pbFileData + cbFileData;
@@ -412,9 +428,6 @@ static DWORD LoadIndexFile_V2(TCascStorage * hs, CASC_INDEX_HEADER & InHeader, E
     DWORD BlockSize = 0;
     DWORD dwErrCode = ERROR_NOT_SUPPORTED;
 
-    // Remember the values from the index header
-    SaveFileOffsetBitsAndEKeyLength(hs, InHeader.FileOffsetBits, InHeader.EKeyLength);
-
     // Get the pointer to the first block of EKey entries
     if((pbEKeyEntry = CaptureGuardedBlock2(pbFilePtr, pbFileEnd, InHeader.EntryLength, &BlockSize)) != NULL)
     {
@@ -422,7 +435,7 @@ static DWORD LoadIndexFile_V2(TCascStorage * hs, CASC_INDEX_HEADER & InHeader, E
         InHeader.HeaderPadding += sizeof(FILE_INDEX_GUARDED_BLOCK);
 
         // Load the continuous array of EKeys
-        return LoadIndexItems(hs, InHeader, PfnEKeyEntry, pbEKeyEntry, pbEKeyEntry + BlockSize);
+        return LoadIndexItems(InHeader, PfnEKeyEntry, pvContext, pbEKeyEntry, pbEKeyEntry + BlockSize);
     }
 
     // Get the pointer to the second block of EKey entries.
@@ -449,7 +462,7 @@ static DWORD LoadIndexFile_V2(TCascStorage * hs, CASC_INDEX_HEADER & InHeader, E
                 //BREAK_ON_XKEY3(pbEKeyEntry, 0xbc, 0xe8, 0x23);
 
                 // Call the EKey entry callback
-                if(!PfnEKeyEntry(hs, InHeader, pbEKeyEntry))
+                if(!PfnEKeyEntry(pvContext, InHeader, pbEKeyEntry))
                     return ERROR_INDEX_PARSING_DONE;
 
                 pbEKeyEntry += AlignedLength;
@@ -464,38 +477,89 @@ static DWORD LoadIndexFile_V2(TCascStorage * hs, CASC_INDEX_HEADER & InHeader, E
     return dwErrCode;
 }
 
-static DWORD LoadIndexFile(TCascStorage * hs, EKEY_ENTRY_CALLBACK PfnEKeyEntry, LPBYTE pbFileData, size_t cbFileData, DWORD BucketIndex)
+static DWORD LoadIndexFile(CASC_INDEX_HEADER & InHeader, EKEY_ENTRY_CALLBACK PfnEKeyEntry, void * pvContext, LPBYTE pbFileData, size_t cbFileData, DWORD BucketIndex)
 {
-    CASC_INDEX_HEADER InHeader;
-
     // Check for CASC version 2
     if(CaptureIndexHeader_V2(InHeader, pbFileData, cbFileData, BucketIndex) == ERROR_SUCCESS)
-        return LoadIndexFile_V2(hs, InHeader, PfnEKeyEntry, pbFileData, cbFileData);
+        return LoadIndexFile_V2(InHeader, PfnEKeyEntry, pvContext, pbFileData, cbFileData);
 
     // Check for CASC index version 1
     if(CaptureIndexHeader_V1(InHeader, pbFileData, cbFileData, BucketIndex) == ERROR_SUCCESS)
-        return LoadIndexFile_V1(hs, InHeader, PfnEKeyEntry, pbFileData, cbFileData);
+        return LoadIndexFile_V1(InHeader, PfnEKeyEntry, pvContext, pbFileData, cbFileData);
 
     // Should never happen
     assert(false);
     return ERROR_BAD_FORMAT;
 }
 
-// Checks the EKey entry for EKey of the ENCODING manifest
-static bool InsertEncodingEKeyToMap(TCascStorage * hs, CASC_INDEX_HEADER &, LPBYTE pbEKeyEntry)
+// Collects pointers to the EKey entries of one index file
+static bool CollectIndexEKeyEntry(void * pvContext, CASC_INDEX_HEADER &, LPBYTE pbEKeyEntry)
 {
-    hs->IndexEKeyMap.InsertObject(pbEKeyEntry, pbEKeyEntry);
-    return true;
+    CASC_ARRAY * pEKeyEntries = (CASC_ARRAY *)pvContext;
+
+    return (pEKeyEntries->Insert(&pbEKeyEntry, 1) != NULL);
 }
 
-static DWORD ProcessLocalIndexFiles(TCascStorage * hs, EKEY_ENTRY_CALLBACK PfnEKeyEntry)
+// Loads and parses the index files. Runs on multiple threads, each index file is loaded by one of them.
+// The storage is only read here; everything that changes the storage is done by MergeLocalIndexFiles
+static void LoadLocalIndexFilesWorker(void * pvContext)
 {
-    DWORD dwErrCode = ERROR_SUCCESS;
+    PCASC_INDEX_LOAD_JOB pJob = (PCASC_INDEX_LOAD_JOB)pvContext;
+    TCascStorage * hs = pJob->hs;
+    DWORD dwIndex;
+
+    while((dwIndex = CascInterlockedIncrement(&pJob->NextIndex) - 1) < CASC_INDEX_COUNT)
+    {
+        CASC_INDEX_BUCKET & Bucket = pJob->Buckets[dwIndex];
+        CASC_INDEX & IndexFile = hs->IndexFiles[dwIndex];
+        DWORD cbFileData = 0;
+
+        // Create the file name
+        if((IndexFile.szFileName = CreateIndexFileName(hs, dwIndex, IndexFile.NewSubIndex)) == NULL)
+        {
+            Bucket.dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+            continue;
+        }
+
+        // WoW6 actually reads THE ENTIRE file to memory. Verified on Mac build (x64).
+        if((IndexFile.pbFileData = LoadFileToMemory(IndexFile.szFileName, &cbFileData)) == NULL)
+        {
+            Bucket.dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+            continue;
+        }
+        IndexFile.cbFileData = cbFileData;
+
+        // Collect the EKey entries. The array grows if there is more of them than expected
+        Bucket.dwErrCode = Bucket.EKeyEntries.Create<LPBYTE>((cbFileData / sizeof(FILE_EKEY_ENTRY)) + 1);
+        if(Bucket.dwErrCode == ERROR_SUCCESS)
+        {
+            // The collector only stops when the array cannot be enlarged
+            Bucket.dwErrCode = LoadIndexFile(Bucket.InHeader, CollectIndexEKeyEntry, &Bucket.EKeyEntries, IndexFile.pbFileData, IndexFile.cbFileData, dwIndex);
+            if(Bucket.dwErrCode == ERROR_INDEX_PARSING_DONE)
+                Bucket.dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+}
+
+// Builds the map of EKey -> IndexEKeyEntry from the loaded index files.
+// The entries are inserted in the same order as if the files were processed one by one
+static DWORD MergeLocalIndexFiles(TCascStorage * hs, CASC_INDEX_LOAD_JOB & Job)
+{
+    size_t TotalEntries = 0;
+    DWORD dwErrCode;
 
-    // Load each index file
+    // Create a map large enough to hold all entries
+    for(DWORD i = 0; i < CASC_INDEX_COUNT; i++)
+        TotalEntries += Job.Buckets[i].EKeyEntries.ItemCount();
+    dwErrCode = hs->IndexEKeyMap.Create(TotalEntries, CASC_EKEY_SIZE, 0);
+    if(dwErrCode != ERROR_SUCCESS)
+        return dwErrCode;
+
+    // Insert the entries of each index file
     for(DWORD i = 0; i < CASC_INDEX_COUNT; i++)
     {
-        CASC_INDEX & IndexFile = hs->IndexFiles[i];
+        CASC_INDEX_BUCKET & Bucket = Job.Buckets[i];
+        size_t nEntries = Bucket.EKeyEntries.ItemCount();
 
         // Inform the user about what we are doing
         if(InvokeProgressCallback(hs, "Loading index files", NULL, i, CASC_INDEX_COUNT))
@@ -504,15 +568,19 @@ static DWORD ProcessLocalIndexFiles(TCascStorage * hs, EKEY_ENTRY_CALLBACK PfnEK
             break;
         }
 
-        // Load the index file
-        if((dwErrCode = LoadIndexFile(hs, PfnEKeyEntry, IndexFile.pbFileData, IndexFile.cbFileData, i)) != ERROR_SUCCESS)
+        // Remember the values from the index header, if the header was valid
+        if(Bucket.InHeader.EntryLength != 0 && Bucket.dwErrCode != ERROR_BAD_FORMAT)
+            SaveFileOffsetBitsAndEKeyLength(hs, Bucket.InHeader.FileOffsetBits, Bucket.InHeader.EKeyLength);
+
+        // Insert all EKey entries found in the file
+        if(nEntries != 0)
+            hs->IndexEKeyMap.InsertObjects((void **)Bucket.EKeyEntries.ItemAt(0), nEntries);
+
+        // Stop on the first index file that failed to load
+        if((dwErrCode = Bucket.dwErrCode) != ERROR_SUCCESS)
             break;
     }
 
-    // Swallow the "done parsing" error
-    if(dwErrCode == ERROR_INDEX_PARSING_DONE)
-        dwErrCode = ERROR_SUCCESS;
-
     // Remember the number of files that are present locally
     hs->LocalFiles = hs->CKeyArray.ItemCount();
     return dwErrCode;
@@ -520,39 +588,40 @@ static DWORD ProcessLocalIndexFiles(TCascStorage * hs, EKEY_ENTRY_CALLBACK PfnEK
 
 static DWORD LoadLocalIndexFiles(TCascStorage * hs)
 {
-    ULONGLONG TotalSize = 0;
+    PCASC_INDEX_LOAD_JOB pJob;
     DWORD dwErrCode;
 
     // Inform the user about what we are doing
     if(InvokeProgressCallback(hs, "Loading index files", NULL, 0, 0))
         return ERROR_CANCELLED;
 
-    // Perform the directory scan
-    if((dwErrCode = ScanIndexDirectory(hs->szIndexPath, IndexDirectory_OnFileFound, hs)) == ERROR_SUCCESS)
+    // The index files must have been found by ScanIndexFiles
+    dwErrCode = (hs->szIndexFormat != NULL) ? ERROR_SUCCESS : ERROR_FILE_NOT_FOUND;
+    if(dwErrCode == ERROR_SUCCESS)
     {
-        // Load each index file
+        // Load and parse all index files on multiple threads
+        if((pJob = new CASC_INDEX_LOAD_JOB) == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        pJob->hs = hs;
+        pJob->NextIndex = 0;
         for(DWORD i = 0; i < CASC_INDEX_COUNT; i++)
         {
-            CASC_INDEX & IndexFile = hs->IndexFiles[i];
-            DWORD cbFileData = 0;
-
-            // Create the file name
-            if((IndexFile.szFileName = CreateIndexFileName(hs, i, IndexFile.NewSubIndex)) == NULL)
-                return ERROR_NOT_ENOUGH_MEMORY;
+            memset(&pJob->Buckets[i].InHeader, 0, sizeof(CASC_INDEX_HEADER));
+            pJob->Buckets[i].dwErrCode = ERROR_SUCCESS;
+        }
+        CascRunWorkers(LoadLocalIndexFilesWorker, pJob, CASCLIB_MIN(CascGetWorkerCount(), CASC_INDEX_COUNT));
 
-            // WoW6 actually reads THE ENTIRE file to memory. Verified on Mac build (x64).
-            if((IndexFile.pbFileData = LoadFileToMemory(IndexFile.szFileName, &cbFileData)) == NULL)
-                return ERROR_NOT_ENOUGH_MEMORY;
-            IndexFile.cbFileData = cbFileData;
-            TotalSize += cbFileData;
+        // A file that could not be loaded fails the whole storage
+        for(DWORD i = 0; i < CASC_INDEX_COUNT; i++)
+        {
+            if(hs->IndexFiles[i].pbFileData == NULL)
+                dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
         }
 
         // Build the map of EKey -> IndexEKeyEntry
-        dwErrCode = hs->IndexEKeyMap.Create((size_t)(TotalSize / sizeof(FILE_EKEY_ENTRY)), CASC_EKEY_SIZE, 0);
         if(dwErrCode == ERROR_SUCCESS)
-        {
-            dwErrCode = ProcessLocalIndexFiles(hs, InsertEncodingEKeyToMap);
-        }
+            dwErrCode = MergeLocalIndexFiles(hs, *pJob);
+        delete pJob;
     }
 
     return dwErrCode;
@@ -810,6 +879,25 @@ bool CopyEKeyEntry(TCascStorage * hs, PCASC_CKEY_ENTRY pCKeyEntry)
     return true;
 }
 
+DWORD ScanIndexFiles(TCascStorage * hs)
+{
+    // Online storages have no local index files
+    if(hs->dwFeatures & CASC_FEATURE_ONLINE)
+        return ERROR_SUCCESS;
+
+    // Find the newest version of each index file
+    return ScanIndexDirectory(hs->szIndexPath, IndexDirectory_OnFileFound, hs);
+}
+
+LPTSTR GetIndexFileName(TCascStorage * hs, DWORD IndexValue)
+{
+    // Only valid after the index directory has been scanned
+    if(hs->szIndexFormat == NULL || IndexValue >= CASC_INDEX_COUNT)
+        return NULL;
+
+    return CreateIndexFileName(hs, IndexValue, hs->IndexFiles[IndexValue].NewSubIndex);
+}
+
 DWORD LoadIndexFiles(TCascStorage * hs)
 {
     // For local storages, load the index files from the disk
@@ -829,6 +917,9 @@ void FreeIndexFiles(TCascStorage * hs)
     // Free the map of EKey -> Index Ekey item
     hs->IndexEKeyMap.Free();
 
+    // Free the index entries loaded from the storage snapshot
+    CASC_FREE(hs->pbIndexSnapshot);
+
     // Free all loaded index files
     for(size_t i = 0; i < CASC_INDEX_COUNT; i++)
     {
@@ -141,6 +141,16 @@ extern "C" {
 #define CASC_FEATURE_CONTENT_FLAGS  0x00000080  // Content flags are supported
 #define CASC_FEATURE_ONLINE         0x00000100  // The storage is an online storage
 
+// Flags for CASC_OPEN_STORAGE_ARGS::dwFlags
+#define CASC_STORAGE_MAP_DATA_FILES 0x00000001  // 64-bit only: Memory-map the local data files and decode file frames in place.
+                                                // Not safe if the data files can be truncated while the storage is open (SIGBUS on POSIX)
+#define CASC_STORAGE_PARALLEL_DECODE 0x00000002 // Decode the frames of large whole-file reads on multiple threads. Each such read
+                                                // starts and joins its own threads, so this pays off on big files only
+
+// Values for CASC_OPEN_STORAGE_ARGS::FrameCacheSize
+#define CASC_FRAME_CACHE_DEFAULT    0x04000000  // Default size of the storage-wide cache of decoded file frames (64 MB)
+#define CASC_FRAME_CACHE_DISABLED   ((size_t)-1) // Do not cache decoded file frames across file handles
+
 // Macro to convert FileDataId to the argument of CascOpenFile
 #define CASC_FILE_DATA_ID(FileDataId) ((LPCSTR)(size_t)FileDataId)
 #define CASC_FILE_DATA_ID_FROM_STRING(szFileName)  ((DWORD)(size_t)szFileName)
@@ -167,6 +177,7 @@ typedef enum _CASC_STORAGE_INFO_CLASS
     CascStorageProduct,                         // Gives CASC_STORAGE_PRODUCT
     CascStorageTags,                            // Gives CASC_STORAGE_TAGS structure
     CascStoragePathProduct,                     // Gives Path:Product into a LPTSTR buffer
+    CascStorageFrameCacheStats,                 // Gives CASC_FRAME_CACHE_STATS structure
     CascStorageInfoClassMax
 
 } CASC_STORAGE_INFO_CLASS, *PCASC_STORAGE_INFO_CLASS;
@@ -257,6 +268,16 @@ typedef struct _CASC_STORAGE_PRODUCT
 
 } CASC_STORAGE_PRODUCT, *PCASC_STORAGE_PRODUCT;
 
+typedef struct _CASC_FRAME_CACHE_STATS
+{
+    ULONGLONG Hits;                             // Number of file frames (and frame tables) that were taken from the cache
+    ULONGLONG Misses;                           // Number of file frames (and frame tables) that had to be loaded
+    ULONGLONG Evictions;                        // Number of file frames removed from the cache to make room for new ones
+    ULONGLONG BytesCached;                      // Number of decoded bytes currently held in the cache
+    ULONGLONG BytesLimit;                       // Maximum number of decoded bytes held in the cache. Zero if the cache is disabled
+
+} CASC_FRAME_CACHE_STATS, *PCASC_FRAME_CACHE_STATS;
+
 typedef struct _CASC_FILE_FULL_INFO
 {
     BYTE CKey[MD5_HASH_SIZE];                   // CKey
@@ -329,7 +350,13 @@ typedef struct _CASC_OPEN_STORAGE_ARGS
     void * PtrProductParam;                     // Pointer-sized parameter that will be passed to PfnProgressCallback
 
     DWORD dwLocaleMask;                         // Locale mask to open
-    DWORD dwFlags;                              // Reserved. Set to zero.
+    DWORD dwFlags;                              // Combination of CASC_STORAGE_XXX flags. Set to zero if not needed
+    size_t FrameCacheSize;                      // Byte size of the cache of decoded file frames and frame tables, shared by all file handles.
+                                                // Zero means CASC_FRAME_CACHE_DEFAULT, CASC_FRAME_CACHE_DISABLED turns the cache off.
+                                                // Only partial reads add frames to the cache; whole-file reads only take frames from it
+    LPCTSTR szSnapshotFile;                     // Optional name of the storage snapshot file (local storages only). If the snapshot
+                                                // matches the build and the index files, the index files, ENCODING and DOWNLOAD
+                                                // are not parsed. Otherwise, they are parsed and a new snapshot is saved
 
     //
     // Any additional member from here on must be checked for availability using the ExtractVersionedArgument function.
@@ -343,6 +370,17 @@ typedef struct _CASC_OPEN_STORAGE_ARGS
 
 //-----------------------------------------------------------------------------
 // Functions for storage manipulation
+//
+// Thread safety:
+// Once CascOpenStorage(Ex) returns, the maps of the storage and the CKey entries in them
+// are not changed anymore. The sizes found out when reading a file are kept in the file handle.
+// A storage handle can be shared by multiple threads, which may call CascOpenFile,
+// CascGetStorageInfo, CascFindFirstFile and CascReadFile at the same time.
+// - Each file and search handle must only be used by one thread at a time
+// - Encryption keys must be added before the storage is shared between threads
+// - CascCloseStorage may be called while files are open; the storage is freed
+//   after the last file handle is closed
+//
 
 bool  WINAPI CascOpenStorageEx(LPCTSTR szParams, PCASC_OPEN_STORAGE_ARGS pArgs, bool bOnlineStorage, HANDLE * phStorage);
 bool  WINAPI CascOpenStorage(LPCTSTR szParams, DWORD dwLocaleMask, HANDLE * phStorage);
@@ -351,6 +389,7 @@ bool  WINAPI CascGetStorageInfo(HANDLE hStorage, CASC_STORAGE_INFO_CLASS InfoCla
 bool  WINAPI CascCloseStorage(HANDLE hStorage);
 
 bool  WINAPI CascOpenFile(HANDLE hStorage, const void * pvFileName, DWORD dwLocaleFlags, DWORD dwOpenFlags, HANDLE * PtrFileHandle);
+bool  WINAPI CascOpenFilesById(HANDLE hStorage, const DWORD * FileDataIds, size_t nFileDataIds, DWORD dwOpenFlags, HANDLE * FileHandles);
 bool  WINAPI CascOpenLocalFile(LPCTSTR szFileName, DWORD dwOpenFlags, HANDLE * PtrFileHandle);
 bool  WINAPI CascGetFileInfo(HANDLE hFile, CASC_FILE_INFO_CLASS InfoClass, void * pvFileInfo, size_t cbFileInfo, size_t * pcbLengthNeeded);
 bool  WINAPI CascGetFileSize64(HANDLE hFile, PULONGLONG PtrFileSize);
@@ -98,6 +98,7 @@ DWORD TCascFile::OpenFileSpans(LPCTSTR szSpanList)
         }
 
         pCKeyEntry[i].EncodedSize = (DWORD)FileSize;
+        pFileSpan[i].EncodedSize = (DWORD)FileSize;
     }
 
     // Free the so-far-opened files
@@ -136,6 +137,11 @@ void TCascFile::InitFileSpans(PCASC_FILE_SPAN pSpans, DWORD dwSpanCount)
         pSpans->ArchiveIndex = (DWORD)(pCKeyEntry[i].StorageOffset >> FileOffsetBits);
         pSpans->ArchiveOffs = (DWORD)(pCKeyEntry[i].StorageOffset & FileOffsetMask);
 
+        // Copy the sizes. Those not known yet are found out when the span is loaded.
+        // The CKey entry is shared with other threads, so it must not be changed.
+        pSpans->ContentSize = pCKeyEntry[i].ContentSize;
+        pSpans->EncodedSize = pCKeyEntry[i].EncodedSize;
+
         // Add to the total encoded size
         if(ContentSize != CASC_INVALID_SIZE64)
         {
@@ -413,6 +419,69 @@ bool WINAPI CascOpenFile(HANDLE hStorage, const void * pvFileName, DWORD dwLocal
     return OpenFileByCKeyEntry(hs, pCKeyEntry, dwOpenFlags, PtrFileHandle);
 }
 
+// Opens multiple files by their FileDataIds in one call. The FileDataIds should be sorted
+// in ascending order, so that the root handler resolves them in one pass.
+// Files that were not found get NULL handle. If any file could not be opened,
+// the function returns false and GetLastError() returns the error code.
+bool WINAPI CascOpenFilesById(HANDLE hStorage, const DWORD * FileDataIds, size_t nFileDataIds, DWORD dwOpenFlags, HANDLE * FileHandles)
+{
+    PCASC_CKEY_ENTRY * CKeyEntries;
+    TCascStorage * hs;
+    size_t nFound;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Clear all handles first, so that the caller never sees garbage on failure
+    for(size_t i = 0; FileHandles != NULL && i < nFileDataIds; i++)
+        FileHandles[i] = NULL;
+
+    // Validate the storage handle
+    hs = TCascStorage::IsValid(hStorage);
+    if(hs == NULL)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // Validate the other parameters
+    if(nFileDataIds != 0 && (FileDataIds == NULL || FileHandles == NULL))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Allocate the array for the CKey entries
+    CKeyEntries = CASC_ALLOC<PCASC_CKEY_ENTRY>(nFileDataIds);
+    if(CKeyEntries == NULL && nFileDataIds != 0)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+
+    // Resolve all FileDataIds at once
+    nFound = hs->pRootHandler->GetFiles(hs, FileDataIds, nFileDataIds, CKeyEntries);
+    if(nFound < nFileDataIds)
+        dwErrCode = ERROR_FILE_NOT_FOUND;
+
+    // Open all files that were found. The open type in dwOpenFlags is ignored.
+    // A missing file does not hide a more serious error from another open
+    for(size_t i = 0; i < nFileDataIds; i++)
+    {
+        if(CKeyEntries[i] != NULL && !OpenFileByCKeyEntry(hs, CKeyEntries[i], dwOpenFlags, &FileHandles[i]))
+        {
+            if(dwErrCode == ERROR_SUCCESS || dwErrCode == ERROR_FILE_NOT_FOUND)
+                dwErrCode = GetLastError();
+        }
+    }
+
+    // Free the CKey entry array
+    CASC_FREE(CKeyEntries);
+
+    // Handle last error
+    if(dwErrCode != ERROR_SUCCESS)
+        SetLastError(dwErrCode);
+    return (dwErrCode == ERROR_SUCCESS);
+}
+
 bool WINAPI CascOpenLocalFile(LPCTSTR szFileName, DWORD dwOpenFlags, HANDLE * PtrFileHandle)
 {
     // Verify parameters
@@ -20,6 +20,71 @@
 // Limit for "additional" items in CKey table
 #define CASC_MAX_EXTRA_ITEMS 0x40
 
+// Storage snapshot file
+#define CASC_SNAPSHOT_SIGNATURE     0x504E5343      // 'CSNP'
+#define CASC_SNAPSHOT_VERSION       1
+
+//-----------------------------------------------------------------------------
+// Local structures
+
+// The CKey pages of the ENCODING manifest are parsed by multiple threads.
+// Each page fills its own, pre-allocated range of CKey entries
+typedef struct _CASC_ENCODING_JOB
+{
+    TCascStorage * hs;                              // The storage being open
+    PCASC_CKEY_ENTRY pCKeyEntries;                  // Pre-allocated CKey entries for all pages
+    size_t * PageFirstEntry;                        // Index of the first CKey entry of each page
+    LPBYTE pbFirstPage;                             // Pointer to the first CKey page
+    DWORD CKeyPageSize;                             // Size of one CKey page
+    DWORD CKeyLength;                               // Length of the CKey in the ENCODING file
+    DWORD EKeyLength;                               // Length of the EKey in the ENCODING file
+    DWORD PageCount;                                // Number of pages to parse
+    DWORD NextPage;                                 // Index of the next page to be taken by a worker
+} CASC_ENCODING_JOB, *PCASC_ENCODING_JOB;
+
+// The CKey map and the EKey map are built at the same time, each one by one thread
+typedef struct _CASC_MAP_BUILD_JOB
+{
+    TCascStorage * hs;                              // The storage being open
+    PCASC_CKEY_ENTRY pCKeyEntries;                  // CKey entries to be inserted to the maps
+    size_t nCKeyEntries;                            // Number of CKey entries
+    DWORD NextMap;                                  // Index of the next map to be taken by a worker
+} CASC_MAP_BUILD_JOB, *PCASC_MAP_BUILD_JOB;
+
+// Identification of one local index file in the storage snapshot
+typedef struct _CASC_SNAPSHOT_INDEX
+{
+    ULONGLONG FileSize;                             // Size of the index file
+    ULONGLONG FileTime;                             // Last write time of the index file
+    DWORD NewSubIndex;                              // Version of the index file
+    DWORD Alignment;
+} CASC_SNAPSHOT_INDEX, *PCASC_SNAPSHOT_INDEX;
+
+// Header of the storage snapshot file. The header is followed by the CKey entries,
+// the index entries and the tag entries, in that order.
+typedef struct _CASC_SNAPSHOT_HEADER
+{
+    DWORD Signature;                                // CASC_SNAPSHOT_SIGNATURE
+    DWORD Version;                                  // CASC_SNAPSHOT_VERSION
+    DWORD CKeyEntrySize;                            // sizeof(CASC_CKEY_ENTRY) of the library that saved the snapshot
+    DWORD PointerSize;                              // sizeof(void *) of the library that saved the snapshot
+    BYTE BuildKey[MD5_HASH_SIZE];                   // CDN build key of the storage
+    CASC_SNAPSHOT_INDEX IndexFiles[CASC_INDEX_COUNT];
+
+    // Everything above must match the storage being open
+    CASC_CKEY_ENTRY EncodingCKey;                   // The ENCODING entry, as completed from the index files
+    ULONGLONG LocalFiles;                           // Number of files that are present locally
+    ULONGLONG TotalFiles;                           // Number of files after loading the DOWNLOAD manifest
+    ULONGLONG EKeyLength;                           // EKey length from the index files
+    DWORD FileOffsetBits;                           // Number of bits in the storage offset
+    DWORD Features;                                 // CASC_FEATURE_TAGS if the storage has tags
+    ULONGLONG CKeyEntries;                          // Number of CASC_CKEY_ENTRY items
+    ULONGLONG IndexEntries;                         // Number of index entries
+    ULONGLONG IndexEntryLength;                     // Length of one index entry, in bytes
+    ULONGLONG TagEntries;                           // Number of CASC_TAG_ENTRY2 items
+    ULONGLONG TagEntryLength;                       // Length of one tag entry, in bytes
+} CASC_SNAPSHOT_HEADER, *PCASC_SNAPSHOT_HEADER;
+
 //-----------------------------------------------------------------------------
 // DEBUG functions
 
@@ -63,8 +128,11 @@ TCascStorage::TCascStorage()
     
     memset(DataFiles, 0, sizeof(DataFiles));
     memset(IndexFiles, 0, sizeof(IndexFiles));
+    pbIndexSnapshot = NULL;
+    CascInitLock(StorageLock);
     dwBuildNumber = 0;
     dwFeatures = 0;
+    dwOpenFlags = 0;
     BuildFileType = CascBuildNone;
 
     LocalFiles = TotalFiles = EKeyEntries = EKeyLength = FileOffsetBits = 0;
@@ -106,6 +174,7 @@ TCascStorage::~TCascStorage()
     FreeCascBlob(&PatchArchivesKey);
     FreeCascBlob(&PatchArchivesGroup);
     FreeCascBlob(&BuildFiles);
+    CascFreeLock(StorageLock);
     ClassName = 0;
 }
 
@@ -200,32 +269,40 @@ static PCASC_CKEY_ENTRY InsertCKeyEntry(TCascStorage * hs, CASC_CKEY_ENTRY & CKe
     return pCKeyEntry;
 }
 
+// Fills a CKey entry from an ENCODING entry. Only reads the storage,
+// so it can be called from multiple threads
+static void InitCKeyEntry(TCascStorage * hs, PCASC_CKEY_ENTRY pCKeyEntry, PFILE_CKEY_ENTRY pFileEntry)
+{
+    // Stop on file-of-interest
+    BREAK_ON_WATCHED(pFileEntry->EKey);
+
+    // Initialize the entry
+    CopyMemory16(pCKeyEntry->CKey, pFileEntry->CKey);
+    CopyMemory16(pCKeyEntry->EKey, pFileEntry->EKey);
+    pCKeyEntry->StorageOffset = CASC_INVALID_OFFS64;
+    pCKeyEntry->TagBitMask = 0;
+    pCKeyEntry->ContentSize = ConvertBytesToInteger_4(pFileEntry->ContentSize);
+    pCKeyEntry->EncodedSize = CASC_INVALID_SIZE;
+    pCKeyEntry->Flags = CASC_CE_HAS_CKEY | CASC_CE_HAS_EKEY | CASC_CE_IN_ENCODING;
+    pCKeyEntry->RefCount = 0;
+    pCKeyEntry->SpanCount = 1;
+    pCKeyEntry->Priority = 0;
+
+    // Copy the information from index files to the CKey entry
+    CopyEKeyEntry(hs, pCKeyEntry);
+}
+
 // Inserts an entry from ENCODING
 static PCASC_CKEY_ENTRY InsertCKeyEntry(TCascStorage * hs, PFILE_CKEY_ENTRY pFileEntry)
 {
     PCASC_CKEY_ENTRY pCKeyEntry;
 
-    // Stop on file-of-interest
-    BREAK_ON_WATCHED(pFileEntry->EKey);
-
     // Insert a new entry to the array. DO NOT ALLOW enlarge array here
     pCKeyEntry = (PCASC_CKEY_ENTRY)hs->CKeyArray.Insert(1, false);
     if(pCKeyEntry != NULL)
     {
         // Initialize the entry
-        CopyMemory16(pCKeyEntry->CKey, pFileEntry->CKey);
-        CopyMemory16(pCKeyEntry->EKey, pFileEntry->EKey);
-        pCKeyEntry->StorageOffset = CASC_INVALID_OFFS64;
-        pCKeyEntry->TagBitMask = 0;
-        pCKeyEntry->ContentSize = ConvertBytesToInteger_4(pFileEntry->ContentSize);
-        pCKeyEntry->EncodedSize = CASC_INVALID_SIZE;
-        pCKeyEntry->Flags = CASC_CE_HAS_CKEY | CASC_CE_HAS_EKEY | CASC_CE_IN_ENCODING;
-        pCKeyEntry->RefCount = 0;
-        pCKeyEntry->SpanCount = 1;
-        pCKeyEntry->Priority = 0;
-
-        // Copy the information from index files to the CKey entry
-        CopyEKeyEntry(hs, pCKeyEntry);
+        InitCKeyEntry(hs, pCKeyEntry, pFileEntry);
 
         // Insert the item into both maps
         hs->CKeyMap.InsertObject(pCKeyEntry, pCKeyEntry->CKey);
@@ -426,6 +503,129 @@ static int LoadEncodingCKeyPage(TCascStorage * hs, CASC_ENCODING_HEADER & EnHead
     return ERROR_SUCCESS;
 }
 
+// Counts the entries in one CKey page. Must walk the page the same way as LoadEncodingCKeyPage
+static size_t GetEncodingCKeyPageEntries(DWORD CKeyLength, DWORD EKeyLength, LPBYTE pbPageBegin, LPBYTE pbEndOfPage)
+{
+    PFILE_CKEY_ENTRY pFileEntry;
+    LPBYTE pbFileEntry = pbPageBegin;
+    size_t nEntries = 0;
+
+    while(pbFileEntry < pbEndOfPage)
+    {
+        pFileEntry = (PFILE_CKEY_ENTRY)pbFileEntry;
+        if(pFileEntry->EKeyCount == 0)
+            break;
+
+        pbFileEntry = pbFileEntry + 2 + 4 + CKeyLength + (pFileEntry->EKeyCount * EKeyLength);
+        nEntries++;
+    }
+
+    return nEntries;
+}
+
+static void LoadEncodingCKeyPagesWorker(void * pvContext)
+{
+    PCASC_ENCODING_JOB pJob = (PCASC_ENCODING_JOB)pvContext;
+    DWORD dwPageIndex;
+
+    while((dwPageIndex = CascInterlockedIncrement(&pJob->NextPage) - 1) < pJob->PageCount)
+    {
+        PCASC_CKEY_ENTRY pCKeyEntry = pJob->pCKeyEntries + pJob->PageFirstEntry[dwPageIndex];
+        LPBYTE pbFileEntry = pJob->pbFirstPage + (size_t)dwPageIndex * pJob->CKeyPageSize;
+        size_t nEntries = pJob->PageFirstEntry[dwPageIndex + 1] - pJob->PageFirstEntry[dwPageIndex];
+
+        // The number of entries has already been counted
+        for(size_t i = 0; i < nEntries; i++, pCKeyEntry++)
+        {
+            PFILE_CKEY_ENTRY pFileEntry = (PFILE_CKEY_ENTRY)pbFileEntry;
+
+            InitCKeyEntry(pJob->hs, pCKeyEntry, pFileEntry);
+            pbFileEntry = pbFileEntry + 2 + 4 + pJob->CKeyLength + (pFileEntry->EKeyCount * pJob->EKeyLength);
+        }
+    }
+}
+
+static void BuildCKeyMapsWorker(void * pvContext)
+{
+    PCASC_MAP_BUILD_JOB pJob = (PCASC_MAP_BUILD_JOB)pvContext;
+    TCascStorage * hs = pJob->hs;
+    DWORD dwMapIndex;
+
+    while((dwMapIndex = CascInterlockedIncrement(&pJob->NextMap) - 1) < 2)
+    {
+        for(size_t i = 0; i < pJob->nCKeyEntries; i++)
+        {
+            PCASC_CKEY_ENTRY pCKeyEntry = pJob->pCKeyEntries + i;
+
+            if(dwMapIndex == 0 && (pCKeyEntry->Flags & CASC_CE_HAS_CKEY))
+                hs->CKeyMap.InsertObject(pCKeyEntry, pCKeyEntry->CKey);
+            if(dwMapIndex == 1 && (pCKeyEntry->Flags & CASC_CE_HAS_EKEY))
+                hs->EKeyMap.InsertObject(pCKeyEntry, pCKeyEntry->EKey);
+        }
+    }
+}
+
+// Loads the given number of CKey pages. The pages are parsed on multiple threads
+// to a pre-allocated range of the CKey array, then both maps are built at once.
+// The result is the same as if the pages were loaded by LoadEncodingCKeyPage one by one
+static int LoadEncodingCKeyPages(TCascStorage * hs, CASC_ENCODING_HEADER & EnHeader, LPBYTE pbFirstPage, DWORD dwPageCount)
+{
+    CASC_ENCODING_JOB Job;
+    CASC_MAP_BUILD_JOB MapJob;
+    PCASC_CKEY_ENTRY pCKeyEntries;
+    LPBYTE pbCKeyPage = pbFirstPage;
+    size_t * PageFirstEntry;
+    size_t nEntries = 0;
+
+    // Count the entries in each page
+    if((PageFirstEntry = CASC_ALLOC<size_t>(dwPageCount + 1)) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    for(DWORD i = 0; i < dwPageCount; i++)
+    {
+        PageFirstEntry[i] = nEntries;
+        nEntries += GetEncodingCKeyPageEntries(EnHeader.CKeyLength, EnHeader.EKeyLength, pbCKeyPage, pbCKeyPage + EnHeader.CKeyPageSize);
+        pbCKeyPage += EnHeader.CKeyPageSize;
+    }
+    PageFirstEntry[dwPageCount] = nEntries;
+
+    // Reserve the CKey entries for all pages. If the array is not big enough,
+    // load the pages one by one and let the surplus entries be dropped
+    pCKeyEntries = (PCASC_CKEY_ENTRY)hs->CKeyArray.Insert(nEntries, false);
+    if(pCKeyEntries == NULL)
+    {
+        for(DWORD i = 0; i < dwPageCount; i++)
+        {
+            pbCKeyPage = pbFirstPage + (size_t)i * EnHeader.CKeyPageSize;
+            LoadEncodingCKeyPage(hs, EnHeader, pbCKeyPage, pbCKeyPage + EnHeader.CKeyPageSize);
+        }
+
+        CASC_FREE(PageFirstEntry);
+        return ERROR_SUCCESS;
+    }
+
+    // Parse the pages
+    Job.hs = hs;
+    Job.pCKeyEntries = pCKeyEntries;
+    Job.PageFirstEntry = PageFirstEntry;
+    Job.pbFirstPage = pbFirstPage;
+    Job.CKeyPageSize = EnHeader.CKeyPageSize;
+    Job.CKeyLength = EnHeader.CKeyLength;
+    Job.EKeyLength = EnHeader.EKeyLength;
+    Job.PageCount = dwPageCount;
+    Job.NextPage = 0;
+    CascRunWorkers(LoadEncodingCKeyPagesWorker, &Job, CASCLIB_MIN(CascGetWorkerCount(), dwPageCount));
+
+    // Insert the entries to the CKey map and to the EKey map
+    MapJob.hs = hs;
+    MapJob.pCKeyEntries = pCKeyEntries;
+    MapJob.nCKeyEntries = nEntries;
+    MapJob.NextMap = 0;
+    CascRunWorkers(BuildCKeyMapsWorker, &MapJob, 2);
+
+    CASC_FREE(PageFirstEntry);
+    return ERROR_SUCCESS;
+}
+
 static int LoadEncodingManifest(TCascStorage * hs)
 {
     CASC_CKEY_ENTRY & CKeyEntry = hs->EncodingCKey;
@@ -454,7 +654,9 @@ static int LoadEncodingManifest(TCascStorage * hs)
         {
             // Get the CKey page header and the first page
             PFILE_CKEY_PAGE pPageHeader = (PFILE_CKEY_PAGE)(pbEncodingFile + sizeof(FILE_ENCODING_HEADER) + EnHeader.ESpecBlockSize);
-            LPBYTE pbCKeyPage = (LPBYTE)(pPageHeader + EnHeader.CKeyPageCount);
+            LPBYTE pbFirstPage = (LPBYTE)(pPageHeader + EnHeader.CKeyPageCount);
+            LPBYTE pbCKeyPage = pbFirstPage;
+            DWORD dwPageCount = 0;
 
             // Go through all CKey pages and verify them
             for(DWORD i = 0; i < EnHeader.CKeyPageCount; i++)
@@ -481,14 +683,18 @@ static int LoadEncodingManifest(TCascStorage * hs)
                     break;
                 }
 
-                // Load the entire page of CKey entries.
-                // This operation will never fail, because all memory is already pre-allocated
-                dwErrCode = LoadEncodingCKeyPage(hs, EnHeader, pbCKeyPage, pbCKeyPage + EnHeader.CKeyPageSize);
-                if(dwErrCode != ERROR_SUCCESS)
-                    break;
-
                 // Move to the next CKey page
                 pbCKeyPage += EnHeader.CKeyPageSize;
+                dwPageCount++;
+            }
+
+            // Load all pages that precede the first corrupt one
+            if(dwPageCount != 0)
+            {
+                DWORD dwLoadErrCode = LoadEncodingCKeyPages(hs, EnHeader, pbFirstPage, dwPageCount);
+
+                if(dwErrCode == ERROR_SUCCESS)
+                    dwErrCode = dwLoadErrCode;
             }
         }
 
@@ -800,6 +1006,288 @@ static int LoadInstallManifest(TCascStorage * hs)
     return dwErrCode;
 }
 
+//-----------------------------------------------------------------------------
+// Storage snapshot. Holds the state of the storage after the index files,
+// ENCODING and DOWNLOAD manifests have been loaded, so that the next open
+// of the same build can skip parsing them.
+
+static bool CreateSnapshotHeader(TCascStorage * hs, CASC_SNAPSHOT_HEADER & Header)
+{
+    // Clear the entire header. The identification part is compared as a block of memory
+    Header = CASC_SNAPSHOT_HEADER();
+
+    // Only local storages with known build key can have a snapshot
+    if((hs->dwFeatures & CASC_FEATURE_ONLINE) || hs->CdnBuildKey.cbData != MD5_HASH_SIZE)
+        return false;
+
+    Header.Signature = CASC_SNAPSHOT_SIGNATURE;
+    Header.Version = CASC_SNAPSHOT_VERSION;
+    Header.CKeyEntrySize = sizeof(CASC_CKEY_ENTRY);
+    Header.PointerSize = sizeof(void *);
+    memcpy(Header.BuildKey, hs->CdnBuildKey.pbData, MD5_HASH_SIZE);
+
+    // The index files are rewritten as the game client updates the storage.
+    // Any change of their version, size or time invalidates the snapshot
+    for(DWORD i = 0; i < CASC_INDEX_COUNT; i++)
+    {
+        TFileStream * pStream = NULL;
+        LPTSTR szFileName;
+
+        if((szFileName = GetIndexFileName(hs, i)) != NULL)
+        {
+            pStream = FileStream_OpenFile(szFileName, STREAM_FLAG_READ_ONLY | STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+            CASC_FREE(szFileName);
+        }
+
+        if(pStream == NULL)
+            return false;
+
+        FileStream_GetSize(pStream, &Header.IndexFiles[i].FileSize);
+        FileStream_GetTime(pStream, &Header.IndexFiles[i].FileTime);
+        Header.IndexFiles[i].NewSubIndex = hs->IndexFiles[i].NewSubIndex;
+        FileStream_Close(pStream);
+    }
+
+    return true;
+}
+
+static bool CheckSnapshotHeader(TCascStorage * hs, CASC_SNAPSHOT_HEADER & Header, ULONGLONG FileSize)
+{
+    ULONGLONG cbExpected = sizeof(CASC_SNAPSHOT_HEADER);
+
+    // Each index entry is EKey, followed by 5-byte storage offset and 4-byte encoded size
+    if(Header.EKeyLength == 0 || Header.EKeyLength > MD5_HASH_SIZE || Header.IndexEntryLength != (Header.EKeyLength + 9))
+        return false;
+
+    // Storages without tags save no tag entries and a zero tag length
+    if(Header.TagEntries != 0 && Header.TagEntryLength < FIELD_OFFSET(CASC_TAG_ENTRY2, szTagName))
+        return false;
+
+    // The CKey entries must fit into the array that has been pre-allocated for this build
+    if(Header.CKeyEntries > hs->CKeyArray.ItemCountMax() || Header.IndexEntries == 0)
+        return false;
+
+    // Check the item counts first, so that the lengths below cannot overflow
+    if(Header.CKeyEntries > (FileSize / sizeof(CASC_CKEY_ENTRY)) ||
+       Header.IndexEntries > (FileSize / Header.IndexEntryLength) ||
+       (Header.TagEntries != 0 && Header.TagEntries > (FileSize / Header.TagEntryLength)))
+        return false;
+
+    // The file must contain exactly the header and all the entries
+    cbExpected += Header.CKeyEntries * sizeof(CASC_CKEY_ENTRY);
+    cbExpected += Header.IndexEntries * Header.IndexEntryLength;
+    cbExpected += Header.TagEntries * Header.TagEntryLength;
+    return (cbExpected == FileSize);
+}
+
+static bool ReadSnapshotPart(TFileStream * pStream, ULONGLONG & ByteOffset, void * pvBuffer, ULONGLONG cbBuffer)
+{
+    // FileStream_Read only reads up to 4 GB at once
+    if(cbBuffer > 0xFFFFFFFF)
+        return false;
+
+    if(cbBuffer != 0 && !FileStream_Read(pStream, &ByteOffset, pvBuffer, (DWORD)cbBuffer))
+        return false;
+
+    ByteOffset += cbBuffer;
+    return true;
+}
+
+static bool WriteSnapshotPart(TFileStream * pStream, ULONGLONG & ByteOffset, const void * pvBuffer, ULONGLONG cbBuffer)
+{
+    // FileStream_Write only writes up to 4 GB at once
+    if(cbBuffer > 0xFFFFFFFF)
+        return false;
+
+    if(cbBuffer != 0 && !FileStream_Write(pStream, &ByteOffset, pvBuffer, (DWORD)cbBuffer))
+        return false;
+
+    ByteOffset += cbBuffer;
+    return true;
+}
+
+// Loads the storage state from the snapshot. Returns ERROR_FILE_NOT_FOUND or ERROR_BAD_FORMAT
+// if the snapshot does not exist or does not match the storage. The storage is not changed in that case.
+static DWORD LoadStorageSnapshot(TCascStorage * hs, LPCTSTR szSnapshotFile)
+{
+    CASC_SNAPSHOT_HEADER Expected;
+    CASC_SNAPSHOT_HEADER Header;
+    CASC_MAP_BUILD_JOB MapJob;
+    PCASC_CKEY_ENTRY pCKeyEntries = NULL;
+    TFileStream * pStream;
+    ULONGLONG ByteOffset = 0;
+    ULONGLONG FileSize = 0;
+    LPBYTE pbIndexEntries = NULL;
+    LPBYTE pbTagEntries = NULL;
+    DWORD dwErrCode = ERROR_BAD_FORMAT;
+
+    // Build the header that the snapshot must have
+    if(!CreateSnapshotHeader(hs, Expected))
+        return ERROR_BAD_FORMAT;
+
+    // Open the snapshot file
+    pStream = FileStream_OpenFile(szSnapshotFile, STREAM_FLAG_READ_ONLY | STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+    if(pStream == NULL)
+        return ERROR_FILE_NOT_FOUND;
+    FileStream_GetSize(pStream, &FileSize);
+
+    // Read and verify the header
+    if(ReadSnapshotPart(pStream, ByteOffset, &Header, sizeof(CASC_SNAPSHOT_HEADER)) &&
+       !memcmp(&Header, &Expected, FIELD_OFFSET(CASC_SNAPSHOT_HEADER, EncodingCKey)) &&
+       CheckSnapshotHeader(hs, Header, FileSize))
+    {
+        // Inform the user about what we are doing
+        if(InvokeProgressCallback(hs, "Loading storage snapshot", NULL, 0, 0))
+        {
+            FileStream_Close(pStream);
+            return ERROR_CANCELLED;
+        }
+
+        // Read the CKey entries directly to the CKey array. DO NOT ALLOW enlarge array here
+        pCKeyEntries = (PCASC_CKEY_ENTRY)hs->CKeyArray.Insert((size_t)Header.CKeyEntries, false);
+        pbIndexEntries = CASC_ALLOC<BYTE>((size_t)(Header.IndexEntries * Header.IndexEntryLength));
+        if(Header.TagEntries != 0 && hs->TagsArray.Create((size_t)Header.TagEntryLength, (size_t)Header.TagEntries) == ERROR_SUCCESS)
+            pbTagEntries = (LPBYTE)hs->TagsArray.Insert((size_t)Header.TagEntries);
+
+        if(pCKeyEntries != NULL && pbIndexEntries != NULL && (pbTagEntries != NULL || Header.TagEntries == 0))
+        {
+            if(ReadSnapshotPart(pStream, ByteOffset, pCKeyEntries, Header.CKeyEntries * sizeof(CASC_CKEY_ENTRY)) &&
+               ReadSnapshotPart(pStream, ByteOffset, pbIndexEntries, Header.IndexEntries * Header.IndexEntryLength) &&
+               ReadSnapshotPart(pStream, ByteOffset, pbTagEntries, Header.TagEntries * Header.TagEntryLength))
+            {
+                dwErrCode = ERROR_SUCCESS;
+            }
+        }
+        else
+        {
+            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+        }
+
+        // Revert the storage to the original state if anything failed
+        if(dwErrCode != ERROR_SUCCESS)
+        {
+            hs->CKeyArray.Reset();
+            hs->TagsArray.Free();
+            CASC_FREE(pbIndexEntries);
+        }
+    }
+    FileStream_Close(pStream);
+
+    // Build the map of EKey -> index entry. The entries are unique
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = hs->IndexEKeyMap.Create((size_t)Header.IndexEntries, CASC_EKEY_SIZE, 0);
+        if(dwErrCode == ERROR_SUCCESS)
+        {
+            for(size_t i = 0; i < Header.IndexEntries; i++)
+            {
+                LPBYTE pbEKeyEntry = pbIndexEntries + (i * (size_t)Header.IndexEntryLength);
+
+                hs->IndexEKeyMap.InsertObject(pbEKeyEntry, pbEKeyEntry);
+            }
+        }
+        hs->pbIndexSnapshot = pbIndexEntries;
+    }
+
+    // Restore the storage members and build the CKey map and the EKey map.
+    // The maps are filled in the array order, so they are the same as after loading ENCODING and DOWNLOAD
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        hs->EncodingCKey = Header.EncodingCKey;
+        hs->LocalFiles = (size_t)Header.LocalFiles;
+        hs->TotalFiles = (size_t)Header.TotalFiles;
+        hs->EKeyLength = (size_t)Header.EKeyLength;
+        hs->FileOffsetBits = Header.FileOffsetBits;
+        hs->dwFeatures |= (Header.Features & CASC_FEATURE_TAGS);
+
+        MapJob.hs = hs;
+        MapJob.pCKeyEntries = pCKeyEntries;
+        MapJob.nCKeyEntries = (size_t)Header.CKeyEntries;
+        MapJob.NextMap = 0;
+        CascRunWorkers(BuildCKeyMapsWorker, &MapJob, 2);
+    }
+
+    return dwErrCode;
+}
+
+// Saves the storage state after the DOWNLOAD manifest has been loaded.
+// The snapshot is written to a temporary file which then replaces the old snapshot,
+// so that a storage being open at the same time never reads a mix of both
+static DWORD SaveStorageSnapshot(TCascStorage * hs, LPCTSTR szSnapshotFile)
+{
+    CASC_SNAPSHOT_HEADER Header;
+    TFileStream * pStream;
+    LPTSTR szTempFile;
+    ULONGLONG ByteOffset = sizeof(CASC_SNAPSHOT_HEADER);
+    ULONGLONG HeaderOffset = 0;
+    LPBYTE pbIndexEntries;
+    LPBYTE pbIndexEntry;
+    size_t cbIndexEntry = hs->EKeyLength + 9;
+    DWORD dwErrCode = ERROR_CAN_NOT_COMPLETE;
+
+    // Build the identification part of the header
+    if(!CreateSnapshotHeader(hs, Header))
+        return ERROR_NOT_SUPPORTED;
+
+    // Fill the rest of the header
+    Header.EncodingCKey = hs->EncodingCKey;
+    Header.LocalFiles = hs->LocalFiles;
+    Header.TotalFiles = hs->TotalFiles;
+    Header.EKeyLength = hs->EKeyLength;
+    Header.FileOffsetBits = hs->FileOffsetBits;
+    Header.Features = (hs->dwFeatures & CASC_FEATURE_TAGS);
+    Header.CKeyEntries = hs->CKeyArray.ItemCount();
+    Header.IndexEntries = hs->IndexEKeyMap.ItemCount();
+    Header.IndexEntryLength = cbIndexEntry;
+    Header.TagEntries = hs->TagsArray.ItemCount();
+    Header.TagEntryLength = hs->TagsArray.ItemSize();
+
+    // Collect the index entries from the map. Each of them points into a loaded index file
+    if((pbIndexEntry = pbIndexEntries = CASC_ALLOC<BYTE>(hs->IndexEKeyMap.ItemCount() * cbIndexEntry)) == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    for(size_t i = 0; i < hs->IndexEKeyMap.HashTableSize(); i++)
+    {
+        LPBYTE pbEKeyEntry = (LPBYTE)hs->IndexEKeyMap.ItemAt(i);
+
+        if(pbEKeyEntry != NULL)
+        {
+            memcpy(pbIndexEntry, pbEKeyEntry, cbIndexEntry);
+            pbIndexEntry += cbIndexEntry;
+        }
+    }
+
+    // Prepare the name of the temporary file
+    if((szTempFile = CASC_ALLOC<TCHAR>(_tcslen(szSnapshotFile) + 5)) == NULL)
+    {
+        CASC_FREE(pbIndexEntries);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    CascStrPrintf(szTempFile, _tcslen(szSnapshotFile) + 5, _T("%s.tmp"), szSnapshotFile);
+
+    // Write the entries, then the header
+    if((pStream = FileStream_CreateFile(szTempFile, BASE_PROVIDER_FILE | STREAM_PROVIDER_FLAT)) != NULL)
+    {
+        if(WriteSnapshotPart(pStream, ByteOffset, hs->CKeyArray.ItemAt(0), Header.CKeyEntries * sizeof(CASC_CKEY_ENTRY)) &&
+           WriteSnapshotPart(pStream, ByteOffset, pbIndexEntries, Header.IndexEntries * Header.IndexEntryLength) &&
+           WriteSnapshotPart(pStream, ByteOffset, hs->TagsArray.ItemAt(0), Header.TagEntries * Header.TagEntryLength) &&
+           WriteSnapshotPart(pStream, HeaderOffset, &Header, sizeof(CASC_SNAPSHOT_HEADER)))
+        {
+            dwErrCode = ERROR_SUCCESS;
+        }
+        FileStream_Close(pStream);
+
+        // Replace the old snapshot with the complete new one
+        if(dwErrCode == ERROR_SUCCESS && !RenameFileOver(szTempFile, szSnapshotFile))
+            dwErrCode = GetLastError();
+        if(dwErrCode != ERROR_SUCCESS)
+            _tremove(szTempFile);
+    }
+
+    CASC_FREE(szTempFile);
+    CASC_FREE(pbIndexEntries);
+    return dwErrCode;
+}
+
 static bool InsertWellKnownFile(TCascStorage * hs, const char * szFileName, CASC_CKEY_ENTRY & FakeCKeyEntry, DWORD dwFlags = 0)
 {
     PCASC_CKEY_ENTRY pCKeyEntry = NULL;
@@ -1061,6 +1549,17 @@ static bool GetStoragePathProduct(TCascStorage * hs, void * pvStorageInfo, size_
     return (szBuffer != NULL);
 }
 
+static bool GetStorageFrameCacheStats(TCascStorage * hs, void * pvStorageInfo, size_t cbStorageInfo, size_t * pcbLengthNeeded)
+{
+    PCASC_FRAME_CACHE_STATS pStats;
+
+    // Verify whether we have enough space in the buffer
+    pStats = (PCASC_FRAME_CACHE_STATS)ProbeOutputBuffer(pvStorageInfo, cbStorageInfo, sizeof(CASC_FRAME_CACHE_STATS), pcbLengthNeeded);
+    if(pStats != NULL)
+        hs->FrameCache.GetStats(pStats);
+    return (pStats != NULL);
+}
+
 static DWORD InitializeLocalDirectories(TCascStorage * hs, PCASC_OPEN_STORAGE_ARGS pArgs)
 {
     LPTSTR szWorkPath;
@@ -1128,17 +1627,21 @@ static DWORD InitializeOnlineDirectories(TCascStorage * hs, PCASC_OPEN_STORAGE_A
 
 static DWORD LoadCascStorage(TCascStorage * hs, PCASC_OPEN_STORAGE_ARGS pArgs)
 {
+    LPCTSTR szSnapshotFile = NULL;
     LPCTSTR szCodeName = NULL;
     LPCTSTR szRegion = NULL;
     char szRegionA[0x40];
+    size_t FrameCacheSize = 0;
     DWORD dwLocaleMask = 0;
     DWORD dwErrCode = ERROR_SUCCESS;
+    bool bSnapshotLoaded = false;
 
     // Pass the argument array to the storage
     hs->pArgs = pArgs;
 
     // Extract optional arguments
     ExtractVersionedArgument(pArgs, FIELD_OFFSET(CASC_OPEN_STORAGE_ARGS, dwLocaleMask), &dwLocaleMask);
+    ExtractVersionedArgument(pArgs, FIELD_OFFSET(CASC_OPEN_STORAGE_ARGS, dwFlags), &hs->dwOpenFlags);
     
     // Extract the product code name
     if(ExtractVersionedArgument(pArgs, FIELD_OFFSET(CASC_OPEN_STORAGE_ARGS, szCodeName), &szCodeName) && szCodeName != NULL)
@@ -1151,6 +1654,17 @@ static DWORD LoadCascStorage(TCascStorage * hs, PCASC_OPEN_STORAGE_ARGS pArgs)
         hs->szRegion = CascNewStr(szRegionA);
     }
 
+    // Create the cache of decoded file frames
+    ExtractVersionedArgument(pArgs, FIELD_OFFSET(CASC_OPEN_STORAGE_ARGS, FrameCacheSize), &FrameCacheSize);
+    if(FrameCacheSize != CASC_FRAME_CACHE_DISABLED)
+    {
+        FrameCacheSize = (FrameCacheSize != 0) ? FrameCacheSize : CASC_FRAME_CACHE_DEFAULT;
+        dwErrCode = hs->FrameCache.Create(FrameCacheSize);
+    }
+
+    // Extract the name of the storage snapshot (optional)
+    ExtractVersionedArgument(pArgs, FIELD_OFFSET(CASC_OPEN_STORAGE_ARGS, szSnapshotFile), &szSnapshotFile);
+
     // For online storages, we need to load CDN servers
     if ((dwErrCode == ERROR_SUCCESS) && (hs->dwFeatures & CASC_FEATURE_ONLINE))
     {
@@ -1184,24 +1698,47 @@ static DWORD LoadCascStorage(TCascStorage * hs, PCASC_OPEN_STORAGE_ARGS pArgs)
         dwErrCode = InitCKeyArray(hs);
     }
 
-    // Pre-load the local index files
+    // Find the local index files
     if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = ScanIndexFiles(hs);
+    }
+
+    // If there is a snapshot of this build, load the CKey entries from it
+    if(dwErrCode == ERROR_SUCCESS && szSnapshotFile != NULL)
+    {
+        dwErrCode = LoadStorageSnapshot(hs, szSnapshotFile);
+        bSnapshotLoaded = (dwErrCode == ERROR_SUCCESS);
+
+        // A missing or outdated snapshot is not an error. The storage is loaded the usual way
+        if(dwErrCode == ERROR_FILE_NOT_FOUND || dwErrCode == ERROR_BAD_FORMAT)
+            dwErrCode = ERROR_SUCCESS;
+    }
+
+    // Pre-load the local index files
+    if(dwErrCode == ERROR_SUCCESS && !bSnapshotLoaded)
     {
         dwErrCode = LoadIndexFiles(hs);
     }
 
     // Load the ENCODING manifest
-    if(dwErrCode == ERROR_SUCCESS)
+    if(dwErrCode == ERROR_SUCCESS && !bSnapshotLoaded)
     {
         dwErrCode = LoadEncodingManifest(hs);
     }
 
     // We need to load the DOWNLOAD manifest
-    if(dwErrCode == ERROR_SUCCESS)
+    if(dwErrCode == ERROR_SUCCESS && !bSnapshotLoaded)
     {
         dwErrCode = LoadDownloadManifest(hs);
     }
 
+    // Save the snapshot for the next open. Failure to save it is not an error
+    if(dwErrCode == ERROR_SUCCESS && szSnapshotFile != NULL && !bSnapshotLoaded)
+    {
+        SaveStorageSnapshot(hs, szSnapshotFile);
+    }
+
     // Load the build manifest ("ROOT" file)
     if(dwErrCode == ERROR_SUCCESS)
     {
@@ -1434,6 +1971,9 @@ bool WINAPI CascGetStorageInfo(
         case CascStoragePathProduct:
             return GetStoragePathProduct(hs, pvStorageInfo, cbStorageInfo, pcbLengthNeeded);
 
+        case CascStorageFrameCacheStats:
+            return GetStorageFrameCacheStats(hs, pvStorageInfo, cbStorageInfo, pcbLengthNeeded);
+
         default:
             SetLastError(ERROR_INVALID_PARAMETER);
             return false;
@@ -100,6 +100,7 @@
   #include <wchar.h>
   #include <cassert>
   #include <errno.h>
+  #include <pthread.h>
 
   // Support for PowerPC on Max OS X
   #if (__ppc__ == 1) || (__POWERPC__ == 1) || (_ARCH_PPC == 1)
@@ -145,6 +146,7 @@
   #include <wchar.h>
   #include <assert.h>
   #include <errno.h>
+  #include <pthread.h>
 
   #define URL_SEP_CHAR              '/'
   #define PATH_SEP_CHAR             '/'
@@ -230,6 +232,8 @@
   #define stat64  stat
   #define fstat64 fstat
   #define lseek64 lseek
+  #define pread64 pread
+  #define pwrite64 pwrite
   #define ftruncate64 ftruncate
   #define off64_t off_t
   #define O_LARGEFILE 0
@@ -329,7 +333,7 @@ inline DWORD CascInterlockedIncrement(PDWORD PtrValue)
 #ifdef PLATFORM_WINDOWS
     return (DWORD)InterlockedIncrement((LONG *)(PtrValue));
 #else
-    return ++PtrValue[0];
+    return __sync_add_and_fetch(PtrValue, 1);
 #endif
 }
 
@@ -338,7 +342,7 @@ inline DWORD CascInterlockedDecrement(PDWORD PtrValue)
 #ifdef PLATFORM_WINDOWS
     return (DWORD)InterlockedDecrement((LONG *)(PtrValue));
 #else
-    return --PtrValue[0];
+    return __sync_sub_and_fetch(PtrValue, 1);
 #endif
 }
 
@@ -348,7 +352,7 @@ inline DWORD CascInterlockedDecrement(PDWORD PtrValue)
 #ifdef PLATFORM_WINDOWS
 typedef RTL_CRITICAL_SECTION CASC_LOCK;
 #else
-typedef unsigned int CASC_LOCK;
+typedef pthread_mutex_t CASC_LOCK;
 #endif
 
 inline void CascInitLock(CASC_LOCK & Lock)
@@ -356,7 +360,7 @@ inline void CascInitLock(CASC_LOCK & Lock)
 #ifdef PLATFORM_WINDOWS
     InitializeCriticalSection(&Lock);
 #else
-    Lock = 0;   // TODO
+    pthread_mutex_init(&Lock, NULL);
 #endif
 }
 
@@ -365,7 +369,7 @@ inline void CascFreeLock(CASC_LOCK & Lock)
 #ifdef PLATFORM_WINDOWS
     DeleteCriticalSection(&Lock);
 #else
-    Lock = 0;   // TODO
+    pthread_mutex_destroy(&Lock);
 #endif
 }
 
@@ -374,7 +378,7 @@ inline void CascLock(CASC_LOCK & Lock)
 #ifdef PLATFORM_WINDOWS
     EnterCriticalSection(&Lock);
 #else
-    Lock = 0;   // TODO
+    pthread_mutex_lock(&Lock);
 #endif
 }
 
@@ -383,7 +387,7 @@ inline void CascUnlock(CASC_LOCK & Lock)
 #ifdef PLATFORM_WINDOWS
     LeaveCriticalSection(&Lock);
 #else
-    Lock = 0;   // TODO
+    pthread_mutex_unlock(&Lock);
 #endif
 }
 
@@ -12,6 +12,44 @@
 #include "CascLib.h"
 #include "CascCommon.h"
 
+//-----------------------------------------------------------------------------
+// Local defines
+
+// Minimum amount of decoded data per thread when decoding frames on multiple threads.
+// Starting a thread is only worth it if it has enough work to do
+#define CASC_PARALLEL_DECODE_SIZE   0x00040000
+
+//-----------------------------------------------------------------------------
+// Local structures
+
+// One frame of a span that is being decoded to the user buffer
+typedef struct _CASC_DECODE_FRAME
+{
+    LPBYTE pbDecoded;                       // Place in the user buffer where the frame decodes to
+    DWORD EncodedOffset;                    // Offset of the frame in the encoded span data
+    DWORD dwErrCode;                        // Result of decoding the frame
+} CASC_DECODE_FRAME, *PCASC_DECODE_FRAME;
+
+// Frame decoding job shared by all worker threads
+typedef struct _CASC_DECODE_JOB
+{
+    TCascFile * hf;                         // The file being read
+    PCASC_CKEY_ENTRY pCKeyEntry;            // CKey entry of the span
+    PCASC_FILE_SPAN pFileSpan;              // The span being decoded
+    PCASC_DECODE_FRAME pDecodeFrames;       // Array of frames to decode
+    LPBYTE pbEncoded;                       // Encoded data of the span
+    DWORD FrameCount;                       // Number of frames to decode
+    DWORD NextFrame;                        // Index of the next frame to be taken by a worker
+} CASC_DECODE_JOB, *PCASC_DECODE_JOB;
+
+// Parsed frame table of a file span, as kept in the storage frame cache.
+// The frames follow the structure. Their file offsets are relative to the start of the span
+typedef struct _CASC_FRAME_TABLE
+{
+    DWORD FrameCount;                       // Number of frames that follow
+    DWORD HeaderSize;                       // Size of the BLTE header of the span, including the frame headers
+} CASC_FRAME_TABLE, *PCASC_FRAME_TABLE;
+
 //-----------------------------------------------------------------------------
 // Local functions
 
@@ -41,7 +79,9 @@ static DWORD OpenDataStream(TCascFile * hf, PCASC_FILE_SPAN pFileSpan, PCASC_CKE
         DWORD dwArchiveIndex = pFileSpan->ArchiveIndex;
 
         // If the data archive is not open yet, open it now.
-        // TODO: This is not thread safe, we need to implement locking here
+        // The lock makes sure that each data file is only open once,
+        // even if multiple threads open files from the same storage
+        CascLock(hs->StorageLock);
         if(hs->DataFiles[dwArchiveIndex] == NULL)
         {
             // Prepare the name of the data file
@@ -49,13 +89,22 @@ static DWORD OpenDataStream(TCascFile * hf, PCASC_FILE_SPAN pFileSpan, PCASC_CKE
             CombinePath(szDataFile, _countof(szDataFile), PATH_SEP_CHAR, hs->szIndexPath, szPlainName, NULL);
 
             // Open the data stream with read+write sharing to prevent Battle.net agent
-            // detecting a corruption and redownloading the entire package
-            pStream = FileStream_OpenFile(szDataFile, STREAM_FLAG_READ_ONLY | STREAM_FLAG_WRITE_SHARE | STREAM_PROVIDER_FLAT | STREAM_FLAG_FILL_MISSING | BASE_PROVIDER_FILE);
+            // detecting a corruption and redownloading the entire package.
+            // The stream is shared by all file handles, so it is read by positional reads only.
+            // If asked to, the data file is memory-mapped on 64-bit platforms, so that the encoded
+            // data can be decoded in place. If the mapping fails, we fall back to normal file.
+#ifdef PLATFORM_64BIT
+            if(hs->dwOpenFlags & CASC_STORAGE_MAP_DATA_FILES)
+                pStream = FileStream_OpenFile(szDataFile, STREAM_FLAG_READ_ONLY | STREAM_FLAG_WRITE_SHARE | STREAM_FLAG_SHARED_READ | STREAM_PROVIDER_FLAT | STREAM_FLAG_FILL_MISSING | BASE_PROVIDER_MAP);
+            if(pStream == NULL)
+#endif
+                pStream = FileStream_OpenFile(szDataFile, STREAM_FLAG_READ_ONLY | STREAM_FLAG_WRITE_SHARE | STREAM_FLAG_SHARED_READ | STREAM_PROVIDER_FLAT | STREAM_FLAG_FILL_MISSING | BASE_PROVIDER_FILE);
             hs->DataFiles[dwArchiveIndex] = pStream;
         }
+        pFileSpan->pStream = hs->DataFiles[dwArchiveIndex];
+        CascUnlock(hs->StorageLock);
 
         // Return error or success
-        pFileSpan->pStream = hs->DataFiles[dwArchiveIndex];
         return (pFileSpan->pStream != NULL) ? ERROR_SUCCESS : ERROR_FILE_NOT_FOUND;
     }
     else
@@ -88,9 +137,9 @@ static DWORD OpenDataStream(TCascFile * hf, PCASC_FILE_SPAN pFileSpan, PCASC_CKE
                         pFileSpan->ArchiveOffs = (DWORD)CdnsInfo.ArchiveOffs;
 
                         // Encoded size
-                        if(pCKeyEntry->EncodedSize == CASC_INVALID_SIZE)
-                            pCKeyEntry->EncodedSize = CdnsInfo.EncodedSize;
-                        assert(pCKeyEntry->EncodedSize == CdnsInfo.EncodedSize);
+                        if(pFileSpan->EncodedSize == CASC_INVALID_SIZE)
+                            pFileSpan->EncodedSize = CdnsInfo.EncodedSize;
+                        assert(pFileSpan->EncodedSize == CdnsInfo.EncodedSize);
                     }
                     else
                     {
@@ -99,9 +148,9 @@ static DWORD OpenDataStream(TCascFile * hf, PCASC_FILE_SPAN pFileSpan, PCASC_CKE
                         pFileSpan->ArchiveOffs = 0;
 
                         // Encoded size
-                        if(pCKeyEntry->EncodedSize == CASC_INVALID_SIZE)
-                            pCKeyEntry->EncodedSize = GetStreamEncodedSize(pStream);
-                        assert(pCKeyEntry->EncodedSize == GetStreamEncodedSize(pStream));
+                        if(pFileSpan->EncodedSize == CASC_INVALID_SIZE)
+                            pFileSpan->EncodedSize = GetStreamEncodedSize(pStream);
+                        assert(pFileSpan->EncodedSize == GetStreamEncodedSize(pStream));
                     }
 
                     // We need to close the file stream after we're done
@@ -161,7 +210,7 @@ static void VerifyHeaderSpan(PBLTE_ENCODED_HEADER pBlteHeader, ULONGLONG HeaderO
 }
 #endif
 
-static DWORD ParseBlteHeader(PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_ENTRY pCKeyEntry, ULONGLONG HeaderOffset, LPBYTE pbEncodedBuffer, size_t cbEncodedBuffer, size_t * pcbHeaderSize)
+static DWORD ParseBlteHeader(PCASC_FILE_SPAN pFileSpan, ULONGLONG HeaderOffset, LPBYTE pbEncodedBuffer, size_t cbEncodedBuffer, size_t * pcbHeaderSize)
 {
     PBLTE_ENCODED_HEADER pEncodedHeader = (PBLTE_ENCODED_HEADER)pbEncodedBuffer;
     PBLTE_HEADER pBlteHeader = (PBLTE_HEADER)pbEncodedBuffer;
@@ -179,7 +228,7 @@ static DWORD ParseBlteHeader(PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_ENTRY pCKeyEn
         // There must be at least some bytes
         if (cbEncodedBuffer < FIELD_OFFSET(BLTE_ENCODED_HEADER, MustBe0F))
             return ERROR_BAD_FORMAT;
-        if (pEncodedHeader->EncodedSize != pCKeyEntry->EncodedSize)
+        if (pEncodedHeader->EncodedSize != pFileSpan->EncodedSize)
             return ERROR_BAD_FORMAT;
 
 #ifdef _DEBUG
@@ -258,7 +307,7 @@ static LPBYTE CaptureBlteFileFrame(CASC_FILE_FRAME & Frame, LPBYTE pbFramePtr, L
     return pbFramePtr + sizeof(BLTE_FRAME);
 }
 
-static DWORD LoadSpanFrames(PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_ENTRY pCKeyEntry, DWORD DataFileOffset, LPBYTE pbFramePtr, LPBYTE pbFrameEnd, size_t cbHeaderSize)
+static DWORD LoadSpanFrames(PCASC_FILE_SPAN pFileSpan, DWORD DataFileOffset, LPBYTE pbFramePtr, LPBYTE pbFrameEnd, size_t cbHeaderSize)
 {
     PCASC_FILE_FRAME pFrames = NULL;
     DWORD ContentSize = 0;
@@ -301,10 +350,10 @@ static DWORD LoadSpanFrames(PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_ENTRY pCKeyEnt
                 DataFileOffset += Frame.EncodedSize;
             }
 
-            // Save the content size of the file
-            if(pCKeyEntry->ContentSize == CASC_INVALID_SIZE)
+            // Save the content size of the span
+            if(pFileSpan->ContentSize == CASC_INVALID_SIZE)
             {
-                pCKeyEntry->ContentSize = ContentSize;
+                pFileSpan->ContentSize = ContentSize;
             }
         }
         else
@@ -323,8 +372,8 @@ static DWORD LoadSpanFrames(PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_ENTRY pCKeyEnt
             pFrames->StartOffset = pFileSpan->StartOffset;
             pFrames->EndOffset = pFileSpan->EndOffset;
             pFrames->DataFileOffset = DataFileOffset;
-            pFrames->EncodedSize = (DWORD)(pCKeyEntry->EncodedSize - cbHeaderSize);
-            pFrames->ContentSize = pCKeyEntry->ContentSize;
+            pFrames->EncodedSize = (DWORD)(pFileSpan->EncodedSize - cbHeaderSize);
+            pFrames->ContentSize = pFileSpan->ContentSize;
 
             // Save the number of file frames
             pFileSpan->FrameCount = 1;
@@ -346,7 +395,7 @@ static DWORD LoadSpanFrames(PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_ENTRY pCKeyEnt
     return dwErrCode;
 }
 
-static DWORD LoadSpanFramesForPlainFile(PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_ENTRY pCKeyEntry)
+static DWORD LoadSpanFramesForPlainFile(PCASC_FILE_SPAN pFileSpan)
 {
     PCASC_FILE_FRAME pFrames;
 
@@ -355,16 +404,16 @@ static DWORD LoadSpanFramesForPlainFile(PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_EN
     if (pFrames != NULL)
     {
         // Setup the size
-        pFileSpan->EndOffset = pFileSpan->StartOffset + pCKeyEntry->ContentSize;
-        pCKeyEntry->Flags |= CASC_CE_PLAIN_DATA;
+        pFileSpan->EndOffset = pFileSpan->StartOffset + pFileSpan->ContentSize;
+        pFileSpan->bPlainData = true;
 
         // Fill the single frame
         memset(&pFrames->FrameHash, 0, sizeof(CONTENT_KEY));
         pFrames->StartOffset = pFileSpan->StartOffset;
-        pFrames->EndOffset = pFrames->StartOffset + pCKeyEntry->ContentSize;
+        pFrames->EndOffset = pFrames->StartOffset + pFileSpan->ContentSize;
         pFrames->DataFileOffset = 0;
-        pFrames->EncodedSize = pCKeyEntry->EncodedSize;
-        pFrames->ContentSize = pCKeyEntry->ContentSize;
+        pFrames->EncodedSize = pFileSpan->EncodedSize;
+        pFrames->ContentSize = pFileSpan->ContentSize;
 
         // Save the number of file frames
         pFileSpan->FrameCount = 1;
@@ -375,7 +424,7 @@ static DWORD LoadSpanFramesForPlainFile(PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_EN
     return ERROR_NOT_ENOUGH_MEMORY;
 }
 
-static DWORD LoadEncodedHeaderAndSpanFrames(PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_ENTRY pCKeyEntry)
+static DWORD LoadEncodedHeaderAndSpanFrames(PCASC_FILE_SPAN pFileSpan)
 {
     LPBYTE pbEncodedBuffer;
     size_t cbEncodedBuffer = MAX_ENCODED_HEADER;
@@ -394,10 +443,10 @@ static DWORD LoadEncodedHeaderAndSpanFrames(PCASC_FILE_SPAN pFileSpan, PCASC_CKE
         size_t cbHeaderSize = 0;
 
         // At this point, we expect encoded size to be known
-        assert(pCKeyEntry->EncodedSize != CASC_INVALID_SIZE);
+        assert(pFileSpan->EncodedSize != CASC_INVALID_SIZE);
 
         // Do not read more than encoded size
-        cbEncodedBuffer = CASCLIB_MIN(cbEncodedBuffer, pCKeyEntry->EncodedSize);
+        cbEncodedBuffer = CASCLIB_MIN(cbEncodedBuffer, pFileSpan->EncodedSize);
 
         // Load the entire (eventual) header area. This is faster than doing
         // two read operations in a row. Read as much as possible. If the file is cut,
@@ -405,7 +454,7 @@ static DWORD LoadEncodedHeaderAndSpanFrames(PCASC_FILE_SPAN pFileSpan, PCASC_CKE
         if (FileStream_Read(pFileSpan->pStream, &ReadOffset, pbEncodedBuffer, (DWORD)cbEncodedBuffer))
         {
             // Parse the BLTE header
-            dwErrCode = ParseBlteHeader(pFileSpan, pCKeyEntry, ReadOffset, pbEncodedBuffer, cbEncodedBuffer, &cbHeaderSize);
+            dwErrCode = ParseBlteHeader(pFileSpan, ReadOffset, pbEncodedBuffer, cbEncodedBuffer, &cbHeaderSize);
             if (dwErrCode == ERROR_SUCCESS)
             {
                 // If the headers are larger than the initial read size, we read the missing data
@@ -422,16 +471,16 @@ static DWORD LoadEncodedHeaderAndSpanFrames(PCASC_FILE_SPAN pFileSpan, PCASC_CKE
                 if (dwErrCode == ERROR_SUCCESS)
                 {
                     assert((DWORD)(ReadOffset + cbHeaderSize) > (DWORD)ReadOffset);
-                    dwErrCode = LoadSpanFrames(pFileSpan, pCKeyEntry, (DWORD)(ReadOffset + cbHeaderSize), pbEncodedBuffer + cbHeaderSize, pbEncodedBuffer + cbEncodedBuffer, cbHeaderSize);
+                    dwErrCode = LoadSpanFrames(pFileSpan, (DWORD)(ReadOffset + cbHeaderSize), pbEncodedBuffer + cbHeaderSize, pbEncodedBuffer + cbEncodedBuffer, cbHeaderSize);
                 }
             }
             else
             {
                 // Special treatment for plain files ("PATCH"): If the content size and encoded size
                 // are equal, we will create a single fake frame
-                if(pCKeyEntry->EncodedSize == pCKeyEntry->ContentSize)
+                if(pFileSpan->EncodedSize == pFileSpan->ContentSize)
                 {
-                    dwErrCode = LoadSpanFramesForPlainFile(pFileSpan, pCKeyEntry);
+                    dwErrCode = LoadSpanFramesForPlainFile(pFileSpan);
                 }
             }
         }
@@ -451,6 +500,91 @@ static DWORD LoadEncodedHeaderAndSpanFrames(PCASC_FILE_SPAN pFileSpan, PCASC_CKE
     return dwErrCode;
 }
 
+// Decoded frames are shared between file handles through the storage frame cache.
+// Files read with no caching at all (the internal files) stay out of it.
+static bool CanUseFrameCache(TCascFile * hf, PCASC_CKEY_ENTRY pCKeyEntry)
+{
+    return (hf->hs != NULL &&
+            hf->hs->FrameCache.IsInitialized() &&
+            hf->CacheStrategy != CascCacheNothing &&
+            (pCKeyEntry->Flags & CASC_CE_HAS_EKEY));
+}
+
+// Frame tables are cached too, so that a file opened again only reads the file data.
+// Only the files in local data files have fixed position, which the frame table refers to
+static bool CanUseFrameTableCache(TCascFile * hf, PCASC_CKEY_ENTRY pCKeyEntry, PCASC_FILE_SPAN pFileSpan)
+{
+    return (CanUseFrameCache(hf, pCKeyEntry) &&
+            (pCKeyEntry->Flags & CASC_CE_FILE_IS_LOCAL) &&
+            (pFileSpan->bPlainData == false));
+}
+
+static bool LoadCachedSpanFrames(TCascStorage * hs, PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_ENTRY pCKeyEntry)
+{
+    PCASC_FRAME_TABLE pFrameTable;
+    PCASC_FILE_FRAME pFrames = NULL;
+    DWORD cbFrameTable = 0;
+
+    // Retrieve the copy of the frame table from the cache
+    pFrameTable = (PCASC_FRAME_TABLE)hs->FrameCache.Find(pCKeyEntry->EKey, CASC_FRAME_TABLE_INDEX, &cbFrameTable);
+    if(pFrameTable != NULL)
+    {
+        // Verify the size and allocate the frames of the span
+        if(cbFrameTable == sizeof(CASC_FRAME_TABLE) + pFrameTable->FrameCount * sizeof(CASC_FILE_FRAME))
+        {
+            if((pFrames = CASC_ALLOC<CASC_FILE_FRAME>(pFrameTable->FrameCount)) != NULL)
+            {
+                memcpy(pFrames, pFrameTable + 1, pFrameTable->FrameCount * sizeof(CASC_FILE_FRAME));
+
+                // Move the frames to the position of the span in the file
+                for(DWORD i = 0; i < pFrameTable->FrameCount; i++)
+                {
+                    pFrames[i].StartOffset += pFileSpan->StartOffset;
+                    pFrames[i].EndOffset += pFileSpan->StartOffset;
+                }
+
+                pFileSpan->HeaderSize = pFrameTable->HeaderSize;
+                pFileSpan->FrameCount = pFrameTable->FrameCount;
+                pFileSpan->pFrames = pFrames;
+
+                // If the content size of the span is not known, it is the sum of the frames
+                if(pFileSpan->ContentSize == CASC_INVALID_SIZE && pFrameTable->FrameCount != 0)
+                    pFileSpan->ContentSize = (DWORD)(pFrames[pFrameTable->FrameCount - 1].EndOffset - pFrames[0].StartOffset);
+            }
+        }
+
+        CASC_FREE(pFrameTable);
+    }
+
+    return (pFrames != NULL);
+}
+
+static void SaveCachedSpanFrames(TCascStorage * hs, PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_ENTRY pCKeyEntry)
+{
+    PCASC_FRAME_TABLE pFrameTable;
+    PCASC_FILE_FRAME pFrames;
+    size_t cbFrameTable = sizeof(CASC_FRAME_TABLE) + pFileSpan->FrameCount * sizeof(CASC_FILE_FRAME);
+
+    // Make the frame offsets relative to the span, because the same span may be in more files
+    pFrameTable = (PCASC_FRAME_TABLE)CASC_ALLOC<BYTE>(cbFrameTable);
+    if(pFrameTable != NULL)
+    {
+        pFrameTable->FrameCount = pFileSpan->FrameCount;
+        pFrameTable->HeaderSize = pFileSpan->HeaderSize;
+        pFrames = (PCASC_FILE_FRAME)(pFrameTable + 1);
+        memcpy(pFrames, pFileSpan->pFrames, pFileSpan->FrameCount * sizeof(CASC_FILE_FRAME));
+
+        for(DWORD i = 0; i < pFileSpan->FrameCount; i++)
+        {
+            pFrames[i].StartOffset -= pFileSpan->StartOffset;
+            pFrames[i].EndOffset -= pFileSpan->StartOffset;
+        }
+
+        hs->FrameCache.Insert(pCKeyEntry->EKey, CASC_FRAME_TABLE_INDEX, (LPBYTE)pFrameTable, (DWORD)cbFrameTable);
+        CASC_FREE(pFrameTable);
+    }
+}
+
 static DWORD LoadSpanFrames(TCascFile * hf, PCASC_FILE_SPAN pFileSpan, PCASC_CKEY_ENTRY pCKeyEntry)
 {
     DWORD dwErrCode = ERROR_SUCCESS;
@@ -466,8 +600,15 @@ static DWORD LoadSpanFrames(TCascFile * hf, PCASC_FILE_SPAN pFileSpan, PCASC_CKE
             return dwErrCode;
     }
 
+    // If the file has been open before, take the frame table from the cache
+    if(CanUseFrameTableCache(hf, pCKeyEntry, pFileSpan) && LoadCachedSpanFrames(hf->hs, pFileSpan, pCKeyEntry))
+        return ERROR_SUCCESS;
+
     // Make sure we have header area loaded
-    return LoadEncodedHeaderAndSpanFrames(pFileSpan, pCKeyEntry);
+    dwErrCode = LoadEncodedHeaderAndSpanFrames(pFileSpan);
+    if(dwErrCode == ERROR_SUCCESS && CanUseFrameTableCache(hf, pCKeyEntry, pFileSpan))
+        SaveCachedSpanFrames(hf->hs, pFileSpan, pCKeyEntry);
+    return dwErrCode;
 }
 
 // Loads all file spans to memory
@@ -496,8 +637,8 @@ static DWORD LoadFileSpanFrames(TCascFile * hf)
             if(dwErrCode != ERROR_SUCCESS)
                 break;
 
-            hf->ContentSize += pCKeyEntry->ContentSize;
-            hf->EncodedSize += pCKeyEntry->EncodedSize;
+            hf->ContentSize += pFileSpan->ContentSize;
+            hf->EncodedSize += pFileSpan->EncodedSize;
             pFileSpan->EndOffset = hf->ContentSize;
         }
     }
@@ -535,13 +676,24 @@ static DWORD EnsureFileSpanFramesLoaded(TCascFile * hf)
     return ERROR_SUCCESS;
 }
 
+// Retrieves the decoded frame from the storage frame cache. When the caller wants
+// the data verified, the frame is always loaded from the storage
+static bool FindCachedFrame(TCascFile * hf, PCASC_CKEY_ENTRY pCKeyEntry, PCASC_FILE_FRAME pFrame, DWORD FrameIndex, LPBYTE pbDecoded)
+{
+    if(CanUseFrameCache(hf, pCKeyEntry) && hf->bVerifyIntegrity == false)
+        return hf->hs->FrameCache.Find(pCKeyEntry->EKey, FrameIndex, pbDecoded, pFrame->ContentSize);
+    return false;
+}
+
 static DWORD DecodeFileFrame(
     TCascFile * hf,
     PCASC_CKEY_ENTRY pCKeyEntry,
+    PCASC_FILE_SPAN pFileSpan,
     PCASC_FILE_FRAME pFrame,
     LPBYTE pbEncoded,
     LPBYTE pbDecoded,
-    DWORD FrameIndex)
+    DWORD FrameIndex,
+    bool bShareFrame)
 {
     TCascStorage * hs = hf->hs;
     LPBYTE pbWorkBuffer = NULL;
@@ -551,6 +703,7 @@ static DWORD DecodeFileFrame(
     DWORD dwErrCode = ERROR_SUCCESS;
     DWORD cbEncoded = pFrame->EncodedSize;
     DWORD cbDecoded = pFrame->ContentSize;
+    BYTE EncodingMode = pbEncoded[0];
     bool bWorkComplete = false;
 
     //if(pFrame->EncodedSize == 0xda001)
@@ -561,12 +714,12 @@ static DWORD DecodeFileFrame(
     //}
 
     // If this is a file span with plain data, just copy the data
-    if(pCKeyEntry->Flags & CASC_CE_PLAIN_DATA)
+    if(pFileSpan->bPlainData)
     {
-        assert(pCKeyEntry->ContentSize == pCKeyEntry->EncodedSize);
-        assert(pCKeyEntry->ContentSize == pFrame->ContentSize);
+        assert(pFileSpan->ContentSize == pFileSpan->EncodedSize);
+        assert(pFileSpan->ContentSize == pFrame->ContentSize);
         assert(pFrame->ContentSize == pFrame->EncodedSize);
-        memcpy(pbDecoded, pbEncoded, pCKeyEntry->ContentSize);
+        memcpy(pbDecoded, pbEncoded, pFrame->ContentSize);
         return ERROR_SUCCESS;
     }
 
@@ -652,6 +805,11 @@ static DWORD DecodeFileFrame(
         dwErrCode = ERROR_SUCCESS;
     }
 
+    // Share the decoded frame with other file handles. Encrypted frames are not shared,
+    // because the result depends on the keys known at the time and on bOvercomeEncrypted
+    if(dwErrCode == ERROR_SUCCESS && bShareFrame && EncodingMode != 'E' && CanUseFrameCache(hf, pCKeyEntry))
+        hs->FrameCache.Insert(pCKeyEntry->EKey, FrameIndex, pbDecoded, pFrame->ContentSize);
+
     // Free the temporary buffer
     CASC_FREE(pbWorkBuffer);
     return dwErrCode;
@@ -769,51 +927,166 @@ static DWORD ReadFile_Cache(TCascFile * hf, LPBYTE pbBuffer, ULONGLONG StartOffs
     return 0;
 }
 
+// Decodes the frames of one file span. Each frame is decoded independently,
+// so the frames are taken by worker threads from a shared counter
+static void DecodeFramesWorker(void * pvContext)
+{
+    PCASC_DECODE_JOB pJob = (PCASC_DECODE_JOB)pvContext;
+    PCASC_DECODE_FRAME pDecodeFrame;
+    DWORD FrameIndex;
+
+    while((FrameIndex = CascInterlockedIncrement(&pJob->NextFrame) - 1) < pJob->FrameCount)
+    {
+        // Skip the frames that were taken from the frame cache
+        pDecodeFrame = pJob->pDecodeFrames + FrameIndex;
+        if(pDecodeFrame->dwErrCode == ERROR_SUCCESS)
+            continue;
+
+        pDecodeFrame->dwErrCode = DecodeFileFrame(pJob->hf,
+                                                  pJob->pCKeyEntry,
+                                                  pJob->pFileSpan,
+                                                  pJob->pFileSpan->pFrames + FrameIndex,
+                                                  pJob->pbEncoded + pDecodeFrame->EncodedOffset,
+                                                  pDecodeFrame->pbDecoded,
+                                                  FrameIndex,
+                                                  false);
+    }
+}
+
+// Reads all frames of the span to the output buffer. Returns the number of bytes
+// that were read before the first frame that failed. The frames already in the
+// storage frame cache are taken from there, but the frames decoded by a whole-file
+// read are not inserted into it; they are likely never going to be read again.
+static DWORD ReadSpanFrames(TCascFile * hf, PCASC_CKEY_ENTRY pCKeyEntry, PCASC_FILE_SPAN pFileSpan, LPBYTE pbBuffer, PDWORD PtrErrCode)
+{
+    PCASC_DECODE_FRAME pDecodeFrames;
+    PCASC_FILE_FRAME pFileFrame = pFileSpan->pFrames;
+    CASC_DECODE_JOB Job;
+    LPBYTE pbMapped;
+    ULONGLONG ByteOffset = pFileSpan->ArchiveOffs + pFileSpan->HeaderSize;
+    DWORD EncodedSize = pFileSpan->EncodedSize - pFileSpan->HeaderSize;
+    DWORD dwWorkerCount = 1;
+    DWORD dwBytesRead = 0;
+    DWORD cbToDecode = 0;
+    DWORD cbContent = 0;
+    DWORD EncodedOffset = 0;
+    DWORD FrameCount = 0;
+    DWORD dwErrCode = ERROR_SUCCESS;
+
+    // Allocate the array of frame work items
+    pDecodeFrames = CASC_ALLOC<CASC_DECODE_FRAME>(pFileSpan->FrameCount);
+    if(pDecodeFrames == NULL)
+    {
+        PtrErrCode[0] = ERROR_NOT_ENOUGH_MEMORY;
+        return 0;
+    }
+
+    // Give every frame its position in the encoded data and in the output buffer.
+    // The frames that don't fit into the encoded span are not decoded.
+    for(FrameCount = 0; FrameCount < pFileSpan->FrameCount; FrameCount++, pFileFrame++)
+    {
+        PCASC_DECODE_FRAME pDecodeFrame = pDecodeFrames + FrameCount;
+
+        if(pFileFrame->EncodedSize > (EncodedSize - EncodedOffset))
+            break;
+
+        pDecodeFrame->pbDecoded = pbBuffer + cbContent;
+        pDecodeFrame->EncodedOffset = EncodedOffset;
+        pDecodeFrame->dwErrCode = ERROR_CAN_NOT_COMPLETE;
+        EncodedOffset += pFileFrame->EncodedSize;
+        cbContent += pFileFrame->ContentSize;
+
+        // Frames found in the storage frame cache need no decoding
+        if(FindCachedFrame(hf, pCKeyEntry, pFileFrame, FrameCount, pDecodeFrame->pbDecoded))
+            pDecodeFrame->dwErrCode = ERROR_SUCCESS;
+        else
+            cbToDecode += pFileFrame->ContentSize;
+    }
+
+    // Load the encoded data and decode the frames that were not cached.
+    // If the data file is memory-mapped, the frames are decoded in place.
+    Job.pbEncoded = NULL;
+    if(cbToDecode != 0)
+    {
+        pbMapped = FileStream_GetMappedData(pFileSpan->pStream, ByteOffset, EncodedSize);
+        Job.pbEncoded = (pbMapped != NULL) ? pbMapped : CASC_ALLOC<BYTE>(EncodedSize);
+        if(Job.pbEncoded != NULL)
+        {
+            if(pbMapped != NULL || FileStream_Read(pFileSpan->pStream, &ByteOffset, Job.pbEncoded, EncodedSize))
+            {
+                // Only use more threads if asked to and if each of them has enough data to decode
+                if(hf->hs != NULL && (hf->hs->dwOpenFlags & CASC_STORAGE_PARALLEL_DECODE) && cbToDecode >= (2 * CASC_PARALLEL_DECODE_SIZE))
+                    dwWorkerCount = CASCLIB_MIN(CascGetWorkerCount(), CASCLIB_MIN(FrameCount, cbToDecode / CASC_PARALLEL_DECODE_SIZE));
+
+                // Decode the frames
+                Job.hf = hf;
+                Job.pCKeyEntry = pCKeyEntry;
+                Job.pFileSpan = pFileSpan;
+                Job.pDecodeFrames = pDecodeFrames;
+                Job.FrameCount = FrameCount;
+                Job.NextFrame = 0;
+                CascRunWorkers(DecodeFramesWorker, &Job, dwWorkerCount);
+            }
+            else
+            {
+                dwErrCode = GetLastError();
+            }
+
+            if(pbMapped == NULL)
+                CASC_FREE(Job.pbEncoded);
+        }
+        else
+        {
+            dwErrCode = ERROR_NOT_ENOUGH_MEMORY;
+        }
+    }
+
+    // Count the data up to the first frame that failed
+    if(dwErrCode == ERROR_SUCCESS)
+    {
+        dwErrCode = (FrameCount < pFileSpan->FrameCount) ? ERROR_FILE_CORRUPT : ERROR_SUCCESS;
+        for(DWORD FrameIndex = 0; FrameIndex < FrameCount; FrameIndex++)
+        {
+            if(pDecodeFrames[FrameIndex].dwErrCode != ERROR_SUCCESS)
+            {
+                dwErrCode = pDecodeFrames[FrameIndex].dwErrCode;
+                break;
+            }
+
+            dwBytesRead += pFileSpan->pFrames[FrameIndex].ContentSize;
+        }
+    }
+
+    CASC_FREE(pDecodeFrames);
+    PtrErrCode[0] = dwErrCode;
+    return dwBytesRead;
+}
+
 // No cache at all. The entire file will be read directly to the user buffer
 static DWORD ReadFile_WholeFile(TCascFile * hf, LPBYTE pbBuffer)
 {
     PCASC_CKEY_ENTRY pCKeyEntry = hf->pCKeyEntry;
     PCASC_FILE_SPAN pFileSpan = hf->pFileSpan;
     LPBYTE pbSaveBuffer = pbBuffer;
-    LPBYTE pbEncoded;
-    LPBYTE pbEncodedPtr;
-    DWORD dwErrCode;
+    DWORD dwErrCode = ERROR_SUCCESS;
+    DWORD dwSpanErrCode;
 
     for(DWORD SpanIndex = 0; SpanIndex < hf->SpanCount; SpanIndex++, pCKeyEntry++, pFileSpan++)
     {
-        ULONGLONG ByteOffset = pFileSpan->ArchiveOffs + pFileSpan->HeaderSize;
-        DWORD EncodedSize = pCKeyEntry->EncodedSize - pFileSpan->HeaderSize;
+        pbBuffer += ReadSpanFrames(hf, pCKeyEntry, pFileSpan, pbBuffer, &dwSpanErrCode);
+        if(dwErrCode == ERROR_SUCCESS)
+            dwErrCode = dwSpanErrCode;
 
-        // Allocate the buffer for the entire encoded span 
-        pbEncodedPtr = pbEncoded = CASC_ALLOC<BYTE>(EncodedSize);
-        if(pbEncoded == NULL)
+        // Running out of memory is fatal
+        if(dwSpanErrCode == ERROR_NOT_ENOUGH_MEMORY)
         {
             SetLastError(ERROR_NOT_ENOUGH_MEMORY);
             return 0;
         }
-
-        // Load the encoded buffer
-        if(FileStream_Read(pFileSpan->pStream, &ByteOffset, pbEncoded, EncodedSize))
-        {
-            PCASC_FILE_FRAME pFileFrame = pFileSpan->pFrames;
-
-            for(DWORD FrameIndex = 0; FrameIndex < pFileSpan->FrameCount; FrameIndex++, pFileFrame++)
-            {
-                // Decode the file frame
-                dwErrCode = DecodeFileFrame(hf, pCKeyEntry, pFileFrame, pbEncodedPtr, pbBuffer, FrameIndex);
-                if(dwErrCode != ERROR_SUCCESS)
-                    break;
-
-                // Move pointers
-                pbEncodedPtr += pFileFrame->EncodedSize;
-                pbBuffer += pFileFrame->ContentSize;
-            }
-        }
-
-        CASC_FREE(pbEncoded);
     }
 
-    // Give the amount of bytes read
+    // Give the amount of bytes read. Always set LastError.
+    SetLastError(dwErrCode);
     return (DWORD)(pbBuffer - pbSaveBuffer);
 }
 
@@ -829,6 +1102,7 @@ static DWORD ReadFile_FrameCached(TCascFile * hf, LPBYTE pbBuffer, ULONGLONG Sta
     DWORD dwBytesRead = 0;
     DWORD dwErrCode = ERROR_SUCCESS;
     bool bNeedFreeDecoded = true;
+    bool bFrameLoaded;
 
     // Parse all file spans
     for(DWORD SpanIndex = 0; SpanIndex < hf->SpanCount; SpanIndex++, pCKeyEntry++, pFileSpan++)
@@ -868,35 +1142,48 @@ static DWORD ReadFile_FrameCached(TCascFile * hf, LPBYTE pbBuffer, ULONGLONG Sta
                         pbDecoded = pbBuffer;
                     }
 
-                    // Allocate the encoded frame
-                    if((pbEncoded = CASC_ALLOC<BYTE>(pFileFrame->EncodedSize)) == NULL)
+                    // Other file handles may have decoded the frame already
+                    bFrameLoaded = FindCachedFrame(hf, pCKeyEntry, pFileFrame, FrameIndex, pbDecoded);
+                    // Memory-mapped frames are decoded in place
+                    ByteOffset = pFileFrame->DataFileOffset;
+                    if(bFrameLoaded == false && (pbEncoded = FileStream_GetMappedData(pFileSpan->pStream, ByteOffset, pFileFrame->EncodedSize)) != NULL)
                     {
-                        CASC_FREE(pbDecoded);
-                        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
-                        return 0;
+                        dwErrCode = DecodeFileFrame(hf, pCKeyEntry, pFileSpan, pFileFrame, pbEncoded, pbDecoded, FrameIndex, true);
+                        bFrameLoaded = (dwErrCode == ERROR_SUCCESS);
+                        pbEncoded = NULL;
                     }
-
-                    // Load the frame to the encoded buffer
-                    ByteOffset = pFileFrame->DataFileOffset;
-                    if(FileStream_Read(pFileSpan->pStream, &ByteOffset, pbEncoded, pFileFrame->EncodedSize))
+                    else if(bFrameLoaded == false)
                     {
-                        ULONGLONG EndOfCopy = CASCLIB_MIN(pFileFrame->EndOffset, EndOffset);
-                        DWORD dwBytesToCopy = (DWORD)(EndOfCopy - StartOffset);
+                        // Allocate the encoded frame
+                        if((pbEncoded = CASC_ALLOC<BYTE>(pFileFrame->EncodedSize)) == NULL)
+                        {
+                            CASC_FREE(pbDecoded);
+                            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                            return 0;
+                        }
 
-                        // Decode the frame
-                        dwErrCode = DecodeFileFrame(hf, pCKeyEntry, pFileFrame, pbEncoded, pbDecoded, FrameIndex);
-                        if(dwErrCode == ERROR_SUCCESS)
+                        // Load the frame to the encoded buffer and decode it
+                        if(FileStream_Read(pFileSpan->pStream, &ByteOffset, pbEncoded, pFileFrame->EncodedSize))
                         {
-                            // Copy the data
-                            if(pbDecoded != pbBuffer)
-                                memcpy(pbBuffer, pbDecoded + (DWORD)(StartOffset - pFileFrame->StartOffset), dwBytesToCopy);
-                            StartOffset += dwBytesToCopy;
-                            pbBuffer += dwBytesToCopy;
+                            dwErrCode = DecodeFileFrame(hf, pCKeyEntry, pFileSpan, pFileFrame, pbEncoded, pbDecoded, FrameIndex, true);
+                            bFrameLoaded = (dwErrCode == ERROR_SUCCESS);
                         }
+
+                        // Free the encoded buffer
+                        CASC_FREE(pbEncoded);
                     }
 
-                    // Free the encoded buffer
-                    CASC_FREE(pbEncoded);
+                    // Copy the data
+                    if(bFrameLoaded)
+                    {
+                        ULONGLONG EndOfCopy = CASCLIB_MIN(pFileFrame->EndOffset, EndOffset);
+                        DWORD dwBytesToCopy = (DWORD)(EndOfCopy - StartOffset);
+
+                        if(pbDecoded != pbBuffer)
+                            memcpy(pbBuffer, pbDecoded + (DWORD)(StartOffset - pFileFrame->StartOffset), dwBytesToCopy);
+                        StartOffset += dwBytesToCopy;
+                        pbBuffer += dwBytesToCopy;
+                    }
 
                     // If we are at the end of the read area, break all loops
                     if(dwErrCode != ERROR_SUCCESS || StartOffset >= EndOffset)
@@ -1250,8 +1537,13 @@ bool WINAPI CascReadFile(HANDLE hFile, void * pvBuffer, DWORD dwBytesToRead, PDW
 
         // Read as many frames as we can. The last loaded frame, if not read entirely,
         // will stay in the cache - We expect the next read to continue from that offset.
+        // Reading the whole file at once leaves nothing to cache, so all frames
+        // are decoded straight to the user buffer, possibly on multiple threads.
         case CascCacheLastFrame:
-            dwBytesRead2 = ReadFile_FrameCached(hf, pbBuffer, StartOffset, EndOffset);
+            if(StartOffset == 0 && EndOffset == hf->ContentSize)
+                dwBytesRead2 = ReadFile_WholeFile(hf, pbBuffer);
+            else
+                dwBytesRead2 = ReadFile_FrameCached(hf, pbBuffer, StartOffset, EndOffset);
             break;
     }
 
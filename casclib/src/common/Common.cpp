@@ -65,7 +65,8 @@ unsigned char IntToHexChar[] = "0123456789abcdef";
 // GetLastError/SetLastError support for non-Windows platform
 
 #ifndef PLATFORM_WINDOWS
-static DWORD dwLastError = ERROR_SUCCESS;
+// Each thread has its own error code, like on Windows
+static thread_local DWORD dwLastError = ERROR_SUCCESS;
 
 DWORD GetLastError()
 {
@@ -730,3 +731,104 @@ void CascCalculateDataBlockHash(void * pvDataBlock, DWORD cbDataBlock, LPBYTE md
     MD5_Update(&md5_ctx, pvDataBlock, cbDataBlock);
     MD5_Final(md5_hash, &md5_ctx);
 }
+
+//-----------------------------------------------------------------------------
+// Worker threads
+
+typedef struct _CASC_WORKERS
+{
+    CASC_WORKER pfnWorker;                      // Routine executed by every worker thread
+    void * pvContext;                           // Context shared by all workers
+} CASC_WORKERS, *PCASC_WORKERS;
+
+#ifdef PLATFORM_WINDOWS
+static DWORD WINAPI CascWorkerThread(LPVOID pvParam)
+#else
+static void * CascWorkerThread(void * pvParam)
+#endif
+{
+    PCASC_WORKERS pWorkers = (PCASC_WORKERS)pvParam;
+
+    pWorkers->pfnWorker(pWorkers->pvContext);
+    return 0;
+}
+
+// Number of additional worker threads currently running in the whole process.
+// All CascRunWorkers calls together never run more threads than there are CPUs.
+static DWORD dwRunningWorkers = 0;
+
+// Returns the number of worker threads worth running (one per CPU)
+DWORD CascGetWorkerCount()
+{
+    DWORD dwCpuCount = 1;
+
+#ifdef PLATFORM_WINDOWS
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    dwCpuCount = si.dwNumberOfProcessors;
+#else
+    long nCpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(nCpuCount > 0)
+        dwCpuCount = (DWORD)nCpuCount;
+#endif
+
+    dwCpuCount = CASCLIB_MIN(dwCpuCount, CASC_MAX_WORKERS);
+    return CASCLIB_MAX(dwCpuCount, 1);
+}
+
+// Runs the worker routine on the given number of threads and waits until all of them
+// finish. The calling thread is one of the workers. If a thread cannot be created,
+// or if other operations already keep all CPUs busy, fewer workers run,
+// so the workers must take their work from a shared counter.
+void CascRunWorkers(CASC_WORKER pfnWorker, void * pvContext, DWORD dwWorkerCount)
+{
+    CASC_WORKERS Workers;
+#ifdef PLATFORM_WINDOWS
+    HANDLE Threads[CASC_MAX_WORKERS];
+#else
+    pthread_t Threads[CASC_MAX_WORKERS];
+#endif
+    DWORD dwMaxRunning = CascGetWorkerCount() - 1;
+    DWORD dwThreads = 0;
+
+    // Start the additional threads
+    Workers.pfnWorker = pfnWorker;
+    Workers.pvContext = pvContext;
+    while((dwThreads + 1) < CASCLIB_MIN(dwWorkerCount, CASC_MAX_WORKERS))
+    {
+        // Reserve the thread in the process-wide limit
+        if(CascInterlockedIncrement(&dwRunningWorkers) > dwMaxRunning)
+        {
+            CascInterlockedDecrement(&dwRunningWorkers);
+            break;
+        }
+
+#ifdef PLATFORM_WINDOWS
+        if((Threads[dwThreads] = CreateThread(NULL, 0, CascWorkerThread, &Workers, 0, NULL)) == NULL)
+#else
+        if(pthread_create(&Threads[dwThreads], NULL, CascWorkerThread, &Workers) != 0)
+#endif
+        {
+            CascInterlockedDecrement(&dwRunningWorkers);
+            break;
+        }
+        dwThreads++;
+    }
+
+    // Work on the calling thread too
+    pfnWorker(pvContext);
+
+    // Wait for the others to finish
+    for(DWORD i = 0; i < dwThreads; i++)
+    {
+#ifdef PLATFORM_WINDOWS
+        WaitForSingleObject(Threads[i], INFINITE);
+        CloseHandle(Threads[i]);
+#else
+        pthread_join(Threads[i], NULL);
+#endif
+        CascInterlockedDecrement(&dwRunningWorkers);
+    }
+}
@@ -70,7 +70,6 @@ typedef struct _CASC_EKEY_ENTRY
 #define CASC_CE_FOLDER_ENTRY       0x00000100       // This CKey entry is a folder
 #define CASC_CE_FILE_SPAN          0x00000200       // This CKey entry is a follow-up file span
 #define CASC_CE_FILE_PATCH         0x00000400       // The file is in PATCH subfolder in remote storage
-#define CASC_CE_PLAIN_DATA         0x00000800       // The file data is not BLTE encoded, but in plain format
 
 // In-memory representation of a single entry. 
 struct CASC_CKEY_ENTRY
@@ -443,6 +442,17 @@ bool CascIsValidMD5(LPBYTE pbMd5);
 void CascCalculateDataBlockHash(void * pvDataBlock, DWORD cbDataBlock, LPBYTE md5_hash);
 bool CascVerifyDataBlockHash(void * pvDataBlock, DWORD cbDataBlock, LPBYTE expected_md5);
 
+//-----------------------------------------------------------------------------
+// Worker threads
+
+// Maximum number of threads that work on one operation
+#define CASC_MAX_WORKERS            0x20
+
+typedef void (*CASC_WORKER)(void * pvContext);
+
+DWORD CascGetWorkerCount();
+void  CascRunWorkers(CASC_WORKER pfnWorker, void * pvContext, DWORD dwWorkerCount);
+
 //-----------------------------------------------------------------------------
 // Scanning a directory
 
@@ -52,6 +52,27 @@ bool MakeDirectory(const TCHAR * szDirectory)
 #endif
 }
 
+// Renames the source file to the target file. An existing target file is replaced
+// in one step, so that the target is never seen partially written
+bool RenameFileOver(LPCTSTR szSourceFile, LPCTSTR szTargetFile)
+{
+#ifdef PLATFORM_WINDOWS
+
+    BOOL bResult = MoveFileEx(szSourceFile, szTargetFile, MOVEFILE_REPLACE_EXISTING);
+    return (bResult) ? true : false;
+
+#else
+
+    if(rename(szSourceFile, szTargetFile) == -1)
+    {
+        SetLastError(errno);
+        return false;
+    }
+    return true;
+
+#endif
+}
+
 int ScanIndexDirectory(
     LPCTSTR szIndexPath,
     INDEX_FILE_FOUND pfnOnFileFound,
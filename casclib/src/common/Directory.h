@@ -18,6 +18,8 @@ bool DirectoryExists(LPCTSTR szDirectory);
 
 bool MakeDirectory(LPCTSTR szDirectory);
 
+bool RenameFileOver(LPCTSTR szSourceFile, LPCTSTR szTargetFile);
+
 int ScanIndexDirectory(
     LPCTSTR szIndexPath,
     INDEX_FILE_FOUND pfnOnFileFound,
@@ -170,9 +170,6 @@ static bool BaseFile_Read(
         // file offset to read from file. This allows us to skip
         // one system call to SetFilePointer
 
-        // Update the byte offset
-        pStream->Base.File.FilePos = ByteOffset;
-
         // Read the data
         if(dwBytesToRead != 0)
         {
@@ -191,22 +188,11 @@ static bool BaseFile_Read(
     {
         ssize_t bytes_read;
 
-        // If the byte offset is different from the current file position,
-        // we have to update the file position
-        if(ByteOffset != pStream->Base.File.FilePos)
-        {
-            if(lseek64((intptr_t)pStream->Base.File.hFile, (off64_t)(ByteOffset), SEEK_SET) == (off64_t)-1)
-            {
-                SetLastError(errno);
-                return false;
-            }
-            pStream->Base.File.FilePos = ByteOffset;
-        }
-
-        // Perform the read operation
+        // Perform the read operation. Reading from the given offset doesn't
+        // use the file pointer of the handle, so multiple threads can read at once
         if(dwBytesToRead != 0)
         {
-            bytes_read = read((intptr_t)pStream->Base.File.hFile, pvBuffer, (size_t)dwBytesToRead);
+            bytes_read = pread64((intptr_t)pStream->Base.File.hFile, pvBuffer, (size_t)dwBytesToRead, (off64_t)(ByteOffset));
             if(bytes_read == -1)
             {
                 SetLastError(errno);
@@ -218,8 +204,10 @@ static bool BaseFile_Read(
     }
 #endif
 
-    // Increment the current file position by number of bytes read
-    pStream->Base.File.FilePos = ByteOffset + dwBytesRead;
+    // Increment the current file position by number of bytes read.
+    // Streams shared between threads have no current position
+    if((pStream->dwFlags & STREAM_FLAG_SHARED_READ) == 0)
+        pStream->Base.File.FilePos = ByteOffset + dwBytesRead;
 
     // If the number of bytes read doesn't match to required amount, return false
     // However, Blizzard's CASC handlers read encoded data so that if less than expected
@@ -280,20 +268,9 @@ static bool BaseFile_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const
     {
         ssize_t bytes_written;
 
-        // If the byte offset is different from the current file position,
-        // we have to update the file position
-        if(ByteOffset != pStream->Base.File.FilePos)
-        {
-            if(lseek64((intptr_t)pStream->Base.File.hFile, (off64_t)(ByteOffset), SEEK_SET) == (off64_t)-1)
-            {
-                SetLastError(errno);
-                return false;
-            }
-            pStream->Base.File.FilePos = ByteOffset;
-        }
-
-        // Perform the read operation
-        bytes_written = write((intptr_t)pStream->Base.File.hFile, pvBuffer, (size_t)dwBytesToWrite);
+        // Perform the write operation. Like the reads, the writes
+        // don't use the file pointer of the handle
+        bytes_written = pwrite64((intptr_t)pStream->Base.File.hFile, pvBuffer, (size_t)dwBytesToWrite, (off64_t)(ByteOffset));
         if(bytes_written == -1)
         {
             SetLastError(errno);
@@ -443,13 +420,12 @@ static bool BaseMap_Open(TFileStream * pStream, const TCHAR * szFileName, DWORD
     ULARGE_INTEGER FileSize;
     HANDLE hFile;
     HANDLE hMap;
+    DWORD dwWriteShare = (dwStreamFlags & STREAM_FLAG_WRITE_SHARE) ? FILE_SHARE_WRITE : 0;
     bool bResult = false;
 
-    // Keep compiler happy
-    dwStreamFlags = dwStreamFlags;
-
     // Open the file for read access
-    hFile = CreateFile(szFileName, FILE_READ_DATA, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    pStream->Base.Map.hFile = INVALID_HANDLE_VALUE;
+    hFile = CreateFile(szFileName, FILE_READ_DATA, FILE_SHARE_READ | dwWriteShare, NULL, OPEN_EXISTING, 0, NULL);
     if(hFile != INVALID_HANDLE_VALUE)
     {
         // Retrieve file size. Don't allow mapping file of a zero size.
@@ -472,6 +448,7 @@ static bool BaseMap_Open(TFileStream * pStream, const TCHAR * szFileName, DWORD
                     // Retrieve file size and position
                     pStream->Base.Map.FileSize = FileSize.QuadPart;
                     pStream->Base.Map.FilePos = 0;
+                    pStream->Base.Map.hFile = hFile;
                     bResult = true;
                 }
 
@@ -480,8 +457,9 @@ static bool BaseMap_Open(TFileStream * pStream, const TCHAR * szFileName, DWORD
             }
         }
 
-        // Close the file handle
-        CloseHandle(hFile);
+        // Close the file handle, unless it is kept for reading past the mapped view
+        if(bResult == false)
+            CloseHandle(hFile);
     }
 
     // If the file is not there and is not available for random access,
@@ -495,14 +473,20 @@ static bool BaseMap_Open(TFileStream * pStream, const TCHAR * szFileName, DWORD
     intptr_t handle;
     bool bResult = false;
 
+    // Keep compiler happy
+    CASCLIB_UNUSED(dwStreamFlags);
+
     // Open the file
+    pStream->Base.Map.hFile = INVALID_HANDLE_VALUE;
     handle = open(szFileName, O_RDONLY);
     if(handle != -1)
     {
-        // Get the file size
-        if(fstat64(handle, &fileinfo) != -1)
+        // Get the file size. Don't allow mapping file of a zero size.
+        if(fstat64(handle, &fileinfo) != -1 && fileinfo.st_size != 0)
         {
             pStream->Base.Map.pbFile = (LPBYTE)mmap(NULL, (size_t)fileinfo.st_size, PROT_READ, MAP_PRIVATE, handle, 0);
+            if(pStream->Base.Map.pbFile == (LPBYTE)MAP_FAILED)
+                pStream->Base.Map.pbFile = NULL;
             if(pStream->Base.Map.pbFile != NULL)
             {
                 // time_t is number of seconds since 1.1.1970, UTC.
@@ -511,10 +495,14 @@ static bool BaseMap_Open(TFileStream * pStream, const TCHAR * szFileName, DWORD
                 pStream->Base.Map.FileTime = 0x019DB1DED53E8000ULL + (10000000 * fileinfo.st_mtime);
                 pStream->Base.Map.FileSize = (ULONGLONG)fileinfo.st_size;
                 pStream->Base.Map.FilePos = 0;
+                pStream->Base.Map.hFile = (HANDLE)handle;
                 bResult = true;
             }
         }
-        close(handle);
+
+        // Close the file handle, unless it is kept for reading past the mapped view
+        if(bResult == false)
+            close(handle);
     }
 
     // Did the mapping fail?
@@ -535,20 +523,28 @@ static bool BaseMap_Read(
     DWORD dwBytesToRead)                    // Number of bytes to read from the file
 {
     ULONGLONG ByteOffset = (pByteOffset != NULL) ? *pByteOffset : pStream->Base.Map.FilePos;
+    DWORD dwBytesRead = 0;
 
-    // Do we have to read anything at all?
-    if(dwBytesToRead != 0)
+    // Copy the part of the data that is in the mapped view
+    if(ByteOffset < pStream->Base.Map.FileSize)
     {
-        // Don't allow reading past file size
-        if((ByteOffset + dwBytesToRead) > pStream->Base.Map.FileSize)
-            return false;
-
-        // Copy the required data
-        memcpy(pvBuffer, pStream->Base.Map.pbFile + (size_t)ByteOffset, dwBytesToRead);
+        dwBytesRead = (DWORD)CASCLIB_MIN((ULONGLONG)dwBytesToRead, pStream->Base.Map.FileSize - ByteOffset);
+        memcpy(pvBuffer, pStream->Base.Map.pbFile + (size_t)ByteOffset, dwBytesRead);
     }
 
     // Move the current file position
-    pStream->Base.Map.FilePos += dwBytesToRead;
+    if((pStream->dwFlags & STREAM_FLAG_SHARED_READ) == 0)
+        pStream->Base.Map.FilePos = ByteOffset + dwBytesRead;
+
+    // The view only covers the file size at the time it was mapped. The file may have
+    // grown since then (data files written by the game agent), so the rest is read from the file.
+    // This also handles the end of the file the same way as BaseFile_Read
+    if(dwBytesRead < dwBytesToRead)
+    {
+        ByteOffset += dwBytesRead;
+        return BaseFile_Read(pStream, &ByteOffset, (LPBYTE)pvBuffer + dwBytesRead, dwBytesToRead - dwBytesRead);
+    }
+
     return true;
 }
 
@@ -565,6 +561,9 @@ static void BaseMap_Close(TFileStream * pStream)
 #endif
 
     pStream->Base.Map.pbFile = NULL;
+
+    // Close the file handle. Reuse BaseFile function
+    BaseFile_Close(pStream);
 }
 
 // Initializes base functions for the mapped file
@@ -2570,6 +2569,8 @@ bool FileStream_SetCallback(TFileStream * pStream, STREAM_DOWNLOAD_CALLBACK pfnC
  * - If the pByteOffset is NULL, the function must read the data from the current file position
  * - The function can be called with dwBytesToRead = 0. In that case, pvBuffer is ignored
  *   and the function just adjusts file pointer.
+ * - Flat file streams and mapped streams opened with STREAM_FLAG_SHARED_READ can be read
+ *   by multiple threads at once. Such reads must give pByteOffset.
  *
  * \a pStream Pointer to an open stream
  * \a pByteOffset Pointer to file byte offset. If NULL, it reads from the current position
@@ -2587,6 +2588,31 @@ bool FileStream_Read(TFileStream * pStream, ULONGLONG * pByteOffset, void * pvBu
     return pStream->StreamRead(pStream, pByteOffset, pvBuffer, dwBytesToRead);
 }
 
+/**
+ * Returns pointer to the stream data, if the stream is a memory-mapped file.
+ * This allows the caller to use the data in place, without copying them.
+ *
+ * - Returns NULL if the stream is not mapped or if the range is not entirely in the file.
+ *   The caller must then use FileStream_Read.
+ * - The data stay valid until the stream is closed
+ *
+ * \a pStream Pointer to an open stream
+ * \a ByteOffset File byte offset of the data
+ * \a dwBytesToRead Number of bytes the caller needs
+ */
+LPBYTE FileStream_GetMappedData(TFileStream * pStream, ULONGLONG ByteOffset, DWORD dwBytesToRead)
+{
+    // Only plain memory-mapped streams qualify
+    if(pStream->StreamRead != BaseMap_Read || pStream->Base.Map.pbFile == NULL)
+        return NULL;
+
+    // The entire range must be within the file
+    if(ByteOffset > pStream->Base.Map.FileSize || dwBytesToRead > (pStream->Base.Map.FileSize - ByteOffset))
+        return NULL;
+
+    return pStream->Base.Map.pbFile + (size_t)ByteOffset;
+}
+
 /**
  * This function writes data to the stream
  *
@@ -30,6 +30,7 @@
 #define STREAM_FLAG_USE_BITMAP      0x00000400  // If the file has a file bitmap, load it and use it
 #define STREAM_FLAG_FILL_MISSING    0x00000800  // If less than expected was read from the file, fill the missing part with zeros
 #define STREAM_FLAG_USE_PORT_1119   0x00001000  // For HTTP streams, use port 1119
+#define STREAM_FLAG_SHARED_READ     0x00002000  // Stream is read by multiple threads at once. Reads must give the byte offset and don't move the file position
 #define STREAM_OPTIONS_MASK         0x0000FF00  // Mask for stream options
 
 #define STREAM_PROVIDERS_MASK       0x000000FF  // Mask to get stream providers
@@ -167,6 +168,7 @@ union TBaseProviderData
         ULONGLONG FileSize;                 // Size of the file
         ULONGLONG FilePos;                  // Current file position
         ULONGLONG FileTime;                 // Last write time
+        HANDLE hFile;                       // File handle, for reading data past the mapped view. Must be at the same place as File.hFile
         LPBYTE pbFile;                      // Pointer to mapped view
     } Map;
 
@@ -255,6 +257,7 @@ size_t FileStream_Prefix(LPCTSTR szFileName, DWORD * pdwProvider);
 bool FileStream_SetCallback(TFileStream * pStream, STREAM_DOWNLOAD_CALLBACK pfnCallback, void * pvUserData);
 
 bool FileStream_Read(TFileStream * pStream, ULONGLONG * pByteOffset, void * pvBuffer, DWORD dwBytesToRead);
+LPBYTE FileStream_GetMappedData(TFileStream * pStream, ULONGLONG ByteOffset, DWORD dwBytesToRead);
 bool FileStream_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const void * pvBuffer, DWORD dwBytesToWrite);
 bool FileStream_SetSize(TFileStream * pStream, ULONGLONG NewFileSize);
 bool FileStream_GetSize(TFileStream * pStream, ULONGLONG * pFileSize);
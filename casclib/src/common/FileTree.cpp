@@ -516,6 +516,32 @@ PCASC_FILE_NODE CASC_FILE_TREE::FindById(DWORD FileDataId)
     return pFileNode;
 }
 
+size_t CASC_FILE_TREE::FindByIds(const DWORD * FileDataIdList, size_t nFileDataIds, PCASC_CKEY_ENTRY * CKeyEntries)
+{
+    PCASC_FILE_NODE * FileNodes = NULL;
+    PCASC_FILE_NODE pFileNode;
+    size_t nMaxFileDataId = 0;
+    size_t nFound = 0;
+
+    // The FileDataId array is only valid when there is at least one item
+    if(FileDataIds.IsInitialized() && FileDataIds.ItemCount() != 0)
+    {
+        FileNodes = (PCASC_FILE_NODE *)FileDataIds.ItemAt(0);
+        nMaxFileDataId = FileDataIds.ItemCount();
+    }
+
+    // Sorted FileDataIds go through the array from the beginning to the end,
+    // so the whole list is resolved in one sequential pass
+    for(size_t i = 0; i < nFileDataIds; i++)
+    {
+        pFileNode = (FileDataIdList[i] < nMaxFileDataId) ? FileNodes[FileDataIdList[i]] : NULL;
+        CKeyEntries[i] = (pFileNode != NULL) ? pFileNode->pCKeyEntry : NULL;
+        nFound += (CKeyEntries[i] != NULL) ? 1 : 0;
+    }
+
+    return nFound;
+}
+
 bool CASC_FILE_TREE::SetNodeFileName(PCASC_FILE_NODE pFileNode, const char * szFileName)
 {
     ULONGLONG FileNameHash = 0;
@@ -62,6 +62,9 @@ class CASC_FILE_TREE
     PCASC_FILE_NODE Find(ULONGLONG FileNameHash);
     PCASC_FILE_NODE FindById(DWORD FileDataId);
 
+    // Retrieves CKey entries of multiple files by FileDataId. Entries of missing files are set to NULL
+    size_t FindByIds(const DWORD * FileDataIdList, size_t nFileDataIds, PCASC_CKEY_ENTRY * CKeyEntries);
+
     // Assigns a file name to the node
     bool SetNodeFileName(PCASC_FILE_NODE pFileNode, const char * szFileName);
 
@@ -0,0 +1,314 @@
+/*****************************************************************************/
+/* FrameCache.cpp                         Part of CascLib                    */
+/*---------------------------------------------------------------------------*/
+/* Cache of decoded file frames, shared by all file handles of a storage     */
+/*---------------------------------------------------------------------------*/
+/*   Date    Ver   Who  Comment                                              */
+/* --------  ----  ---  -------                                              */
+/* 19.10.26  1.00       The first version of FrameCache.cpp                  */
+/*****************************************************************************/
+
+#define __CASCLIB_SELF__
+#include "../CascLib.h"
+#include "../CascCommon.h"
+
+//-----------------------------------------------------------------------------
+// Local defines
+
+// Expected average size of a decoded frame. Used to size the hash tables
+#define CASC_FRAME_AVERAGE_SIZE     0x10000
+
+// Minimum number of hash buckets in one shard
+#define CASC_FRAME_MIN_BUCKETS      0x40
+
+//-----------------------------------------------------------------------------
+// Local functions
+
+static LPBYTE GetEntryData(PCASC_FRAME_CACHE_ENTRY pEntry)
+{
+    return (LPBYTE)(pEntry + 1);
+}
+
+//-----------------------------------------------------------------------------
+// Public functions
+
+CASC_FRAME_CACHE::CASC_FRAME_CACHE()
+{
+    memset(m_Shards, 0, sizeof(m_Shards));
+    m_BytesLimit = 0;
+    m_ShardLimit = 0;
+    m_HashMask = 0;
+}
+
+CASC_FRAME_CACHE::~CASC_FRAME_CACHE()
+{
+    Free();
+}
+
+DWORD CASC_FRAME_CACHE::Create(size_t BytesLimit)
+{
+    size_t nBuckets = CASC_FRAME_MIN_BUCKETS;
+
+    // Split the byte limit between the shards.
+    // Size the hash tables so that the chains stay short when the cache is full
+    m_ShardLimit = BytesLimit / CASC_FRAME_CACHE_SHARDS;
+    while(nBuckets < (m_ShardLimit / CASC_FRAME_AVERAGE_SIZE))
+        nBuckets = nBuckets << 1;
+    m_HashMask = (DWORD)(nBuckets - 1);
+
+    // Initialize all shards
+    for(size_t i = 0; i < CASC_FRAME_CACHE_SHARDS; i++)
+    {
+        PCASC_FRAME_CACHE_SHARD pShard = &m_Shards[i];
+
+        if((pShard->HashTable = CASC_ALLOC_ZERO<PCASC_FRAME_CACHE_ENTRY>(nBuckets)) == NULL)
+        {
+            Free();
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+
+        CascInitLock(pShard->Lock);
+        pShard->pFirst = pShard->pLast = NULL;
+        pShard->BytesCached = 0;
+        pShard->Hits = pShard->Misses = pShard->Evictions = 0;
+    }
+
+    m_BytesLimit = BytesLimit;
+    return ERROR_SUCCESS;
+}
+
+void CASC_FRAME_CACHE::Free()
+{
+    for(size_t i = 0; i < CASC_FRAME_CACHE_SHARDS; i++)
+    {
+        PCASC_FRAME_CACHE_SHARD pShard = &m_Shards[i];
+        PCASC_FRAME_CACHE_ENTRY pEntry;
+        PCASC_FRAME_CACHE_ENTRY pNext;
+
+        if(pShard->HashTable != NULL)
+        {
+            // Free all entries
+            for(pEntry = pShard->pFirst; pEntry != NULL; pEntry = pNext)
+            {
+                pNext = pEntry->pNext;
+                CASC_FREE(pEntry);
+            }
+
+            CASC_FREE(pShard->HashTable);
+            CascFreeLock(pShard->Lock);
+        }
+    }
+
+    memset(m_Shards, 0, sizeof(m_Shards));
+    m_BytesLimit = 0;
+}
+
+bool CASC_FRAME_CACHE::Find(LPBYTE EKey, DWORD FrameIndex, LPBYTE pbBuffer, DWORD cbBuffer)
+{
+    PCASC_FRAME_CACHE_SHARD pShard;
+    PCASC_FRAME_CACHE_ENTRY pEntry;
+    DWORD HashValue;
+    bool bResult = false;
+
+    if(m_BytesLimit != 0)
+    {
+        HashValue = HashFrameKey(EKey, FrameIndex);
+        pShard = &m_Shards[HashValue & (CASC_FRAME_CACHE_SHARDS - 1)];
+
+        CascLock(pShard->Lock);
+
+        // Find the entry in the hash bucket
+        for(pEntry = pShard->HashTable[(HashValue >> 4) & m_HashMask]; pEntry != NULL; pEntry = pEntry->pHashNext)
+        {
+            if(pEntry->HashValue == HashValue && pEntry->FrameIndex == FrameIndex && !memcmp(pEntry->EKey, EKey, MD5_HASH_SIZE))
+                break;
+        }
+
+        // If found, copy the data and move the entry to the front of the LRU list
+        if(pEntry != NULL && pEntry->cbData == cbBuffer)
+        {
+            memcpy(pbBuffer, GetEntryData(pEntry), cbBuffer);
+            Unlink(pShard, pEntry);
+            LinkFirst(pShard, pEntry);
+            pShard->Hits++;
+            bResult = true;
+        }
+        else
+        {
+            pShard->Misses++;
+        }
+
+        CascUnlock(pShard->Lock);
+    }
+
+    return bResult;
+}
+
+LPBYTE CASC_FRAME_CACHE::Find(LPBYTE EKey, DWORD FrameIndex, PDWORD PtrDataSize)
+{
+    PCASC_FRAME_CACHE_SHARD pShard;
+    PCASC_FRAME_CACHE_ENTRY pEntry;
+    LPBYTE pbData = NULL;
+    DWORD HashValue;
+
+    if(m_BytesLimit != 0)
+    {
+        HashValue = HashFrameKey(EKey, FrameIndex);
+        pShard = &m_Shards[HashValue & (CASC_FRAME_CACHE_SHARDS - 1)];
+
+        CascLock(pShard->Lock);
+
+        // Find the entry in the hash bucket
+        for(pEntry = pShard->HashTable[(HashValue >> 4) & m_HashMask]; pEntry != NULL; pEntry = pEntry->pHashNext)
+        {
+            if(pEntry->HashValue == HashValue && pEntry->FrameIndex == FrameIndex && !memcmp(pEntry->EKey, EKey, MD5_HASH_SIZE))
+                break;
+        }
+
+        // If found, make a copy of the data and move the entry to the front of the LRU list
+        if(pEntry != NULL && (pbData = CASC_ALLOC<BYTE>(pEntry->cbData)) != NULL)
+        {
+            memcpy(pbData, GetEntryData(pEntry), pEntry->cbData);
+            PtrDataSize[0] = pEntry->cbData;
+            Unlink(pShard, pEntry);
+            LinkFirst(pShard, pEntry);
+            pShard->Hits++;
+        }
+        else
+        {
+            pShard->Misses++;
+        }
+
+        CascUnlock(pShard->Lock);
+    }
+
+    return pbData;
+}
+
+void CASC_FRAME_CACHE::Insert(LPBYTE EKey, DWORD FrameIndex, LPBYTE pbData, DWORD cbData)
+{
+    PCASC_FRAME_CACHE_SHARD pShard;
+    PCASC_FRAME_CACHE_ENTRY pEntry;
+    PCASC_FRAME_CACHE_ENTRY * ppBucket;
+    DWORD HashValue;
+
+    // Frames larger than the shard would only flush it
+    if(m_BytesLimit == 0 || cbData == 0 || cbData > m_ShardLimit)
+        return;
+
+    // Prepare the new entry before taking the lock
+    pEntry = (PCASC_FRAME_CACHE_ENTRY)CASC_ALLOC<BYTE>(sizeof(CASC_FRAME_CACHE_ENTRY) + cbData);
+    if(pEntry == NULL)
+        return;
+    memcpy(pEntry->EKey, EKey, MD5_HASH_SIZE);
+    memcpy(GetEntryData(pEntry), pbData, cbData);
+    pEntry->FrameIndex = FrameIndex;
+    pEntry->HashValue = HashValue = HashFrameKey(EKey, FrameIndex);
+    pEntry->cbData = cbData;
+
+    pShard = &m_Shards[HashValue & (CASC_FRAME_CACHE_SHARDS - 1)];
+    ppBucket = &pShard->HashTable[(HashValue >> 4) & m_HashMask];
+
+    CascLock(pShard->Lock);
+
+    // Another thread may have inserted the same frame meanwhile
+    for(PCASC_FRAME_CACHE_ENTRY pExisting = ppBucket[0]; pExisting != NULL; pExisting = pExisting->pHashNext)
+    {
+        if(pExisting->HashValue == HashValue && pExisting->FrameIndex == FrameIndex && !memcmp(pExisting->EKey, EKey, MD5_HASH_SIZE))
+        {
+            CascUnlock(pShard->Lock);
+            CASC_FREE(pEntry);
+            return;
+        }
+    }
+
+    // Make room for the new entry
+    while(pShard->pLast != NULL && (pShard->BytesCached + cbData) > m_ShardLimit)
+        EvictLast(pShard);
+
+    // Link the entry to the hash table and to the front of the LRU list
+    pEntry->pHashNext = ppBucket[0];
+    ppBucket[0] = pEntry;
+    LinkFirst(pShard, pEntry);
+    pShard->BytesCached += cbData;
+
+    CascUnlock(pShard->Lock);
+}
+
+void CASC_FRAME_CACHE::GetStats(PCASC_FRAME_CACHE_STATS pStats)
+{
+    memset(pStats, 0, sizeof(CASC_FRAME_CACHE_STATS));
+
+    if(m_BytesLimit != 0)
+    {
+        for(size_t i = 0; i < CASC_FRAME_CACHE_SHARDS; i++)
+        {
+            PCASC_FRAME_CACHE_SHARD pShard = &m_Shards[i];
+
+            CascLock(pShard->Lock);
+            pStats->Hits += pShard->Hits;
+            pStats->Misses += pShard->Misses;
+            pStats->Evictions += pShard->Evictions;
+            pStats->BytesCached += pShard->BytesCached;
+            CascUnlock(pShard->Lock);
+        }
+
+        pStats->BytesLimit = m_BytesLimit;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Protected functions
+
+// The EKey is already a hash, so its first bytes are mixed with the frame index.
+// The lowest bits select the shard, the higher ones select the hash bucket
+DWORD CASC_FRAME_CACHE::HashFrameKey(LPBYTE EKey, DWORD FrameIndex)
+{
+    DWORD HashValue = ConvertBytesToInteger_4_LE(EKey) ^ ConvertBytesToInteger_4_LE(EKey + 4);
+
+    return (HashValue ^ (FrameIndex * 0x9E3779B1)) * 0x85EBCA6B;
+}
+
+void CASC_FRAME_CACHE::LinkFirst(PCASC_FRAME_CACHE_SHARD pShard, PCASC_FRAME_CACHE_ENTRY pEntry)
+{
+    pEntry->pPrev = NULL;
+    pEntry->pNext = pShard->pFirst;
+
+    if(pShard->pFirst != NULL)
+        pShard->pFirst->pPrev = pEntry;
+    pShard->pFirst = pEntry;
+
+    if(pShard->pLast == NULL)
+        pShard->pLast = pEntry;
+}
+
+void CASC_FRAME_CACHE::Unlink(PCASC_FRAME_CACHE_SHARD pShard, PCASC_FRAME_CACHE_ENTRY pEntry)
+{
+    if(pEntry->pPrev != NULL)
+        pEntry->pPrev->pNext = pEntry->pNext;
+    else
+        pShard->pFirst = pEntry->pNext;
+
+    if(pEntry->pNext != NULL)
+        pEntry->pNext->pPrev = pEntry->pPrev;
+    else
+        pShard->pLast = pEntry->pPrev;
+}
+
+void CASC_FRAME_CACHE::EvictLast(PCASC_FRAME_CACHE_SHARD pShard)
+{
+    PCASC_FRAME_CACHE_ENTRY pEntry = pShard->pLast;
+    PCASC_FRAME_CACHE_ENTRY * ppEntry;
+
+    // Remove the entry from its hash bucket
+    ppEntry = &pShard->HashTable[(pEntry->HashValue >> 4) & m_HashMask];
+    while(ppEntry[0] != pEntry)
+        ppEntry = &ppEntry[0]->pHashNext;
+    ppEntry[0] = pEntry->pHashNext;
+
+    // Remove the entry from the LRU list
+    Unlink(pShard, pEntry);
+    pShard->BytesCached -= pEntry->cbData;
+    pShard->Evictions++;
+    CASC_FREE(pEntry);
+}
@@ -0,0 +1,93 @@
+/*****************************************************************************/
+/* FrameCache.h                           Part of CascLib                    */
+/*---------------------------------------------------------------------------*/
+/* Cache of decoded file frames, shared by all file handles of a storage     */
+/*---------------------------------------------------------------------------*/
+/*   Date    Ver   Who  Comment                                              */
+/* --------  ----  ---  -------                                              */
+/* 19.10.26  1.00       The first version of FrameCache.h                    */
+/*****************************************************************************/
+
+#ifndef __FRAMECACHE_H__
+#define __FRAMECACHE_H__
+
+//-----------------------------------------------------------------------------
+// Structures
+
+// Number of independently locked parts of the cache. Must be a power of two.
+#define CASC_FRAME_CACHE_SHARDS     0x10
+
+// Frame index under which the parsed frame table of a file span is cached
+#define CASC_FRAME_TABLE_INDEX      0xFFFFFFFF
+
+// One decoded frame in the cache. The decoded data follow the structure.
+typedef struct _CASC_FRAME_CACHE_ENTRY
+{
+    struct _CASC_FRAME_CACHE_ENTRY * pHashNext;     // Next entry in the same hash bucket
+    struct _CASC_FRAME_CACHE_ENTRY * pPrev;         // Previous (more recently used) entry
+    struct _CASC_FRAME_CACHE_ENTRY * pNext;         // Next (less recently used) entry
+    BYTE EKey[MD5_HASH_SIZE];                       // Encoded key of the file span
+    DWORD FrameIndex;                               // Index of the frame within the file span
+    DWORD HashValue;                                // Hash of the EKey and the frame index
+    DWORD cbData;                                   // Length of the decoded data
+
+} CASC_FRAME_CACHE_ENTRY, *PCASC_FRAME_CACHE_ENTRY;
+
+// Independently locked part of the cache with its own LRU list
+typedef struct _CASC_FRAME_CACHE_SHARD
+{
+    CASC_LOCK Lock;                                 // Guards all members of the shard
+    PCASC_FRAME_CACHE_ENTRY * HashTable;            // Hash table of the entries
+    PCASC_FRAME_CACHE_ENTRY pFirst;                 // Most recently used entry
+    PCASC_FRAME_CACHE_ENTRY pLast;                  // Least recently used entry
+    size_t BytesCached;                             // Number of decoded bytes held by the shard
+    ULONGLONG Hits;                                 // Number of successful lookups
+    ULONGLONG Misses;                               // Number of failed lookups
+    ULONGLONG Evictions;                            // Number of entries removed to make room
+
+} CASC_FRAME_CACHE_SHARD, *PCASC_FRAME_CACHE_SHARD;
+
+// Byte-limited LRU cache of decoded frames, keyed by EKey and frame index.
+// All methods may be called from multiple threads at once.
+class CASC_FRAME_CACHE
+{
+    public:
+
+    CASC_FRAME_CACHE();
+    ~CASC_FRAME_CACHE();
+
+    // Creates the cache. The byte limit is split evenly between the shards
+    DWORD Create(size_t BytesLimit);
+    void Free();
+
+    // Copies the decoded frame to the buffer. Returns false if the frame is not in the cache
+    bool Find(LPBYTE EKey, DWORD FrameIndex, LPBYTE pbBuffer, DWORD cbBuffer);
+
+    // Returns a copy of the cached data whose size is not known in advance. The caller must free it
+    LPBYTE Find(LPBYTE EKey, DWORD FrameIndex, PDWORD PtrDataSize);
+
+    // Stores a copy of the decoded frame
+    void Insert(LPBYTE EKey, DWORD FrameIndex, LPBYTE pbData, DWORD cbData);
+
+    // Retrieves the cache statistics
+    void GetStats(PCASC_FRAME_CACHE_STATS pStats);
+
+    bool IsInitialized()
+    {
+        return (m_BytesLimit != 0);
+    }
+
+    protected:
+
+    DWORD HashFrameKey(LPBYTE EKey, DWORD FrameIndex);
+    void LinkFirst(PCASC_FRAME_CACHE_SHARD pShard, PCASC_FRAME_CACHE_ENTRY pEntry);
+    void Unlink(PCASC_FRAME_CACHE_SHARD pShard, PCASC_FRAME_CACHE_ENTRY pEntry);
+    void EvictLast(PCASC_FRAME_CACHE_SHARD pShard);
+
+    CASC_FRAME_CACHE_SHARD m_Shards[CASC_FRAME_CACHE_SHARDS];
+    size_t m_BytesLimit;                            // Byte limit of the entire cache
+    size_t m_ShardLimit;                            // Byte limit of one shard
+    DWORD m_HashMask;                               // Mask of the hash table index in one shard
+};
+
+#endif // __FRAMECACHE_H__
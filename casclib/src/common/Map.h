@@ -29,6 +29,26 @@ typedef enum _KEY_TYPE
 
 #define KEY_LENGTH_STRING 0xFFFFFFFF
 
+#define CASC_MAP_GROUP_SIZE     7               // Number of slots in one group of CASC_KEY_MAP. On 64-bit platforms, a group is one 64-byte cache line
+#define CASC_MAP_GROUP_MASK     0x7F            // Bit mask of all slots in a group
+#define CASC_MAP_GROUP_ALIGN    64              // Alignment of the groups, in bytes
+#define CASC_MAP_SLOT_EMPTY     0x00            // Fingerprint of an empty slot. Fingerprints of used slots have the highest bit set
+#define CASC_MAP_BATCH_SIZE     32              // Number of objects whose groups are prefetched at once by CASC_KEY_MAP::InsertObjects
+
+// Groups of CASC_KEY_MAP are probed by SSE2 where available
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define CASC_MAP_SSE2
+#endif
+
+// One group of slots of CASC_KEY_MAP. The fingerprints of all slots are compared at once,
+// so the objects are only accessed when the fingerprint matches
+typedef struct _CASC_MAP_GROUP
+{
+    BYTE Fingerprints[8];                       // Fingerprints of the keys in the slots. CASC_MAP_SLOT_EMPTY if the slot is free. The last one is unused
+    void * Objects[CASC_MAP_GROUP_SIZE];        // Pointers to the objects
+} CASC_MAP_GROUP, *PCASC_MAP_GROUP;
+
 //-----------------------------------------------------------------------------
 // Hashing functions
 
@@ -354,4 +374,336 @@ class CASC_MAP
                                                 // Will improve performance, as we will not hash a hash :-)
 };
 
+//-----------------------------------------------------------------------------
+// Map of fixed-length binary keys (CKeys, EKeys). Unlike CASC_MAP, each slot
+// has a 7-bit fingerprint of the key stored inline. Slots are probed by groups
+// of CASC_MAP_GROUP_SIZE and the key in the object is only compared when
+// the fingerprint matches. Objects cannot be removed, same like in CASC_MAP.
+
+class CASC_KEY_MAP
+{
+    public:
+
+    CASC_KEY_MAP()
+    {
+        PfnCalcHashValue = NULL;
+        m_pbGroupBuffer = NULL;
+        m_Groups = NULL;
+        m_GroupCount = 0;
+        m_ItemCount = 0;
+        m_KeyOffset = 0;
+        m_KeyLength = 0;
+    }
+
+    ~CASC_KEY_MAP()
+    {
+        Free();
+    }
+
+    DWORD Create(size_t MaxItems, size_t KeyLength, size_t KeyOffset, KEY_TYPE KeyType = KeyIsHash)
+    {
+        // Set the class variables
+        m_KeyLength = CASCLIB_MAX(KeyLength, 8);
+        m_KeyOffset = KeyOffset;
+        m_ItemCount = 0;
+
+        // Setup the hashing function. String keys are only supported by CASC_MAP
+        switch(KeyType)
+        {
+            case KeyIsHash:
+                PfnCalcHashValue = CalcHashValue_Hash;
+                break;
+
+            case KeyIsArbitrary:
+                PfnCalcHashValue = CalcHashValue_Key;
+                break;
+
+            default:
+                assert(false);
+                return ERROR_NOT_SUPPORTED;
+        }
+
+        // Take 133% of the item count, same like CASC_MAP. The number of groups is a power of two
+        m_GroupCount = GetNearestPowerOfTwo((MaxItems * 4 / 3) / CASC_MAP_GROUP_SIZE);
+        if(m_GroupCount == 0)
+            return ERROR_NOT_ENOUGH_MEMORY;
+
+        // Allocate the groups, aligned to the cache line size. All slots are empty
+        m_pbGroupBuffer = CASC_ALLOC_ZERO<BYTE>(m_GroupCount * sizeof(CASC_MAP_GROUP) + CASC_MAP_GROUP_ALIGN);
+        if(m_pbGroupBuffer == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        m_Groups = (PCASC_MAP_GROUP)ALIGN_TO_SIZE((size_t)m_pbGroupBuffer, CASC_MAP_GROUP_ALIGN);
+        return ERROR_SUCCESS;
+    }
+
+    void * FindObject(void * pvKey, PDWORD PtrIndex = NULL)
+    {
+        PCASC_MAP_GROUP pGroup;
+        DWORD dwHashValue;
+        DWORD dwMatchMask;
+        DWORD dwEmptyMask;
+        DWORD dwSlot;
+        size_t nGroupIndex;
+        BYTE Fingerprint;
+
+        // Verify pointer to the map
+        if(m_Groups != NULL)
+        {
+            // Get the first group and the fingerprint
+            dwHashValue = PfnCalcHashValue(pvKey, m_KeyLength);
+            nGroupIndex = HashToGroup(dwHashValue);
+            Fingerprint = HashToFingerprint(dwHashValue);
+
+            for(;;)
+            {
+                pGroup = m_Groups + nGroupIndex;
+
+                // Compare the keys of all objects with the same fingerprint
+                dwMatchMask = MatchFingerprint(pGroup, Fingerprint);
+                dwEmptyMask = MatchFingerprint(pGroup, CASC_MAP_SLOT_EMPTY);
+                while(dwMatchMask != 0)
+                {
+                    dwSlot = GetLowestBitIndex(dwMatchMask);
+                    if(CompareObject_Key(pGroup->Objects[dwSlot], pvKey))
+                    {
+                        if(PtrIndex != NULL)
+                            PtrIndex[0] = (DWORD)(nGroupIndex * CASC_MAP_GROUP_SIZE + dwSlot);
+                        return pGroup->Objects[dwSlot];
+                    }
+                    dwMatchMask &= (dwMatchMask - 1);
+                }
+
+                // If the group has a free slot, the key would have been inserted there
+                if(dwEmptyMask != 0)
+                    break;
+
+                // Move to the next group
+                nGroupIndex = (nGroupIndex + 1) & (m_GroupCount - 1);
+            }
+        }
+
+        // Not found, sorry
+        return NULL;
+    }
+
+    bool InsertObject(void * pvNewObject, void * pvKey)
+    {
+        // Verify pointer to the map
+        if(m_Groups != NULL)
+        {
+            return InsertObject(pvNewObject, pvKey, PfnCalcHashValue(pvKey, m_KeyLength));
+        }
+
+        // Failed
+        return false;
+    }
+
+    // Inserts multiple objects. The groups of each batch of objects are prefetched first,
+    // so that their memory loads overlap. The objects are inserted in the given order,
+    // so the result is the same as when InsertObject is called for each of them.
+    // Returns the number of objects that have been inserted.
+    size_t InsertObjects(void ** ObjectArray, size_t nObjects)
+    {
+        DWORD HashValues[CASC_MAP_BATCH_SIZE];
+        size_t nInserted = 0;
+        size_t nBatch;
+
+        // Verify pointer to the map
+        if(m_Groups != NULL)
+        {
+            for(size_t i = 0; i < nObjects; i += nBatch)
+            {
+                nBatch = CASCLIB_MIN(nObjects - i, CASC_MAP_BATCH_SIZE);
+
+                // Calculate the hashes and prefetch the groups
+                for(size_t j = 0; j < nBatch; j++)
+                {
+                    HashValues[j] = PfnCalcHashValue((LPBYTE)ObjectArray[i + j] + m_KeyOffset, m_KeyLength);
+                    PrefetchGroup(m_Groups + HashToGroup(HashValues[j]));
+                }
+
+                // Insert the objects
+                for(size_t j = 0; j < nBatch; j++)
+                {
+                    if(InsertObject(ObjectArray[i + j], (LPBYTE)ObjectArray[i + j] + m_KeyOffset, HashValues[j]))
+                        nInserted++;
+                }
+            }
+        }
+
+        return nInserted;
+    }
+
+    // Slots are numbered the same way as in CASC_MAP. Free slots return NULL
+    void * ItemAt(size_t nIndex)
+    {
+        assert(nIndex < HashTableSize());
+        return m_Groups[nIndex / CASC_MAP_GROUP_SIZE].Objects[nIndex % CASC_MAP_GROUP_SIZE];
+    }
+
+    size_t HashTableSize()
+    {
+        return m_GroupCount * CASC_MAP_GROUP_SIZE;
+    }
+
+    size_t ItemCount()
+    {
+        return m_ItemCount;
+    }
+
+    bool IsInitialized()
+    {
+        return (m_Groups && m_GroupCount);
+    }
+
+    void Free()
+    {
+        PfnCalcHashValue = NULL;
+        CASC_FREE(m_pbGroupBuffer);
+        m_Groups = NULL;
+        m_GroupCount = 0;
+    }
+
+    protected:
+
+    bool InsertObject(void * pvNewObject, void * pvKey, DWORD dwHashValue)
+    {
+        PCASC_MAP_GROUP pGroup;
+        size_t nGroupIndex = HashToGroup(dwHashValue);
+        DWORD dwMatchMask;
+        DWORD dwSlot;
+        BYTE Fingerprint = HashToFingerprint(dwHashValue);
+
+        // Limit check. There must always be at least one free slot
+        if((m_ItemCount + 1) >= HashTableSize())
+            return false;
+
+        for(;;)
+        {
+            pGroup = m_Groups + nGroupIndex;
+
+            // Check if key being inserted conflicts with an existing key
+            dwMatchMask = MatchFingerprint(pGroup, Fingerprint);
+            while(dwMatchMask != 0)
+            {
+                dwSlot = GetLowestBitIndex(dwMatchMask);
+                if(CompareObject_Key(pGroup->Objects[dwSlot], pvKey))
+                    return false;
+                dwMatchMask &= (dwMatchMask - 1);
+            }
+
+            // Insert to the first free slot. Slots are filled from the beginning of the group
+            dwMatchMask = MatchFingerprint(pGroup, CASC_MAP_SLOT_EMPTY);
+            if(dwMatchMask != 0)
+            {
+                dwSlot = GetLowestBitIndex(dwMatchMask);
+                pGroup->Fingerprints[dwSlot] = Fingerprint;
+                pGroup->Objects[dwSlot] = pvNewObject;
+                m_ItemCount++;
+                return true;
+            }
+
+            // Move to the next group
+            nGroupIndex = (nGroupIndex + 1) & (m_GroupCount - 1);
+        }
+    }
+
+    // The group index is taken from the lower bits of the hash, the fingerprint from the upper seven bits
+    size_t HashToGroup(DWORD dwHashValue)
+    {
+        return dwHashValue & (m_GroupCount - 1);
+    }
+
+    BYTE HashToFingerprint(DWORD dwHashValue)
+    {
+        return (BYTE)(0x80 | (dwHashValue >> 25));
+    }
+
+    // Returns bit mask of the slots in the group that have the given fingerprint
+    static DWORD MatchFingerprint(PCASC_MAP_GROUP pGroup, BYTE Fingerprint)
+    {
+#ifdef CASC_MAP_SSE2
+        __m128i Fingerprints = _mm_loadl_epi64((const __m128i *)pGroup->Fingerprints);
+        return (DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(Fingerprints, _mm_set1_epi8((char)Fingerprint))) & CASC_MAP_GROUP_MASK;
+#elif defined(PLATFORM_LITTLE_ENDIAN)
+        ULONGLONG Fingerprints;
+        ULONGLONG MatchBytes;
+
+        // Compare all eight bytes at once. Matching bytes get their highest bit set,
+        // then the highest bits are gathered to the upper byte by the multiplication
+        memcpy(&Fingerprints, pGroup->Fingerprints, sizeof(ULONGLONG));
+        Fingerprints ^= 0x0101010101010101ULL * Fingerprint;
+        MatchBytes = ~(((Fingerprints & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | Fingerprints) & 0x8080808080808080ULL;
+        return (DWORD)(((MatchBytes >> 7) * 0x0102040810204080ULL) >> 56) & CASC_MAP_GROUP_MASK;
+#else
+        DWORD dwMatchMask = 0;
+
+        for(DWORD i = 0; i < CASC_MAP_GROUP_SIZE; i++)
+            dwMatchMask |= (DWORD)(pGroup->Fingerprints[i] == Fingerprint) << i;
+        return dwMatchMask;
+#endif
+    }
+
+    static DWORD GetLowestBitIndex(DWORD dwMatchMask)
+    {
+#if defined(_MSC_VER)
+        unsigned long dwIndex;
+        _BitScanForward(&dwIndex, dwMatchMask);
+        return (DWORD)dwIndex;
+#elif defined(__GNUC__)
+        return (DWORD)__builtin_ctz(dwMatchMask);
+#else
+        DWORD dwIndex = 0;
+
+        while((dwMatchMask & 1) == 0)
+        {
+            dwMatchMask >>= 1;
+            dwIndex++;
+        }
+        return dwIndex;
+#endif
+    }
+
+    static void PrefetchGroup(PCASC_MAP_GROUP pGroup)
+    {
+#ifdef CASC_MAP_SSE2
+        _mm_prefetch((const char *)pGroup, _MM_HINT_T0);
+#else
+        (void)pGroup;
+#endif
+    }
+
+    bool CompareObject_Key(void * pvObject, void * pvKey)
+    {
+        LPBYTE pbObjectKey = (LPBYTE)pvObject + m_KeyOffset;
+        return (memcmp(pbObjectKey, pvKey, m_KeyLength) == 0);
+    }
+
+    size_t GetNearestPowerOfTwo(size_t MaxItems)
+    {
+        size_t PowerOfTwo;
+
+        // Round the hash table size up to the nearest power of two
+        for(PowerOfTwo = MIN_HASH_TABLE_SIZE; PowerOfTwo <= MAX_HASH_TABLE_SIZE; PowerOfTwo <<= 1)
+        {
+            if(PowerOfTwo > MaxItems)
+            {
+                return PowerOfTwo;
+            }
+        }
+
+        // If the hash table is too big, we cannot create the map
+        assert(false);
+        return 0;
+    }
+
+    PFNHASHFUNC PfnCalcHashValue;
+    LPBYTE m_pbGroupBuffer;                     // Allocated buffer for the groups
+    PCASC_MAP_GROUP m_Groups;                   // Array of slot groups, aligned to CASC_MAP_GROUP_ALIGN
+    size_t m_GroupCount;                        // Number of groups. Always a power of two.
+    size_t m_ItemCount;                         // Number of objects in the map
+    size_t m_KeyOffset;                         // How far is the key from the begin of the objects (in bytes)
+    size_t m_KeyLength;                         // Length of the key, in bytes
+};
+
 #endif // __CASC_MAP_H__
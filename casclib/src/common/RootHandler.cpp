@@ -58,6 +58,11 @@ PCASC_CKEY_ENTRY TFileTreeRoot::GetFile(TCascStorage * /* hs */, DWORD FileDataI
     return (pFileNode != NULL) ? pFileNode->pCKeyEntry : NULL;
 }
 
+size_t TFileTreeRoot::GetFiles(TCascStorage * /* hs */, const DWORD * FileDataIds, size_t nFileDataIds, PCASC_CKEY_ENTRY * CKeyEntries)
+{
+    return FileTree.FindByIds(FileDataIds, nFileDataIds, CKeyEntries);
+}
+
 PCASC_CKEY_ENTRY TFileTreeRoot::Search(TCascSearch * pSearch, PCASC_FIND_DATA pFindData)
 {
     PCASC_FILE_NODE pFileNode;
@@ -62,6 +62,25 @@ struct TRootHandler
         return NULL;
     }
 
+    // Searches multiple files by file data id. Entries of files that were not found are set to NULL
+    // hs           - Pointer to the storage structure
+    // FileDataIds  - Array of file data ids, preferably sorted in ascending order
+    // nFileDataIds - Number of file data ids
+    // CKeyEntries  - Array that receives the CKey entries (count: nFileDataIds)
+    // Returns the number of files that were found
+    virtual size_t GetFiles(struct TCascStorage * hs, const DWORD * FileDataIds, size_t nFileDataIds, PCASC_CKEY_ENTRY * CKeyEntries)
+    {
+        size_t nFound = 0;
+
+        for(size_t i = 0; i < nFileDataIds; i++)
+        {
+            CKeyEntries[i] = GetFile(hs, FileDataIds[i]);
+            nFound += (CKeyEntries[i] != NULL) ? 1 : 0;
+        }
+
+        return nFound;
+    }
+
     // Performs find-next-file operation
     // pSearch   - Pointer to the initialized search structure
     // pFindData - Pointer to output structure that will contain the information
@@ -100,6 +119,7 @@ struct TFileTreeRoot : public TRootHandler
 
     PCASC_CKEY_ENTRY GetFile(struct TCascStorage * hs, const char * szFileName);
     PCASC_CKEY_ENTRY GetFile(struct TCascStorage * hs, DWORD FileDataId);
+    size_t GetFiles(struct TCascStorage * hs, const DWORD * FileDataIds, size_t nFileDataIds, PCASC_CKEY_ENTRY * CKeyEntries);
     PCASC_CKEY_ENTRY Search(struct TCascSearch * pSearch, struct _CASC_FIND_DATA * pFindData);
     bool GetInfo(PCASC_CKEY_ENTRY pCKeyEntry, struct _CASC_FILE_FULL_INFO * pFileInfo);
 
@@ -67,6 +67,41 @@ namespace fs {
             throw std::runtime_error("file not found");
         }
 
+        std::vector<std::shared_ptr<casc_file>> casc_file_system::open_files(std::vector<DWORD> const& fdids) const
+        {
+            std::vector<HANDLE> fileHandles(fdids.size(), nullptr);
+            std::vector<std::shared_ptr<casc_file>> files(fdids.size());
+
+            // A missing file is not fatal here; its handle is simply null
+            if (!CascOpenFilesById(_storageHandle, fdids.data(), fdids.size(), 0, fileHandles.data()) && GetLastError() != ERROR_FILE_NOT_FOUND)
+            {
+                for (HANDLE fileHandle : fileHandles)
+                    if (fileHandle != nullptr)
+                        CascCloseFile(fileHandle);
+                throw std::runtime_error("unable to open files");
+            }
+
+            for (size_t i = 0; i < fileHandles.size(); ++i)
+            {
+                if (fileHandles[i] == nullptr)
+                    continue;
+
+                try
+                {
+                    files[i] = std::shared_ptr<casc_file>(new casc_file(fileHandles[i]));
+                }
+                catch (...)
+                {
+                    for (size_t j = i; j < fileHandles.size(); ++j)
+                        if (fileHandles[j] != nullptr)
+                            CascCloseFile(fileHandles[j]);
+                    throw;
+                }
+            }
+
+            return files;
+        }
+
         casc_file::casc_file(HANDLE fileHandle)
         {
             _fileHandle = fileHandle;
@@ -30,6 +30,8 @@ namespace fs {
             std::vector<uint8_t> _fileData;
         };
 
+        // open_file may be called from multiple threads at once; the storage handle is shared.
+        // Each casc_file must only be used by one thread at a time.
         class casc_file_system final
         {
         public:
@@ -58,6 +60,10 @@ namespace fs {
             std::shared_ptr<casc_file> open_file(encoding_key ekey) const;
             std::shared_ptr<casc_file> open_file(size_t fdid) const;
 
+            // Opens many files at once. fdids should be sorted in ascending order.
+            // Files that are not found get a null pointer instead of throwing.
+            std::vector<std::shared_ptr<casc_file>> open_files(std::vector<DWORD> const& fdids) const;
+
         private:
             HANDLE _storageHandle;
             std::string _currentRootFolder;
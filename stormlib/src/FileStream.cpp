@@ -30,11 +30,19 @@
 #define INVALID_HANDLE_VALUE ((HANDLE)-1)
 #endif
 
+// On Linux, FileStream_ReadBatch keeps all reads of the batch in flight at once through io_uring.
+// Define STORMLIB_NO_IO_URING when building against kernel headers that don't have it
+#if defined(PLATFORM_LINUX) && !defined(STORMLIB_NO_IO_URING)
+#define STORMLIB_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
 //-----------------------------------------------------------------------------
 // Local functions - platform-specific functions
 
 #ifndef PLATFORM_WINDOWS
-static DWORD nLastError = ERROR_SUCCESS;
+static __thread DWORD nLastError = ERROR_SUCCESS;
 
 DWORD GetLastError()
 {
@@ -431,6 +439,250 @@ static void BaseFile_Init(TFileStream * pStream)
     pStream->BaseClose   = BaseFile_Close;
 }
 
+//-----------------------------------------------------------------------------
+// Local functions - batched reads of the disk file (io_uring)
+
+#ifdef STORMLIB_IO_URING
+
+#define STREAM_RING_ENTRIES     0x40        // Maximum number of reads in flight
+
+struct TStreamRing
+{
+    TStreamRing * pNext;                    // Next idle ring of the stream
+    int fd;                                 // File descriptor of the io_uring instance
+    DWORD dwEntries;                        // Number of entries in the submission queue
+    unsigned * SqHead;                      // Submission queue, shared with the kernel
+    unsigned * SqTail;
+    unsigned * SqMask;
+    unsigned * SqArray;
+    struct io_uring_sqe * Sqes;
+    unsigned * CqHead;                      // Completion queue, shared with the kernel
+    unsigned * CqTail;
+    unsigned * CqMask;
+    struct io_uring_cqe * Cqes;
+    void * pvSqRing;                        // Mapped rings and their sizes
+    void * pvCqRing;
+    size_t cbSqRing;
+    size_t cbCqRing;
+    size_t cbSqes;
+};
+
+// Set when the kernel doesn't support io_uring (or it is blocked).
+// The reads are done one by one then. Accessed atomically, as rings
+// can be created by multiple threads at once
+static bool bRingUnavailable = false;
+
+static void BaseFile_FreeRing(TStreamRing * pRing)
+{
+    if(pRing->pvSqRing != NULL && pRing->pvSqRing != MAP_FAILED)
+        munmap(pRing->pvSqRing, pRing->cbSqRing);
+    if(pRing->pvCqRing != NULL && pRing->pvCqRing != MAP_FAILED)
+        munmap(pRing->pvCqRing, pRing->cbCqRing);
+    if(pRing->Sqes != NULL && (void *)pRing->Sqes != MAP_FAILED)
+        munmap(pRing->Sqes, pRing->cbSqes);
+    if(pRing->fd >= 0)
+        close(pRing->fd);
+    STORM_FREE(pRing);
+}
+
+static TStreamRing * BaseFile_CreateRing()
+{
+    struct io_uring_params Params;
+    TStreamRing * pRing;
+    LPBYTE pbSqRing;
+    LPBYTE pbCqRing;
+
+    // Don't try again if the first attempt failed
+    if(__atomic_load_n(&bRingUnavailable, __ATOMIC_RELAXED))
+        return NULL;
+
+    pRing = STORM_ALLOC(TStreamRing, 1);
+    if(pRing == NULL)
+        return NULL;
+    memset(pRing, 0, sizeof(TStreamRing));
+    memset(&Params, 0, sizeof(struct io_uring_params));
+
+    // Create the io_uring instance
+    pRing->fd = (int)syscall(__NR_io_uring_setup, STREAM_RING_ENTRIES, &Params);
+    if(pRing->fd < 0)
+    {
+        __atomic_store_n(&bRingUnavailable, true, __ATOMIC_RELAXED);
+        STORM_FREE(pRing);
+        return NULL;
+    }
+
+    // Map the submission queue, the completion queue and the submission entries
+    pRing->cbSqRing = Params.sq_off.array + Params.sq_entries * sizeof(unsigned);
+    pRing->cbCqRing = Params.cq_off.cqes + Params.cq_entries * sizeof(struct io_uring_cqe);
+    pRing->cbSqes = Params.sq_entries * sizeof(struct io_uring_sqe);
+    pRing->pvSqRing = mmap(NULL, pRing->cbSqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_SQ_RING);
+    pRing->pvCqRing = mmap(NULL, pRing->cbCqRing, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_CQ_RING);
+    pRing->Sqes = (struct io_uring_sqe *)mmap(NULL, pRing->cbSqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_SQES);
+    if(pRing->pvSqRing == MAP_FAILED || pRing->pvCqRing == MAP_FAILED || (void *)pRing->Sqes == MAP_FAILED)
+    {
+        __atomic_store_n(&bRingUnavailable, true, __ATOMIC_RELAXED);
+        BaseFile_FreeRing(pRing);
+        return NULL;
+    }
+
+    // Fill the pointers to the ring members
+    pbSqRing = (LPBYTE)pRing->pvSqRing;
+    pbCqRing = (LPBYTE)pRing->pvCqRing;
+    pRing->SqHead  = (unsigned *)(pbSqRing + Params.sq_off.head);
+    pRing->SqTail  = (unsigned *)(pbSqRing + Params.sq_off.tail);
+    pRing->SqMask  = (unsigned *)(pbSqRing + Params.sq_off.ring_mask);
+    pRing->SqArray = (unsigned *)(pbSqRing + Params.sq_off.array);
+    pRing->CqHead  = (unsigned *)(pbCqRing + Params.cq_off.head);
+    pRing->CqTail  = (unsigned *)(pbCqRing + Params.cq_off.tail);
+    pRing->CqMask  = (unsigned *)(pbCqRing + Params.cq_off.ring_mask);
+    pRing->Cqes    = (struct io_uring_cqe *)(pbCqRing + Params.cq_off.cqes);
+    pRing->dwEntries = Params.sq_entries;
+    return pRing;
+}
+
+// Finishes a read that the ring completed only partially (or not at all)
+static void BaseFile_ReadRest(TFileStream * pStream, TStreamRead * pRead, DWORD dwBytesDone)
+{
+    ssize_t bytes_read;
+
+    while(dwBytesDone < pRead->dwBytesToRead)
+    {
+        bytes_read = pread64((intptr_t)pStream->Base.File.hFile,
+                             (LPBYTE)pRead->pvBuffer + dwBytesDone,
+                             (size_t)(pRead->dwBytesToRead - dwBytesDone),
+                             (off64_t)(pRead->ByteOffset + dwBytesDone));
+        if(bytes_read <= 0)
+        {
+            pRead->dwErrCode = (bytes_read == 0) ? ERROR_HANDLE_EOF : errno;
+            return;
+        }
+
+        dwBytesDone += (DWORD)bytes_read;
+    }
+
+    pRead->dwErrCode = ERROR_SUCCESS;
+}
+
+// Processes the completed reads. Short or failed reads are finished by pread.
+// Returns the number of reads that completed
+static DWORD BaseFile_ReapRing(TFileStream * pStream, TStreamRing * pRing, TStreamRead * pReads)
+{
+    struct io_uring_cqe * pCqe;
+    TStreamRead * pRead;
+    unsigned CqHead = *pRing->CqHead;
+    DWORD dwCompleted = 0;
+
+    while(CqHead != __atomic_load_n(pRing->CqTail, __ATOMIC_ACQUIRE))
+    {
+        pCqe = pRing->Cqes + (CqHead & *pRing->CqMask);
+        pRead = pReads + pCqe->user_data;
+
+        if(pCqe->res >= 0 && (DWORD)pCqe->res == pRead->dwBytesToRead)
+            pRead->dwErrCode = ERROR_SUCCESS;
+        else
+            BaseFile_ReadRest(pStream, pRead, (pCqe->res > 0) ? (DWORD)pCqe->res : 0);
+
+        CqHead++;
+        dwCompleted++;
+    }
+    __atomic_store_n(pRing->CqHead, CqHead, __ATOMIC_RELEASE);
+    return dwCompleted;
+}
+
+// Submits all reads to the kernel, keeping up to STREAM_RING_ENTRIES of them in flight.
+// Returns false if io_uring is not available; nothing has been read in that case.
+// The file position of the stream is not changed, so the function doesn't need the read lock.
+// Each batch in progress uses its own ring, so batches from multiple threads run at once.
+static bool BaseFile_ReadBatch(TFileStream * pStream, TStreamRead * pReads, DWORD dwReadCount)
+{
+    TStreamRing * pRing;
+    struct io_uring_sqe * pSqe;
+    TStreamRead * pRead;
+    unsigned SqHead;
+    unsigned SqTail;
+    DWORD dwNextRead = 0;
+    DWORD dwInFlight = 0;
+    int nResult;
+
+    // Take an idle ring of the stream or create a new one
+    StormLock(&pStream->ReadLock);
+    if((pRing = (TStreamRing *)pStream->pReadRing) != NULL)
+        pStream->pReadRing = pRing->pNext;
+    StormUnlock(&pStream->ReadLock);
+    if(pRing == NULL && (pRing = BaseFile_CreateRing()) == NULL)
+        return false;
+
+    // Every read is pending until its completion arrives
+    for(DWORD i = 0; i < dwReadCount; i++)
+        pReads[i].dwErrCode = ERROR_CAN_NOT_COMPLETE;
+
+    while(dwNextRead < dwReadCount || dwInFlight != 0)
+    {
+        // Put as many reads to the submission queue as it can hold
+        SqTail = *pRing->SqTail;
+        while(dwNextRead < dwReadCount && dwInFlight < pRing->dwEntries)
+        {
+            pRead = pReads + dwNextRead;
+            pSqe = pRing->Sqes + (SqTail & *pRing->SqMask);
+
+            memset(pSqe, 0, sizeof(struct io_uring_sqe));
+            pSqe->opcode = IORING_OP_READ;
+            pSqe->fd = (int)(intptr_t)pStream->Base.File.hFile;
+            pSqe->off = pRead->ByteOffset;
+            pSqe->addr = (ULONGLONG)(size_t)pRead->pvBuffer;
+            pSqe->len = pRead->dwBytesToRead;
+            pSqe->user_data = dwNextRead;
+            pRing->SqArray[SqTail & *pRing->SqMask] = (SqTail & *pRing->SqMask);
+
+            SqTail++;
+            dwNextRead++;
+            dwInFlight++;
+        }
+        __atomic_store_n(pRing->SqTail, SqTail, __ATOMIC_RELEASE);
+
+        // Submit the new reads and wait for at least one of them
+        nResult = (int)syscall(__NR_io_uring_enter, pRing->fd, SqTail - __atomic_load_n(pRing->SqHead, __ATOMIC_ACQUIRE), 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(nResult < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            // The ring can't take more reads. Withdraw the reads that the kernel
+            // has not taken from the submission queue yet
+            SqHead = __atomic_load_n(pRing->SqHead, __ATOMIC_ACQUIRE);
+            __atomic_store_n(pRing->SqTail, SqHead, __ATOMIC_RELEASE);
+            dwInFlight -= (SqTail - SqHead);
+            dwNextRead -= (SqTail - SqHead);
+
+            // The kernel may still write to the buffers of the reads it has taken.
+            // Wait for all of them, unless the ring stops working altogether
+            while((dwInFlight -= BaseFile_ReapRing(pStream, pRing, pReads)) != 0)
+            {
+                nResult = (int)syscall(__NR_io_uring_enter, pRing->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+                if(nResult < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                    break;
+            }
+
+            // Drop the ring. The reads the kernel has never taken are done the ordinary way.
+            // The reads still in flight keep ERROR_CAN_NOT_COMPLETE; their buffers must not
+            // be used again, because closing the ring doesn't wait for them
+            BaseFile_FreeRing(pRing);
+            for(DWORD i = dwNextRead; i < dwReadCount; i++)
+                BaseFile_ReadRest(pStream, pReads + i, 0);
+            return true;
+        }
+
+        // Process the completed reads
+        dwInFlight -= BaseFile_ReapRing(pStream, pRing, pReads);
+    }
+
+    // Give the ring back to the stream
+    StormLock(&pStream->ReadLock);
+    pRing->pNext = (TStreamRing *)pStream->pReadRing;
+    pStream->pReadRing = pRing;
+    StormUnlock(&pStream->ReadLock);
+    return true;
+}
+
+#endif  // STORMLIB_IO_URING
+
 //-----------------------------------------------------------------------------
 // Local functions - base memory-mapped file support
 
@@ -858,12 +1110,34 @@ static bool BlockStream_Read(
     assert((BlockSize & (BlockSize - 1)) == 0);
     BlockBufferOffset = (DWORD)(ByteOffset & (BlockSize - 1));
 
-    // Allocate buffer for reading blocks
-    TransferBuffer = BlockBuffer = STORM_ALLOC(BYTE, (BlockCount * BlockSize));
-    if(TransferBuffer == NULL)
+    // If the caller wants whole blocks, they can be loaded directly
+    // into the caller's buffer. BlockRead may fill up to the end of the last block,
+    // which is fine here, because the caller's buffer ends at the block boundary.
+    if(BlockBufferOffset == 0 && (dwBytesToRead & (BlockSize - 1)) == 0)
     {
-        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
-        return false;
+        TransferBuffer = BlockBuffer = (LPBYTE)pvBuffer;
+    }
+    else
+    {
+        // Reuse the stream's transfer buffer. Reading is serialized
+        // by the stream lock, so there can only be one reader at a time
+        if(pStream->TransferSize < (BlockCount * BlockSize))
+        {
+            if(pStream->TransferBuffer != NULL)
+                STORM_FREE(pStream->TransferBuffer);
+            pStream->TransferBuffer = STORM_ALLOC(BYTE, (BlockCount * BlockSize));
+            pStream->TransferSize = 0;
+
+            if(pStream->TransferBuffer == NULL)
+            {
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return false;
+            }
+
+            pStream->TransferSize = (BlockCount * BlockSize);
+        }
+
+        TransferBuffer = BlockBuffer = pStream->TransferBuffer;
     }
 
     // If all blocks are available, just read all blocks at once
@@ -934,7 +1208,8 @@ static bool BlockStream_Read(
     // Now copy the data to the user buffer
     if(bResult)
     {
-        memcpy(pvBuffer, TransferBuffer + BlockBufferOffset, dwBytesToRead);
+        if(TransferBuffer != pvBuffer)
+            memcpy(pvBuffer, TransferBuffer + BlockBufferOffset, dwBytesToRead);
         pStream->StreamPos = ByteOffset + dwBytesToRead;
     }
     else
@@ -947,8 +1222,6 @@ static bool BlockStream_Read(
     if(bCallbackCalled)
         pStream->pfnCallback(pStream->UserData, 0, 0);
 
-    // Free the block buffer and return
-    STORM_FREE(TransferBuffer);
     return bResult;
 }
 
@@ -1041,6 +1314,7 @@ static TFileStream * AllocateFileStream(
 
         // Initialize the stream functions
         StreamBaseInit[dwStreamFlags & 0x03](pStream);
+        StormInitLock(&pStream->ReadLock);
     }
 
     return pStream;
@@ -2371,6 +2645,7 @@ TFileStream * FileStream_CreateFile(
         }
 
         // File create failed, delete the stream
+        StormFreeLock(&pStream->ReadLock);
         STORM_FREE(pStream);
         pStream = NULL;
     }
@@ -2658,8 +2933,72 @@ bool FileStream_GetBitmap(TFileStream * pStream, void * pvBitmap, DWORD cbBitmap
  */
 bool FileStream_Read(TFileStream * pStream, ULONGLONG * pByteOffset, void * pvBuffer, DWORD dwBytesToRead)
 {
+    bool bResult;
+
+    assert(pStream->StreamRead != NULL);
+
+    // Stream providers keep file position and block caches,
+    // so reads from multiple threads must not overlap
+    StormLock(&pStream->ReadLock);
+    bResult = pStream->StreamRead(pStream, pByteOffset, pvBuffer, dwBytesToRead);
+    StormUnlock(&pStream->ReadLock);
+    return bResult;
+}
+
+/**
+ * Reads multiple blocks of data from the stream
+ *
+ * - Returns true if all reads succeeded
+ * - Returns false if any of the reads failed. The error code of each read is in its dwErrCode;
+ *   GetLastError() returns the error of the first failed read
+ * - A read that fails with ERROR_CAN_NOT_COMPLETE may still be in progress in the kernel
+ *   (the io_uring instance stopped working). Its buffer must not be reused or freed
+ * - On Linux, the reads of a local file are all submitted to the kernel at once through io_uring.
+ *   Other streams (and other platforms) do the reads one after another
+ * - The current position of the stream is not defined after the function returns
+ * - Meant for loading the data of many files at once (SFileVerifyAllFiles). Reading one file
+ *   (SFileReadFile, SFileExtractFile) is a single contiguous read and doesn't need it
+ *
+ * \a pStream Pointer to an open stream
+ * \a pReads Array of read requests
+ * \a dwReadCount Number of read requests
+ */
+bool FileStream_ReadBatch(TFileStream * pStream, TStreamRead * pReads, DWORD dwReadCount)
+{
+    bool bBatchDone = false;
+
     assert(pStream->StreamRead != NULL);
-    return pStream->StreamRead(pStream, pByteOffset, pvBuffer, dwBytesToRead);
+
+#ifdef STORMLIB_IO_URING
+    // Plain disk files can have all the reads in flight at once.
+    // Batches from multiple threads don't wait for each other
+    if(pStream->StreamRead == BaseFile_Read)
+        bBatchDone = BaseFile_ReadBatch(pStream, pReads, dwReadCount);
+#endif
+
+    // Other streams read the blocks one by one, under the read lock
+    if(bBatchDone == false)
+    {
+        for(DWORD i = 0; i < dwReadCount; i++)
+        {
+            ULONGLONG ByteOffset = pReads[i].ByteOffset;
+
+            pReads[i].dwErrCode = ERROR_SUCCESS;
+            if(!FileStream_Read(pStream, &ByteOffset, pReads[i].pvBuffer, pReads[i].dwBytesToRead))
+                pReads[i].dwErrCode = GetLastError();
+        }
+    }
+
+    // Report the first failed read, if any
+    for(DWORD i = 0; i < dwReadCount; i++)
+    {
+        if(pReads[i].dwErrCode != ERROR_SUCCESS)
+        {
+            SetLastError(pReads[i].dwErrCode);
+            return false;
+        }
+    }
+    return true;
 }
 
 /**
@@ -2822,7 +3161,29 @@ void FileStream_Close(TFileStream * pStream)
         else if(pStream->BaseClose != NULL)
             pStream->BaseClose(pStream);
 
+#ifdef STORMLIB_IO_URING
+        // Free the io_uring instances, if any
+        while(pStream->pReadRing != NULL)
+        {
+            TStreamRing * pRing = (TStreamRing *)pStream->pReadRing;
+
+            pStream->pReadRing = pRing->pNext;
+            BaseFile_FreeRing(pRing);
+        }
+#endif
+
+        // Free the transfer buffer of block-oriented streams
+        if(pStream->BlockRead != NULL)
+        {
+            TBlockStream * pBlockStream = (TBlockStream *)pStream;
+
+            if(pBlockStream->TransferBuffer != NULL)
+                STORM_FREE(pBlockStream->TransferBuffer);
+            pBlockStream->TransferBuffer = NULL;
+        }
+
         // Free the stream itself
+        StormFreeLock(&pStream->ReadLock);
         STORM_FREE(pStream);
     }
 }
@@ -185,6 +185,8 @@ struct TFileStream
     ULONGLONG StreamPos;                    // Stream position
     DWORD BuildNumber;                      // Game build number
     DWORD dwFlags;                          // Stream flags
+    STORM_LOCK ReadLock;                    // Allows reading the stream from multiple threads
+    void * pReadRing;                       // Idle io_uring instances used by FileStream_ReadBatch (Linux only, guarded by ReadLock)
 
     // Followed by stream provider data, with variable length
 };
@@ -197,6 +199,8 @@ struct TBlockStream : public TFileStream
     SFILE_DOWNLOAD_CALLBACK pfnCallback;    // Callback for downloading
     void * FileBitmap;                      // Array of bits for file blocks
     void * UserData;                        // User data to be passed to the download callback
+    LPBYTE TransferBuffer;                  // Block buffer kept between reads (guarded by ReadLock)
+    DWORD TransferSize;                     // Size of the transfer buffer, in bytes
     DWORD BitmapSize;                       // Size of the file bitmap (in bytes)
     DWORD BlockSize;                        // Size of one block, in bytes
     DWORD BlockCount;                       // Number of data blocks in the file
@@ -305,6 +305,57 @@ DWORD HashStringLower(const char * szFileName, DWORD dwHashType)
     return dwSeed1;
 }
 
+// Calculates all three hashes needed for the hash table search
+// in a single pass over the file name. The three hash chains are independent,
+// so the compiler can interleave them instead of waiting on each one
+static void HashStringTriple(const char * szFileName, const unsigned char * ConvertTable, TMPQNameHash * pNameHash)
+{
+    LPBYTE pbKey = (BYTE *)szFileName;
+    DWORD  dwSeedI1 = 0x7FED7FED;
+    DWORD  dwSeedI2 = 0xEEEEEEEE;
+    DWORD  dwSeedA1 = 0x7FED7FED;
+    DWORD  dwSeedA2 = 0xEEEEEEEE;
+    DWORD  dwSeedB1 = 0x7FED7FED;
+    DWORD  dwSeedB2 = 0xEEEEEEEE;
+    DWORD  ch;
+
+    while(*pbKey != 0)
+    {
+        // Normalize the character only once for all three hashes
+        ch = ConvertTable[*pbKey++];
+
+        dwSeedI1 = StormBuffer[MPQ_HASH_TABLE_INDEX + ch] ^ (dwSeedI1 + dwSeedI2);
+        dwSeedA1 = StormBuffer[MPQ_HASH_NAME_A + ch] ^ (dwSeedA1 + dwSeedA2);
+        dwSeedB1 = StormBuffer[MPQ_HASH_NAME_B + ch] ^ (dwSeedB1 + dwSeedB2);
+
+        dwSeedI2 = ch + dwSeedI1 + dwSeedI2 + (dwSeedI2 << 5) + 3;
+        dwSeedA2 = ch + dwSeedA1 + dwSeedA2 + (dwSeedA2 << 5) + 3;
+        dwSeedB2 = ch + dwSeedB1 + dwSeedB2 + (dwSeedB2 << 5) + 3;
+    }
+
+    pNameHash->dwStartIndex = dwSeedI1;
+    pNameHash->dwName1 = dwSeedA1;
+    pNameHash->dwName2 = dwSeedB1;
+}
+
+// Calculates the hash table position and both name hashes of a file name,
+// using the same character conversion as the archive's hashing function
+void HashFileName(TMPQArchive * ha, const char * szFileName, TMPQNameHash * pNameHash)
+{
+    if(ha->pfnHashString == HashString)
+        HashStringTriple(szFileName, AsciiToUpperTable, pNameHash);
+    else if(ha->pfnHashString == HashStringSlash)
+        HashStringTriple(szFileName, AsciiToUpperTable_Slash, pNameHash);
+    else if(ha->pfnHashString == HashStringLower)
+        HashStringTriple(szFileName, AsciiToLowerTable, pNameHash);
+    else
+    {
+        pNameHash->dwStartIndex = ha->pfnHashString(szFileName, MPQ_HASH_TABLE_INDEX);
+        pNameHash->dwName1 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_A);
+        pNameHash->dwName2 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_B);
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Calculates the hash table size for a given amount of files
 
@@ -599,6 +650,246 @@ DWORD DecryptFileKey(
     return dwFileKey;
 }
 
+//-----------------------------------------------------------------------------
+// Memory pool
+
+void * AllocateFromPool(TMPQPoolBlock ** ppPool, size_t cbSize)
+{
+    TMPQPoolBlock * pBlock = ppPool[0];
+    size_t cbBlockSize;
+    LPBYTE pbData;
+
+    // Keep all allocations aligned to 8 bytes
+    cbSize = (cbSize + 7) & ~(size_t)7;
+
+    // Allocate new block if the current one has not enough space
+    if(pBlock == NULL || (pBlock->cbBlockSize - pBlock->cbBlockUsed) < cbSize)
+    {
+        // Large allocations get their own block
+        cbBlockSize = STORMLIB_MAX(cbSize, MPQ_POOL_BLOCK_SIZE);
+
+        pBlock = (TMPQPoolBlock *)STORM_ALLOC(BYTE, sizeof(TMPQPoolBlock) + cbBlockSize);
+        if(pBlock == NULL)
+            return NULL;
+
+        // Link the block to the pool
+        pBlock->pNext = ppPool[0];
+        pBlock->cbBlockSize = cbBlockSize;
+        pBlock->cbBlockUsed = 0;
+        ppPool[0] = pBlock;
+    }
+
+    // Give away the space from the block
+    pbData = (LPBYTE)(pBlock + 1) + pBlock->cbBlockUsed;
+    pBlock->cbBlockUsed += cbSize;
+    return pbData;
+}
+
+char * StringDupFromPool(TMPQPoolBlock ** ppPool, const char * szString, size_t nLength)
+{
+    char * szCopy;
+
+    szCopy = (char *)AllocateFromPool(ppPool, nLength + 1);
+    if(szCopy != NULL)
+    {
+        memcpy(szCopy, szString, nLength);
+        szCopy[nLength] = 0;
+    }
+
+    return szCopy;
+}
+
+void FreeMemoryPool(TMPQPoolBlock ** ppPool)
+{
+    TMPQPoolBlock * pBlock = ppPool[0];
+    TMPQPoolBlock * pNext;
+
+    while(pBlock != NULL)
+    {
+        pNext = pBlock->pNext;
+        STORM_FREE(pBlock);
+        pBlock = pNext;
+    }
+
+    ppPool[0] = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Locks and worker threads
+
+typedef struct _TStormWorkers
+{
+    STORM_WORKER pfnWorker;                     // Routine executed by every worker thread
+    void * pvContext;                           // Context shared by all workers
+} TStormWorkers;
+
+#ifdef PLATFORM_WINDOWS
+static DWORD WINAPI StormWorkerThread(LPVOID pvParam)
+#else
+static void * StormWorkerThread(void * pvParam)
+#endif
+{
+    TStormWorkers * pWorkers = (TStormWorkers *)pvParam;
+
+    pWorkers->pfnWorker(pWorkers->pvContext);
+    return 0;
+}
+
+void StormInitLock(STORM_LOCK * pLock)
+{
+#ifdef PLATFORM_WINDOWS
+    InitializeCriticalSection(pLock);
+#else
+    pthread_mutex_init(pLock, NULL);
+#endif
+}
+
+void StormFreeLock(STORM_LOCK * pLock)
+{
+#ifdef PLATFORM_WINDOWS
+    DeleteCriticalSection(pLock);
+#else
+    pthread_mutex_destroy(pLock);
+#endif
+}
+
+void StormLock(STORM_LOCK * pLock)
+{
+#ifdef PLATFORM_WINDOWS
+    EnterCriticalSection(pLock);
+#else
+    pthread_mutex_lock(pLock);
+#endif
+}
+
+void StormUnlock(STORM_LOCK * pLock)
+{
+#ifdef PLATFORM_WINDOWS
+    LeaveCriticalSection(pLock);
+#else
+    pthread_mutex_unlock(pLock);
+#endif
+}
+
+void StormInitCond(STORM_COND * pCond)
+{
+#ifdef PLATFORM_WINDOWS
+    InitializeConditionVariable(pCond);
+#else
+    pthread_cond_init(pCond, NULL);
+#endif
+}
+
+void StormFreeCond(STORM_COND * pCond)
+{
+#ifdef PLATFORM_WINDOWS
+    // Windows condition variables need no cleanup
+    STORMLIB_UNUSED(pCond);
+#else
+    pthread_cond_destroy(pCond);
+#endif
+}
+
+// Releases the lock, waits until the condition is signalled and takes the lock again.
+// The wakeup may be spurious, so the caller must check its condition again.
+void StormWaitCond(STORM_COND * pCond, STORM_LOCK * pLock)
+{
+#ifdef PLATFORM_WINDOWS
+    SleepConditionVariableCS(pCond, pLock, INFINITE);
+#else
+    pthread_cond_wait(pCond, pLock);
+#endif
+}
+
+// Wakes all threads waiting for the condition
+void StormWakeAll(STORM_COND * pCond)
+{
+#ifdef PLATFORM_WINDOWS
+    WakeAllConditionVariable(pCond);
+#else
+    pthread_cond_broadcast(pCond);
+#endif
+}
+
+// Returns the number of worker threads worth running (one per CPU)
+DWORD StormGetWorkerCount()
+{
+    DWORD dwCpuCount = 1;
+
+#ifdef PLATFORM_WINDOWS
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    dwCpuCount = si.dwNumberOfProcessors;
+#else
+    long nCpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(nCpuCount > 0)
+        dwCpuCount = (DWORD)nCpuCount;
+#endif
+
+    dwCpuCount = STORMLIB_MIN(dwCpuCount, STORM_MAX_WORKERS);
+    return STORMLIB_MAX(dwCpuCount, 1);
+}
+
+// Runs the worker routine on the given number of threads and waits until all of them
+// finish. The calling thread is one of the workers. If a thread cannot be created,
+// fewer workers run, so the workers must take their work from a shared queue.
+// Returns the number of workers that actually ran, including the calling thread.
+DWORD StormRunWorkers(STORM_WORKER pfnWorker, void * pvContext, DWORD dwWorkerCount)
+{
+    TStormWorkers Workers;
+#ifdef PLATFORM_WINDOWS
+    HANDLE Threads[STORM_MAX_WORKERS];
+#else
+    pthread_t Threads[STORM_MAX_WORKERS];
+#endif
+    DWORD dwThreads = 0;
+
+    // Start the additional threads
+    Workers.pfnWorker = pfnWorker;
+    Workers.pvContext = pvContext;
+    while((dwThreads + 1) < STORMLIB_MIN(dwWorkerCount, STORM_MAX_WORKERS))
+    {
+#ifdef PLATFORM_WINDOWS
+        if((Threads[dwThreads] = CreateThread(NULL, 0, StormWorkerThread, &Workers, 0, NULL)) == NULL)
+            break;
+#else
+        if(pthread_create(&Threads[dwThreads], NULL, StormWorkerThread, &Workers) != 0)
+            break;
+#endif
+        dwThreads++;
+    }
+
+    // Work on the calling thread too
+    pfnWorker(pvContext);
+
+    // Wait for the others to finish
+    for(DWORD i = 0; i < dwThreads; i++)
+    {
+#ifdef PLATFORM_WINDOWS
+        WaitForSingleObject(Threads[i], INFINITE);
+        CloseHandle(Threads[i]);
+#else
+        pthread_join(Threads[i], NULL);
+#endif
+    }
+    return dwThreads + 1;
+}
+
+// Returns a millisecond counter, used for measuring throughput
+DWORD StormGetTickCount()
+{
+#ifdef PLATFORM_WINDOWS
+    return GetTickCount();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (DWORD)((ULONGLONG)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+
 //-----------------------------------------------------------------------------
 // Handle validation functions
 
@@ -680,13 +971,28 @@ TMPQHash * FindFreeHashEntry(TMPQArchive * ha, DWORD dwStartIndex, DWORD dwName1
 // Retrieves the first hash entry for the given file.
 // Every locale version of a file has its own hash entry
 TMPQHash * GetFirstHashEntry(TMPQArchive * ha, const char * szFileName)
+{
+    TMPQNameHash NameHash;
+
+    HashFileName(ha, szFileName, &NameHash);
+    return GetFirstHashEntryByHash(ha, &NameHash);
+}
+
+// Retrieves the first hash entry for already calculated name hashes.
+// Allows the caller to hash the name once and search it in multiple archives
+TMPQHash * GetFirstHashEntryByHash(TMPQArchive * ha, TMPQNameHash * pNameHash)
 {
     DWORD dwHashIndexMask = HASH_INDEX_MASK(ha);
-    DWORD dwStartIndex = ha->pfnHashString(szFileName, MPQ_HASH_TABLE_INDEX);
-    DWORD dwName1 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_A);
-    DWORD dwName2 = ha->pfnHashString(szFileName, MPQ_HASH_NAME_B);
+    DWORD dwStartIndex = pNameHash->dwStartIndex;
+    DWORD dwName1 = pNameHash->dwName1;
+    DWORD dwName2 = pNameHash->dwName2;
     DWORD dwIndex;
 
+    // If the archive has the hash index, it can tell us
+    // that the name is not there without touching the hash table
+    if(ha->pHashIndex != NULL && !IsNameInHashIndex(ha->pHashIndex, dwName1, dwName2))
+        return NULL;
+
     // Set the initial index
     dwStartIndex = dwIndex = (dwStartIndex & dwHashIndexMask);
 
@@ -746,18 +1052,19 @@ TMPQHash * AllocateHashEntry(
     TFileEntry * pFileEntry,
     LCID lcLocale)
 {
+    TMPQNameHash NameHash;
     TMPQHash * pHash;
-    DWORD dwStartIndex = ha->pfnHashString(pFileEntry->szFileName, MPQ_HASH_TABLE_INDEX);
-    DWORD dwName1 = ha->pfnHashString(pFileEntry->szFileName, MPQ_HASH_NAME_A);
-    DWORD dwName2 = ha->pfnHashString(pFileEntry->szFileName, MPQ_HASH_NAME_B);
+
+    // Calculate all three hashes of the file name
+    HashFileName(ha, pFileEntry->szFileName, &NameHash);
 
     // Attempt to find a free hash entry
-    pHash = FindFreeHashEntry(ha, dwStartIndex, dwName1, dwName2, lcLocale);
+    pHash = FindFreeHashEntry(ha, NameHash.dwStartIndex, NameHash.dwName1, NameHash.dwName2, lcLocale);
     if(pHash != NULL)
     {
         // Fill the free hash entry
-        pHash->dwName1      = dwName1;
-        pHash->dwName2      = dwName2;
+        pHash->dwName1      = NameHash.dwName1;
+        pHash->dwName2      = NameHash.dwName2;
         pHash->lcLocale     = (USHORT)lcLocale;
         pHash->Platform     = 0;
         pHash->dwBlockIndex = (DWORD)(pFileEntry - ha->pFileTable);
@@ -1006,6 +1313,26 @@ unsigned char * AllocateMd5Buffer(
     return md5_array;
 }
 
+// Reads raw data of the file from the MPQ. If the data have been loaded
+// in advance (see SFileVerifyAllFiles), they are copied from memory
+bool ReadMpqFileData(TMPQFile * hf, ULONGLONG RawFilePos, void * pvBuffer, DWORD dwBytesToRead)
+{
+    // Is the requested range within the preloaded data?
+    if(hf->pbRawData != NULL && RawFilePos >= hf->RawFilePos)
+    {
+        ULONGLONG RawDataOffset = RawFilePos - hf->RawFilePos;
+
+        if((RawDataOffset + dwBytesToRead) <= hf->cbRawData)
+        {
+            memcpy(pvBuffer, hf->pbRawData + RawDataOffset, dwBytesToRead);
+            return true;
+        }
+    }
+
+    // Read the data from the stream
+    return FileStream_Read(hf->ha->pStream, &RawFilePos, pvBuffer, dwBytesToRead);
+}
+
 // Allocates sector buffer and sector offset table
 int AllocateSectorBuffer(TMPQFile * hf)
 {
@@ -1032,7 +1359,6 @@ int AllocateSectorBuffer(TMPQFile * hf)
 // Allocates sector offset table
 int AllocatePatchInfo(TMPQFile * hf, bool bLoadFromFile)
 {
-    TMPQArchive * ha = hf->ha;
     DWORD dwLength = sizeof(TPatchInfo);
 
     // The following conditions must be true
@@ -1051,7 +1377,7 @@ __AllocateAndLoadPatchInfo:
     if(bLoadFromFile)
     {
         // Load the patch header
-        if(!FileStream_Read(ha->pStream, &hf->RawFilePos, hf->pPatchInfo, dwLength))
+        if(!ReadMpqFileData(hf, hf->RawFilePos, hf->pPatchInfo, dwLength))
         {
             // Free the patch info
             STORM_FREE(hf->pPatchInfo);
@@ -1151,7 +1477,7 @@ int AllocateSectorOffsets(TMPQFile * hf, bool bLoadFromFile)
             }
 
             // Load the sector offsets from the file
-            if(!FileStream_Read(ha->pStream, &RawFilePos, hf->SectorOffsets, dwSectorOffsLen))
+            if(!ReadMpqFileData(hf, RawFilePos, hf->SectorOffsets, dwSectorOffsLen))
             {
                 // Free the sector offsets
                 STORM_FREE(hf->SectorOffsets);
@@ -1583,32 +1909,20 @@ void FreeArchiveHandle(TMPQArchive *& ha)
         if(ha->haPatch != NULL)
             FreeArchiveHandle(ha->haPatch);
 
-        // Free the patch prefix, if any
-        if(ha->pPatchPrefix != NULL)
-            STORM_FREE(ha->pPatchPrefix);
-
         // Close the file stream
         FileStream_Close(ha->pStream);
         ha->pStream = NULL;
 
-        // Free the file names from the file table
-        if(ha->pFileTable != NULL)
-        {
-            for(DWORD i = 0; i < ha->dwFileTableSize; i++)
-            {
-                if(ha->pFileTable[i].szFileName != NULL)
-                    STORM_FREE(ha->pFileTable[i].szFileName);
-                ha->pFileTable[i].szFileName = NULL;
-            }
-
-            // Then free all buffers allocated in the archive structure
-            STORM_FREE(ha->pFileTable);
-        }
-
         if(ha->pHashTable != NULL)
             STORM_FREE(ha->pHashTable);
         if(ha->pHetTable != NULL)
             FreeHetTable(ha->pHetTable);
+        InvalidateNameIndex(ha);
+        Patch_FreeCache(ha);
+
+        // Free the memory pool. This frees the file table, the file names,
+        // the hash index and the patch prefix at once
+        FreeMemoryPool(&ha->pMemoryPool);
         STORM_FREE(ha);
         ha = NULL;
     }
@@ -80,6 +80,33 @@ static TBitArray * CreateBitArray(
     return pBitArray;
 }
 
+// Reads up to 64 bits from the bit array and returns them as integer.
+// Uses one unaligned 64-bit load for runs that fit into 56 bits
+static ULONGLONG LoadBits64(TBitArray * pArray, unsigned int nBitPosition, unsigned int nBitLength)
+{
+    unsigned int nBytePosition = (nBitPosition / 8);
+    ULONGLONG Value = 0;
+
+    // Longer values are loaded in two parts
+    if(nBitLength > 56)
+        return LoadBits64(pArray, nBitPosition, 32) | (LoadBits64(pArray, nBitPosition + 32, nBitLength - 32) << 32);
+
+    // Load eight bytes at once, if the array is long enough. Otherwise load the remaining bytes
+    if((nBytePosition + 8) <= pArray->NumberOfBytes)
+    {
+        memcpy(&Value, pArray->Elements + nBytePosition, sizeof(ULONGLONG));
+        Value = BSWAP_INT64_UNSIGNED(Value);
+    }
+    else
+    {
+        for(unsigned int i = 0; i < 8 && (nBytePosition + i) < pArray->NumberOfBytes; i++)
+            Value |= (ULONGLONG)pArray->Elements[nBytePosition + i] << (i * 8);
+    }
+
+    // Shift the value to the bit position and cut the extra bits
+    return (Value >> (nBitPosition & 0x07)) & (((ULONGLONG)1 << nBitLength) - 1);
+}
+
 void GetBits(
     TBitArray * pArray,
     unsigned int nBitPosition,
@@ -88,11 +115,7 @@ void GetBits(
     int nResultByteSize)
 {
     unsigned char * pbBuffer = (unsigned char *)pvBuffer;
-    unsigned int nBytePosition0 = (nBitPosition / 8);
-    unsigned int nBytePosition1 = nBytePosition0 + 1;
-    unsigned int nByteLength = (nBitLength / 8);
-    unsigned int nBitOffset = (nBitPosition & 0x07);
-    unsigned char BitBuffer;
+    ULONGLONG Value;
 
     // Keep compiler happy for platforms where nResultByteSize is not used
     nResultByteSize = nResultByteSize;
@@ -108,41 +131,23 @@ void GetBits(
     pbBuffer += (nResultByteSize - 1);
 #endif    
 
-    // Copy whole bytes, if any
-    while(nByteLength > 0)
+    // Copy the value in parts of up to 64 bits
+    while(nBitLength > 0)
     {
-        // Is the current position in the Elements byte-aligned?
-        if(nBitOffset != 0)
-        {
-            BitBuffer = (unsigned char)((pArray->Elements[nBytePosition0] >> nBitOffset) | (pArray->Elements[nBytePosition1] << (0x08 - nBitOffset)));
-        }
-        else
-        {
-            BitBuffer = pArray->Elements[nBytePosition0];
-        }
+        unsigned int nPartLength = STORMLIB_MIN(nBitLength, 64);
 
+        Value = LoadBits64(pArray, nBitPosition, nPartLength);
+        for(unsigned int i = 0; i < (nPartLength + 7) / 8; i++)
+        {
 #ifdef PLATFORM_LITTLE_ENDIAN
-        *pbBuffer++ = BitBuffer;
+            *pbBuffer++ = (unsigned char)(Value >> (i * 8));
 #else
-        *pbBuffer-- = BitBuffer;
+            *pbBuffer-- = (unsigned char)(Value >> (i * 8));
 #endif
+        }
 
-        // Move byte positions and lengths
-        nBytePosition1++;
-        nBytePosition0++;
-        nByteLength--;
-    }
-
-    // Get the rest of the bits
-    nBitLength = (nBitLength & 0x07);
-    if(nBitLength != 0)
-    {
-        *pbBuffer = (unsigned char)(pArray->Elements[nBytePosition0] >> nBitOffset);
-
-        if(nBitLength > (8 - nBitOffset))
-            *pbBuffer = (unsigned char)((pArray->Elements[nBytePosition1] << (8 - nBitOffset)) | (pArray->Elements[nBytePosition0] >> nBitOffset));
-
-        *pbBuffer &= (0x01 << nBitLength) - 1;
+        nBitPosition += nPartLength;
+        nBitLength -= nPartLength;
     }
 }
 
@@ -168,6 +173,33 @@ void SetBits(
     pbBuffer += (nResultByteSize - 1);
 #endif    
 
+    // If the bits fit into one 64-bit word within the array,
+    // update them with a single read-modify-write
+    if(nBitLength <= 56 && (nBytePosition + 8) <= pArray->NumberOfBytes)
+    {
+        ULONGLONG ValueMask = ((ULONGLONG)1 << nBitLength) - 1;
+        ULONGLONG NewValue = 0;
+        ULONGLONG Word;
+
+        // Load the new value from the buffer
+        for(unsigned int i = 0; i < (nBitLength + 7) / 8; i++)
+        {
+#ifdef PLATFORM_LITTLE_ENDIAN
+            NewValue |= (ULONGLONG)(*pbBuffer++) << (i * 8);
+#else
+            NewValue |= (ULONGLONG)(*pbBuffer--) << (i * 8);
+#endif
+        }
+
+        // Merge the value into the array
+        memcpy(&Word, pArray->Elements + nBytePosition, sizeof(ULONGLONG));
+        Word = BSWAP_INT64_UNSIGNED(Word);
+        Word = (Word & ~(ValueMask << nBitOffset)) | ((NewValue & ValueMask) << nBitOffset);
+        Word = BSWAP_INT64_UNSIGNED(Word);
+        memcpy(pArray->Elements + nBytePosition, &Word, sizeof(ULONGLONG));
+        return;
+    }
+
     // Copy whole bytes, if any
     while(nBitLength > 8)
     {
@@ -612,6 +644,88 @@ static bool IsValidHashEntry1(TMPQArchive * ha, TMPQHash * pHash, TMPQBlock * pB
     return false;
 }
 
+// Creates the in-memory index of name hashes from the hash table.
+// The index is only valid as long as the hash table does not change,
+// so it must only be created for read-only archives.
+TMPQHashIndex * CreateHashIndex(TMPQArchive * ha)
+{
+    TMPQHashIndex * pHashIndex;
+    TMPQHash * pHashTableEnd = ha->pHashTable + ha->pHeader->dwHashTableSize;
+    TMPQHash * pHash;
+    DWORD dwEntryCount = 0;
+    DWORD dwTotalCount;
+    DWORD dwIndex;
+
+    // Count the hash entries that may be returned by GetFirstHashEntry
+    for(pHash = ha->pHashTable; pHash < pHashTableEnd; pHash++)
+    {
+        if(MPQ_BLOCK_INDEX(pHash) < ha->dwFileTableSize)
+            dwEntryCount++;
+    }
+
+    // Keep the index at most half full, so that the search stops quickly
+    dwTotalCount = GetNearestPowerOfTwo(dwEntryCount * 2);
+    if(dwTotalCount < 0x10)
+        dwTotalCount = 0x10;
+
+    // Allocate and clear the index. It is released together with the memory pool
+    pHashIndex = (TMPQHashIndex *)AllocateFromPool(&ha->pMemoryPool, sizeof(TMPQHashIndex) + dwTotalCount * sizeof(TMPQHashIndexEntry));
+    if(pHashIndex != NULL)
+    {
+        memset(pHashIndex, 0, sizeof(TMPQHashIndex) + dwTotalCount * sizeof(TMPQHashIndexEntry));
+        pHashIndex->dwIndexMask = dwTotalCount - 1;
+
+        // Insert every name hash pair. Multiple locales of the same file are only inserted once.
+        // A pair of zero hashes is never inserted; IsNameInHashIndex always reports it as present.
+        for(pHash = ha->pHashTable; pHash < pHashTableEnd; pHash++)
+        {
+            if(MPQ_BLOCK_INDEX(pHash) < ha->dwFileTableSize && (pHash->dwName1 | pHash->dwName2) != 0)
+            {
+                for(dwIndex = pHash->dwName1 & pHashIndex->dwIndexMask; ; dwIndex = (dwIndex + 1) & pHashIndex->dwIndexMask)
+                {
+                    TMPQHashIndexEntry * pEntry = pHashIndex->Entries + dwIndex;
+
+                    if(pEntry->dwName1 == pHash->dwName1 && pEntry->dwName2 == pHash->dwName2)
+                        break;
+
+                    if((pEntry->dwName1 | pEntry->dwName2) == 0)
+                    {
+                        pEntry->dwName1 = pHash->dwName1;
+                        pEntry->dwName2 = pHash->dwName2;
+                        pHashIndex->dwEntryCount++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    return pHashIndex;
+}
+
+// Returns false if there is surely no hash entry with the given name hashes.
+bool IsNameInHashIndex(TMPQHashIndex * pHashIndex, DWORD dwName1, DWORD dwName2)
+{
+    DWORD dwIndex = dwName1 & pHashIndex->dwIndexMask;
+
+    // Zero name hashes are not in the index
+    if((dwName1 | dwName2) == 0)
+        return true;
+
+    // The index is never full, so we will always reach an empty entry
+    for(;;)
+    {
+        TMPQHashIndexEntry * pEntry = pHashIndex->Entries + dwIndex;
+
+        if(pEntry->dwName1 == dwName1 && pEntry->dwName2 == dwName2)
+            return true;
+        if((pEntry->dwName1 | pEntry->dwName2) == 0)
+            return false;
+
+        dwIndex = (dwIndex + 1) & pHashIndex->dwIndexMask;
+    }
+}
+
 // Returns a hash table entry in the following order:
 // 1) A hash table entry with the preferred locale and platform
 // 2) A hash table entry with the neutral|matching locale and neutral|matching platform
@@ -839,10 +953,10 @@ static int BuildFileTableFromBlockTable(
     if(DefragmentTable != NULL)
     {
         // If we defragmented the block table in the process,
-        // free some memory by shrinking the file table
+        // shrink the file table. The file table is in the memory pool,
+        // so the unused entries stay allocated until the archive is closed
         if(ha->dwFileTableSize > ha->dwMaxFileCount)
         {
-            ha->pFileTable = STORM_REALLOC(TFileEntry, ha->pFileTable, ha->dwMaxFileCount);
             ha->pHeader->BlockTableSize64 = ha->dwMaxFileCount * sizeof(TMPQBlock);
             ha->pHeader->dwBlockTableSize = ha->dwMaxFileCount;
             ha->dwFileTableSize = ha->dwMaxFileCount;
@@ -1389,23 +1503,28 @@ static TMPQExtHeader * TranslateHetTable(TMPQHetTable * pHetTable, ULONGLONG * p
     return (TMPQExtHeader *)pbLinearTable;
 }
 
-static DWORD GetFileIndex_Het(TMPQArchive * ha, const char * szFileName)
+// Returns nonzero if any of the eight name hashes in the group
+// is either a free entry or equal to the searched NameHash1
+static ULONGLONG HetGroupHasCandidate(LPBYTE pbNameHashes, BYTE NameHash1)
 {
-    TMPQHetTable * pHetTable = ha->pHetTable;
-    ULONGLONG FileNameHash;
-    DWORD StartIndex;
-    DWORD Index;
-    BYTE NameHash1;                 // Upper 8 bits of the masked file name hash
+    ULONGLONG Pattern = 0x0101010101010101ULL * NameHash1;
+    ULONGLONG Group;
 
-    // If there are no entries in the HET table, do nothing
-    if(pHetTable->dwEntryCount == 0)
-        return HASH_ENTRY_FREE;
+    // Load eight name hashes at once. The byte order does not matter here
+    memcpy(&Group, pbNameHashes, sizeof(ULONGLONG));
 
-    // Do nothing if the MPQ has no HET table
-    assert(ha->pHetTable != NULL);
+    // Check for HET_ENTRY_FREE (0x00) and for NameHash1
+    return HasZeroByte64(Group) | HasZeroByte64(Group ^ Pattern);
+}
 
-    // Calculate 64-bit hash of the file name
-    FileNameHash = (HashStringJenkins(szFileName) & pHetTable->AndMask64) | pHetTable->OrMask64;
+static DWORD GetFileIndex_HetByHash(TMPQArchive * ha, ULONGLONG FileNameHash)
+{
+    TMPQHetTable * pHetTable = ha->pHetTable;
+    LPBYTE pbNameHashes = pHetTable->pNameHashes;
+    DWORD dwTotalCount = pHetTable->dwTotalCount;
+    DWORD dwEntriesLeft = dwTotalCount;
+    DWORD Index;
+    BYTE NameHash1;                 // Upper 8 bits of the masked file name hash
 
     // Split the file name hash into two parts:
     // NameHash1: The highest 8 bits of the name hash
@@ -1414,21 +1533,29 @@ static DWORD GetFileIndex_Het(TMPQArchive * ha, const char * szFileName)
     NameHash1 = (BYTE)(FileNameHash >> (pHetTable->dwNameHashBitSize - 8));
 
     // Calculate the starting index to the hash table
-    StartIndex = Index = (DWORD)(FileNameHash % pHetTable->dwTotalCount);
+    Index = (DWORD)(FileNameHash % dwTotalCount);
 
     // Go through HET table until we find a terminator
-    while(pHetTable->pNameHashes[Index] != HET_ENTRY_FREE)
+    // or until we checked every entry of the table
+    while(dwEntriesLeft > 0)
     {
-        // Did we find a match ?
-        if(pHetTable->pNameHashes[Index] == NameHash1)
+        // Skip whole groups of eight entries that contain neither a terminator nor a match
+        if(dwEntriesLeft >= 8 && (Index + 8) <= dwTotalCount && !HetGroupHasCandidate(pbNameHashes + Index, NameHash1))
         {
-            DWORD dwFileIndex = 0;
+            Index = (Index + 8) % dwTotalCount;
+            dwEntriesLeft -= 8;
+            continue;
+        }
 
+        // Stop at the terminator
+        if(pbNameHashes[Index] == HET_ENTRY_FREE)
+            break;
+
+        // Did we find a match ?
+        if(pbNameHashes[Index] == NameHash1)
+        {
             // Get the file index
-            GetBits(pHetTable->pBetIndexes, pHetTable->dwIndexSizeTotal * Index,
-                                            pHetTable->dwIndexSize,
-                                           &dwFileIndex,
-                                            sizeof(DWORD));
+            DWORD dwFileIndex = (DWORD)LoadBits64(pHetTable->pBetIndexes, pHetTable->dwIndexSizeTotal * Index, pHetTable->dwIndexSize);
 
             // Verify the FileNameHash against the entry in the table of name hashes
             if(dwFileIndex <= ha->dwFileTableSize && ha->pFileTable[dwFileIndex].FileNameHash == FileNameHash)
@@ -1438,16 +1565,72 @@ static DWORD GetFileIndex_Het(TMPQArchive * ha, const char * szFileName)
         }
 
         // Move to the next entry in the HET table
-        // If we came to the start index again, we are done
-        Index = (Index + 1) % pHetTable->dwTotalCount;
-        if(Index == StartIndex)
-            break;
+        Index = (Index + 1) % dwTotalCount;
+        dwEntriesLeft--;
     }
 
     // File not found
     return HASH_ENTRY_FREE;
 }
 
+static DWORD GetFileIndex_Het(TMPQArchive * ha, const char * szFileName)
+{
+    TMPQHetTable * pHetTable = ha->pHetTable;
+    ULONGLONG FileNameHash;
+
+    // Do nothing if the MPQ has no HET table
+    assert(ha->pHetTable != NULL);
+
+    // If there are no entries in the HET table, do nothing
+    if(pHetTable->dwEntryCount == 0)
+        return HASH_ENTRY_FREE;
+
+    // Calculate 64-bit hash of the file name
+    FileNameHash = (HashStringJenkins(szFileName) & pHetTable->AndMask64) | pHetTable->OrMask64;
+    return GetFileIndex_HetByHash(ha, FileNameHash);
+}
+
+// Finds multiple files in the HET table. All names of a batch are hashed first,
+// then the HET table is searched, so the hashing loop does not touch the table.
+// Each item of PtrFileIndexes receives a file index or HASH_ENTRY_FREE
+void GetFileIndexes_Het(TMPQArchive * ha, const char ** szFileNames, DWORD dwNameCount, LPDWORD PtrFileIndexes)
+{
+    TMPQHetTable * pHetTable = ha->pHetTable;
+    ULONGLONG FileNameHashes[HET_LOOKUP_BATCH];
+    DWORD dwBatchSize;
+    DWORD i;
+
+    // Do nothing if the MPQ has no HET table
+    assert(ha->pHetTable != NULL);
+
+    while(dwNameCount > 0)
+    {
+        dwBatchSize = STORMLIB_MIN(dwNameCount, HET_LOOKUP_BATCH);
+
+        // If there are no entries in the HET table, nothing can be found
+        if(pHetTable->dwEntryCount == 0)
+        {
+            for(i = 0; i < dwBatchSize; i++)
+                PtrFileIndexes[i] = HASH_ENTRY_FREE;
+        }
+        else
+        {
+            // Calculate the 64-bit hashes of all file names
+            for(i = 0; i < dwBatchSize; i++)
+                FileNameHashes[i] = (HashStringJenkins(szFileNames[i]) & pHetTable->AndMask64) | pHetTable->OrMask64;
+
+            // Search the HET table
+            for(i = 0; i < dwBatchSize; i++)
+                PtrFileIndexes[i] = GetFileIndex_HetByHash(ha, FileNameHashes[i]);
+        }
+
+        // Move to the next batch
+        szFileNames += dwBatchSize;
+        PtrFileIndexes += dwBatchSize;
+        dwNameCount -= dwBatchSize;
+    }
+}
+
 void FreeHetTable(TMPQHetTable * pHetTable)
 {
     if(pHetTable != NULL)
@@ -1878,21 +2061,17 @@ void AllocateFileName(TMPQArchive * ha, TFileEntry * pFileEntry, const char * sz
     // Sanity check
     assert(pFileEntry != NULL);
 
-    // If the file name is pseudo file name, free it at this point
+    // The sorted file names are no longer valid
+    InvalidateNameIndex(ha);
+
+    // If the file name is pseudo file name, drop it at this point.
+    // File names are allocated from the archive's memory pool, so they are never freed one by one
     if(IsPseudoFileName(pFileEntry->szFileName, NULL))
-    {
-        if(pFileEntry->szFileName != NULL)
-            STORM_FREE(pFileEntry->szFileName);
         pFileEntry->szFileName = NULL;
-    }
 
     // Only allocate new file name if it's not there yet
     if(pFileEntry->szFileName == NULL)
-    {
-        pFileEntry->szFileName = STORM_ALLOC(char, strlen(szFileName) + 1);
-        if(pFileEntry->szFileName != NULL)
-            strcpy(pFileEntry->szFileName, szFileName);
-    }
+        pFileEntry->szFileName = StringDupFromPool(&ha->pMemoryPool, szFileName, strlen(szFileName));
 
     // We also need to create the file name hash
     if(ha->pHetTable != NULL)
@@ -2003,9 +2182,7 @@ int RenameFileEntry(
         pHashEntry->dwBlockIndex = HASH_ENTRY_DELETED;
     }
 
-    // Free the old file name
-    if(pFileEntry->szFileName != NULL)
-        STORM_FREE(pFileEntry->szFileName);
+    // Drop the old file name. It stays in the memory pool until the archive is closed
     pFileEntry->szFileName = NULL;
 
     // Allocate new file name
@@ -2044,10 +2221,9 @@ int DeleteFileEntry(TMPQArchive * ha, TMPQFile * hf)
         pHashEntry->dwBlockIndex = HASH_ENTRY_DELETED;
     }
 
-    // Free the file name, and set the file entry as deleted
-    if(pFileEntry->szFileName != NULL)
-        STORM_FREE(pFileEntry->szFileName);
+    // Drop the file name, and set the file entry as deleted
     pFileEntry->szFileName = NULL;
+    InvalidateNameIndex(ha);
 
     //
     // Don't modify the HET table, because it gets recreated by the caller
@@ -2204,7 +2380,7 @@ static TMPQHash * LoadHashTable(TMPQArchive * ha)
 
 int CreateFileTable(TMPQArchive * ha, DWORD dwFileTableSize)
 {
-    ha->pFileTable = STORM_ALLOC(TFileEntry, dwFileTableSize);
+    ha->pFileTable = (TFileEntry *)AllocateFromPool(&ha->pMemoryPool, sizeof(TFileEntry) * dwFileTableSize);
     if(ha->pFileTable == NULL)
         return ERROR_NOT_ENOUGH_MEMORY;
 
@@ -2405,13 +2581,41 @@ static int BuildFileTable_Classic(TMPQArchive * ha)
     return nError;
 }
 
+// Unpacks all columns of the BET file table into the file table in one pass
+static void UnpackBetFileTable(TMPQArchive * ha, TMPQBetTable * pBetTable)
+{
+    TFileEntry * pFileEntry = ha->pFileTable;
+    TBitArray * pBitArray = pBetTable->pFileTable;
+    DWORD dwBitPosition = 0;
+
+    for(DWORD i = 0; i < pBetTable->dwEntryCount; i++, pFileEntry++)
+    {
+        // Read the file position, file size and compressed size
+        pFileEntry->ByteOffset = LoadBits64(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FilePos, pBetTable->dwBitCount_FilePos);
+        pFileEntry->dwFileSize = (DWORD)LoadBits64(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FileSize, pBetTable->dwBitCount_FileSize);
+        pFileEntry->dwCmpSize = (DWORD)LoadBits64(pBitArray, dwBitPosition + pBetTable->dwBitIndex_CmpSize, pBetTable->dwBitCount_CmpSize);
+
+        // Read the flag index
+        if(pBetTable->dwFlagCount != 0)
+        {
+            DWORD dwFlagIndex = (DWORD)LoadBits64(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FlagIndex, pBetTable->dwBitCount_FlagIndex);
+            pFileEntry->dwFlags = pBetTable->pFileFlags[dwFlagIndex];
+        }
+
+        //
+        // TODO: Locale (?)
+        //
+
+        // Move the current bit position
+        dwBitPosition += pBetTable->dwTableEntrySize;
+    }
+}
+
 static int BuildFileTable_HetBet(TMPQArchive * ha)
 {
     TMPQHetTable * pHetTable = ha->pHetTable;
     TMPQBetTable * pBetTable;
     TFileEntry * pFileEntry = ha->pFileTable;
-    TBitArray * pBitArray;
-    DWORD dwBitPosition = 0;
     DWORD i;
     int nError = ERROR_FILE_CORRUPT;
 
@@ -2430,27 +2634,20 @@ static int BuildFileTable_HetBet(TMPQArchive * ha)
         // Step one: Fill the name indexes
         for(i = 0; i < pHetTable->dwTotalCount; i++)
         {
-            DWORD dwFileIndex = 0;
-
             // Is the entry in the HET table occupied?
             if(pHetTable->pNameHashes[i] != HET_ENTRY_FREE)
             {
                 // Load the index to the BET table
-                GetBits(pHetTable->pBetIndexes, pHetTable->dwIndexSizeTotal * i,
-                                                pHetTable->dwIndexSize,
-                                               &dwFileIndex,
-                                                4);
+                DWORD dwFileIndex = (DWORD)LoadBits64(pHetTable->pBetIndexes, pHetTable->dwIndexSizeTotal * i, pHetTable->dwIndexSize);
+
                 // Overflow test
                 if(dwFileIndex < pBetTable->dwEntryCount)
                 {
                     ULONGLONG NameHash1 = pHetTable->pNameHashes[i];
-                    ULONGLONG NameHash2 = 0;
+                    ULONGLONG NameHash2;
 
                     // Load the BET hash
-                    GetBits(pBetTable->pNameHashes, pBetTable->dwBitTotal_NameHash2 * dwFileIndex,
-                                                    pBetTable->dwBitCount_NameHash2,
-                                                   &NameHash2,
-                                                    8);
+                    NameHash2 = LoadBits64(pBetTable->pNameHashes, pBetTable->dwBitTotal_NameHash2 * dwFileIndex, pBetTable->dwBitCount_NameHash2);
 
                     // Combine both part of the name hash and put it to the file table
                     pFileEntry = ha->pFileTable + dwFileIndex;
@@ -2459,50 +2656,8 @@ static int BuildFileTable_HetBet(TMPQArchive * ha)
             }
         }
 
-        // Go through the entire BET table and convert it to the file table.
-        pFileEntry = ha->pFileTable;
-        pBitArray = pBetTable->pFileTable; 
-        for(i = 0; i < pBetTable->dwEntryCount; i++)
-        {
-            DWORD dwFlagIndex = 0;
-
-            // Read the file position
-            GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FilePos,
-                               pBetTable->dwBitCount_FilePos,
-                              &pFileEntry->ByteOffset,
-                               8);
-
-            // Read the file size
-            GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FileSize,
-                               pBetTable->dwBitCount_FileSize,
-                              &pFileEntry->dwFileSize,
-                               4);
-
-            // Read the compressed size
-            GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_CmpSize,
-                               pBetTable->dwBitCount_CmpSize,
-                              &pFileEntry->dwCmpSize,
-                               4);
-
-
-            // Read the flag index
-            if(pBetTable->dwFlagCount != 0)
-            {
-                GetBits(pBitArray, dwBitPosition + pBetTable->dwBitIndex_FlagIndex,
-                                   pBetTable->dwBitCount_FlagIndex,
-                                  &dwFlagIndex,
-                                   4);
-                pFileEntry->dwFlags = pBetTable->pFileFlags[dwFlagIndex];
-            }
-
-            //
-            // TODO: Locale (?)
-            //
-
-            // Move the current bit position
-            dwBitPosition += pBetTable->dwTableEntrySize;
-            pFileEntry++;
-        }
+        // Step two: Go through the entire BET table and convert it to the file table.
+        UnpackBetFileTable(ha, pBetTable);
 
         // Set the current size of the file table
         FreeBetTable(pBetTable);
@@ -2530,7 +2685,7 @@ int BuildFileTable(TMPQArchive * ha)
     dwFileTableSize = STORMLIB_MAX(ha->pHeader->dwBlockTableSize, ha->dwMaxFileCount);
 
     // Allocate the file table with size determined before
-    ha->pFileTable = STORM_ALLOC(TFileEntry, dwFileTableSize);
+    ha->pFileTable = (TFileEntry *)AllocateFromPool(&ha->pMemoryPool, sizeof(TFileEntry) * dwFileTableSize);
     if(ha->pFileTable == NULL)
         return ERROR_NOT_ENOUGH_MEMORY;
 
@@ -2621,9 +2776,7 @@ int DefragmentFileTable(TMPQArchive * ha)
             }
 			else
 			{
-				// If there is file name left, free it
-				if(pSource->szFileName != NULL)
-					STORM_FREE(pSource->szFileName);
+				// If there is file name left, drop it. It is in the memory pool
 				pSource->szFileName = NULL;
 			}
         }
@@ -2723,16 +2876,23 @@ int RebuildFileTable(TMPQArchive * ha, DWORD dwNewHashTableSize)
     assert((dwNewHashTableSize & (dwNewHashTableSize - 1)) == 0);
     assert(ha->pHashTable != NULL);
 
-    // Reallocate the new file table, if needed
+    // Reallocate the new file table, if needed.
+    // The old file table stays in the memory pool until the archive is closed
     if(dwNewHashTableSize > ha->dwFileTableSize)
     {
-        ha->pFileTable = STORM_REALLOC(TFileEntry, ha->pFileTable, dwNewHashTableSize);
-        if(ha->pFileTable == NULL)
+        TFileEntry * pNewFileTable = (TFileEntry *)AllocateFromPool(&ha->pMemoryPool, sizeof(TFileEntry) * dwNewHashTableSize);
+
+        if(pNewFileTable == NULL)
             return ERROR_NOT_ENOUGH_MEMORY;
 
-        memset(ha->pFileTable + ha->dwFileTableSize, 0, (dwNewHashTableSize - ha->dwFileTableSize) * sizeof(TFileEntry));
+        memcpy(pNewFileTable, ha->pFileTable, ha->dwFileTableSize * sizeof(TFileEntry));
+        memset(pNewFileTable + ha->dwFileTableSize, 0, (dwNewHashTableSize - ha->dwFileTableSize) * sizeof(TFileEntry));
+        ha->pFileTable = pNewFileTable;
     }
 
+    // The name index refers to the old tables
+    InvalidateNameIndex(ha);
+
     // Allocate new hash table
     if(nError == ERROR_SUCCESS)
     {
@@ -23,6 +23,20 @@
 // Kept here for compatibility with code that was created with StormLib version < 6.50
 static DWORD DefaultDataCompression = MPQ_COMPRESSION_PKWARE;
 
+// Size of the data blocks in which SFileAddFileEx writes the file to the MPQ
+#define ADD_FILE_BLOCK_SIZE 0x1000
+
+// Local file being added to the MPQ
+typedef struct _TMPQLocalFile
+{
+    TFileStream * pStream;                      // Stream of the local file. NULL if the file data are in memory
+    LPBYTE pbFileData;                          // Entire file data, if loaded to memory
+    ULONGLONG FileTime;                         // Time of the local file
+    ULONGLONG FileSize;                         // Size of the local file
+    TMPQCompressedSector * pSectors;            // Sectors compressed in advance, if any
+    DWORD dwSectorCount;                        // Number of entries in pSectors
+} TMPQLocalFile;
+
 //-----------------------------------------------------------------------------
 // WAVE verification
 
@@ -122,6 +136,54 @@ static int FillWritableHandle(
 //-----------------------------------------------------------------------------
 // MPQ write data functions
 
+// Compresses one file sector. Note that both SCompImplode and SCompCompress
+// copy data as-is, if they are unable to compress the data.
+static int CompressFileSector(LPBYTE pbCompressed, LPBYTE pbSector, DWORD cbSector, DWORD dwFlags, DWORD dwCompression)
+{
+    int nCompressionLevel;                  // ADPCM compression level (only used for wave files)
+    int nOutBuffer = (int)cbSector;
+    int nInBuffer = (int)cbSector;
+
+    if(dwFlags & MPQ_FILE_IMPLODE)
+    {
+        SCompImplode(pbCompressed, &nOutBuffer, pbSector, nInBuffer);
+    }
+
+    if(dwFlags & MPQ_FILE_COMPRESS)
+    {
+        // If the caller wants ADPCM compression, we will set wave compression level to 4,
+        // which corresponds to medium quality
+        nCompressionLevel = (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? 4 : -1;
+        SCompCompress(pbCompressed, &nOutBuffer, pbSector, nInBuffer, (unsigned)dwCompression, 0, nCompressionLevel);
+    }
+
+    return nOutBuffer;
+}
+
+// Takes the file sector compressed in advance by SFileAddFiles. The caller of SFileAddFiles
+// gives the same data like the sector was compressed from, so we only have to check
+// that the sector is compressed the same way.
+static bool LoadCompressedSector(TMPQFile * hf, DWORD dwSectorIndex, DWORD cbSector, DWORD dwCompression, LPBYTE pbCompressed, int * pnOutBuffer)
+{
+    TMPQCompressedSector * pSector;
+    DWORD dwFlags = hf->pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK;
+
+    // Was that sector compressed at all?
+    if(dwSectorIndex >= hf->dwCompressedSectors || hf->pCompressedSectors[dwSectorIndex].pbCompressed == NULL)
+        return false;
+    pSector = hf->pCompressedSectors + dwSectorIndex;
+
+    // Was it compressed the same way?
+    if(pSector->cbSector != cbSector || pSector->dwFlags != dwFlags)
+        return false;
+    if((dwFlags & MPQ_FILE_COMPRESS) && pSector->dwCompression != dwCompression)
+        return false;
+
+    memcpy(pbCompressed, pSector->pbCompressed, pSector->cbCompressed);
+    pnOutBuffer[0] = (int)pSector->cbCompressed;
+    return true;
+}
+
 static int WriteDataToMpqFile(
     TMPQArchive * ha,
     TMPQFile * hf,
@@ -133,7 +195,6 @@ static int WriteDataToMpqFile(
     ULONGLONG ByteOffset;
     LPBYTE pbCompressed = NULL;             // Compressed (target) data
     LPBYTE pbToWrite = hf->pbFileSector;    // Data to write to the file
-    int nCompressionLevel;                  // ADPCM compression level (only used for wave files)
     int nError = ERROR_SUCCESS;
 
     // Make sure that the caller won't overrun the previously initiated file size
@@ -183,7 +244,6 @@ static int WriteDataToMpqFile(
                 if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS_MASK)
                 {
                     int nOutBuffer = (int)dwBytesInSector;
-                    int nInBuffer = (int)dwBytesInSector;
 
                     // If the file is compressed, allocate buffer for the compressed data.
                     // Note that we allocate buffer that is a bit longer than sector size,
@@ -198,35 +258,21 @@ static int WriteDataToMpqFile(
                         }
                     }
 
+                    // If this is the first sector, we need to override the given compression
+                    // by the first sector compression. This is because the entire sector must
+                    // be compressed by the same compression.
                     //
-                    // Note that both SCompImplode and SCompCompress copy data as-is,
-                    // if they are unable to compress the data.
+                    // Test case:                        
                     //
+                    // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_PKWARE)       // Write 0x10 bytes (sector 0)
+                    // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
+                    // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
+                    // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
+                    dwCompression = (dwSectorIndex == 0) ? hf->dwCompression0 : dwCompression;
 
-                    if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
-                    {
-                        SCompImplode(pbCompressed, &nOutBuffer, hf->pbFileSector, nInBuffer);
-                    }
-
-                    if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
-                    {
-                        // If this is the first sector, we need to override the given compression
-                        // by the first sector compression. This is because the entire sector must
-                        // be compressed by the same compression.
-                        //
-                        // Test case:                        
-                        //
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_PKWARE)       // Write 0x10 bytes (sector 0)
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
-                        // WRITE_FILE(hFile, pvBuffer, 0x10, MPQ_COMPRESSION_ADPCM_MONO)   // Write 0x10 bytes (still sector 0)
-                        dwCompression = (dwSectorIndex == 0) ? hf->dwCompression0 : dwCompression;
-
-                        // If the caller wants ADPCM compression, we will set wave compression level to 4,
-                        // which corresponds to medium quality
-                        nCompressionLevel = (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? 4 : -1;
-                        SCompCompress(pbCompressed, &nOutBuffer, hf->pbFileSector, nInBuffer, (unsigned)dwCompression, 0, nCompressionLevel);
-                    }
+                    // Take the sector compressed in advance, if any. If not, compress it now.
+                    if(!LoadCompressedSector(hf, dwSectorIndex, dwBytesInSector, dwCompression, pbCompressed, &nOutBuffer))
+                        nOutBuffer = CompressFileSector(pbCompressed, hf->pbFileSector, dwBytesInSector, pFileEntry->dwFlags, dwCompression);
 
                     // Update sector positions
                     dwBytesInSector = nOutBuffer;
@@ -526,6 +572,7 @@ int SFileAddFile_Init(
         {
             pFileEntry[0] = hfSrc->pFileEntry[0];
             pFileEntry->szFileName = NULL;
+            InvalidateNameIndex(ha);
         }
         else
             nError = ERROR_ALREADY_EXISTS;
@@ -875,82 +922,261 @@ bool WINAPI SFileFinishFile(HANDLE hFile)
     return (nError == ERROR_SUCCESS);
 }
 
+//-----------------------------------------------------------------------------
+// Compression policy
+
+// Maximum number of file sectors given to the compression policy as a sample
+#define MAX_POLICY_SAMPLE_SECTORS  3
+
+// Relative cost of decompressing one KB of data by each compression method.
+// These are not times; they only rank the methods against each other,
+// with ZLIB taken as 100. BZIP2 decompresses about ten times slower than ZLIB.
+typedef struct _TDecodeCost
+{
+    DWORD dwCompression;                        // MPQ_COMPRESSION_XXX
+    DWORD dwCost;                               // Decompression cost per KB, relative to ZLIB (100)
+} TDecodeCost;
+
+static TDecodeCost DecodeCosts[] =
+{
+    {MPQ_COMPRESSION_HUFFMANN,       200},
+    {MPQ_COMPRESSION_ZLIB,           100},
+    {MPQ_COMPRESSION_PKWARE,         200},
+    {MPQ_COMPRESSION_BZIP2,         1000},
+    {MPQ_COMPRESSION_SPARSE,          25},
+    {MPQ_COMPRESSION_ADPCM_MONO,     150},
+    {MPQ_COMPRESSION_ADPCM_STEREO,   150}
+};
+
+// LZMA is not a combination of flags, so it has its own entry
+#define LZMA_DECODE_COST  500
+
+// Default settings of SFileAutoCompression
+static SFILE_AUTO_COMPRESSION DefaultAutoCompression =
+{
+    {MPQ_COMPRESSION_ZLIB, MPQ_COMPRESSION_BZIP2},
+    5,
+    3,
+    0
+};
+
+static DWORD GetDecodeCost(DWORD dwCompression)
+{
+    DWORD dwCost = 0;
+
+    if(dwCompression == MPQ_COMPRESSION_LZMA)
+        return LZMA_DECODE_COST;
+
+    for(size_t i = 0; i < (sizeof(DecodeCosts) / sizeof(TDecodeCost)); i++)
+    {
+        if(dwCompression & DecodeCosts[i].dwCompression)
+            dwCost += DecodeCosts[i].dwCost;
+    }
+    return dwCost;
+}
+
+// Lets the compression policy choose the compression of the file. The policy gets
+// the first, the middle and the last sector of the file as a sample. If the policy
+// returns zero, the file is stored without compression.
+static void ApplyCompressionPolicy(
+    TMPQArchive * ha,
+    const char * szArchivedName,
+    TMPQLocalFile * pLocalFile,
+    LPDWORD pdwFlags,
+    LPDWORD pdwCompression,
+    LPDWORD pdwCompressionNext)
+{
+    ULONGLONG ByteOffset;
+    LPBYTE pbSample;
+    DWORD dwCompressionNext = *pdwCompressionNext;
+    DWORD dwCompression;
+    DWORD dwSectorCount;
+    DWORD dwSampleCount;
+    DWORD dwSectorIndex;
+    DWORD cbSample = 0;
+    DWORD cbSector;
+    DWORD i;
+
+    // Only files compressed by SCompCompress have a choice. ADPCM compression
+    // is chosen by the caller according to the format of the WAVE file.
+    if(ha->pfnCompressionCB == NULL || (*pdwFlags & MPQ_FILE_COMPRESS) == 0)
+        return;
+    if(dwCompressionNext == MPQ_COMPRESSION_NEXT_SAME)
+        dwCompressionNext = *pdwCompression;
+    if((*pdwCompression | dwCompressionNext) & MPQ_LOSSY_COMPRESSION_MASK)
+        return;
+    if(pLocalFile->FileSize == 0 || (pLocalFile->FileSize >> 32))
+        return;
+
+    // Allocate buffer for the sample
+    dwSectorCount = (DWORD)((pLocalFile->FileSize - 1) / ha->dwSectorSize) + 1;
+    dwSampleCount = STORMLIB_MIN(dwSectorCount, MAX_POLICY_SAMPLE_SECTORS);
+    pbSample = STORM_ALLOC(BYTE, ha->dwSectorSize * dwSampleCount);
+    if(pbSample == NULL)
+        return;
+
+    // Load the sample sectors
+    for(i = 0; i < dwSampleCount; i++)
+    {
+        dwSectorIndex = (dwSampleCount > 1) ? (i * (dwSectorCount - 1)) / (dwSampleCount - 1) : 0;
+        ByteOffset = (ULONGLONG)dwSectorIndex * ha->dwSectorSize;
+        cbSector = (DWORD)STORMLIB_MIN(pLocalFile->FileSize - ByteOffset, ha->dwSectorSize);
+
+        if(pLocalFile->pStream != NULL)
+        {
+            if(!FileStream_Read(pLocalFile->pStream, &ByteOffset, pbSample + cbSample, cbSector))
+                break;
+        }
+        else
+        {
+            memcpy(pbSample + cbSample, pLocalFile->pbFileData + ByteOffset, cbSector);
+        }
+
+        cbSample += cbSector;
+    }
+
+    // Let the policy choose the compression
+    if(i == dwSampleCount)
+    {
+        dwCompression = ha->pfnCompressionCB(ha->pvCompressionUserData, szArchivedName, pbSample, cbSample, ha->dwSectorSize);
+        if(dwCompression == 0)
+            *pdwFlags &= ~MPQ_FILE_COMPRESS_MASK;
+        else
+            *pdwCompression = *pdwCompressionNext = dwCompression;
+    }
+
+    STORM_FREE(pbSample);
+}
+
+// Updates the statistics of added files. The decompression time is estimated
+// from the compression of the first sector and of the next sectors
+static void UpdateCompressionStats(TMPQArchive * ha, TFileEntry * pFileEntry, DWORD dwCompression, DWORD dwCompressionNext)
+{
+    ULONGLONG FirstBytes = pFileEntry->dwFileSize;
+    ULONGLONG NextBytes = 0;
+
+    ha->AddedFileBytes += pFileEntry->dwFileSize;
+    ha->AddedRawBytes += pFileEntry->dwCmpSize;
+    ha->dwAddedFiles++;
+
+    if(pFileEntry->dwFlags & MPQ_FILE_COMPRESS)
+    {
+        if((pFileEntry->dwFlags & MPQ_FILE_SINGLE_UNIT) == 0 && FirstBytes > ha->dwSectorSize)
+        {
+            NextBytes = FirstBytes - ha->dwSectorSize;
+            FirstBytes = ha->dwSectorSize;
+        }
+
+        ha->AddedDecodeCost += FirstBytes * GetDecodeCost(dwCompression) + NextBytes * GetDecodeCost(dwCompressionNext);
+    }
+    else if(pFileEntry->dwFlags & MPQ_FILE_IMPLODE)
+    {
+        ha->AddedDecodeCost += FirstBytes * GetDecodeCost(MPQ_COMPRESSION_PKWARE);
+    }
+    else
+    {
+        ha->dwAddedStoredFiles++;
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Adds a file to the archive 
 
-bool WINAPI SFileAddFileEx(
+// Resolves the compression of the first and next sectors. The first data block
+// of the file decides whether the file can be compressed by ADPCM.
+static void ResolveAddFileCompression(
+    LPBYTE pbFirstBlock,
+    DWORD cbFirstBlock,
+    LPDWORD pdwCompression,
+    LPDWORD pdwCompressionNext)
+{
+    DWORD dwCompression = *pdwCompression;
+    DWORD dwCompressionNext = *pdwCompressionNext;
+    DWORD dwChannels = 0;
+
+    // When the compression for next blocks is set to default,
+    // we will copy the compression for the first sector
+    if(dwCompressionNext == MPQ_COMPRESSION_NEXT_SAME)
+        dwCompressionNext = dwCompression;
+    
+    // If the caller wants ADPCM compression, we make sure
+    // that the first sector is not compressed with lossy compression
+    if(dwCompressionNext & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
+    {
+        // The compression of the first file sector must not be ADPCM
+        // in order not to corrupt the headers
+        if(dwCompression & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
+            dwCompression = MPQ_COMPRESSION_PKWARE;
+        
+        // Remove both flag mono and stereo flags.
+        // They will be re-added according to WAVE type
+        dwCompressionNext &= ~(MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO);
+
+        // The file must really be a WAVE file with at least 16 bits per sample,
+        // otherwise the ADPCM compression will corrupt it
+        if(IsWaveFile_16BitsPerAdpcmSample(pbFirstBlock, cbFirstBlock, &dwChannels))
+        {
+            // Setup the compression of next sectors according to number of channels
+            dwCompressionNext |= (dwChannels == 1) ? MPQ_COMPRESSION_ADPCM_MONO : MPQ_COMPRESSION_ADPCM_STEREO;
+        }
+        else
+        {
+            // Setup the compression of next sectors to a lossless compression
+            dwCompressionNext = (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? MPQ_COMPRESSION_PKWARE : dwCompression;
+        }
+    }
+
+    *pdwCompression = dwCompression;
+    *pdwCompressionNext = dwCompressionNext;
+}
+
+// Adds a local file to the archive. The file data are either read from the file stream,
+// or they have been loaded to memory by SFileAddFiles.
+static int AddLocalFile(
     HANDLE hMpq,
-    const TCHAR * szFileName,
+    TMPQLocalFile * pLocalFile,
     const char * szArchivedName,
     DWORD dwFlags,
-    DWORD dwCompression,            // Compression of the first sector
-    DWORD dwCompressionNext)        // Compression of next sectors
+    DWORD dwCompression,
+    DWORD dwCompressionNext)
 {
-    ULONGLONG FileSize = 0;
-    ULONGLONG FileTime = 0;
-    TFileStream * pStream = NULL;
+    TFileEntry * pFileEntry = NULL;
+    ULONGLONG ByteOffset = 0;
     HANDLE hMpqFile = NULL;
     LPBYTE pbFileData = NULL;
+    DWORD dwFirstCompression = dwCompression;
     DWORD dwBytesRemaining = 0;
     DWORD dwBytesToRead;
-    DWORD dwSectorSize = 0x1000;
-    DWORD dwChannels = 0;
-    bool bIsAdpcmCompression = false;
     bool bIsFirstSector = true;
     int nError = ERROR_SUCCESS;
 
-    // Check parameters
-    if(hMpq == NULL || szFileName == NULL || *szFileName == 0)
-    {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        return false;
-    }
-
-    // Open added file
-    pStream = FileStream_OpenFile(szFileName, STREAM_FLAG_READ_ONLY | STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
-    if(pStream == NULL)
-        return false;
-
     // Files bigger than 4GB cannot be added to MPQ
-    FileStream_GetTime(pStream, &FileTime);
-    FileStream_GetSize(pStream, &FileSize);
-    if(FileSize >> 32)
+    if(pLocalFile->FileSize >> 32)
         nError = ERROR_DISK_FULL;
 
     // Allocate data buffer for reading from the source file
     if(nError == ERROR_SUCCESS)
     {
-        dwBytesRemaining = (DWORD)FileSize;
-        pbFileData = STORM_ALLOC(BYTE, dwSectorSize);
-        if(pbFileData == NULL)
-            nError = ERROR_NOT_ENOUGH_MEMORY;
+        dwBytesRemaining = (DWORD)pLocalFile->FileSize;
+        pbFileData = pLocalFile->pbFileData;
+        if(pLocalFile->pStream != NULL)
+        {
+            pbFileData = STORM_ALLOC(BYTE, ADD_FILE_BLOCK_SIZE);
+            if(pbFileData == NULL)
+                nError = ERROR_NOT_ENOUGH_MEMORY;
+        }
     }
 
-    // Deal with various combination of compressions
+    // Initiate adding file to the MPQ
     if(nError == ERROR_SUCCESS)
     {
-        // When the compression for next blocks is set to default,
-        // we will copy the compression for the first sector
-        if(dwCompressionNext == MPQ_COMPRESSION_NEXT_SAME)
-            dwCompressionNext = dwCompression;
-        
-        // If the caller wants ADPCM compression, we make sure
-        // that the first sector is not compressed with lossy compression
-        if(dwCompressionNext & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
+        if(SFileCreateFile(hMpq, szArchivedName, pLocalFile->FileTime, (DWORD)pLocalFile->FileSize, lcFileLocale, dwFlags, &hMpqFile))
         {
-            // The compression of the first file sector must not be ADPCM
-            // in order not to corrupt the headers
-            if(dwCompression & (MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO))
-                dwCompression = MPQ_COMPRESSION_PKWARE;
-            
-            // Remove both flag mono and stereo flags.
-            // They will be re-added according to WAVE type
-            dwCompressionNext &= ~(MPQ_COMPRESSION_ADPCM_MONO | MPQ_COMPRESSION_ADPCM_STEREO);
-            bIsAdpcmCompression = true;
+            ((TMPQFile *)hMpqFile)->pCompressedSectors = pLocalFile->pSectors;
+            ((TMPQFile *)hMpqFile)->dwCompressedSectors = pLocalFile->dwSectorCount;
+            pFileEntry = ((TMPQFile *)hMpqFile)->pFileEntry;
         }
-
-        // Initiate adding file to the MPQ
-        if(!SFileCreateFile(hMpq, szArchivedName, FileTime, (DWORD)FileSize, lcFileLocale, dwFlags, &hMpqFile))
+        else
             nError = GetLastError();
     }
 
@@ -959,32 +1185,22 @@ bool WINAPI SFileAddFileEx(
     {
         // Get the number of bytes remaining in the source file
         dwBytesToRead = dwBytesRemaining;
-        if(dwBytesToRead > dwSectorSize)
-            dwBytesToRead = dwSectorSize;
+        if(dwBytesToRead > ADD_FILE_BLOCK_SIZE)
+            dwBytesToRead = ADD_FILE_BLOCK_SIZE;
 
-        // Read data from the local file
-        if(!FileStream_Read(pStream, NULL, pbFileData, dwBytesToRead))
+        // Read data from the local file. The position is given explicitly,
+        // because the compression policy may have read from the file
+        if(pLocalFile->pStream != NULL && !FileStream_Read(pLocalFile->pStream, &ByteOffset, pbFileData, dwBytesToRead))
         {
             nError = GetLastError();
             break;
         }
 
-        // If the file being added is a WAVE file, we check number of channels
-        if(bIsFirstSector && bIsAdpcmCompression)
+        // The first data block decides about the compression of next sectors
+        if(bIsFirstSector)
         {
-            // The file must really be a WAVE file with at least 16 bits per sample,
-            // otherwise the ADPCM compression will corrupt it
-            if(IsWaveFile_16BitsPerAdpcmSample(pbFileData, dwBytesToRead, &dwChannels))
-            {
-                // Setup the compression of next sectors according to number of channels
-                dwCompressionNext |= (dwChannels == 1) ? MPQ_COMPRESSION_ADPCM_MONO : MPQ_COMPRESSION_ADPCM_STEREO;
-            }
-            else
-            {
-                // Setup the compression of next sectors to a lossless compression
-                dwCompressionNext = (dwCompression & MPQ_LOSSY_COMPRESSION_MASK) ? MPQ_COMPRESSION_PKWARE : dwCompression;
-            }
-
+            ResolveAddFileCompression(pbFileData, dwBytesToRead, &dwCompression, &dwCompressionNext);
+            dwFirstCompression = dwCompression;
             bIsFirstSector = false;
         }
 
@@ -998,6 +1214,11 @@ bool WINAPI SFileAddFileEx(
         // Set the next data compression
         dwBytesRemaining -= dwBytesToRead;
         dwCompression = dwCompressionNext;
+
+        // Move to the next block of the file data
+        if(pLocalFile->pStream == NULL)
+            pbFileData += dwBytesToRead;
+        ByteOffset += dwBytesToRead;
     }
 
     // Finish the file writing
@@ -1007,11 +1228,49 @@ bool WINAPI SFileAddFileEx(
             nError = GetLastError();
     }
 
+    // Update the statistics of added files
+    if(nError == ERROR_SUCCESS && pFileEntry != NULL)
+        UpdateCompressionStats((TMPQArchive *)hMpq, pFileEntry, dwFirstCompression, dwCompressionNext);
+
     // Cleanup and exit
-    if(pbFileData != NULL)
+    if(pLocalFile->pStream != NULL && pbFileData != NULL)
         STORM_FREE(pbFileData);
-    if(pStream != NULL)
-        FileStream_Close(pStream);
+    return nError;
+}
+
+bool WINAPI SFileAddFileEx(
+    HANDLE hMpq,
+    const TCHAR * szFileName,
+    const char * szArchivedName,
+    DWORD dwFlags,
+    DWORD dwCompression,            // Compression of the first sector
+    DWORD dwCompressionNext)        // Compression of next sectors
+{
+    TMPQLocalFile LocalFile;
+    int nError;
+
+    // Check parameters
+    if(hMpq == NULL || szFileName == NULL || *szFileName == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Open added file
+    memset(&LocalFile, 0, sizeof(TMPQLocalFile));
+    LocalFile.pStream = FileStream_OpenFile(szFileName, STREAM_FLAG_READ_ONLY | STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+    if(LocalFile.pStream == NULL)
+        return false;
+
+    // Add the file
+    FileStream_GetTime(LocalFile.pStream, &LocalFile.FileTime);
+    FileStream_GetSize(LocalFile.pStream, &LocalFile.FileSize);
+    if(IsValidMpqHandle(hMpq))
+        ApplyCompressionPolicy((TMPQArchive *)hMpq, szArchivedName, &LocalFile, &dwFlags, &dwCompression, &dwCompressionNext);
+    nError = AddLocalFile(hMpq, &LocalFile, szArchivedName, dwFlags, dwCompression, dwCompressionNext);
+
+    // Cleanup and exit
+    FileStream_Close(LocalFile.pStream);
     if(nError != ERROR_SUCCESS)
         SetLastError(nError);
     return (nError == ERROR_SUCCESS);
@@ -1072,6 +1331,424 @@ bool WINAPI SFileAddWave(HANDLE hMpq, const TCHAR * szFileName, const char * szA
                           dwCompression);           // Next sectors should be compressed as WAVE
 }
 
+//-----------------------------------------------------------------------------
+// Adds multiple files to the archive on multiple threads
+//
+// The workers load the local files to memory and compress their sectors in parallel.
+// The files are then added to the MPQ in the given order by whichever worker finds
+// the next file ready, using the same code like SFileAddFileEx. Sectors compressed
+// in advance are taken instead of compressing them again, so the MPQ is exactly
+// the same like if the files were added one by one.
+
+// Maximum size of file data held in memory. Each loaded file takes twice its size
+// (file data and compressed sectors). Files bigger than 1/8 of this are added
+// the same way like SFileAddFileEx does.
+#define MPQ_ADD_FILES_BUFFER_SIZE       0x8000000
+#define MPQ_ADD_FILES_MAX_FILE_SIZE     (MPQ_ADD_FILES_BUFFER_SIZE / 8)
+
+// Number of sectors compressed by a worker at once
+#define MPQ_ADD_FILES_SECTORS_PER_TASK  0x10
+
+#define ADD_FILE_WAITING                0   // The local file hasn't been opened yet
+#define ADD_FILE_OPENING                1   // A worker is opening the local file
+#define ADD_FILE_OPENED                 2   // The local file is open and waits for memory
+#define ADD_FILE_LOADING                3   // A worker is loading the file data
+#define ADD_FILE_LOADED                 4   // The file data are loaded, the sectors are being compressed
+#define ADD_FILE_READY                  5   // The file can be added to the MPQ
+
+typedef struct _TMPQAddFileItem
+{
+    PSFILE_ADD_FILE pAddFile;                   // The file, as given by the caller
+    TMPQLocalFile LocalFile;                    // The local file loaded to memory
+    LPBYTE pbCompressed;                        // Buffer for the compressed sectors
+    DWORD dwFlags;                              // File flags, as chosen by the compression policy
+    DWORD dwCompression;                        // Compression of the first sector, as chosen by the compression policy
+    DWORD dwCompressionNext;                    // Compression of next sectors, as chosen by the compression policy
+    DWORD dwSectorSize;                         // Size of one file sector
+    DWORD dwNextSector;                         // Index of the next sector to be compressed by a worker
+    DWORD dwSectorsPending;                     // Number of sectors not compressed yet
+    DWORD cbMemory;                             // Memory taken by the loaded file
+    DWORD dwState;                              // ADD_FILE_XXX
+} TMPQAddFileItem;
+
+typedef struct _TMPQAddFilesJob
+{
+    HANDLE hMpq;                                // The archive the files are added to
+    TMPQAddFileItem * pItems;                   // Files to add, in the order given by the caller
+    DWORD dwItemCount;                          // Number of files in pItems
+    DWORD dwValidFlags;                         // File flags allowed in the MPQ
+    DWORD dwSectorSize;                         // Default size of one file sector in the MPQ
+    DWORD dwNextLoad;                           // Index of the next file to be loaded
+    DWORD dwNextAdd;                            // Index of the next file to be added to the MPQ
+    DWORD dwLoading;                            // Number of files being opened or loaded
+    DWORD cbInFlight;                           // Memory taken by the loaded files
+    bool bAdding;                               // If true, a worker is adding a file to the MPQ
+    STORM_LOCK Lock;                            // Protects all members above
+    STORM_COND Changed;                         // Signalled when a worker finishes its task
+} TMPQAddFilesJob;
+
+// Opens the local file. Returns true if the file should be loaded to memory.
+// Otherwise, the file is added the same way like SFileAddFileEx does.
+static bool OpenAddedFile(TMPQAddFileItem * pItem)
+{
+    TMPQLocalFile * pLocalFile = &pItem->LocalFile;
+
+    // Open the local file. If that fails, SFileAddFileEx will fail the same way
+    if(pItem->pAddFile->szFileName == NULL || pItem->pAddFile->szFileName[0] == 0)
+        return false;
+    pLocalFile->pStream = FileStream_OpenFile(pItem->pAddFile->szFileName, STREAM_FLAG_READ_ONLY | STREAM_PROVIDER_FLAT | BASE_PROVIDER_FILE);
+    if(pLocalFile->pStream == NULL)
+        return false;
+
+    // Empty files and files too big for the memory are not loaded
+    FileStream_GetTime(pLocalFile->pStream, &pLocalFile->FileTime);
+    FileStream_GetSize(pLocalFile->pStream, &pLocalFile->FileSize);
+    if(pLocalFile->FileSize == 0 || pLocalFile->FileSize > MPQ_ADD_FILES_MAX_FILE_SIZE)
+    {
+        FileStream_Close(pLocalFile->pStream);
+        pLocalFile->pStream = NULL;
+        return false;
+    }
+
+    pItem->cbMemory = (DWORD)pLocalFile->FileSize * 2;
+    return true;
+}
+
+// Loads the local file to memory and prepares its sectors for compression.
+// Returns the number of sectors to compress.
+static DWORD LoadAddedFile(TMPQAddFilesJob * pJob, TMPQAddFileItem * pItem)
+{
+    TMPQCompressedSector * pSectors;
+    TMPQLocalFile * pLocalFile = &pItem->LocalFile;
+    DWORD dwCompression;
+    DWORD dwCompressionNext;
+    DWORD dwFlags;
+    DWORD cbFileData = (DWORD)pLocalFile->FileSize;
+    DWORD dwSectorCount;
+    DWORD dwSectorEnd;
+
+    // Load the entire file. If that fails, the file is added by SFileAddFileEx
+    pLocalFile->pbFileData = STORM_ALLOC(BYTE, cbFileData);
+    if(pLocalFile->pbFileData != NULL && !FileStream_Read(pLocalFile->pStream, NULL, pLocalFile->pbFileData, cbFileData))
+    {
+        STORM_FREE(pLocalFile->pbFileData);
+        pLocalFile->pbFileData = NULL;
+    }
+    FileStream_Close(pLocalFile->pStream);
+    pLocalFile->pStream = NULL;
+
+    if(pLocalFile->pbFileData == NULL)
+        return 0;
+
+    // Let the compression policy choose the compression
+    pItem->dwFlags = pItem->pAddFile->dwFlags;
+    pItem->dwCompression = pItem->pAddFile->dwCompression;
+    pItem->dwCompressionNext = pItem->pAddFile->dwCompressionNext;
+    ApplyCompressionPolicy((TMPQArchive *)pJob->hMpq, pItem->pAddFile->szArchivedName, pLocalFile, &pItem->dwFlags, &pItem->dwCompression, &pItem->dwCompressionNext);
+    dwCompression = pItem->dwCompression;
+    dwCompressionNext = pItem->dwCompressionNext;
+
+    // Only compressed files have sectors to compress
+    dwFlags = pItem->dwFlags & pJob->dwValidFlags & MPQ_FILE_COMPRESS_MASK;
+    if(dwFlags != MPQ_FILE_IMPLODE && dwFlags != MPQ_FILE_COMPRESS)
+        return 0;
+
+    // The sectors are the same like AllocateSectorBuffer will make them
+    pItem->dwSectorSize = (pItem->dwFlags & MPQ_FILE_SINGLE_UNIT) ? cbFileData : pJob->dwSectorSize;
+    dwSectorCount = ((cbFileData - 1) / pItem->dwSectorSize) + 1;
+
+    // Allocate the sectors and the buffer for the compressed data.
+    // If that fails, the sectors will be compressed when the file is added
+    pSectors = STORM_ALLOC(TMPQCompressedSector, dwSectorCount);
+    pItem->pbCompressed = STORM_ALLOC(BYTE, cbFileData);
+    if(pSectors == NULL || pItem->pbCompressed == NULL)
+    {
+        if(pItem->pbCompressed != NULL)
+            STORM_FREE(pItem->pbCompressed);
+        if(pSectors != NULL)
+            STORM_FREE(pSectors);
+        pItem->pbCompressed = NULL;
+        return 0;
+    }
+    memset(pSectors, 0, sizeof(TMPQCompressedSector) * dwSectorCount);
+
+    // Each sector is compressed by the compression given to the SFileWriteFile call
+    // that fills the sector. The first sector is always compressed by the first compression.
+    ResolveAddFileCompression(pLocalFile->pbFileData, STORMLIB_MIN(cbFileData, ADD_FILE_BLOCK_SIZE), &dwCompression, &dwCompressionNext);
+    for(DWORD i = 0; i < dwSectorCount; i++)
+    {
+        dwSectorEnd = STORMLIB_MIN((i + 1) * pItem->dwSectorSize, cbFileData);
+        pSectors[i].cbSector = dwSectorEnd - (i * pItem->dwSectorSize);
+        pSectors[i].dwFlags = dwFlags;
+        pSectors[i].dwCompression = (i == 0 || dwSectorEnd <= ADD_FILE_BLOCK_SIZE) ? dwCompression : dwCompressionNext;
+    }
+
+    pLocalFile->pSectors = pSectors;
+    pLocalFile->dwSectorCount = dwSectorCount;
+    return dwSectorCount;
+}
+
+static void CompressAddedFileSectors(TMPQAddFileItem * pItem, DWORD dwFirstSector, DWORD dwSectorCount)
+{
+    TMPQCompressedSector * pSector;
+    LPBYTE pbWorkBuffer;
+    DWORD cbCompressed;
+
+    // Like in WriteDataToMpqFile, the buffer is a bit longer than the sector,
+    // for case if the compression method performs a buffer overrun
+    pbWorkBuffer = STORM_ALLOC(BYTE, pItem->dwSectorSize + 0x100);
+    if(pbWorkBuffer == NULL)
+        return;
+
+    for(DWORD i = dwFirstSector; i < dwFirstSector + dwSectorCount; i++)
+    {
+        pSector = pItem->LocalFile.pSectors + i;
+        cbCompressed = (DWORD)CompressFileSector(pbWorkBuffer,
+                                                 pItem->LocalFile.pbFileData + (i * pItem->dwSectorSize),
+                                                 pSector->cbSector,
+                                                 pSector->dwFlags,
+                                                 pSector->dwCompression);
+
+        // Compressed sectors are never bigger than the original ones
+        if(cbCompressed <= pSector->cbSector)
+        {
+            pSector->pbCompressed = pItem->pbCompressed + (i * pItem->dwSectorSize);
+            pSector->cbCompressed = cbCompressed;
+            memcpy(pSector->pbCompressed, pbWorkBuffer, cbCompressed);
+        }
+    }
+
+    STORM_FREE(pbWorkBuffer);
+}
+
+// Adds one file to the MPQ and frees its data. Only called by one worker at once.
+static void AddLoadedFile(TMPQAddFilesJob * pJob, TMPQAddFileItem * pItem)
+{
+    TMPQLocalFile * pLocalFile = &pItem->LocalFile;
+    PSFILE_ADD_FILE pAddFile = pItem->pAddFile;
+
+    // Files that have not been loaded are added the usual way
+    if(pLocalFile->pbFileData != NULL)
+    {
+        pAddFile->dwErrorCode = AddLocalFile(pJob->hMpq,
+                                             pLocalFile,
+                                             pAddFile->szArchivedName,
+                                             pItem->dwFlags,
+                                             pItem->dwCompression,
+                                             pItem->dwCompressionNext);
+    }
+    else
+    {
+        pAddFile->dwErrorCode = SFileAddFileEx(pJob->hMpq,
+                                               pAddFile->szFileName,
+                                               pAddFile->szArchivedName,
+                                               pAddFile->dwFlags,
+                                               pAddFile->dwCompression,
+                                               pAddFile->dwCompressionNext) ? ERROR_SUCCESS : GetLastError();
+    }
+
+    // Free the file data
+    if(pLocalFile->pbFileData != NULL)
+        STORM_FREE(pLocalFile->pbFileData);
+    if(pLocalFile->pSectors != NULL)
+        STORM_FREE(pLocalFile->pSectors);
+    if(pItem->pbCompressed != NULL)
+        STORM_FREE(pItem->pbCompressed);
+    pLocalFile->pbFileData = NULL;
+    pLocalFile->pSectors = NULL;
+    pItem->pbCompressed = NULL;
+}
+
+static void AddFilesWorker(void * pvContext)
+{
+    TMPQAddFilesJob * pJob = (TMPQAddFilesJob *)pvContext;
+    TMPQAddFileItem * pItem;
+    DWORD dwFirstSector;
+    DWORD dwSectorCount;
+    DWORD i;
+
+    StormLock(&pJob->Lock);
+    while(pJob->dwNextAdd < pJob->dwItemCount)
+    {
+        // Adding goes first, because it frees the memory for loading more files
+        pItem = pJob->pItems + pJob->dwNextAdd;
+        if(pJob->bAdding == false && pItem->dwState == ADD_FILE_READY)
+        {
+            pJob->bAdding = true;
+            StormUnlock(&pJob->Lock);
+
+            AddLoadedFile(pJob, pItem);
+
+            StormLock(&pJob->Lock);
+            pJob->cbInFlight -= pItem->cbMemory;
+            pJob->dwNextAdd++;
+            pJob->bAdding = false;
+            StormWakeAll(&pJob->Changed);
+            continue;
+        }
+
+        // Compress sectors of the loaded files, earlier files first
+        for(i = pJob->dwNextAdd; i < pJob->dwNextLoad; i++)
+        {
+            pItem = pJob->pItems + i;
+            if(pItem->dwState == ADD_FILE_LOADED && pItem->dwNextSector < pItem->LocalFile.dwSectorCount)
+                break;
+        }
+
+        if(i < pJob->dwNextLoad)
+        {
+            dwFirstSector = pItem->dwNextSector;
+            dwSectorCount = STORMLIB_MIN(pItem->LocalFile.dwSectorCount - dwFirstSector, MPQ_ADD_FILES_SECTORS_PER_TASK);
+            pItem->dwNextSector += dwSectorCount;
+            StormUnlock(&pJob->Lock);
+
+            CompressAddedFileSectors(pItem, dwFirstSector, dwSectorCount);
+
+            StormLock(&pJob->Lock);
+            pItem->dwSectorsPending -= dwSectorCount;
+            if(pItem->dwSectorsPending == 0)
+            {
+                pItem->dwState = ADD_FILE_READY;
+                StormWakeAll(&pJob->Changed);
+            }
+            continue;
+        }
+
+        // Open the next file
+        pItem = pJob->pItems + pJob->dwNextLoad;
+        if(pJob->dwNextLoad < pJob->dwItemCount && pItem->dwState == ADD_FILE_WAITING)
+        {
+            pItem->dwState = ADD_FILE_OPENING;
+            pJob->dwLoading++;
+            StormUnlock(&pJob->Lock);
+
+            bool bLoadFile = OpenAddedFile(pItem);
+
+            StormLock(&pJob->Lock);
+            pJob->dwLoading--;
+            if(bLoadFile == false)
+            {
+                pItem->dwState = ADD_FILE_READY;
+                pJob->dwNextLoad++;
+            }
+            else
+                pItem->dwState = ADD_FILE_OPENED;
+            StormWakeAll(&pJob->Changed);
+            continue;
+        }
+
+        // Load the next file if there is enough memory for it.
+        // If cbInFlight is nonzero, the memory will be freed by adding the loaded files.
+        if(pJob->dwNextLoad < pJob->dwItemCount && pItem->dwState == ADD_FILE_OPENED)
+        {
+            if(pJob->cbInFlight == 0 || (pJob->cbInFlight + pItem->cbMemory) <= MPQ_ADD_FILES_BUFFER_SIZE)
+            {
+                pItem->dwState = ADD_FILE_LOADING;
+                pJob->cbInFlight += pItem->cbMemory;
+                pJob->dwNextLoad++;
+                pJob->dwLoading++;
+                StormUnlock(&pJob->Lock);
+
+                dwSectorCount = LoadAddedFile(pJob, pItem);
+
+                StormLock(&pJob->Lock);
+                pJob->dwLoading--;
+                pItem->dwSectorsPending = dwSectorCount;
+                pItem->dwState = (dwSectorCount != 0) ? ADD_FILE_LOADED : ADD_FILE_READY;
+                StormWakeAll(&pJob->Changed);
+                continue;
+            }
+        }
+
+        // Nothing to do now. If all files have been loaded, the workers
+        // that are still busy will do the rest of the work.
+        if(pJob->dwNextLoad >= pJob->dwItemCount && pJob->dwLoading == 0)
+            break;
+
+        // Otherwise, wait until another worker finishes its task
+        StormWaitCond(&pJob->Changed, &pJob->Lock);
+    }
+    StormUnlock(&pJob->Lock);
+}
+
+// Adds multiple files to the archive. The result is the same like calling SFileAddFileEx
+// for each file, but the files are loaded and compressed on multiple threads.
+bool WINAPI SFileAddFiles(HANDLE hMpq, PSFILE_ADD_FILE pAddFiles, DWORD dwFileCount)
+{
+    TMPQAddFilesJob Job;
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+    DWORD dwWorkerCount = StormGetWorkerCount();
+    int nError = ERROR_SUCCESS;
+
+    // Check parameters
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+    if(pAddFiles == NULL && dwFileCount != 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    // Prepare the job
+    memset(&Job, 0, sizeof(TMPQAddFilesJob));
+    if(dwWorkerCount > 1 && dwFileCount != 0)
+    {
+        Job.pItems = STORM_ALLOC(TMPQAddFileItem, dwFileCount);
+        if(Job.pItems != NULL)
+        {
+            memset(Job.pItems, 0, sizeof(TMPQAddFileItem) * dwFileCount);
+            for(DWORD i = 0; i < dwFileCount; i++)
+                Job.pItems[i].pAddFile = pAddFiles + i;
+        }
+    }
+
+    // Add the files on all CPUs
+    if(Job.pItems != NULL)
+    {
+        Job.hMpq = hMpq;
+        Job.dwItemCount = dwFileCount;
+        Job.dwValidFlags = (ha->dwFlags & MPQ_FLAG_WAR3_MAP) ? MPQ_FILE_VALID_FLAGS_W3X : MPQ_FILE_VALID_FLAGS;
+        Job.dwSectorSize = ha->dwSectorSize;
+
+        StormInitLock(&Job.Lock);
+        StormInitCond(&Job.Changed);
+        StormRunWorkers(AddFilesWorker, &Job, dwWorkerCount);
+        StormFreeCond(&Job.Changed);
+        StormFreeLock(&Job.Lock);
+        STORM_FREE(Job.pItems);
+    }
+    else
+    {
+        // Add the files one by one
+        for(DWORD i = 0; i < dwFileCount; i++)
+        {
+            pAddFiles[i].dwErrorCode = SFileAddFileEx(hMpq,
+                                                      pAddFiles[i].szFileName,
+                                                      pAddFiles[i].szArchivedName,
+                                                      pAddFiles[i].dwFlags,
+                                                      pAddFiles[i].dwCompression,
+                                                      pAddFiles[i].dwCompressionNext) ? ERROR_SUCCESS : GetLastError();
+        }
+    }
+
+    // Report the first error, if any
+    for(DWORD i = 0; i < dwFileCount; i++)
+    {
+        if(pAddFiles[i].dwErrorCode != ERROR_SUCCESS)
+        {
+            nError = pAddFiles[i].dwErrorCode;
+            break;
+        }
+    }
+
+    if(nError != ERROR_SUCCESS)
+        SetLastError(nError);
+    return (nError == ERROR_SUCCESS);
+}
+
 //-----------------------------------------------------------------------------
 // bool SFileRemoveFile(HANDLE hMpq, char * szFileName)
 //
@@ -1310,3 +1987,133 @@ bool WINAPI SFileSetAddFileCallback(HANDLE hMpq, SFILE_ADDFILE_CALLBACK AddFileC
     ha->pfnAddFileCB = AddFileCB;
     return true;
 }
+
+//-----------------------------------------------------------------------------
+// Sets the compression policy
+//
+// The policy is called by SFileAddFileEx and SFileAddFiles for each compressed
+// file. It gets a sample of the file data and returns the compression to use.
+// Note that SFileAddFiles may call the policy from multiple threads at once.
+
+bool WINAPI SFileSetCompressionPolicy(HANDLE hMpq, SFILE_COMPRESSION_POLICY CompressionCB, void * pvUserData)
+{
+    TMPQArchive * ha = (TMPQArchive *) hMpq;
+
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    ha->pvCompressionUserData = pvUserData;
+    ha->pfnCompressionCB = CompressionCB;
+    return true;
+}
+
+bool WINAPI SFileGetCompressionStats(HANDLE hMpq, PSFILE_COMPRESSION_STATS pStats)
+{
+    TMPQArchive * ha = (TMPQArchive *) hMpq;
+
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    if(pStats == NULL)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+
+    pStats->dwFileCount = ha->dwAddedFiles;
+    pStats->dwStoredCount = ha->dwAddedStoredFiles;
+    pStats->FileBytes = ha->AddedFileBytes;
+    pStats->RawBytes = ha->AddedRawBytes;
+    pStats->dwRatio = (ha->AddedFileBytes != 0) ? (DWORD)((ha->AddedRawBytes * 100) / ha->AddedFileBytes) : 0;
+    pStats->dwDecodeCost = (DWORD)STORMLIB_MIN(ha->AddedDecodeCost / 0x400, 0xFFFFFFFF);
+    return true;
+}
+
+// Built-in compression policy. Compresses the sample by each candidate compression,
+// and takes the one that gives the smallest data. If another candidate gives data
+// that are only a bit bigger and decompresses faster, that one is taken instead.
+// Already compressed data (e.g. BLP or OGG) that don't shrink enough are stored.
+DWORD WINAPI SFileAutoCompression(void * pvUserData, const char * szArchivedName, LPBYTE pbSample, DWORD cbSample, DWORD dwSectorSize)
+{
+    PSFILE_AUTO_COMPRESSION pSettings = (PSFILE_AUTO_COMPRESSION)pvUserData;
+    LPBYTE pbCompressed;
+    DWORD SampleSizes[SFILE_AUTO_COMPRESSION_CANDIDATES];
+    DWORD dwCompression = 0;
+    DWORD dwBestCost = 0xFFFFFFFF;
+    DWORD dwMinSaving;
+    DWORD cbSmallest = 0xFFFFFFFF;
+    DWORD cbCompressed;
+    DWORD cbSector;
+    DWORD dwOffset;
+    int nOutBuffer;
+
+    // Keep compilers happy
+    STORMLIB_UNUSED(szArchivedName);
+
+    // Use the default settings, if none given
+    if(pSettings == NULL)
+        pSettings = &DefaultAutoCompression;
+    if(pbSample == NULL || cbSample == 0 || dwSectorSize == 0)
+        return pSettings->dwCandidates[0];
+
+    // Like in WriteDataToMpqFile, the buffer is a bit longer than the sector,
+    // for case if the compression method performs a buffer overrun
+    pbCompressed = STORM_ALLOC(BYTE, dwSectorSize + 0x100);
+    if(pbCompressed == NULL)
+        return pSettings->dwCandidates[0];
+
+    // Compress the sample by each candidate, sector by sector
+    for(DWORD i = 0; i < SFILE_AUTO_COMPRESSION_CANDIDATES; i++)
+    {
+        SampleSizes[i] = 0xFFFFFFFF;
+        if(pSettings->dwCandidates[i] == 0)
+            break;
+
+        // Skip candidates that decompress too slowly
+        if(pSettings->dwMaxDecodeCost != 0 && GetDecodeCost(pSettings->dwCandidates[i]) > pSettings->dwMaxDecodeCost)
+            continue;
+
+        for(dwOffset = 0, cbCompressed = 0; dwOffset < cbSample; dwOffset += cbSector)
+        {
+            cbSector = STORMLIB_MIN(cbSample - dwOffset, dwSectorSize);
+            nOutBuffer = (int)cbSector;
+            if(!SCompCompress(pbCompressed, &nOutBuffer, pbSample + dwOffset, (int)cbSector, (unsigned)pSettings->dwCandidates[i], 0, -1))
+                break;
+            cbCompressed += nOutBuffer;
+        }
+
+        // Remember the size, unless the compression failed
+        if(dwOffset >= cbSample)
+        {
+            cbSmallest = STORMLIB_MIN(cbSmallest, cbCompressed);
+            SampleSizes[i] = cbCompressed;
+        }
+    }
+
+    // If the best candidate doesn't save enough, the file is stored. Otherwise,
+    // take the fastest candidate whose size is within the tolerance of the best one
+    dwMinSaving = STORMLIB_MIN(pSettings->dwMinSaving, 100);
+    if(cbSmallest != 0xFFFFFFFF && ((ULONGLONG)cbSmallest * 100) <= ((ULONGLONG)cbSample * (100 - dwMinSaving)))
+    {
+        for(DWORD i = 0; i < SFILE_AUTO_COMPRESSION_CANDIDATES && pSettings->dwCandidates[i] != 0; i++)
+        {
+            if(SampleSizes[i] != 0xFFFFFFFF && ((ULONGLONG)SampleSizes[i] * 100) <= ((ULONGLONG)cbSmallest * (100 + pSettings->dwTolerance)))
+            {
+                if(GetDecodeCost(pSettings->dwCandidates[i]) < dwBestCost)
+                {
+                    dwBestCost = GetDecodeCost(pSettings->dwCandidates[i]);
+                    dwCompression = pSettings->dwCandidates[i];
+                }
+            }
+        }
+    }
+
+    STORM_FREE(pbCompressed);
+    return dwCompression;
+}
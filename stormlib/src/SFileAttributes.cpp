@@ -465,6 +465,18 @@ int SAttrFileSaveToMpq(TMPQArchive * ha)
     return nError;
 }
 
+// Loads the (attributes) of an archive open with MPQ_OPEN_DEFER_LOAD
+void LoadDeferredAttributes(TMPQArchive * ha)
+{
+    if(ha->dwFlags & MPQ_FLAG_ATTRIBUTES_DEFERRED)
+    {
+        ha->dwFlags &= ~MPQ_FLAG_ATTRIBUTES_DEFERRED;
+
+        // Ignore result of the operation. (attributes) is optional.
+        SAttrLoadAttributes(ha);
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Public functions
 
@@ -479,6 +491,7 @@ DWORD WINAPI SFileGetAttributes(HANDLE hMpq)
         return SFILE_INVALID_ATTRIBUTES;
     }
 
+    LoadDeferredAttributes(ha);
     return ha->dwAttrFlags;
 }
 
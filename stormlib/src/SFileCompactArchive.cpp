@@ -18,6 +18,53 @@
 /* Local functions                                                           */
 /*****************************************************************************/
 
+// Maximum size of file data held in memory when the files are copied on multiple threads.
+// Files bigger than a quarter of this are copied directly to the new archive.
+#define MPQ_COMPACT_BUFFER_SIZE     0x4000000
+#define MPQ_COMPACT_MAX_FILE_SIZE   (MPQ_COMPACT_BUFFER_SIZE / 4)
+
+#define COMPACT_FILE_WAITING        0   // The file hasn't been taken by any worker yet
+#define COMPACT_FILE_COPYING        1   // A worker is copying the file to memory
+#define COMPACT_FILE_READY          2   // The file can be written to the new archive
+
+// Where CopyMpqFileSectors puts the file data. The serial copy writes them
+// directly to the new archive, the pipelined copy collects them in memory.
+typedef struct _TMPQCopyTarget
+{
+    TFileStream * pStream;                      // Stream of the new archive. NULL when copying to memory
+    LPBYTE pbBuffer;                            // Buffer for the file data
+    DWORD cbBuffer;                             // Size of the buffer
+    DWORD cbWritten;                            // Number of bytes stored in the buffer
+    DWORD dwProgress;                           // Compact progress, reported when the buffer is written
+} TMPQCopyTarget;
+
+// One file copied by the pipelined copy
+typedef struct _TMPQCompactFile
+{
+    TFileEntry * pFileEntry;                    // The file entry in the archive
+    ULONGLONG MpqFilePos;                       // Position of the file in the new archive
+    ULONGLONG cbFileData;                       // Number of bytes the file takes in the new archive
+    DWORD dwFileKey;                            // Decryption key of the file
+    DWORD dwState;                              // COMPACT_FILE_XXX
+    TMPQCopyTarget Target;                      // The file data copied to memory
+} TMPQCompactFile;
+
+typedef struct _TMPQCompactJob
+{
+    TMPQArchive * ha;                           // The archive being compacted
+    TFileStream * pNewStream;                   // Stream of the new archive
+    TMPQCompactFile * pFiles;                   // Files to copy, in the order of the file table
+    DWORD dwFileCount;                          // Number of files in pFiles
+    DWORD dwNextCopy;                           // Index of the next file to be taken by a worker
+    DWORD dwNextWrite;                          // Index of the next file to be written
+    DWORD cbInFlight;                           // Size of the file data held in memory
+    bool bWriting;                              // If true, a worker is writing to the new archive
+    int nError;                                 // The first error that occurred
+    STORM_LOCK Lock;                            // Protects all members above
+    STORM_COND Changed;                         // Signalled when a file is copied or written
+} TMPQCompactJob;
+
+
 static int CheckIfAllFilesKnown(TMPQArchive * ha)
 {
     TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
@@ -142,15 +189,71 @@ static int CopyNonMpqData(
     return nError;
 }
 
+// Writes the copied data to the target
+static int WriteCopyTarget(TMPQCopyTarget * pTarget, const void * pvData, DWORD cbData)
+{
+    // Serial copy: write the data to the new archive
+    if(pTarget->pStream != NULL)
+        return FileStream_Write(pTarget->pStream, NULL, pvData, cbData) ? ERROR_SUCCESS : GetLastError();
+
+    // Pipelined copy: the buffer has been allocated for the precalculated file size.
+    // If the data don't fit, the file is not laid out the way we thought.
+    if(cbData > (pTarget->cbBuffer - pTarget->cbWritten))
+        return ERROR_FILE_CORRUPT;
+
+    memcpy(pTarget->pbBuffer + pTarget->cbWritten, pvData, cbData);
+    pTarget->cbWritten += cbData;
+    return ERROR_SUCCESS;
+}
+
+// Writes the MD5s of the raw file data to the target
+static int WriteCopyTargetMD5(TMPQArchive * ha, TMPQCopyTarget * pTarget, ULONGLONG MpqFilePos, DWORD dwRawDataSize)
+{
+    DWORD dwChunkSize = ha->pHeader->dwRawChunkSize;
+    DWORD dwMd5ArraySize;
+    DWORD dwOffset;
+
+    // Serial copy: read the data back from the new archive
+    if(pTarget->pStream != NULL)
+        return WriteMpqDataMD5(pTarget->pStream, ha->MpqPos + MpqFilePos, dwRawDataSize, dwChunkSize);
+
+    // Pipelined copy: the raw data are at the begin of the buffer
+    dwMd5ArraySize = (((dwRawDataSize - 1) / dwChunkSize) + 1) * MD5_DIGEST_SIZE;
+    if(dwRawDataSize > pTarget->cbWritten || dwMd5ArraySize > (pTarget->cbBuffer - pTarget->cbWritten))
+        return ERROR_FILE_CORRUPT;
+
+    for(dwOffset = 0; dwOffset < dwRawDataSize; dwOffset += dwChunkSize)
+    {
+        CalculateDataBlockHash(pTarget->pbBuffer + dwOffset, STORMLIB_MIN(dwRawDataSize - dwOffset, dwChunkSize), pTarget->pbBuffer + pTarget->cbWritten);
+        pTarget->cbWritten += MD5_DIGEST_SIZE;
+    }
+    return ERROR_SUCCESS;
+}
+
+// Reports the compact progress. When copying to memory, the progress
+// is reported by the writer, after it has written the buffer.
+static void UpdateCompactProgress(TMPQArchive * ha, TMPQCopyTarget * pTarget, DWORD dwBytesCopied)
+{
+    if(pTarget->pStream == NULL)
+    {
+        pTarget->dwProgress += dwBytesCopied;
+    }
+    else if(ha->pfnCompactCB != NULL)
+    {
+        ha->CompactBytesProcessed += dwBytesCopied;
+        ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+    }
+}
+
 // Copies all file sectors into another archive.
 static int CopyMpqFileSectors(
     TMPQArchive * ha,
     TMPQFile * hf,
-    TFileStream * pNewStream,
+    TMPQCopyTarget * pTarget,
     ULONGLONG MpqFilePos)               // MPQ file position in the new archive
 {
     TFileEntry * pFileEntry = hf->pFileEntry;
-    ULONGLONG RawFilePos;               // Used for calculating sector offset in the old MPQ archive
+    ULONGLONG RawFilePos = 0;           // Used for calculating sector offset in the old MPQ archive
     DWORD dwBytesToCopy = pFileEntry->dwCmpSize;
     DWORD dwPatchSize = 0;              // Size of patch header
     DWORD dwFileKey1 = 0;               // File key used for decryption
@@ -174,8 +277,7 @@ static int CopyMpqFileSectors(
     if(nError == ERROR_SUCCESS && hf->pPatchInfo != NULL)
     {
         BSWAP_ARRAY32_UNSIGNED(hf->pPatchInfo, sizeof(DWORD) * 3);
-        if(!FileStream_Write(pNewStream, NULL, hf->pPatchInfo, hf->pPatchInfo->dwLength))
-            nError = GetLastError();
+        nError = WriteCopyTarget(pTarget, hf->pPatchInfo, hf->pPatchInfo->dwLength);
 
         // Save the size of the patch info
         dwPatchSize = hf->pPatchInfo->dwLength;
@@ -201,19 +303,14 @@ static int CopyMpqFileSectors(
                 EncryptMpqBlock(SectorOffsetsCopy, dwSectorOffsLen, dwFileKey2 - 1);
 
             BSWAP_ARRAY32_UNSIGNED(SectorOffsetsCopy, dwSectorOffsLen);
-            if(!FileStream_Write(pNewStream, NULL, SectorOffsetsCopy, dwSectorOffsLen))
-                nError = GetLastError();
+            nError = WriteCopyTarget(pTarget, SectorOffsetsCopy, dwSectorOffsLen);
 
             dwBytesToCopy -= dwSectorOffsLen;
             dwCmpSize += dwSectorOffsLen;
         }
 
         // Update compact progress
-        if(ha->pfnCompactCB != NULL)
-        {
-            ha->CompactBytesProcessed += dwSectorOffsLen;
-            ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
-        }
+        UpdateCompactProgress(ha, pTarget, dwSectorOffsLen);
 
         STORM_FREE(SectorOffsetsCopy);
     }
@@ -260,20 +357,16 @@ static int CopyMpqFileSectors(
             }
 
             // Now write the sector back to the file
-            if(!FileStream_Write(pNewStream, NULL, hf->pbFileSector, dwRawDataInSector))
-            {
-                nError = GetLastError();
+            nError = WriteCopyTarget(pTarget, hf->pbFileSector, dwRawDataInSector);
+            if(nError != ERROR_SUCCESS)
                 break;
-            }
 
             // Update compact progress
-            if(ha->pfnCompactCB != NULL)
-            {
-                ha->CompactBytesProcessed += dwRawDataInSector;
-                ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
-            }
+            UpdateCompactProgress(ha, pTarget, dwRawDataInSector);
 
-            // Adjust byte counts
+            // Adjust byte counts. The data following the last sector
+            // are read from where the sector ends.
+            RawFilePos += dwRawDataInSector;
             dwBytesToCopy -= dwRawDataInSector;
             dwCmpSize += dwRawDataInSector;
         }
@@ -288,20 +381,17 @@ static int CopyMpqFileSectors(
         dwCrcLength = hf->SectorOffsets[hf->dwSectorCount + 1] - hf->SectorOffsets[hf->dwSectorCount];
         if(dwCrcLength != 0)
         {
-            if(!FileStream_Read(ha->pStream, NULL, hf->SectorChksums, dwCrcLength))
+            if(!FileStream_Read(ha->pStream, &RawFilePos, hf->SectorChksums, dwCrcLength))
                 nError = GetLastError();
 
-            if(!FileStream_Write(pNewStream, NULL, hf->SectorChksums, dwCrcLength))
-                nError = GetLastError();
+            if(nError == ERROR_SUCCESS)
+                nError = WriteCopyTarget(pTarget, hf->SectorChksums, dwCrcLength);
 
             // Update compact progress
-            if(ha->pfnCompactCB != NULL)
-            {
-                ha->CompactBytesProcessed += dwCrcLength;
-                ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
-            }
+            UpdateCompactProgress(ha, pTarget, dwCrcLength);
 
             // Size of the CRC block is also included in the compressed file size
+            RawFilePos += dwCrcLength;
             dwBytesToCopy -= dwCrcLength;
             dwCmpSize += dwCrcLength;
         }
@@ -320,11 +410,11 @@ static int CopyMpqFileSectors(
         pbExtraData = STORM_ALLOC(BYTE, dwBytesToCopy);
         if(pbExtraData != NULL)
         {
-            if(!FileStream_Read(ha->pStream, NULL, pbExtraData, dwBytesToCopy))
+            if(!FileStream_Read(ha->pStream, &RawFilePos, pbExtraData, dwBytesToCopy))
                 nError = GetLastError();
 
-            if(!FileStream_Write(pNewStream, NULL, pbExtraData, dwBytesToCopy))
-                nError = GetLastError();
+            if(nError == ERROR_SUCCESS)
+                nError = WriteCopyTarget(pTarget, pbExtraData, dwBytesToCopy);
 
             // Include these extra data in the compressed size
             dwCmpSize += dwBytesToCopy;
@@ -337,10 +427,7 @@ static int CopyMpqFileSectors(
     // Write the MD5's of the raw file data, if needed
     if(nError == ERROR_SUCCESS && ha->pHeader->dwRawChunkSize != 0)
     {
-        nError = WriteMpqDataMD5(pNewStream, 
-                                 ha->MpqPos + MpqFilePos,
-                                 pFileEntry->dwCmpSize,
-                                 ha->pHeader->dwRawChunkSize);
+        nError = WriteCopyTargetMD5(ha, pTarget, MpqFilePos, pFileEntry->dwCmpSize);
     }
 
     // Verify the number of bytes written
@@ -370,14 +457,62 @@ static int CopyMpqFileSectors(
     return nError;
 }
 
+// Copies one file with nonzero size into another archive
+static int CopyMpqFile(
+    TMPQArchive * ha,
+    TFileEntry * pFileEntry,
+    DWORD dwFileKey,
+    TMPQCopyTarget * pTarget,
+    ULONGLONG MpqFilePos)
+{
+    TMPQFile * hf;
+    int nError = ERROR_SUCCESS;
+
+    // Allocate structure for the MPQ file
+    hf = CreateFileHandle(ha, pFileEntry);
+    if(hf == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    // Set the file decryption key
+    hf->dwFileKey = dwFileKey;
+
+    // If the file is a patch file, load the patch header
+    if(nError == ERROR_SUCCESS && (pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE))
+        nError = AllocatePatchInfo(hf, true);
+
+    // Allocate buffers for file sector and sector offset table
+    if(nError == ERROR_SUCCESS)
+        nError = AllocateSectorBuffer(hf);
+
+    // Also allocate sector offset table and sector checksum table
+    if(nError == ERROR_SUCCESS)
+        nError = AllocateSectorOffsets(hf, true);
+
+    // Also load sector checksums, if any
+    if(nError == ERROR_SUCCESS && (pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC))
+        nError = AllocateSectorChecksums(hf, false);
+
+    // Copy all file sectors
+    if(nError == ERROR_SUCCESS)
+        nError = CopyMpqFileSectors(ha, hf, pTarget, MpqFilePos);
+
+    // Free buffers
+    FreeFileHandle(hf);
+    return nError;
+}
+
 static int CopyMpqFiles(TMPQArchive * ha, LPDWORD pFileKeys, TFileStream * pNewStream)
 {
     TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
     TFileEntry * pFileEntry;
-    TMPQFile * hf = NULL;
+    TMPQCopyTarget Target;
     ULONGLONG MpqFilePos;
     int nError = ERROR_SUCCESS;
 
+    // All files go directly to the new archive
+    memset(&Target, 0, sizeof(TMPQCopyTarget));
+    Target.pStream = pNewStream;
+
     // Walk through all files and write them to the destination MPQ archive
     for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
     {
@@ -392,57 +527,263 @@ static int CopyMpqFiles(TMPQArchive * ha, LPDWORD pFileKeys, TFileStream * pNewS
             // Perform file copy ONLY if the file has nonzero size
             if(pFileEntry->dwFileSize != 0)
             {
-                // Allocate structure for the MPQ file
-                hf = CreateFileHandle(ha, pFileEntry);
-                if(hf == NULL)
-                    return ERROR_NOT_ENOUGH_MEMORY;
+                nError = CopyMpqFile(ha, pFileEntry, pFileKeys[pFileEntry - ha->pFileTable], &Target, MpqFilePos);
+                if(nError != ERROR_SUCCESS)
+                    break;
+            }
 
-                // Set the file decryption key
-                hf->dwFileKey = pFileKeys[pFileEntry - ha->pFileTable];
+            // Note: DO NOT update the compressed size in the file entry, no matter how bad it is.
+            pFileEntry->ByteOffset = MpqFilePos;
+        }
+    }
 
-                // If the file is a patch file, load the patch header
-                if(pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE)
-                {
-                    nError = AllocatePatchInfo(hf, true);
-                    if(nError != ERROR_SUCCESS)
-                        break;
-                }
+    return nError;
+}
 
-                // Allocate buffers for file sector and sector offset table
-                nError = AllocateSectorBuffer(hf);
-                if(nError != ERROR_SUCCESS)
-                    break;
+//-----------------------------------------------------------------------------
+// Pipelined copy of the files
+//
+// The workers read the files and re-encrypt them into memory buffers, in any order.
+// Whichever worker finds the next file in the file table order ready, becomes
+// the writer and writes the buffer to the new archive. Because of that,
+// the new archive is exactly the same like the one made by CopyMpqFiles.
+// The position of each file in the new archive is calculated in advance,
+// because the encryption key of the file may depend on it.
+
+// Calculates the number of bytes that the file will take in the new archive
+static int GetCompactedFileSize(TMPQArchive * ha, TFileEntry * pFileEntry, ULONGLONG * pcbFileData)
+{
+    TMPQFile * hf;
+    DWORD dwChunkSize = ha->pHeader->dwRawChunkSize;
+    int nError = ERROR_SUCCESS;
 
-                // Also allocate sector offset table and sector checksum table
-                nError = AllocateSectorOffsets(hf, true);
-                if(nError != ERROR_SUCCESS)
-                    break;
+    // Files with zero size are not copied at all
+    pcbFileData[0] = 0;
+    if(pFileEntry->dwFileSize == 0)
+        return ERROR_SUCCESS;
 
-                // Also load sector checksums, if any
-                if(pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC)
-                {
-                    nError = AllocateSectorChecksums(hf, false);
-                    if(nError != ERROR_SUCCESS)
-                        break;
-                }
+    // The compressed size covers everything except the patch header
+    pcbFileData[0] = pFileEntry->dwCmpSize;
 
-                // Copy all file sectors
-                nError = CopyMpqFileSectors(ha, hf, pNewStream, MpqFilePos);
-                if(nError != ERROR_SUCCESS)
-                    break;
+    // The length of the patch header is stored in the header itself
+    if(pFileEntry->dwFlags & MPQ_FILE_PATCH_FILE)
+    {
+        hf = CreateFileHandle(ha, pFileEntry);
+        if(hf == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
 
-                // Free buffers. This also sets "hf" to NULL.
-                FreeFileHandle(hf);
-            }
+        nError = AllocatePatchInfo(hf, true);
+        if(nError == ERROR_SUCCESS)
+            pcbFileData[0] += hf->pPatchInfo->dwLength;
+        FreeFileHandle(hf);
+    }
 
-            // Note: DO NOT update the compressed size in the file entry, no matter how bad it is.
-            pFileEntry->ByteOffset = MpqFilePos;
+    // MD5s of the raw data follow the file
+    if(dwChunkSize != 0 && pFileEntry->dwCmpSize != 0)
+        pcbFileData[0] += (((pFileEntry->dwCmpSize - 1) / dwChunkSize) + 1) * MD5_DIGEST_SIZE;
+    return nError;
+}
+
+// Copies one file to memory. Called by a worker without holding the lock.
+static int CopyFileToMemory(TMPQCompactJob * pJob, TMPQCompactFile * pFile)
+{
+    TMPQCopyTarget * pTarget = &pFile->Target;
+    int nError;
+
+    // Allocate the buffer for the entire file
+    pTarget->pbBuffer = STORM_ALLOC(BYTE, (DWORD)pFile->cbFileData);
+    if(pTarget->pbBuffer == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    pTarget->cbBuffer = (DWORD)pFile->cbFileData;
+
+    // Copy the file and check that it fills the whole buffer
+    nError = CopyMpqFile(pJob->ha, pFile->pFileEntry, pFile->dwFileKey, pTarget, pFile->MpqFilePos);
+    if(nError == ERROR_SUCCESS && pTarget->cbWritten != pTarget->cbBuffer)
+        nError = ERROR_FILE_CORRUPT;
+    return nError;
+}
+
+// Writes one file to the new archive. Only called by the writer.
+static int WriteCompactedFile(TMPQCompactJob * pJob, TMPQCompactFile * pFile)
+{
+    TMPQCopyTarget Target;
+    TMPQArchive * ha = pJob->ha;
+    ULONGLONG ByteOffset = 0;
+
+    // The file must begin exactly where we calculated
+    FileStream_GetPos(pJob->pNewStream, &ByteOffset);
+    if(ByteOffset != (ha->MpqPos + pFile->MpqFilePos))
+        return ERROR_FILE_CORRUPT;
+
+    // Nothing to do for files with zero size
+    if(pFile->cbFileData == 0)
+        return ERROR_SUCCESS;
+
+    // Files that were too big for memory are copied directly
+    if(pFile->Target.pbBuffer == NULL)
+    {
+        memset(&Target, 0, sizeof(TMPQCopyTarget));
+        Target.pStream = pJob->pNewStream;
+        return CopyMpqFile(ha, pFile->pFileEntry, pFile->dwFileKey, &Target, pFile->MpqFilePos);
+    }
+
+    // Write the buffer prepared by a worker
+    if(!FileStream_Write(pJob->pNewStream, NULL, pFile->Target.pbBuffer, pFile->Target.cbWritten))
+        return GetLastError();
+
+    // Update compact progress. The callback is never called from two threads at once.
+    if(ha->pfnCompactCB != NULL)
+    {
+        ha->CompactBytesProcessed += pFile->Target.dwProgress;
+        ha->pfnCompactCB(ha->pvCompactUserData, CCB_COMPACTING_FILES, ha->CompactBytesProcessed, ha->CompactTotalBytes);
+    }
+    return ERROR_SUCCESS;
+}
+
+static void CompactWorker(void * pvContext)
+{
+    TMPQCompactJob * pJob = (TMPQCompactJob *)pvContext;
+    TMPQCompactFile * pFile;
+    int nError;
+
+    StormLock(&pJob->Lock);
+    while(pJob->nError == ERROR_SUCCESS && pJob->dwNextWrite < pJob->dwFileCount)
+    {
+        // Writing goes first, because it frees the memory for the workers
+        pFile = pJob->pFiles + pJob->dwNextWrite;
+        if(pJob->bWriting == false && pFile->dwState == COMPACT_FILE_READY)
+        {
+            pJob->bWriting = true;
+            StormUnlock(&pJob->Lock);
+
+            nError = WriteCompactedFile(pJob, pFile);
+            STORM_FREE(pFile->Target.pbBuffer);
+            pFile->Target.pbBuffer = NULL;
+
+            StormLock(&pJob->Lock);
+            if(pFile->cbFileData <= MPQ_COMPACT_MAX_FILE_SIZE)
+                pJob->cbInFlight -= (DWORD)pFile->cbFileData;
+            pJob->dwNextWrite++;
+            pJob->bWriting = false;
+            if(pJob->nError == ERROR_SUCCESS)
+                pJob->nError = nError;
+            StormWakeAll(&pJob->Changed);
+            continue;
+        }
+
+        // Nothing to write and nothing to copy. Whoever copies or writes now
+        // will write the remaining files.
+        if(pJob->dwNextCopy >= pJob->dwFileCount)
+            break;
+
+        // Empty files and files too big for the memory are left to the writer
+        pFile = pJob->pFiles + pJob->dwNextCopy;
+        if(pFile->cbFileData == 0 || pFile->cbFileData > MPQ_COMPACT_MAX_FILE_SIZE)
+        {
+            pFile->dwState = COMPACT_FILE_READY;
+            pJob->dwNextCopy++;
+            continue;
+        }
+
+        // If there is not enough memory for the file, wait until the writer frees some.
+        // Note that cbInFlight is nonzero here, so there is a worker that will free it.
+        if(pJob->cbInFlight != 0 && (pJob->cbInFlight + pFile->cbFileData) > MPQ_COMPACT_BUFFER_SIZE)
+        {
+            StormWaitCond(&pJob->Changed, &pJob->Lock);
+            continue;
         }
+
+        // Take the file and copy it to memory without holding the lock
+        pJob->cbInFlight += (DWORD)pFile->cbFileData;
+        pJob->dwNextCopy++;
+        pFile->dwState = COMPACT_FILE_COPYING;
+        StormUnlock(&pJob->Lock);
+
+        nError = CopyFileToMemory(pJob, pFile);
+
+        StormLock(&pJob->Lock);
+        pFile->dwState = COMPACT_FILE_READY;
+        if(pJob->nError == ERROR_SUCCESS)
+            pJob->nError = nError;
+        StormWakeAll(&pJob->Changed);
     }
+    StormUnlock(&pJob->Lock);
+}
 
-    // Cleanup and exit
-    if(hf != NULL)
-        FreeFileHandle(hf);
+static int CopyMpqFilesPipelined(TMPQArchive * ha, LPDWORD pFileKeys, TFileStream * pNewStream, DWORD dwWorkerCount)
+{
+    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TFileEntry * pFileEntry;
+    TMPQCompactFile * pFile;
+    TMPQCompactJob Job;
+    ULONGLONG MpqFilePos = 0;
+    int nError = ERROR_SUCCESS;
+
+    // Prepare the job
+    memset(&Job, 0, sizeof(TMPQCompactJob));
+    Job.pFiles = STORM_ALLOC(TMPQCompactFile, ha->dwFileTableSize + 1);
+    if(Job.pFiles == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memset(Job.pFiles, 0, sizeof(TMPQCompactFile) * (ha->dwFileTableSize + 1));
+    Job.ha = ha;
+    Job.pNewStream = pNewStream;
+
+    // Calculate the positions of all files in the new archive.
+    // The files follow each other in the order of the file table.
+    FileStream_GetPos(pNewStream, &MpqFilePos);
+    MpqFilePos = MpqFilePos - ha->MpqPos;
+    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    {
+        if(pFileEntry->dwFlags & MPQ_FILE_EXISTS)
+        {
+            pFile = Job.pFiles + Job.dwFileCount++;
+            pFile->pFileEntry = pFileEntry;
+            pFile->dwFileKey = pFileKeys[pFileEntry - ha->pFileTable];
+            pFile->MpqFilePos = MpqFilePos;
+
+            nError = GetCompactedFileSize(ha, pFileEntry, &pFile->cbFileData);
+            if(nError != ERROR_SUCCESS)
+                break;
+            MpqFilePos += pFile->cbFileData;
+        }
+    }
+
+    // Copy the files on all CPUs, but don't start more threads than files
+    if(nError == ERROR_SUCCESS && Job.dwFileCount != 0)
+    {
+        StormInitLock(&Job.Lock);
+        StormInitCond(&Job.Changed);
+        StormRunWorkers(CompactWorker, &Job, STORMLIB_MIN(dwWorkerCount, Job.dwFileCount));
+        StormFreeCond(&Job.Changed);
+        StormFreeLock(&Job.Lock);
+        nError = Job.nError;
+    }
+
+    // The last file must end where we calculated
+    if(nError == ERROR_SUCCESS)
+    {
+        ULONGLONG ByteOffset = 0;
+
+        FileStream_GetPos(pNewStream, &ByteOffset);
+        if(ByteOffset != (ha->MpqPos + MpqFilePos))
+            nError = ERROR_FILE_CORRUPT;
+    }
+
+    // Only move the files in the file table if everything succeeded
+    // Note: DO NOT update the compressed size in the file entry, no matter how bad it is.
+    if(nError == ERROR_SUCCESS)
+    {
+        for(DWORD i = 0; i < Job.dwFileCount; i++)
+            Job.pFiles[i].pFileEntry->ByteOffset = Job.pFiles[i].MpqFilePos;
+    }
+
+    // Free buffers that haven't been written due to an error
+    for(DWORD i = 0; i < Job.dwFileCount; i++)
+    {
+        if(Job.pFiles[i].Target.pbBuffer != NULL)
+            STORM_FREE(Job.pFiles[i].Target.pbBuffer);
+    }
+    STORM_FREE(Job.pFiles);
     return nError;
 }
 
@@ -621,9 +962,18 @@ bool WINAPI SFileCompactArchive(HANDLE hMpq, const TCHAR * szListFile, bool /* b
         ha->CompactBytesProcessed += ha->pHeader->dwHeaderSize;
     }
 
-    // Now copy all files
+    // Now copy all files. If the archive was open with MPQ_OPEN_PARALLEL_COMPACT
+    // and there are more CPUs, the files are read and re-encrypted on multiple threads
+    // and written in the same order
     if(nError == ERROR_SUCCESS)
-        nError = CopyMpqFiles(ha, pFileKeys, pTempStream);
+    {
+        DWORD dwWorkerCount = (ha->dwFlags & MPQ_FLAG_PARALLEL_COMPACT) ? StormGetWorkerCount() : 1;
+
+        if(dwWorkerCount > 1)
+            nError = CopyMpqFilesPipelined(ha, pFileKeys, pTempStream, dwWorkerCount);
+        else
+            nError = CopyMpqFiles(ha, pFileKeys, pTempStream);
+    }
 
     // If succeeded, switch the streams
     if(nError == ERROR_SUCCESS)
@@ -15,13 +15,25 @@
 //-----------------------------------------------------------------------------
 // Private structure used for file search (search handle)
 
+// Range of the name index of one archive in the patch chain
+struct TMPQSearchRange
+{
+    TMPQArchive * ha;                   // Archive the name index belongs to
+    TMPQNameIndex * pNameIndex;         // Name index of the archive (referenced by the search)
+    DWORD  dwNextItem;                  // Next named item to be checked
+    DWORD  dwEndItem;                   // End of the named items that match the search mask prefix
+    DWORD  dwNextUnnamed;               // Next unnamed item to be checked
+};
+
 // Used by searching in MPQ archives
 struct TMPQSearch
 {
     TMPQArchive * ha;                   // Handle to MPQ, where the search runs
-    TFileEntry ** pSearchTable;         // Table for files that have been already found
-    DWORD  dwSearchTableItems;          // Number of items in the search table
-    DWORD  dwNextIndex;                 // Next file index to be checked
+    TMPQSearchRange * pRanges;          // Name index ranges, one for each archive in the patch chain
+    DWORD  dwRangeCount;                // Number of archives in the patch chain
+    DWORD  dwUnnamedRange;              // Range where the search for unnamed files continues
+    const char * szGroupName;           // Name of the last file that passed the flag mask
+    TMPQArchive * haGroupOwner;         // Archive that the last file name came from
     DWORD  dwFlagMask;                  // For checking flag mask
     char   szSearchMask[1];             // Search mask (variable length)
 };
@@ -94,83 +106,199 @@ bool CheckWildCard(const char * szString, const char * szWildCard)
     }
 }
 
-static DWORD GetSearchTableItems(TMPQArchive * ha)
+// Compares two file names the same way as CheckWildCard does (case-insensitive)
+static int CompareFileNames(const char * szFileName1, const char * szFileName2)
 {
-    DWORD dwMergeItems = 0;
+    while(AsciiToUpperTable[(BYTE)szFileName1[0]] == AsciiToUpperTable[(BYTE)szFileName2[0]])
+    {
+        if(szFileName1[0] == 0)
+            return 0;
+
+        szFileName1++;
+        szFileName2++;
+    }
+
+    return (int)AsciiToUpperTable[(BYTE)szFileName1[0]] - (int)AsciiToUpperTable[(BYTE)szFileName2[0]];
+}
 
-    // Loop over all patches
-    while(ha != NULL)
+// Compares the beginning of the file name with the prefix of the search mask
+static int CompareNamePrefix(const char * szFileName, const char * szPrefix, size_t nLength)
+{
+    for(size_t i = 0; i < nLength; i++)
     {
-        // Append the number of files
-        dwMergeItems += (ha->pHetTable != NULL) ? ha->pHetTable->dwEntryCount
-                                                : ha->pHeader->dwBlockTableSize;
-        // Move to the patched archive
-        ha = ha->haPatch;
+        if(AsciiToUpperTable[(BYTE)szFileName[i]] != AsciiToUpperTable[(BYTE)szPrefix[i]])
+            return (int)AsciiToUpperTable[(BYTE)szFileName[i]] - (int)AsciiToUpperTable[(BYTE)szPrefix[i]];
     }
 
-    // Return the double size of number of items
-    return (dwMergeItems | 1);
+    return 0;
 }
 
-static bool FileWasFoundBefore(
-    TMPQArchive * ha,
-    TMPQSearch * hs,
-    TFileEntry * pFileEntry)
+static int CompareNameIndexItems(const void * pvItem1, const void * pvItem2)
 {
-    TFileEntry * pEntry;
-    char * szRealFileName = pFileEntry->szFileName;
-    DWORD dwStartIndex;
-    DWORD dwNameHash;
-    DWORD dwIndex;
+    TMPQNameIndexItem * pItem1 = (TMPQNameIndexItem *)pvItem1;
+    TMPQNameIndexItem * pItem2 = (TMPQNameIndexItem *)pvItem2;
+    int nResult;
+
+    // Equal names are kept in the order of the hash table (or the file table),
+    // so the search reports them the same way as when walking the tables
+    nResult = CompareFileNames(pItem1->szFileName, pItem2->szFileName);
+    if(nResult == 0)
+    {
+        if(pItem1->dwHashIndex != pItem2->dwHashIndex)
+            return (pItem1->dwHashIndex < pItem2->dwHashIndex) ? -1 : +1;
+        if(pItem1->dwBlockIndex != pItem2->dwBlockIndex)
+            return (pItem1->dwBlockIndex < pItem2->dwBlockIndex) ? -1 : +1;
+    }
+    return nResult;
+}
 
-    if(hs->pSearchTable != NULL && szRealFileName != NULL)
+// Puts one file entry to the name index. Named files are stored from the begin
+// of the item array, unnamed files are stored from the end
+static void InsertNameIndexItem(TMPQNameIndex * pNameIndex, TMPQArchive * ha, DWORD dwHashIndex, DWORD dwBlockIndex, DWORD dwMaxItems)
+{
+    TMPQNameIndexItem * pItem;
+    TFileEntry * pFileEntry = ha->pFileTable + dwBlockIndex;
+    size_t nPrefixLength = (ha->pPatchPrefix != NULL) ? ha->pPatchPrefix->nLength : 0;
+
+    if(pFileEntry->szFileName != NULL)
     {
-        // If we are in patch MPQ, we check if patch prefix matches
-        // and then trim the patch prefix
-        if(ha->pPatchPrefix != NULL)
-        {
-            // If the patch prefix doesn't fit, we pretend that the file
-            // was there before and it will be skipped
-            if(_strnicmp(szRealFileName, ha->pPatchPrefix->szPatchPrefix, ha->pPatchPrefix->nLength))
-                return true;
+        // Files from the patch MPQ must begin with the patch prefix. Other files are never reported
+        if(nPrefixLength != 0 && _strnicmp(pFileEntry->szFileName, ha->pPatchPrefix->szPatchPrefix, nPrefixLength))
+            return;
 
-            szRealFileName += ha->pPatchPrefix->nLength;
-        }
+        pItem = pNameIndex->Items + pNameIndex->dwNamedCount++;
+        pItem->szFileName = pFileEntry->szFileName + nPrefixLength;
+    }
+    else
+    {
+        pItem = pNameIndex->Items + dwMaxItems - (++pNameIndex->dwUnnamedCount);
+        pItem->szFileName = NULL;
+    }
+
+    pItem->dwHashIndex = dwHashIndex;
+    pItem->dwBlockIndex = dwBlockIndex;
+}
 
-        // Calculate the hash to the table
-        dwNameHash = ha->pfnHashString(szRealFileName, MPQ_HASH_NAME_A);
-        dwStartIndex = dwIndex = (dwNameHash % hs->dwSearchTableItems);
+static TMPQNameIndex * CreateNameIndex(TMPQArchive * ha)
+{
+    TMPQNameIndex * pNameIndex;
+    TMPQHash * pHashTableEnd = ha->pHashTable + ha->pHeader->dwHashTableSize;
+    TMPQHash * pHash;
+    DWORD dwMaxItems = (ha->pHashTable != NULL) ? ha->pHeader->dwHashTableSize : ha->dwFileTableSize;
+    DWORD dwIndex;
 
-        // The file might have been found before
-        // only if this is not the first MPQ being searched
-        if(ha->haBase != NULL)
+    // Allocate the index for the worst case
+    pNameIndex = (TMPQNameIndex *)STORM_ALLOC(BYTE, sizeof(TMPQNameIndex) + dwMaxItems * sizeof(TMPQNameIndexItem));
+    if(pNameIndex == NULL)
+        return NULL;
+    pNameIndex->dwRefCount = 1;
+    pNameIndex->dwNamedCount = 0;
+    pNameIndex->dwUnnamedCount = 0;
+
+    // If the archive has hash table, we need to use hash table
+    // in order to catch hash table index and file locale.
+    // Note: If multiple hash table entries point to the same block entry,
+    // we need to report them all
+    if(ha->pHashTable != NULL)
+    {
+        for(pHash = ha->pHashTable; pHash < pHashTableEnd; pHash++)
         {
-            // Enumerate all entries in the search table
-            for(;;)
+            if(IsValidHashEntry(ha, pHash))
             {
-                // Get the file entry at that position
-                pEntry = hs->pSearchTable[dwIndex];
-                if(pEntry == NULL)
-                    break;
-
-                if(pEntry->szFileName != NULL)
-                {
-                    // Does the name match?
-                    if(!_stricmp(pEntry->szFileName, szRealFileName))
-                        return true;
-                }
-
-                // Move to the next entry
-                dwIndex = (dwIndex + 1) % hs->dwSearchTableItems;
-                if(dwIndex == dwStartIndex)
-                    break;
+                InsertNameIndexItem(pNameIndex, ha, (DWORD)(pHash - ha->pHashTable), MPQ_BLOCK_INDEX(pHash), dwMaxItems);
             }
         }
+    }
+    else
+    {
+        for(dwIndex = 0; dwIndex < ha->dwFileTableSize; dwIndex++)
+        {
+            if(ha->pFileTable[dwIndex].dwFlags & MPQ_FILE_EXISTS)
+            {
+                InsertNameIndexItem(pNameIndex, ha, HASH_ENTRY_FREE, dwIndex, dwMaxItems);
+            }
+        }
+    }
 
-        // Put the entry to the table for later use
-        hs->pSearchTable[dwIndex] = pFileEntry;
+    // Move the unnamed items right after the named ones, in the original order
+    for(dwIndex = 0; dwIndex < pNameIndex->dwUnnamedCount; dwIndex++)
+    {
+        pNameIndex->Items[pNameIndex->dwNamedCount + dwIndex] = pNameIndex->Items[dwMaxItems - 1 - dwIndex];
     }
-    return false;
+
+    // Sort the named items
+    qsort(pNameIndex->Items, pNameIndex->dwNamedCount, sizeof(TMPQNameIndexItem), CompareNameIndexItems);
+    return pNameIndex;
+}
+
+static void ReleaseNameIndex(TMPQNameIndex * pNameIndex)
+{
+    if(pNameIndex != NULL && --pNameIndex->dwRefCount == 0)
+    {
+        STORM_FREE(pNameIndex);
+    }
+}
+
+// Returns the first item whose name is greater than (or equal to, if bUpperBound is false) the prefix
+static DWORD FindNameIndexBound(TMPQNameIndex * pNameIndex, const char * szPrefix, size_t nLength, bool bUpperBound)
+{
+    DWORD dwLower = 0;
+    DWORD dwUpper = pNameIndex->dwNamedCount;
+    DWORD dwMiddle;
+    int nResult;
+
+    while(dwLower < dwUpper)
+    {
+        dwMiddle = dwLower + (dwUpper - dwLower) / 2;
+        nResult = CompareNamePrefix(pNameIndex->Items[dwMiddle].szFileName, szPrefix, nLength);
+
+        if(nResult < 0 || (nResult == 0 && bUpperBound))
+            dwLower = dwMiddle + 1;
+        else
+            dwUpper = dwMiddle;
+    }
+
+    return dwLower;
+}
+
+// Retrieves the file entry (and hash entry) of the index item.
+// If the archive has been modified after the index was built, the item may be out of date
+static TFileEntry * GetNameIndexEntry(TMPQArchive * ha, TMPQNameIndexItem * pItem, TMPQHash ** ppHashEntry)
+{
+    TFileEntry * pFileEntry;
+    TMPQHash * pHashEntry = NULL;
+    size_t nPrefixLength = (ha->pPatchPrefix != NULL) ? ha->pPatchPrefix->nLength : 0;
+
+    // Check the hash table entry
+    if(pItem->dwHashIndex != HASH_ENTRY_FREE)
+    {
+        if(ha->pHashTable == NULL || pItem->dwHashIndex >= ha->pHeader->dwHashTableSize)
+            return NULL;
+
+        pHashEntry = ha->pHashTable + pItem->dwHashIndex;
+        if(MPQ_BLOCK_INDEX(pHashEntry) != pItem->dwBlockIndex)
+            return NULL;
+    }
+
+    // Check the file entry
+    if(pItem->dwBlockIndex >= ha->dwFileTableSize)
+        return NULL;
+    pFileEntry = ha->pFileTable + pItem->dwBlockIndex;
+
+    // Check the file name
+    if(pItem->szFileName != NULL)
+    {
+        if(pFileEntry->szFileName == NULL || pFileEntry->szFileName + nPrefixLength != pItem->szFileName)
+            return NULL;
+    }
+    else
+    {
+        if(pFileEntry->szFileName != NULL)
+            return NULL;
+    }
+
+    ppHashEntry[0] = pHashEntry;
+    return pFileEntry;
 }
 
 static TFileEntry * FindPatchEntry(TMPQArchive * ha, TFileEntry * pFileEntry)
@@ -210,171 +338,242 @@ static bool DoMPQSearch_FileEntry(
     SFILE_FIND_DATA * lpFindFileData,
     TMPQArchive * ha,
     TMPQHash * pHashEntry,
-    TFileEntry * pFileEntry)
+    TFileEntry * pFileEntry,
+    const char * szFileName)
 {
     TFileEntry * pPatchEntry;
     HANDLE hFile = NULL;
-    const char * szFileName;
-    size_t nPrefixLength = (ha->pPatchPrefix != NULL) ? ha->pPatchPrefix->nLength : 0;
     DWORD dwBlockIndex;
     char szNameBuff[MAX_PATH];
 
-    // Is it a file but not a patch file?
-    if((pFileEntry->dwFlags & hs->dwFlagMask) == MPQ_FILE_EXISTS)
+    // Prepare the block index
+    dwBlockIndex = (DWORD)(pFileEntry - ha->pFileTable);
+
+    // Get the file name. If it's not known, we will create pseudo-name
+    if(szFileName == NULL)
     {
-        // Now we have to check if this file was not enumerated before
-        if(!FileWasFoundBefore(ha, hs, pFileEntry))
+        // Open the file by its pseudo-name.
+        sprintf(szNameBuff, "File%08u.xxx", (unsigned int)dwBlockIndex);
+        if(SFileOpenFileEx((HANDLE)ha, szNameBuff, SFILE_OPEN_BASE_FILE, &hFile))
         {
-//          if(pFileEntry != NULL && !_stricmp(pFileEntry->szFileName, "TriggerLibs\\NativeLib.galaxy"))
-//              DebugBreak();
+            SFileGetFileName(hFile, szNameBuff);
+            szFileName = szNameBuff;
+            SFileCloseFile(hFile);
+        }
+    }
 
+    // If the file name is still NULL, we cannot include the file to search results
+    if(szFileName != NULL)
+    {
+        // Check the file name against the wildcard
+        if(CheckWildCard(szFileName, hs->szSearchMask))
+        {
             // Find a patch to this file
             // Note: This either succeeds or returns pFileEntry
             pPatchEntry = FindPatchEntry(ha, pFileEntry);
 
-            // Prepare the block index
-            dwBlockIndex = (DWORD)(pFileEntry - ha->pFileTable);
+            // Fill the found entry. hash entry and block index are taken from the base MPQ
+            lpFindFileData->dwHashIndex  = HASH_ENTRY_FREE;
+            lpFindFileData->dwBlockIndex = dwBlockIndex;
+            lpFindFileData->dwFileSize   = pPatchEntry->dwFileSize;
+            lpFindFileData->dwFileFlags  = pPatchEntry->dwFlags;
+            lpFindFileData->dwCompSize   = pPatchEntry->dwCmpSize;
+            lpFindFileData->lcLocale     = 0;   // pPatchEntry->lcLocale;
 
-            // Get the file name. If it's not known, we will create pseudo-name
-            szFileName = pFileEntry->szFileName;
-            if(szFileName == NULL)
-            {
-                // Open the file by its pseudo-name.
-                sprintf(szNameBuff, "File%08u.xxx", (unsigned int)dwBlockIndex);
-                if(SFileOpenFileEx((HANDLE)hs->ha, szNameBuff, SFILE_OPEN_BASE_FILE, &hFile))
-                {
-                    SFileGetFileName(hFile, szNameBuff);
-                    szFileName = szNameBuff;
-                    SFileCloseFile(hFile);
-                }
-            }
+            // Fill the filetime
+            lpFindFileData->dwFileTimeHi = (DWORD)(pPatchEntry->FileTime >> 32);
+            lpFindFileData->dwFileTimeLo = (DWORD)(pPatchEntry->FileTime);
 
-            // If the file name is still NULL, we cannot include the file to search results
-            if(szFileName != NULL)
+            // Fill-in the entries from hash table entry, if given
+            if(pHashEntry != NULL)
             {
-                // Check the file name against the wildcard
-                if(CheckWildCard(szFileName + nPrefixLength, hs->szSearchMask))
-                {
-                    // Fill the found entry. hash entry and block index are taken from the base MPQ
-                    lpFindFileData->dwHashIndex  = HASH_ENTRY_FREE;
-                    lpFindFileData->dwBlockIndex = dwBlockIndex;
-                    lpFindFileData->dwFileSize   = pPatchEntry->dwFileSize;
-                    lpFindFileData->dwFileFlags  = pPatchEntry->dwFlags;
-                    lpFindFileData->dwCompSize   = pPatchEntry->dwCmpSize;
-                    lpFindFileData->lcLocale     = 0;   // pPatchEntry->lcLocale;
-
-                    // Fill the filetime
-                    lpFindFileData->dwFileTimeHi = (DWORD)(pPatchEntry->FileTime >> 32);
-                    lpFindFileData->dwFileTimeLo = (DWORD)(pPatchEntry->FileTime);
-
-                    // Fill-in the entries from hash table entry, if given
-                    if(pHashEntry != NULL)
-                    {
-                        lpFindFileData->dwHashIndex = (DWORD)(pHashEntry - ha->pHashTable);
-                        lpFindFileData->lcLocale = pHashEntry->lcLocale;
-                    }
-
-                    // Fill the file name and plain file name
-                    StringCopy(lpFindFileData->cFileName, _countof(lpFindFileData->cFileName), szFileName + nPrefixLength);
-                    lpFindFileData->szPlainName = (char *)GetPlainFileName(lpFindFileData->cFileName);
-                    return true;
-                }
+                lpFindFileData->dwHashIndex = (DWORD)(pHashEntry - ha->pHashTable);
+                lpFindFileData->lcLocale = pHashEntry->lcLocale;
             }
+
+            // Fill the file name and plain file name
+            StringCopy(lpFindFileData->cFileName, _countof(lpFindFileData->cFileName), szFileName);
+            lpFindFileData->szPlainName = (char *)GetPlainFileName(lpFindFileData->cFileName);
+            return true;
         }
     }
 
-    // Either not a valid item or was found before
+    // Not matching the search mask
     return false;
 }
 
-static int DoMPQSearch_HashTable(TMPQSearch * hs, SFILE_FIND_DATA * lpFindFileData, TMPQArchive * ha)
+// Checks whether the file has already been reported from another archive in the patch chain.
+// Named files of all archives come sorted, so equal names always follow each other
+static bool FileWasFoundBefore(TMPQSearch * hs, TMPQArchive * ha, const char * szFileName)
 {
-    TMPQHash * pHashTableEnd = ha->pHashTable + ha->pHeader->dwHashTableSize;
-    TMPQHash * pHash;
-
-    // Parse the file table
-    for(pHash = ha->pHashTable + hs->dwNextIndex; pHash < pHashTableEnd; pHash++)
+    // Only patched archives need to be checked
+    if(hs->dwRangeCount > 1)
     {
-        // Increment the next index for subsequent search
-        hs->dwNextIndex++;
-
-        // Does this hash table entry point to a proper block table entry?
-        if(IsValidHashEntry(ha, pHash))
+        // Is this a new file name?
+        if(hs->szGroupName == NULL || CompareFileNames(hs->szGroupName, szFileName))
         {
-            // Check if this file entry should be included in the search result
-            if(DoMPQSearch_FileEntry(hs, lpFindFileData, ha, pHash, ha->pFileTable + MPQ_BLOCK_INDEX(pHash)))
-                return ERROR_SUCCESS;
+            hs->szGroupName = szFileName;
+            hs->haGroupOwner = ha;
+            return false;
         }
+
+        // The file name belongs to the first archive in the chain that contains it.
+        // All entries of that archive are reported (e.g. all locales), the other archives are skipped
+        return (ha != hs->haGroupOwner);
     }
 
-    // No more files
-    return ERROR_NO_MORE_FILES;
+    return false;
 }
 
-static int DoMPQSearch_FileTable(TMPQSearch * hs, SFILE_FIND_DATA * lpFindFileData, TMPQArchive * ha)
+// Performs one MPQ search
+static int DoMPQSearch(TMPQSearch * hs, SFILE_FIND_DATA * lpFindFileData)
 {
-    TFileEntry * pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    TMPQNameIndexItem * pItem;
+    TMPQSearchRange * pRange;
+    TMPQSearchRange * pBest;
     TFileEntry * pFileEntry;
+    TMPQHash * pHashEntry;
+    DWORD i;
+
+    // Merge the name ranges of all archives in the patch chain.
+    // If more archives have the same name, the earlier archive goes first
+    for(;;)
+    {
+        // Find the range with the lowest name
+        pBest = NULL;
+        for(i = 0; i < hs->dwRangeCount; i++)
+        {
+            pRange = hs->pRanges + i;
+            if(pRange->dwNextItem < pRange->dwEndItem)
+            {
+                if(pBest == NULL || CompareFileNames(pRange->pNameIndex->Items[pRange->dwNextItem].szFileName,
+                                                     pBest->pNameIndex->Items[pBest->dwNextItem].szFileName) < 0)
+                {
+                    pBest = pRange;
+                }
+            }
+        }
+
+        // No more named files
+        if(pBest == NULL)
+            break;
+        pItem = pBest->pNameIndex->Items + pBest->dwNextItem++;
+
+        // Is it a file but not a patch file?
+        pFileEntry = GetNameIndexEntry(pBest->ha, pItem, &pHashEntry);
+        if(pFileEntry != NULL && (pFileEntry->dwFlags & hs->dwFlagMask) == MPQ_FILE_EXISTS)
+        {
+            // Now we have to check if this file was not enumerated before
+            if(!FileWasFoundBefore(hs, pBest->ha, pItem->szFileName))
+            {
+                if(DoMPQSearch_FileEntry(hs, lpFindFileData, pBest->ha, pHashEntry, pFileEntry, pItem->szFileName))
+                    return ERROR_SUCCESS;
+            }
+        }
+    }
 
-    // Parse the file table
-    for(pFileEntry = ha->pFileTable + hs->dwNextIndex; pFileEntry < pFileTableEnd; pFileEntry++)
+    // Files without name are checked one by one, as they get pseudo-names
+    while(hs->dwUnnamedRange < hs->dwRangeCount)
     {
-        // Increment the next index for subsequent search
-        hs->dwNextIndex++;
+        pRange = hs->pRanges + hs->dwUnnamedRange;
+
+        while(pRange->dwNextUnnamed < pRange->pNameIndex->dwUnnamedCount)
+        {
+            pItem = pRange->pNameIndex->Items + pRange->pNameIndex->dwNamedCount + pRange->dwNextUnnamed++;
 
-        // Check if this file entry should be included in the search result
-        if(DoMPQSearch_FileEntry(hs, lpFindFileData, ha, NULL, pFileEntry))
-            return ERROR_SUCCESS;
+            pFileEntry = GetNameIndexEntry(pRange->ha, pItem, &pHashEntry);
+            if(pFileEntry != NULL && (pFileEntry->dwFlags & hs->dwFlagMask) == MPQ_FILE_EXISTS)
+            {
+                if(DoMPQSearch_FileEntry(hs, lpFindFileData, pRange->ha, pHashEntry, pFileEntry, NULL))
+                    return ERROR_SUCCESS;
+            }
+        }
+
+        // Move to the next archive in the patch chain
+        hs->dwUnnamedRange++;
     }
 
-    // No more files
+    // No more files found, return error
     return ERROR_NO_MORE_FILES;
 }
 
-// Performs one MPQ search
-static int DoMPQSearch(TMPQSearch * hs, SFILE_FIND_DATA * lpFindFileData)
+// Prepares the search ranges of all archives in the patch chain
+static int InitMPQSearch(TMPQSearch * hs)
 {
-    TMPQArchive * ha = hs->ha;
-    int nError;
-
-    // Start searching with base MPQ
-    while(ha != NULL)
-    { 
-        // If the archive has hash table, we need to use hash table
-        // in order to catch hash table index and file locale.
-        // Note: If multiple hash table entries, point to the same block entry,
-        // we need, to report them all
-        nError = (ha->pHashTable != NULL) ? DoMPQSearch_HashTable(hs, lpFindFileData, ha)
-                                          : DoMPQSearch_FileTable(hs, lpFindFileData, ha);
-        if(nError == ERROR_SUCCESS)
-            return nError;
-
-        // If there is no more patches in the chain, stop it.
-        // This also keeps hs->ha non-NULL, which is required
-        // for freeing the handle later
-        if(ha->haPatch == NULL)
-            break;
+    TMPQSearchRange * pRange;
+    TMPQArchive * ha;
+    size_t nPrefixLength;
+
+    // The fixed part of the search mask determines the range of names
+    nPrefixLength = strcspn(hs->szSearchMask, "*?");
+
+    // Count the archives in the patch chain
+    for(ha = hs->ha; ha != NULL; ha = ha->haPatch)
+        hs->dwRangeCount++;
 
-        // Move to the next patch in the patch chain
-        hs->ha = ha = ha->haPatch;
-        hs->dwNextIndex = 0;
+    hs->pRanges = STORM_ALLOC(TMPQSearchRange, hs->dwRangeCount);
+    if(hs->pRanges == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memset(hs->pRanges, 0, sizeof(TMPQSearchRange) * hs->dwRangeCount);
+
+    // Get the name index of each archive
+    pRange = hs->pRanges;
+    for(ha = hs->ha; ha != NULL; ha = ha->haPatch, pRange++)
+    {
+        // Searching needs the file names and reports the file times
+        LoadDeferredListFile(ha);
+        LoadDeferredAttributes(ha);
+
+        // Build the name index, if not built yet
+        if(ha->pNameIndex == NULL)
+        {
+            ha->pNameIndex = CreateNameIndex(ha);
+            if(ha->pNameIndex == NULL)
+                return ERROR_NOT_ENOUGH_MEMORY;
+        }
+
+        // Reference the index for the lifetime of the search
+        pRange->ha = ha;
+        pRange->pNameIndex = ha->pNameIndex;
+        pRange->pNameIndex->dwRefCount++;
+
+        // Find the names beginning with the fixed part of the search mask
+        pRange->dwNextItem = FindNameIndexBound(pRange->pNameIndex, hs->szSearchMask, nPrefixLength, false);
+        pRange->dwEndItem = FindNameIndexBound(pRange->pNameIndex, hs->szSearchMask, nPrefixLength, true);
     }
 
-    // No more files found, return error
-    return ERROR_NO_MORE_FILES;
+    return ERROR_SUCCESS;
 }
 
 static void FreeMPQSearch(TMPQSearch *& hs)
 {
     if(hs != NULL)
     {
-        if(hs->pSearchTable != NULL)
-            STORM_FREE(hs->pSearchTable);
+        if(hs->pRanges != NULL)
+        {
+            for(DWORD i = 0; i < hs->dwRangeCount; i++)
+                ReleaseNameIndex(hs->pRanges[i].pNameIndex);
+            STORM_FREE(hs->pRanges);
+        }
         STORM_FREE(hs);
         hs = NULL;
     }
 }
 
+//-----------------------------------------------------------------------------
+// Internal functions
+
+// Drops the archive's reference to the sorted file names.
+// Called whenever a file name or a file table entry changes
+void InvalidateNameIndex(TMPQArchive * ha)
+{
+    if(ha->pNameIndex != NULL)
+    {
+        ReleaseNameIndex(ha->pNameIndex);
+        ha->pNameIndex = NULL;
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Public functions
 
@@ -413,18 +612,12 @@ HANDLE WINAPI SFileFindFirstFile(HANDLE hMpq, const char * szMask, SFILE_FIND_DA
         hs->dwFlagMask = MPQ_FILE_EXISTS;
         hs->ha = ha;
 
-        // If the archive is patched archive, we have to create a merge table
-        // to prevent files being repeated
+        // If the archive is patched archive, the patch files are not reported
         if(ha->haPatch != NULL)
-        {
-            hs->dwSearchTableItems = GetSearchTableItems(ha);
-            hs->pSearchTable = STORM_ALLOC(TFileEntry *, hs->dwSearchTableItems);
             hs->dwFlagMask = MPQ_FILE_EXISTS | MPQ_FILE_PATCH_FILE;
-            if(hs->pSearchTable != NULL)
-                memset(hs->pSearchTable, 0, hs->dwSearchTableItems * sizeof(TFileEntry *));
-            else
-                nError = ERROR_NOT_ENOUGH_MEMORY;
-        }
+
+        // Find the range of names in all archives
+        nError = InitMPQSearch(hs);
     }
 
     // Perform first item searching
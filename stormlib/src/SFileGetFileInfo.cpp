@@ -618,6 +618,8 @@ bool WINAPI SFileGetFileInfo(
             hf = IsValidFileHandle(hMpqOrFile);
             if(hf != NULL && hf->pFileEntry != NULL)
             {
+                LoadDeferredListFile(hf->ha);
+                LoadDeferredAttributes(hf->ha);
                 pvSrcFileInfo = pFileEntry = hf->pFileEntry;
                 cbSrcFileInfo = sizeof(TFileEntry);
                 if(pFileEntry->szFileName != NULL)
@@ -714,6 +716,7 @@ bool WINAPI SFileGetFileInfo(
             hf = IsValidFileHandle(hMpqOrFile);
             if(hf != NULL && hf->pFileEntry != NULL)
             {
+                LoadDeferredAttributes(hf->ha);
                 pvSrcFileInfo = &hf->pFileEntry->FileTime;
                 cbSrcFileInfo = sizeof(ULONGLONG);
                 nInfoType = SFILE_INFO_TYPE_DIRECT_POINTER;
@@ -777,6 +780,7 @@ bool WINAPI SFileGetFileInfo(
             hf = IsValidFileHandle(hMpqOrFile);
             if(hf != NULL && hf->pFileEntry != NULL)
             {
+                LoadDeferredAttributes(hf->ha);
                 dwInt32Value = hf->pFileEntry->dwCrc32;
                 pvSrcFileInfo = &dwInt32Value;
                 cbSrcFileInfo = sizeof(DWORD);
@@ -971,6 +975,10 @@ bool WINAPI SFileGetFileName(HANDLE hFile, char * szFileName)
         {
             if(pFileEntry != NULL)
             {
+                // The file name may be in the listfile that has not been loaded yet
+                if(pFileEntry->szFileName == NULL)
+                    LoadDeferredListFile(hf->ha);
+
                 // If the file name is not there yet, create a pseudo name
                 if(pFileEntry->szFileName == NULL)
                     nError = CreatePseudoFileName(hFile, pFileEntry, szFileName);
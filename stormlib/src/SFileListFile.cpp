@@ -18,6 +18,7 @@
 
 #define CACHE_BUFFER_SIZE  0x1000       // Size of the cache buffer
 #define MAX_LISTFILE_SIZE  0x04000000   // Maximum accepted listfile size is about 68 MB
+#define LISTFILE_BATCH_SIZE HET_LOOKUP_BATCH // Number of listfile names processed at once
 
 union TListFileHandle
 {
@@ -172,8 +173,11 @@ static TListFileCache * CreateListFileCache(
     {
         ULONGLONG FileSize = 0;
 
-        // Open the local file
-        ListHandle.pStream = FileStream_OpenFile(szListFile, STREAM_FLAG_READ_ONLY);
+        // Open the local file. Prefer mapping it to memory, as the listfile
+        // is read as a whole. Fall back to regular file if mapping fails
+        ListHandle.pStream = FileStream_OpenFile(szListFile, BASE_PROVIDER_MAP | STREAM_FLAG_READ_ONLY);
+        if(ListHandle.pStream == NULL)
+            ListHandle.pStream = FileStream_OpenFile(szListFile, STREAM_FLAG_READ_ONLY);
         if(ListHandle.pStream != NULL)
         {
             // Verify the file size
@@ -261,6 +265,26 @@ static void FreeNameCache(TMPQNameCache * pNameCache)
 */
 #endif  // _DEBUG
 
+// Finds the first CR or LF in the range. Checks eight bytes at a time
+static LPBYTE FindLineEnd(LPBYTE pbPos, LPBYTE pbEnd)
+{
+    ULONGLONG Group;
+
+    // Skip whole groups of eight bytes that contain no CR or LF
+    while((pbPos + sizeof(ULONGLONG)) <= pbEnd)
+    {
+        memcpy(&Group, pbPos, sizeof(ULONGLONG));
+        if(HasZeroByte64(Group ^ 0x0A0A0A0A0A0A0A0AULL) | HasZeroByte64(Group ^ 0x0D0D0D0D0D0D0D0DULL))
+            break;
+        pbPos += sizeof(ULONGLONG);
+    }
+
+    // Find the exact position
+    while(pbPos < pbEnd && pbPos[0] != 0x0A && pbPos[0] != 0x0D)
+        pbPos++;
+    return pbPos;
+}
+
 static char * ReadListFileLine(TListFileCache * pCache, size_t * PtrLength)
 {
     LPBYTE pbLineBegin;
@@ -276,8 +300,7 @@ static char * ReadListFileLine(TListFileCache * pCache, size_t * PtrLength)
     pbLineBegin = pbLineEnd = pCache->pPos;
 
     // Find the end of the line
-    while(pCache->pPos < pCache->pEnd && pCache->pPos[0] != 0x0A && pCache->pPos[0] != 0x0D)
-        pCache->pPos++;
+    pCache->pPos = FindLineEnd(pCache->pPos, pCache->pEnd);
 
     // Remember the end of the line
     pbLineEnd = pCache->pPos++;
@@ -493,6 +516,83 @@ int SListFileSaveToMpq(TMPQArchive * ha)
     return nError;
 }
 
+// Finds a batch of names in an MPQ that only has hash table.
+// All names are hashed first, then the hash table is searched
+static void SListFileCreateNodes_Hash(TMPQArchive * ha, const char ** szFileNames, DWORD dwNameCount)
+{
+    TMPQNameHash NameHashes[LISTFILE_BATCH_SIZE];
+    TMPQHash * pFirstHash;
+    TMPQHash * pHash;
+    DWORD i;
+
+    // Calculate the hashes of all names in the batch
+    for(i = 0; i < dwNameCount; i++)
+        HashFileName(ha, szFileNames[i], &NameHashes[i]);
+
+    // Assign the name to all locale versions of each file
+    for(i = 0; i < dwNameCount; i++)
+    {
+        pFirstHash = pHash = GetFirstHashEntryByHash(ha, &NameHashes[i]);
+        while(pHash != NULL)
+        {
+            AllocateFileName(ha, ha->pFileTable + MPQ_BLOCK_INDEX(pHash), szFileNames[i]);
+            pHash = GetNextHashEntry(ha, pFirstHash, pHash);
+        }
+    }
+}
+
+// Finds a batch of names in an MPQ that only has HET table.
+static void SListFileCreateNodes_Het(TMPQArchive * ha, const char ** szFileNames, DWORD dwNameCount)
+{
+    DWORD dwFileIndexes[LISTFILE_BATCH_SIZE];
+
+    // Find all names of the batch and assign names to the found file entries
+    GetFileIndexes_Het(ha, szFileNames, dwNameCount, dwFileIndexes);
+    for(DWORD i = 0; i < dwNameCount; i++)
+    {
+        if(dwFileIndexes[i] != HASH_ENTRY_FREE)
+            AllocateFileName(ha, ha->pFileTable + dwFileIndexes[i], szFileNames[i]);
+    }
+}
+
+// Adds all names from the listfile cache to the MPQ.
+// The names are processed in batches, so that the hashing
+// of the names is separated from searching the tables
+static void SListFileCreateNodes(TMPQArchive * ha, TListFileCache * pCache)
+{
+    const char * szFileNames[LISTFILE_BATCH_SIZE];
+    DWORD dwNameCount;
+    char * szFileName;
+    size_t nLength = 0;
+
+    for(;;)
+    {
+        // Collect a batch of non-empty lines
+        for(dwNameCount = 0; dwNameCount < LISTFILE_BATCH_SIZE; )
+        {
+            if((szFileName = ReadListFileLine(pCache, &nLength)) == NULL)
+                break;
+            if(nLength != 0)
+                szFileNames[dwNameCount++] = szFileName;
+        }
+
+        // Stop if there are no more lines
+        if(dwNameCount == 0)
+            break;
+
+        // Add the names of the batch to the MPQ
+        if(ha->pHetTable == NULL && ha->pHashTable != NULL)
+            SListFileCreateNodes_Hash(ha, szFileNames, dwNameCount);
+        else if(ha->pHetTable != NULL && ha->pHashTable == NULL)
+            SListFileCreateNodes_Het(ha, szFileNames, dwNameCount);
+        else
+        {
+            for(DWORD i = 0; i < dwNameCount; i++)
+                SListFileCreateNodeForAllLocales(ha, szFileNames[i]);
+        }
+    }
+}
+
 static int SFileAddArbitraryListFile(
     TMPQArchive * ha,
     HANDLE hMpq,
@@ -505,16 +605,8 @@ static int SFileAddArbitraryListFile(
     pCache = CreateListFileCache(hMpq, szListFile, NULL, dwMaxSize, ha->dwFlags);
     if(pCache != NULL)
     {
-        char * szFileName;
-        size_t nLength = 0;
-
-        // Get the next line
-        while((szFileName = ReadListFileLine(pCache, &nLength)) != NULL)
-        {
-            // Add the line to the MPQ
-            if(nLength != 0)
-                SListFileCreateNodeForAllLocales(ha, szFileName);
-        }
+        // Add all names from the listfile
+        SListFileCreateNodes(ha, pCache);
 
         // Delete the cache
         FreeListFileCache(pCache);
@@ -567,6 +659,21 @@ static int SFileAddInternalListFile(
     return nError;
 }
 
+// Loads the internal listfile of an archive open with MPQ_OPEN_DEFER_LOAD
+void LoadDeferredListFile(TMPQArchive * ha)
+{
+    if(ha->dwFlags & MPQ_FLAG_LISTFILE_DEFERRED)
+    {
+        ha->dwFlags &= ~MPQ_FLAG_LISTFILE_DEFERRED;
+
+        // Ignore result of the operation. (listfile) is optional.
+        SFileAddInternalListFile(ha, (HANDLE)ha);
+        SListFileCreateNodeForAllLocales(ha, LISTFILE_NAME);
+        SListFileCreateNodeForAllLocales(ha, SIGNATURE_NAME);
+        SListFileCreateNodeForAllLocales(ha, ATTRIBUTES_NAME);
+    }
+}
+
 static bool DoListFileSearch(TListFileCache * pCache, SFILE_FIND_DATA * lpFindFileData)
 {
     // Check for the valid search handle
@@ -609,10 +716,14 @@ int WINAPI SFileAddListFile(HANDLE hMpq, const TCHAR * szListFile)
     // Add the listfile for each MPQ in the patch chain
     while(ha != NULL)
     {
+        // The internal listfile is loaded now, don't load it again on first use
         if(szListFile != NULL)
             nError = SFileAddArbitraryListFile(ha, NULL, szListFile, MAX_LISTFILE_SIZE);
         else
+        {
+            ha->dwFlags &= ~MPQ_FLAG_LISTFILE_DEFERRED;
             nError = SFileAddInternalListFile(ha, hMpq);
+        }
 
         // Also, add three special files to the listfile:
         // (listfile) itself, (attributes) and (signature)
@@ -228,6 +228,9 @@ bool WINAPI SFileOpenArchive(
 
         // Also remember if this MPQ is a patch
         ha->dwFlags |= (dwFlags & MPQ_OPEN_PATCH) ? MPQ_FLAG_PATCH : 0;
+
+        // Also remember if the archive shall be compacted on multiple threads
+        ha->dwFlags |= (dwFlags & MPQ_OPEN_PARALLEL_COMPACT) ? MPQ_FLAG_PARALLEL_COMPACT : 0;
        
         // Limit the header searching to about 130 MB of data
         if(EndOfSearch > 0x08000000)
@@ -372,8 +375,8 @@ bool WINAPI SFileOpenArchive(
         ha->pHeader->dwBlockTableSize = (ha->pHeader->dwBlockTableSize & BLOCK_INDEX_MASK);
         ha->pHeader->dwHashTableSize = (ha->pHeader->dwHashTableSize & BLOCK_INDEX_MASK);
 
-        // Both MPQ_OPEN_NO_LISTFILE or MPQ_OPEN_NO_ATTRIBUTES trigger read only mode
-        if(dwFlags & (MPQ_OPEN_NO_LISTFILE | MPQ_OPEN_NO_ATTRIBUTES))
+        // MPQ_OPEN_NO_LISTFILE, MPQ_OPEN_NO_ATTRIBUTES and MPQ_OPEN_DEFER_LOAD trigger read only mode
+        if(dwFlags & (MPQ_OPEN_NO_LISTFILE | MPQ_OPEN_NO_ATTRIBUTES | MPQ_OPEN_DEFER_LOAD))
             ha->dwFlags |= MPQ_FLAG_READ_ONLY;
 
         // Remember whether whis is a map for Warcraft III
@@ -401,6 +404,15 @@ bool WINAPI SFileOpenArchive(
         nError = BuildFileTable(ha);
     }
 
+    // If the archive is read-only, its hash table will not change anymore.
+    // Build the hash index that will make searching for non-existing files cheap.
+    // Build it before loading the listfile, as most listfile names are usually not in the MPQ.
+    // Ignore the result, the hash index is optional.
+    if(nError == ERROR_SUCCESS && ha->pHashTable != NULL && (ha->dwFlags & (MPQ_FLAG_READ_ONLY | MPQ_FLAG_MALFORMED)))
+    {
+        ha->pHashIndex = CreateHashIndex(ha);
+    }
+
     // Load the internal listfile and include it to the file table
     if(nError == ERROR_SUCCESS && (dwFlags & MPQ_OPEN_NO_LISTFILE) == 0)
     {
@@ -409,7 +421,11 @@ bool WINAPI SFileOpenArchive(
         if(pFileEntry != NULL)
         {
             // Ignore result of the operation. (listfile) is optional.
-            SFileAddListFile((HANDLE)ha, NULL);
+            // With MPQ_OPEN_DEFER_LOAD, it is loaded when the names are first needed.
+            if(dwFlags & MPQ_OPEN_DEFER_LOAD)
+                ha->dwFlags |= MPQ_FLAG_LISTFILE_DEFERRED;
+            else
+                SFileAddListFile((HANDLE)ha, NULL);
             ha->dwFileFlags1 = pFileEntry->dwFlags;
         }
     }
@@ -422,7 +438,11 @@ bool WINAPI SFileOpenArchive(
         if(pFileEntry != NULL)
         {
             // Ignore result of the operation. (attributes) is optional.
-            SAttrLoadAttributes(ha);
+            // With MPQ_OPEN_DEFER_LOAD, it is loaded when the attributes are first needed.
+            if(dwFlags & MPQ_OPEN_DEFER_LOAD)
+                ha->dwFlags |= MPQ_FLAG_ATTRIBUTES_DEFERRED;
+            else
+                SAttrLoadAttributes(ha);
             ha->dwFileFlags2 = pFileEntry->dwFlags;
         }
     }
@@ -262,9 +262,11 @@ bool WINAPI SFileOpenFileEx(HANDLE hMpq, const char * szFileName, DWORD dwSearch
                 // Check the pseudo-file name
                 if((bOpenByIndex = IsPseudoFileName(szFileName, &dwFileIndex)) == true)
                 {
-                    // Get the file entry for the file
+                    // Get the file entry for the file. Its name (if known)
+                    // comes from the listfile, which is needed for the decryption key
                     if(dwFileIndex > ha->dwFileTableSize)
                         break;
+                    LoadDeferredListFile(ha);
                     pFileEntry = ha->pFileTable + dwFileIndex;
                 }
                 else
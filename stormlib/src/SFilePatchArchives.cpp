@@ -62,6 +62,18 @@ typedef struct _BSDIFF_CTRL_BLOCK
 
 } BSDIFF_CTRL_BLOCK, *PBSDIFF_CTRL_BLOCK;
 
+// Reader of the (possibly RLE-compressed) BSD0 patch data.
+// Several readers may walk the same patch data at different positions.
+typedef struct _BSDIFF_READER
+{
+    LPBYTE pbData;                          // Current position in the patch data
+    LPBYTE pbDataEnd;                       // End of the patch data
+    DWORD dwRemaining;                      // Remaining bytes of the decompressed patch data
+    DWORD dwLiteral;                        // Remaining bytes of the current literal run
+    DWORD dwZeros;                          // Remaining bytes of the current zero run
+
+} BSDIFF_READER, *PBSDIFF_READER;
+
 typedef struct _LOCALIZED_MPQ_INFO
 {
     const char * szNameTemplate;            // Name template
@@ -156,49 +168,14 @@ static int LoadFilePatch_COPY(TMPQFile * hf, PMPQ_PATCH_HEADER pFullPatch)
     return (cbBytesRead == cbBytesToRead) ? ERROR_SUCCESS : ERROR_FILE_CORRUPT;
 }
 
-static int LoadFilePatch_BSD0(TMPQFile * hf, PMPQ_PATCH_HEADER pFullPatch)
+static int LoadFilePatch_BSD0(TMPQFile * hf, PMPQ_PATCH_HEADER pFullPatch, DWORD cbPatchData)
 {
-    LPBYTE pbDecompressed = (LPBYTE)(pFullPatch + 1);
-    LPBYTE pbCompressed = NULL;
-    DWORD cbDecompressed = 0;
-    DWORD cbCompressed = 0;
     DWORD dwBytesRead = 0;
-    int nError = ERROR_SUCCESS;
-
-    // Calculate the size of compressed data
-    cbDecompressed = pFullPatch->dwSizeOfPatchData - sizeof(MPQ_PATCH_HEADER);
-    cbCompressed = pFullPatch->dwXfrmBlockSize - SIZE_OF_XFRM_HEADER;
-
-    // Is that file compressed?
-    if(cbCompressed < cbDecompressed)
-    {
-        pbCompressed = STORM_ALLOC(BYTE, cbCompressed);
-        if(pbCompressed == NULL)
-            nError = ERROR_NOT_ENOUGH_MEMORY;
-
-        // Read the compressed patch data
-        if(nError == ERROR_SUCCESS)
-        {
-            SFileReadFile((HANDLE)hf, pbCompressed, cbCompressed, &dwBytesRead, NULL);
-            if(dwBytesRead != cbCompressed)
-                nError = ERROR_FILE_CORRUPT;
-        }
-
-        // Decompress the data
-        if(nError == ERROR_SUCCESS)
-            Decompress_RLE(pbDecompressed, cbDecompressed, pbCompressed, cbCompressed);
-
-        if(pbCompressed != NULL)
-            STORM_FREE(pbCompressed);
-    }
-    else
-    {
-        SFileReadFile((HANDLE)hf, pbDecompressed, cbDecompressed, &dwBytesRead, NULL);
-        if(dwBytesRead != cbDecompressed)
-            nError = ERROR_FILE_CORRUPT;
-    }
 
-    return nError;
+    // Load the patch data as they are stored. If they are RLE-compressed,
+    // they are decompressed on the fly while the patch is being applied
+    SFileReadFile((HANDLE)hf, (pFullPatch + 1), cbPatchData, &dwBytesRead, NULL);
+    return (dwBytesRead == cbPatchData) ? ERROR_SUCCESS : ERROR_FILE_CORRUPT;
 }
 
 static int ApplyFilePatch_COPY(
@@ -216,17 +193,129 @@ static int ApplyFilePatch_COPY(
     return ERROR_SUCCESS;
 }
 
+static void BsdiffReader_Init(PBSDIFF_READER pReader, PMPQ_PATCH_HEADER pFullPatch)
+{
+    LPBYTE pbPatchData = (LPBYTE)(pFullPatch + 1);
+    DWORD cbDecompressed = pFullPatch->dwSizeOfPatchData - sizeof(MPQ_PATCH_HEADER);
+    DWORD cbCompressed = pFullPatch->dwXfrmBlockSize - SIZE_OF_XFRM_HEADER;
+
+    // Compressed data: Cut the initial DWORD and start with the first RLE control byte
+    // Plain data: Handle the entire patch as one literal run
+    if(cbCompressed < cbDecompressed)
+    {
+        pReader->pbData = pbPatchData + sizeof(DWORD);
+        pReader->pbDataEnd = pbPatchData + cbCompressed;
+        pReader->dwRemaining = cbDecompressed;
+        pReader->dwLiteral = 0;
+    }
+    else
+    {
+        pReader->pbData = pbPatchData;
+        pReader->pbDataEnd = pbPatchData + cbDecompressed;
+        pReader->dwRemaining = 0;
+        pReader->dwLiteral = cbDecompressed;
+    }
+
+    // Prevent reading past the end on malformed data
+    if(pReader->pbData > pReader->pbDataEnd)
+        pReader->pbData = pReader->pbDataEnd;
+    pReader->dwZeros = 0;
+}
+
+// Reads the next bytes of the decompressed patch. Behaves like Decompress_RLE:
+// zero runs give zeros and everything beyond the end of the patch data is zero too.
+// If pbBuffer is NULL, the data are just skipped.
+static void BsdiffReader_Read(PBSDIFF_READER pReader, LPBYTE pbBuffer, DWORD cbBytesToRead)
+{
+    DWORD dwLength;
+    BYTE OneByte;
+
+    while(cbBytesToRead > 0)
+    {
+        // Start the next run, if the current one is over
+        if(pReader->dwLiteral == 0 && pReader->dwZeros == 0)
+        {
+            // Behind the end of the data, there are zeros only
+            if(pReader->pbData >= pReader->pbDataEnd || pReader->dwRemaining == 0)
+            {
+                pReader->dwZeros = cbBytesToRead;
+            }
+            else
+            {
+                OneByte = *pReader->pbData++;
+                if(OneByte & 0x80)
+                    pReader->dwLiteral = STORMLIB_MIN((DWORD)(OneByte & 0x7F) + 1, (DWORD)(pReader->pbDataEnd - pReader->pbData));
+                else
+                    pReader->dwZeros = (DWORD)OneByte + 1;
+
+                // Don't go past the decompressed size
+                pReader->dwLiteral = STORMLIB_MIN(pReader->dwLiteral, pReader->dwRemaining);
+                pReader->dwZeros = STORMLIB_MIN(pReader->dwZeros, pReader->dwRemaining);
+                pReader->dwRemaining -= (pReader->dwLiteral + pReader->dwZeros);
+                continue;
+            }
+        }
+
+        // Copy the literal bytes
+        if(pReader->dwLiteral != 0)
+        {
+            dwLength = STORMLIB_MIN(pReader->dwLiteral, cbBytesToRead);
+            if(pbBuffer != NULL)
+                memcpy(pbBuffer, pReader->pbData, dwLength);
+            pReader->pbData += dwLength;
+            pReader->dwLiteral -= dwLength;
+        }
+        else
+        {
+            dwLength = STORMLIB_MIN(pReader->dwZeros, cbBytesToRead);
+            if(pbBuffer != NULL)
+                memset(pbBuffer, 0, dwLength);
+            pReader->dwZeros -= dwLength;
+        }
+
+        // Move the buffer
+        if(pbBuffer != NULL)
+            pbBuffer += dwLength;
+        cbBytesToRead -= dwLength;
+    }
+}
+
+// Adds the old data to the diff string, byte by byte without carry.
+// Eight bytes are processed at once: the low 7 bits of each byte are added
+// without overflowing into the next byte, then the top bits are added by XOR.
+static void BsdiffAddOldData(LPBYTE pbNewData, LPBYTE pbOldData, DWORD cbLength)
+{
+    ULONGLONG NewData;
+    ULONGLONG OldData;
+    DWORD i = 0;
+
+    for(; (i + sizeof(ULONGLONG)) <= cbLength; i += sizeof(ULONGLONG))
+    {
+        memcpy(&NewData, pbNewData + i, sizeof(ULONGLONG));
+        memcpy(&OldData, pbOldData + i, sizeof(ULONGLONG));
+        NewData = ((NewData & 0x7F7F7F7F7F7F7F7FULL) + (OldData & 0x7F7F7F7F7F7F7F7FULL)) ^ ((NewData ^ OldData) & 0x8080808080808080ULL);
+        memcpy(pbNewData + i, &NewData, sizeof(ULONGLONG));
+    }
+
+    for(; i < cbLength; i++)
+        pbNewData[i] = pbNewData[i] + pbOldData[i];
+}
+
 static int ApplyFilePatch_BSD0(
     TMPQPatcher * pPatcher,
     PMPQ_PATCH_HEADER pFullPatch,
     LPBYTE pbTarget,
     LPBYTE pbSource)
 {
-    PBLIZZARD_BSDIFF40_FILE pBsdiff;
-    PBSDIFF_CTRL_BLOCK pCtrlBlock;
-    LPBYTE pbPatchData = (LPBYTE)(pFullPatch + 1);
-    LPBYTE pDataBlock;
-    LPBYTE pExtraBlock;
+    BLIZZARD_BSDIFF40_FILE Bsdiff;
+    BSDIFF_CTRL_BLOCK CtrlBlock;
+    BSDIFF_READER CtrlReader;
+    BSDIFF_READER DataReader;
+    BSDIFF_READER ExtraReader;
+    ULONGLONG CtrlBlockSize;
+    ULONGLONG DataBlockSize;
+    ULONGLONG CtrlBlockCount;
+    DWORD cbBlocks;
     LPBYTE pbOldData = pbSource;
     LPBYTE pbNewData = pbTarget;
     DWORD dwCombineSize;
@@ -235,47 +324,54 @@ static int ApplyFilePatch_BSD0(
     DWORD dwNewSize;                                // Patched file size
     DWORD dwOldSize = pPatcher->cbFileData;         // File size before patch
 
-    // Get pointer to the patch header
+    // Get the patch header
     // Format of BSDIFF header corresponds to original BSDIFF, which is:
     // 0000   8 bytes   signature "BSDIFF40"
     // 0008   8 bytes   size of the control block
     // 0010   8 bytes   size of the data block
     // 0018   8 bytes   new size of the patched file
-    pBsdiff = (PBLIZZARD_BSDIFF40_FILE)pbPatchData;
-    pbPatchData += sizeof(BLIZZARD_BSDIFF40_FILE);
+    BsdiffReader_Init(&CtrlReader, pFullPatch);
+    BsdiffReader_Read(&CtrlReader, (LPBYTE)&Bsdiff, sizeof(BLIZZARD_BSDIFF40_FILE));
+    CtrlBlockSize = BSWAP_INT64_UNSIGNED(Bsdiff.CtrlBlockSize);
+    DataBlockSize = BSWAP_INT64_UNSIGNED(Bsdiff.DataBlockSize);
+    dwNewSize = (DWORD)BSWAP_INT64_UNSIGNED(Bsdiff.NewFileSize);
+
+    // The blocks must fit into the patch
+    cbBlocks = pFullPatch->dwSizeOfPatchData - sizeof(MPQ_PATCH_HEADER) - sizeof(BLIZZARD_BSDIFF40_FILE);
+    if(CtrlBlockSize > cbBlocks || DataBlockSize > (cbBlocks - CtrlBlockSize))
+        return ERROR_FILE_CORRUPT;
+    CtrlBlockCount = CtrlBlockSize / sizeof(BSDIFF_CTRL_BLOCK);
 
-    // Get pointer to the 32-bit BSDIFF control block
-    // The control block follows immediately after the BSDIFF header
+    // The 32-bit BSDIFF control block follows immediately after the BSDIFF header
     // and consists of three 32-bit integers
     // 0000   4 bytes   Length to copy from the BSDIFF data block the new file
     // 0004   4 bytes   Length to copy from the BSDIFF extra block
     // 0008   4 bytes   Size to increment source file offset
-    pCtrlBlock = (PBSDIFF_CTRL_BLOCK)pbPatchData;
-    pbPatchData += (size_t)BSWAP_INT64_UNSIGNED(pBsdiff->CtrlBlockSize);
-
-    // Get the pointer to the data block
-    pDataBlock = (LPBYTE)pbPatchData;
-    pbPatchData += (size_t)BSWAP_INT64_UNSIGNED(pBsdiff->DataBlockSize);
-
-    // Get the pointer to the extra block
-    pExtraBlock = (LPBYTE)pbPatchData;
-    dwNewSize = (DWORD)BSWAP_INT64_UNSIGNED(pBsdiff->NewFileSize);
+    // The data block follows the control block and the extra block follows the data block.
+    // All three blocks are read at once, each one by its own reader.
+    DataReader = CtrlReader;
+    BsdiffReader_Read(&DataReader, NULL, (DWORD)CtrlBlockSize);
+    ExtraReader = DataReader;
+    BsdiffReader_Read(&ExtraReader, NULL, (DWORD)DataBlockSize);
 
     // Now patch the file
     while(dwNewOffset < dwNewSize)
     {
-        DWORD dwAddDataLength = BSWAP_INT32_UNSIGNED(pCtrlBlock->dwAddDataLength);
-        DWORD dwMovDataLength = BSWAP_INT32_UNSIGNED(pCtrlBlock->dwMovDataLength);
-        DWORD dwOldMoveLength = BSWAP_INT32_UNSIGNED(pCtrlBlock->dwOldMoveLength);
-        DWORD i;
+        // Get the next control block
+        if(CtrlBlockCount-- == 0)
+            return ERROR_FILE_CORRUPT;
+        BsdiffReader_Read(&CtrlReader, (LPBYTE)&CtrlBlock, sizeof(BSDIFF_CTRL_BLOCK));
+
+        DWORD dwAddDataLength = BSWAP_INT32_UNSIGNED(CtrlBlock.dwAddDataLength);
+        DWORD dwMovDataLength = BSWAP_INT32_UNSIGNED(CtrlBlock.dwMovDataLength);
+        DWORD dwOldMoveLength = BSWAP_INT32_UNSIGNED(CtrlBlock.dwOldMoveLength);
 
         // Sanity check
-        if((dwNewOffset + dwAddDataLength) > dwNewSize)
+        if((dwNewOffset + dwAddDataLength) > dwNewSize || (dwNewOffset + dwAddDataLength) < dwNewOffset)
             return ERROR_FILE_CORRUPT;
 
         // Read the diff string to the target buffer
-        memcpy(pbNewData + dwNewOffset, pDataBlock, dwAddDataLength);
-        pDataBlock += dwAddDataLength;
+        BsdiffReader_Read(&DataReader, pbNewData + dwNewOffset, dwAddDataLength);
 
         // Get the longest block that we can combine
         dwCombineSize = ((dwOldOffset + dwAddDataLength) >= dwOldSize) ? (dwOldSize - dwOldOffset) : dwAddDataLength;
@@ -283,27 +379,24 @@ static int ApplyFilePatch_BSD0(
             return ERROR_FILE_CORRUPT;
 
         // Now combine the patch data with the original file
-        for(i = 0; i < dwCombineSize; i++)
-            pbNewData[dwNewOffset + i] = pbNewData[dwNewOffset + i] + pbOldData[dwOldOffset + i];
-        
+        BsdiffAddOldData(pbNewData + dwNewOffset, pbOldData + dwOldOffset, dwCombineSize);
+
         // Move the offsets 
         dwNewOffset += dwAddDataLength;
         dwOldOffset += dwAddDataLength;
 
         // Sanity check
-        if((dwNewOffset + dwMovDataLength) > dwNewSize)
+        if((dwNewOffset + dwMovDataLength) > dwNewSize || (dwNewOffset + dwMovDataLength) < dwNewOffset)
             return ERROR_FILE_CORRUPT;
 
         // Copy the data from the extra block in BSDIFF patch
-        memcpy(pbNewData + dwNewOffset, pExtraBlock, dwMovDataLength);
-        pExtraBlock += dwMovDataLength;
+        BsdiffReader_Read(&ExtraReader, pbNewData + dwNewOffset, dwMovDataLength);
         dwNewOffset += dwMovDataLength;
 
         // Move the old offset
         if(dwOldMoveLength & 0x80000000)
             dwOldMoveLength = 0x80000000 - dwOldMoveLength;
         dwOldOffset += dwOldMoveLength;
-        pCtrlBlock++;
     }
 
     // The size after patch must match
@@ -318,6 +411,7 @@ static int ApplyFilePatch_BSD0(
 static PMPQ_PATCH_HEADER LoadFullFilePatch(TMPQFile * hf, MPQ_PATCH_HEADER & PatchHeader)
 {
     PMPQ_PATCH_HEADER pFullPatch;
+    DWORD cbPatchData;
     int nError = ERROR_SUCCESS;
 
     // BSWAP the entire header, if needed
@@ -328,8 +422,21 @@ static PMPQ_PATCH_HEADER LoadFullFilePatch(TMPQFile * hf, MPQ_PATCH_HEADER & Pat
     if(PatchHeader.dwSignature != PATCH_SIGNATURE_HEADER || PatchHeader.dwMD5 != PATCH_SIGNATURE_MD5 || PatchHeader.dwXFRM != PATCH_SIGNATURE_XFRM)
         return NULL;
 
-    // Allocate space for patch header and compressed data
-    pFullPatch = (PMPQ_PATCH_HEADER)STORM_ALLOC(BYTE, PatchHeader.dwSizeOfPatchData);
+    // Verify the size of the patch
+    if(PatchHeader.dwSizeOfPatchData < sizeof(MPQ_PATCH_HEADER))
+        return NULL;
+    cbPatchData = PatchHeader.dwSizeOfPatchData - sizeof(MPQ_PATCH_HEADER);
+
+    // BSD0 patches are kept compressed; they are decompressed while being applied
+    if(PatchHeader.dwPatchType == 0x30445342)
+    {
+        if(cbPatchData < sizeof(BLIZZARD_BSDIFF40_FILE) || PatchHeader.dwXfrmBlockSize < SIZE_OF_XFRM_HEADER)
+            return NULL;
+        cbPatchData = STORMLIB_MIN(cbPatchData, PatchHeader.dwXfrmBlockSize - SIZE_OF_XFRM_HEADER);
+    }
+
+    // Allocate space for patch header and the patch data as they are stored
+    pFullPatch = (PMPQ_PATCH_HEADER)STORM_ALLOC(BYTE, sizeof(MPQ_PATCH_HEADER) + cbPatchData);
     if(pFullPatch != NULL)
     {
         // Copy the patch header
@@ -345,7 +452,7 @@ static PMPQ_PATCH_HEADER LoadFullFilePatch(TMPQFile * hf, MPQ_PATCH_HEADER & Pat
                     break;
 
                 case 0x30445342:    // 'BSD0'
-                    nError = LoadFilePatch_BSD0(hf, pFullPatch);
+                    nError = LoadFilePatch_BSD0(hf, pFullPatch, cbPatchData);
                     break;
 
                 default:
@@ -419,8 +526,9 @@ static bool CreatePatchPrefix(TMPQArchive * ha, const char * szFileName, size_t
     if(szFileName != NULL && nLength == 0)
         nLength = strlen(szFileName);
 
-    // Create the patch prefix
-    pNewPrefix = (TMPQNamePrefix *)STORM_ALLOC(BYTE, sizeof(TMPQNamePrefix) + nLength + 1);
+    // Create the patch prefix. Reserve space for the appended backslash and the terminator.
+    // The prefix is freed together with the archive's memory pool
+    pNewPrefix = (TMPQNamePrefix *)AllocateFromPool(&ha->pMemoryPool, sizeof(TMPQNamePrefix) + nLength + 2);
     if(pNewPrefix != NULL)
     {
         // Fill the name prefix. Also add the backslash
@@ -906,6 +1014,73 @@ static bool FindPatchPrefix(TMPQArchive * haBase, TMPQArchive * haPatch, const c
     return true;
 }
 
+//-----------------------------------------------------------------------------
+// Local functions - cache of patched files
+
+// Computes the identity of the base file and all of its patches.
+// The result changes whenever a patch archive is added to the chain
+// or any file of the chain gets replaced.
+static void GetPatchChainHash(TMPQFile * hf, LPBYTE chain_md5)
+{
+    TFileEntry * pFileEntry;
+    hash_state md5_state;
+
+    md5_init(&md5_state);
+    while(hf != NULL)
+    {
+        pFileEntry = hf->pFileEntry;
+
+        // Two patch MPQs may contain equal file entries, so the archive is included too
+        md5_process(&md5_state, (unsigned char *)&hf->ha, sizeof(TMPQArchive *));
+        md5_process(&md5_state, (unsigned char *)&pFileEntry->ByteOffset, sizeof(ULONGLONG));
+        md5_process(&md5_state, (unsigned char *)&pFileEntry->FileTime, sizeof(ULONGLONG));
+        md5_process(&md5_state, (unsigned char *)&pFileEntry->dwFileSize, sizeof(DWORD));
+        md5_process(&md5_state, (unsigned char *)&pFileEntry->dwCmpSize, sizeof(DWORD));
+        md5_process(&md5_state, (unsigned char *)&pFileEntry->dwFlags, sizeof(DWORD));
+        md5_process(&md5_state, pFileEntry->md5, MD5_DIGEST_SIZE);
+        hf = hf->hfPatch;
+    }
+    md5_done(&md5_state, chain_md5);
+}
+
+static void StorePatchedFileToCache(TMPQFile * hf, LPBYTE chain_md5)
+{
+    TMPQPatchCache ** ppCache;
+    TMPQPatchCache * pCache;
+    TMPQArchive * ha = hf->ha;
+
+    // Don't let a single big file flush the entire cache
+    if(hf->cbFileData > (MPQ_PATCH_CACHE_SIZE / 4))
+        return;
+
+    // Drop the least recently used entries until the new one fits
+    while(ha->pPatchCache != NULL && (ha->cbPatchCache + hf->cbFileData) > MPQ_PATCH_CACHE_SIZE)
+    {
+        ppCache = &ha->pPatchCache;
+        while((*ppCache)->pNext != NULL)
+            ppCache = &(*ppCache)->pNext;
+
+        ha->cbPatchCache -= (*ppCache)->cbFileData;
+        STORM_FREE(*ppCache);
+        *ppCache = NULL;
+    }
+
+    // Allocate the entry together with the data. Failure here is not an error
+    pCache = (TMPQPatchCache *)STORM_ALLOC(BYTE, sizeof(TMPQPatchCache) + hf->cbFileData);
+    if(pCache != NULL)
+    {
+        memcpy(pCache->base_md5, hf->pFileEntry->md5, MD5_DIGEST_SIZE);
+        memcpy(pCache->chain_md5, chain_md5, MD5_DIGEST_SIZE);
+        memcpy(pCache + 1, hf->pbFileData, hf->cbFileData);
+        pCache->cbFileData = hf->cbFileData;
+
+        // Insert it as the most recently used one
+        pCache->pNext = ha->pPatchCache;
+        ha->pPatchCache = pCache;
+        ha->cbPatchCache += hf->cbFileData;
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Public functions (StormLib internals)
 
@@ -934,6 +1109,53 @@ bool IsIncrementalPatchFile(const void * pvData, DWORD cbData, LPDWORD pdwPatche
     return false;
 }
 
+bool Patch_LoadFromCache(TMPQFile * hf)
+{
+    TMPQPatchCache ** ppCache;
+    TMPQPatchCache * pCache;
+    TMPQArchive * ha = hf->ha;
+    BYTE chain_md5[MD5_DIGEST_SIZE];
+
+    // Don't bother with the chain hash if nothing has been cached yet
+    if(ha->pPatchCache == NULL)
+        return false;
+    GetPatchChainHash(hf, chain_md5);
+
+    // Search the cache for the file
+    for(ppCache = &ha->pPatchCache; (pCache = *ppCache) != NULL; ppCache = &pCache->pNext)
+    {
+        if(!memcmp(pCache->chain_md5, chain_md5, MD5_DIGEST_SIZE) && !memcmp(pCache->base_md5, hf->pFileEntry->md5, MD5_DIGEST_SIZE))
+        {
+            // Give the file its own copy of the data. Zero-sized files still need a valid buffer
+            hf->pbFileData = STORM_ALLOC(BYTE, pCache->cbFileData + 1);
+            if(hf->pbFileData == NULL)
+                return false;
+            memcpy(hf->pbFileData, pCache + 1, pCache->cbFileData);
+            hf->cbFileData = pCache->cbFileData;
+
+            // Move the entry to the begin of the list
+            *ppCache = pCache->pNext;
+            pCache->pNext = ha->pPatchCache;
+            ha->pPatchCache = pCache;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Patch_FreeCache(TMPQArchive * ha)
+{
+    TMPQPatchCache * pCache;
+
+    while((pCache = ha->pPatchCache) != NULL)
+    {
+        ha->pPatchCache = pCache->pNext;
+        STORM_FREE(pCache);
+    }
+    ha->cbPatchCache = 0;
+}
+
 int Patch_InitPatcher(TMPQPatcher * pPatcher, TMPQFile * hf)
 {
     DWORD cbMaxFileData = 0;
@@ -994,6 +1216,7 @@ int Patch_Process(TMPQPatcher * pPatcher, TMPQFile * hf)
     MPQ_PATCH_HEADER PatchHeader2 = {0};
     TMPQFile * hfBase = hf;
     DWORD cbBytesRead = 0;
+    BYTE chain_md5[MD5_DIGEST_SIZE];
     int nError = ERROR_SUCCESS;
 
     // Move to the first patch
@@ -1063,6 +1286,10 @@ int Patch_Process(TMPQPatcher * pPatcher, TMPQFile * hf)
 
         // Also supply the data size
         hfBase->cbFileData = pPatcher->cbFileData;
+
+        // Remember the result, so the next open doesn't need to apply the patches again
+        GetPatchChainHash(hfBase, chain_md5);
+        StorePatchedFileToCache(hfBase, chain_md5);
     }
 
     return ERROR_SUCCESS;
@@ -1123,6 +1350,16 @@ bool WINAPI SFileOpenPatchArchive(
             nError = ERROR_ACCESS_DENIED;
     }
 
+    // Matching the patches needs the file names and MD5s of the patched archives
+    if(nError == ERROR_SUCCESS)
+    {
+        for(haPatch = ha; haPatch != NULL; haPatch = haPatch->haPatch)
+        {
+            LoadDeferredListFile(haPatch);
+            LoadDeferredAttributes(haPatch);
+        }
+    }
+
     // Open the archive like it is normal archive
     if(nError == ERROR_SUCCESS)
     {
@@ -95,7 +95,7 @@ static int ReadMpqSectors(TMPQFile * hf, LPBYTE pbBuffer, DWORD dwByteOffset, DW
     RawFilePos = CalculateRawSectorOffset(hf, dwRawSectorOffset);
 
     // Set file pointer and read all required sectors
-    if(FileStream_Read(ha->pStream, &RawFilePos, pbInSector, dwRawBytesToRead))
+    if(ReadMpqFileData(hf, RawFilePos, pbInSector, dwRawBytesToRead))
     {
         // Now we have to decrypt and decompress all file sectors that have been loaded
         for(DWORD i = 0; i < dwSectorsToRead; i++)
@@ -254,7 +254,7 @@ static int ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwFilePos
         }
         
         // Load the raw (compressed, encrypted) data
-        if(!FileStream_Read(ha->pStream, &RawFilePos, pbRawData, pFileEntry->dwCmpSize))
+        if(!ReadMpqFileData(hf, RawFilePos, pbRawData, pFileEntry->dwCmpSize))
         {
             STORM_FREE(pbCompressed);
             return GetLastError();
@@ -354,7 +354,6 @@ static int ReadMpqFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwFilePos
 static int ReadMpkFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwFilePos, DWORD dwToRead, LPDWORD pdwBytesRead)
 {
     ULONGLONG RawFilePos = hf->RawFilePos + 0x0C;   // For some reason, MPK files start at position (hf->RawFilePos + 0x0C)
-    TMPQArchive * ha = hf->ha;
     TFileEntry * pFileEntry = hf->pFileEntry;
     LPBYTE pbCompressed = NULL;
     LPBYTE pbRawData = hf->pbFileSector;
@@ -386,7 +385,7 @@ static int ReadMpkFileSingleUnit(TMPQFile * hf, void * pvBuffer, DWORD dwFilePos
         }
         
         // Load the raw (compressed, encrypted) data
-        if(!FileStream_Read(ha->pStream, &RawFilePos, pbRawData, pFileEntry->dwCmpSize))
+        if(!ReadMpqFileData(hf, RawFilePos, pbRawData, pFileEntry->dwCmpSize))
         {
             STORM_FREE(pbCompressed);
             return GetLastError();
@@ -577,8 +576,9 @@ static int ReadMpqFilePatchFile(TMPQFile * hf, void * pvBuffer, DWORD dwFilePos,
     DWORD dwBytesRead = 0;
     int nError = ERROR_SUCCESS;
 
-    // Make sure that the patch file is loaded completely
-    if(nError == ERROR_SUCCESS && hf->pbFileData == NULL)
+    // Make sure that the patch file is loaded completely.
+    // Files that have been patched before are taken from the cache.
+    if(nError == ERROR_SUCCESS && hf->pbFileData == NULL && !Patch_LoadFromCache(hf))
     {
         // Initialize patching process and allocate data
         nError = Patch_InitPatcher(&Patcher, hf);
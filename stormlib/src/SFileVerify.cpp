@@ -21,6 +21,8 @@
 // Local defines
 
 #define MPQ_DIGEST_UNIT_SIZE      0x10000
+#define MPQ_VERIFY_BATCH_FILES    0x40          // Max number of files a verify worker loads at once
+#define MPQ_VERIFY_BATCH_SIZE     0x00400000    // Max number of bytes a verify worker loads at once
 
 //-----------------------------------------------------------------------------
 // Known Blizzard public keys
@@ -551,6 +553,118 @@ static DWORD VerifyStrongSignature(
     return ERROR_STRONG_SIGNATURE_ERROR;
 }
 
+// Reads the entire file and checks the data against CRC32 and MD5
+static DWORD VerifyFileData(
+    TMPQFile * hf,
+    LPDWORD pdwCrc32,
+    LPBYTE md5,
+    DWORD dwFlags)
+{
+    hash_state md5_state;
+    unsigned char * pFileMd5;
+    TFileEntry * pFileEntry = hf->pFileEntry;
+    HANDLE hFile = (HANDLE)hf;
+    BYTE Buffer[0x1000];
+    DWORD dwVerifyResult = 0;
+    DWORD dwTotalBytes = 0;
+    DWORD dwCrc32 = 0;
+
+    // Get the file size
+    dwTotalBytes = SFileGetFileSize(hFile, NULL);
+
+    // Initialize the CRC32 and MD5 contexts
+    md5_init(&md5_state);
+    dwCrc32 = crc32(0, Z_NULL, 0);
+
+    // Also turn on sector checksum verification
+    if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
+        hf->bCheckSectorCRCs = true;
+
+    // Go through entire file and update both CRC32 and MD5
+    for(;;)
+    {
+        DWORD dwBytesRead = 0;
+
+        // Read data from file
+        SFileReadFile(hFile, Buffer, sizeof(Buffer), &dwBytesRead, NULL);
+        if(dwBytesRead == 0)
+        {
+            if(GetLastError() == ERROR_CHECKSUM_ERROR)
+                dwVerifyResult |= VERIFY_FILE_SECTOR_CRC_ERROR;
+            break;
+        }
+
+        // Update CRC32 value
+        if(dwFlags & SFILE_VERIFY_FILE_CRC)
+            dwCrc32 = crc32(dwCrc32, Buffer, dwBytesRead);
+        
+        // Update MD5 value
+        if(dwFlags & SFILE_VERIFY_FILE_MD5)
+            md5_process(&md5_state, Buffer, dwBytesRead);
+
+        // Decrement the total size
+        dwTotalBytes -= dwBytesRead;
+    }
+
+    // If the file has sector checksums, indicate it in the flags
+    if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
+    {
+        if((hf->pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC) && hf->SectorChksums != NULL && hf->SectorChksums[0] != 0)
+            dwVerifyResult |= VERIFY_FILE_HAS_SECTOR_CRC;
+    }
+
+    // Check if the entire file has been read
+    // No point in checking CRC32 and MD5 if not
+    // Skip checksum checks if the file has patches
+    if(dwTotalBytes == 0)
+    {
+        // Check CRC32 and MD5 only if there is no patches
+        if(hf->hfPatch == NULL)
+        {
+            // Check if the CRC32 matches.
+            if(dwFlags & SFILE_VERIFY_FILE_CRC)
+            {
+                // Only check the CRC32 if it is valid
+                if(pFileEntry->dwCrc32 != 0)
+                {
+                    dwVerifyResult |= VERIFY_FILE_HAS_CHECKSUM;
+                    if(dwCrc32 != pFileEntry->dwCrc32)
+                        dwVerifyResult |= VERIFY_FILE_CHECKSUM_ERROR;
+                }
+            }
+
+            // Check if MD5 matches
+            if(dwFlags & SFILE_VERIFY_FILE_MD5)
+            {
+                // Patch files have their MD5 saved in the patch info
+                pFileMd5 = (hf->pPatchInfo != NULL) ? hf->pPatchInfo->md5 : pFileEntry->md5;
+                md5_done(&md5_state, md5);
+
+                // Only check the MD5 if it is valid
+                if(IsValidMD5(pFileMd5))
+                {
+                    dwVerifyResult |= VERIFY_FILE_HAS_MD5;
+                    if(memcmp(md5, pFileMd5, MD5_DIGEST_SIZE))
+                        dwVerifyResult |= VERIFY_FILE_MD5_ERROR;
+                }
+            }
+        }
+        else
+        {
+            // Patched files are MD5-checked automatically
+            dwVerifyResult |= VERIFY_FILE_HAS_MD5;
+        }
+    }
+    else
+    {
+        dwVerifyResult |= VERIFY_READ_ERROR;
+    }
+
+    if(pdwCrc32 != NULL)
+        *pdwCrc32 = dwCrc32;
+    return dwVerifyResult;
+}
+
 static DWORD VerifyFile(
     HANDLE hMpq,
     const char * szFileName,
@@ -558,15 +672,10 @@ static DWORD VerifyFile(
     char * pMD5,
     DWORD dwFlags)
 {
-    hash_state md5_state;
-    unsigned char * pFileMd5;
     unsigned char md5[MD5_DIGEST_SIZE];
     TFileEntry * pFileEntry;
-    TMPQFile * hf;
-    BYTE Buffer[0x1000];
     HANDLE hFile = NULL;
     DWORD dwVerifyResult = 0;
-    DWORD dwTotalBytes = 0;
     DWORD dwCrc32 = 0;
 
     //
@@ -609,114 +718,187 @@ static DWORD VerifyFile(
     // Attempt to open the file
     if(SFileOpenFileEx(hMpq, szFileName, SFILE_OPEN_FROM_MPQ, &hFile))
     {
-        // Get the file size
-        hf = (TMPQFile *)hFile;
-        pFileEntry = hf->pFileEntry;
-        dwTotalBytes = SFileGetFileSize(hFile, NULL);
+        // The CRC32 and MD5 are checked against the (attributes)
+        LoadDeferredAttributes(((TMPQFile *)hFile)->ha);
+        dwVerifyResult |= VerifyFileData((TMPQFile *)hFile, &dwCrc32, md5, dwFlags);
+        SFileCloseFile(hFile);
+    }
+    else
+    {
+        // Remember that the file couldn't be open
+        dwVerifyResult |= VERIFY_OPEN_ERROR;
+    }
+
+    // If the caller required CRC32 and/or MD5, give it to him
+    if(pdwCrc32 != NULL)
+        *pdwCrc32 = dwCrc32;
+    if(pMD5 != NULL)
+        memcpy(pMD5, md5, MD5_DIGEST_SIZE); 
 
-        // Initialize the CRC32 and MD5 contexts
-        md5_init(&md5_state);
-        dwCrc32 = crc32(0, Z_NULL, 0);
+    return dwVerifyResult;
+}
 
-        // Also turn on sector checksum verification
-        if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
-            hf->bCheckSectorCRCs = true;
+//-----------------------------------------------------------------------------
+// Verification of all files on multiple threads
 
-        // Go through entire file and update both CRC32 and MD5
-        for(;;)
-        {
-            DWORD dwBytesRead = 0;
+typedef struct _TMPQVerifyJob
+{
+    TMPQArchive * ha;                           // The archive being verified
+    TFileEntry ** ppFileEntries;                // Files to verify, sorted by their position in the MPQ
+    DWORD dwFileCount;                          // Number of files in ppFileEntries
+    DWORD dwNextFile;                           // Index of the next file to be taken by a worker
+    DWORD dwFlags;                              // SFILE_VERIFY_XXX
+    SFILE_VERIFY_CALLBACK pfnVerifyCB;          // Callback for reporting progress and results
+    void * pvUserData;                          // User data for the callback
+    SFILE_VERIFY_STATS Stats;                   // Statistics of the verification
+    ULONGLONG TotalBytes;                       // Total size of the file data in the MPQ
+    STORM_LOCK Lock;                            // Protects all members above
+} TMPQVerifyJob;
+
+static int CompareFileEntriesByOffset(const void * pvEntry1, const void * pvEntry2)
+{
+    TFileEntry * pFileEntry1 = *(TFileEntry **)pvEntry1;
+    TFileEntry * pFileEntry2 = *(TFileEntry **)pvEntry2;
 
-            // Read data from file
-            SFileReadFile(hFile, Buffer, sizeof(Buffer), &dwBytesRead, NULL);
-            if(dwBytesRead == 0)
-            {
-                if(GetLastError() == ERROR_CHECKSUM_ERROR)
-                    dwVerifyResult |= VERIFY_FILE_SECTOR_CRC_ERROR;
+    if(pFileEntry1->ByteOffset < pFileEntry2->ByteOffset)
+        return -1;
+    return (pFileEntry1->ByteOffset > pFileEntry2->ByteOffset) ? 1 : 0;
+}
+
+// Same as VerifyFile, but works on one file entry of one archive,
+// without patches and without changing the archive
+static DWORD VerifyFileEntry(TMPQArchive * ha, TFileEntry * pFileEntry, DWORD dwFlags, LPBYTE pbRawData, LPDWORD pdwFileSize)
+{
+    unsigned char md5[MD5_DIGEST_SIZE];
+    TMPQFile * hf;
+    DWORD dwVerifyResult = 0;
+
+    // Verify the raw data MD5, if the archive supports it
+    if((dwFlags & SFILE_VERIFY_RAW_MD5) && ha->pHeader->dwRawChunkSize != 0)
+    {
+        dwVerifyResult |= VERIFY_FILE_HAS_RAW_MD5;
+        if(VerifyRawMpqData(ha, pFileEntry->ByteOffset, pFileEntry->dwCmpSize) != ERROR_SUCCESS)
+            return dwVerifyResult | VERIFY_FILE_RAW_MD5_ERROR;
+    }
+
+    // Create the file handle like SFileOpenFileEx does.
+    // We can only calculate the key if we know the file name.
+    hf = CreateFileHandle(ha, pFileEntry);
+    if(hf == NULL)
+        return dwVerifyResult | VERIFY_OPEN_ERROR;
+    if(ha->dwFlags & MPQ_FLAG_CHECK_SECTOR_CRC)
+        hf->bCheckSectorCRCs = true;
+    if((pFileEntry->dwFlags & MPQ_FILE_ENCRYPTED) && pFileEntry->szFileName != NULL)
+        hf->dwFileKey = DecryptFileKey(pFileEntry->szFileName, pFileEntry->ByteOffset, pFileEntry->dwFileSize, pFileEntry->dwFlags);
+
+    // If the raw data have already been loaded, the file reads them from memory
+    if(pbRawData != NULL)
+    {
+        hf->pbRawData = pbRawData;
+        hf->cbRawData = pFileEntry->dwCmpSize;
+    }
+
+    // Read and verify the data
+    dwVerifyResult |= VerifyFileData(hf, NULL, md5, dwFlags);
+    *pdwFileSize = SFileGetFileSize((HANDLE)hf, NULL);
+    FreeFileHandle(hf);
+    return dwVerifyResult;
+}
+
+static void VerifyWorker(void * pvContext)
+{
+    TMPQVerifyJob * pJob = (TMPQVerifyJob *)pvContext;
+    TMPQArchive * ha = pJob->ha;
+    TFileEntry * FileEntries[MPQ_VERIFY_BATCH_FILES];
+    TStreamRead Reads[MPQ_VERIFY_BATCH_FILES];
+    TFileEntry * pFileEntry;
+    LPBYTE pbBatchBuffer;
+    DWORD dwVerifyResult;
+    DWORD dwFileSize = 0;
+    DWORD dwBatchSize;
+    DWORD dwFileCount;
+    bool bFitsBuffer;
+
+    // Buffer for the raw data of a batch of files
+    pbBatchBuffer = STORM_ALLOC(BYTE, MPQ_VERIFY_BATCH_SIZE);
+
+    for(;;)
+    {
+        // Take a batch of files. Files are taken in the order of their position in the MPQ,
+        // so the reads from all workers form one forward sweep through the archive.
+        // A file that doesn't fit into the batch buffer makes a batch of its own
+        // and is read by the file handle itself.
+        StormLock(&pJob->Lock);
+        for(dwFileCount = dwBatchSize = 0; dwFileCount < MPQ_VERIFY_BATCH_FILES && pJob->dwNextFile < pJob->dwFileCount; dwFileCount++)
+        {
+            pFileEntry = pJob->ppFileEntries[pJob->dwNextFile];
+            bFitsBuffer = (pbBatchBuffer != NULL && (dwBatchSize + pFileEntry->dwCmpSize) <= MPQ_VERIFY_BATCH_SIZE);
+            if(dwFileCount != 0 && (bFitsBuffer == false || dwBatchSize == 0))
                 break;
-            }
 
-            // Update CRC32 value
-            if(dwFlags & SFILE_VERIFY_FILE_CRC)
-                dwCrc32 = crc32(dwCrc32, Buffer, dwBytesRead);
-            
-            // Update MD5 value
-            if(dwFlags & SFILE_VERIFY_FILE_MD5)
-                md5_process(&md5_state, Buffer, dwBytesRead);
+            Reads[dwFileCount].ByteOffset = FileOffsetFromMpqOffset(ha, pFileEntry->ByteOffset);
+            Reads[dwFileCount].pvBuffer = bFitsBuffer ? (pbBatchBuffer + dwBatchSize) : NULL;
+            Reads[dwFileCount].dwBytesToRead = pFileEntry->dwCmpSize;
+            Reads[dwFileCount].dwErrCode = ERROR_CAN_NOT_COMPLETE;
+            if(bFitsBuffer)
+                dwBatchSize += pFileEntry->dwCmpSize;
 
-            // Decrement the total size
-            dwTotalBytes -= dwBytesRead;
+            FileEntries[dwFileCount] = pFileEntry;
+            pJob->dwNextFile++;
         }
+        StormUnlock(&pJob->Lock);
 
-        // If the file has sector checksums, indicate it in the flags
-        if(dwFlags & SFILE_VERIFY_SECTOR_CRC)
+        // No more files to verify?
+        if(dwFileCount == 0)
+            break;
+
+        // Load the raw data of the whole batch at once. On Linux, all the reads
+        // are in flight together while the other workers decompress their batches.
+        if(dwBatchSize != 0)
+            FileStream_ReadBatch(ha->pStream, Reads, dwFileCount);
+
+        // If a read may still be in progress, the kernel can write to the batch buffer later.
+        // Leave the buffer alone and read the next files by their file handles.
+        for(DWORD i = 0; i < dwFileCount && pbBatchBuffer != NULL; i++)
         {
-            if((hf->pFileEntry->dwFlags & MPQ_FILE_SECTOR_CRC) && hf->SectorChksums != NULL && hf->SectorChksums[0] != 0)
-                dwVerifyResult |= VERIFY_FILE_HAS_SECTOR_CRC;
+            if(Reads[i].pvBuffer != NULL && Reads[i].dwErrCode == ERROR_CAN_NOT_COMPLETE)
+                pbBatchBuffer = NULL;
         }
 
-        // Check if the entire file has been read
-        // No point in checking CRC32 and MD5 if not
-        // Skip checksum checks if the file has patches
-        if(dwTotalBytes == 0)
+        // Verify the files. The ones whose data failed to load
+        // are read again (and the error reported) by the file handle
+        for(DWORD i = 0; i < dwFileCount; i++)
         {
-            // Check CRC32 and MD5 only if there is no patches
-            if(hf->hfPatch == NULL)
-            {
-                // Check if the CRC32 matches.
-                if(dwFlags & SFILE_VERIFY_FILE_CRC)
-                {
-                    // Only check the CRC32 if it is valid
-                    if(pFileEntry->dwCrc32 != 0)
-                    {
-                        dwVerifyResult |= VERIFY_FILE_HAS_CHECKSUM;
-                        if(dwCrc32 != pFileEntry->dwCrc32)
-                            dwVerifyResult |= VERIFY_FILE_CHECKSUM_ERROR;
-                    }
-                }
-
-                // Check if MD5 matches
-                if(dwFlags & SFILE_VERIFY_FILE_MD5)
-                {
-                    // Patch files have their MD5 saved in the patch info
-                    pFileMd5 = (hf->pPatchInfo != NULL) ? hf->pPatchInfo->md5 : pFileEntry->md5;
-                    md5_done(&md5_state, md5);
-
-                    // Only check the MD5 if it is valid
-                    if(IsValidMD5(pFileMd5))
-                    {
-                        dwVerifyResult |= VERIFY_FILE_HAS_MD5;
-                        if(memcmp(md5, pFileMd5, MD5_DIGEST_SIZE))
-                            dwVerifyResult |= VERIFY_FILE_MD5_ERROR;
-                    }
-                }
-            }
-            else
+            LPBYTE pbRawData = (Reads[i].dwErrCode == ERROR_SUCCESS) ? (LPBYTE)Reads[i].pvBuffer : NULL;
+
+            pFileEntry = FileEntries[i];
+
+            // Read, decompress and verify the file without holding the lock
+            dwVerifyResult = VerifyFileEntry(ha, pFileEntry, pJob->dwFlags, pbRawData, &dwFileSize);
+
+            // Update the statistics and report the result. The callback is never called
+            // from two threads at once, so it doesn't need to do its own locking.
+            StormLock(&pJob->Lock);
+            pJob->Stats.dwFileCount++;
+            pJob->Stats.RawBytes += pFileEntry->dwCmpSize;
+            pJob->Stats.FileBytes += dwFileSize;
+            if(dwVerifyResult & VERIFY_FILE_ERROR_MASK)
+                pJob->Stats.dwFailedCount++;
+            if(pJob->pfnVerifyCB != NULL)
             {
-                // Patched files are MD5-checked automatically
-                dwVerifyResult |= VERIFY_FILE_HAS_MD5;
+                pJob->pfnVerifyCB(pJob->pvUserData,
+                                  (DWORD)(pFileEntry - ha->pFileTable),
+                                  pFileEntry->szFileName,
+                                  dwVerifyResult,
+                                  pJob->Stats.RawBytes,
+                                  pJob->TotalBytes);
             }
+            StormUnlock(&pJob->Lock);
         }
-        else
-        {
-            dwVerifyResult |= VERIFY_READ_ERROR;
-        }
-
-        SFileCloseFile(hFile);
     }
-    else
-    {
-        // Remember that the file couldn't be open
-        dwVerifyResult |= VERIFY_OPEN_ERROR;
-    }
-
-    // If the caller required CRC32 and/or MD5, give it to him
-    if(pdwCrc32 != NULL)
-        *pdwCrc32 = dwCrc32;
-    if(pMD5 != NULL)
-        memcpy(pMD5, md5, MD5_DIGEST_SIZE); 
 
-    return dwVerifyResult;
+    if(pbBatchBuffer != NULL)
+        STORM_FREE(pbBatchBuffer);
 }
 
 // Used in SFileGetFileInfo
@@ -902,6 +1084,77 @@ DWORD WINAPI SFileVerifyFile(HANDLE hMpq, const char * szFileName, DWORD dwFlags
                       dwFlags);
 }
 
+// Verifies all files of the archive on multiple threads
+bool WINAPI SFileVerifyAllFiles(HANDLE hMpq, DWORD dwFlags, SFILE_VERIFY_CALLBACK VerifyCB, void * pvUserData, PSFILE_VERIFY_STATS pStats)
+{
+    TMPQArchive * ha = (TMPQArchive *)hMpq;
+    TFileEntry * pFileTableEnd;
+    TFileEntry * pFileEntry;
+    TMPQVerifyJob Job;
+    DWORD dwStartTime = StormGetTickCount();
+
+    // Verify input parameters
+    if(!IsValidMpqHandle(hMpq))
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // Unwritten changes would be verified against stale data
+    if(ha->dwFlags & MPQ_FLAG_CHANGED)
+        SFileFlushArchive(hMpq);
+
+    // The workers need the attributes and the callback gets the names.
+    // Load them now if the archive deferred them.
+    LoadDeferredListFile(ha);
+    LoadDeferredAttributes(ha);
+
+    // Prepare the job
+    memset(&Job, 0, sizeof(TMPQVerifyJob));
+    Job.ppFileEntries = STORM_ALLOC(TFileEntry *, ha->dwFileTableSize + 1);
+    if(Job.ppFileEntries == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return false;
+    }
+    Job.ha = ha;
+    Job.dwFlags = dwFlags;
+    Job.pfnVerifyCB = VerifyCB;
+    Job.pvUserData = pvUserData;
+
+    // Collect all existing files and sort them by their position in the MPQ
+    pFileTableEnd = ha->pFileTable + ha->dwFileTableSize;
+    for(pFileEntry = ha->pFileTable; pFileEntry < pFileTableEnd; pFileEntry++)
+    {
+        if(pFileEntry->dwFlags & MPQ_FILE_EXISTS)
+        {
+            Job.ppFileEntries[Job.dwFileCount++] = pFileEntry;
+            Job.TotalBytes += pFileEntry->dwCmpSize;
+        }
+    }
+    qsort(Job.ppFileEntries, Job.dwFileCount, sizeof(TFileEntry *), CompareFileEntriesByOffset);
+
+    // Run the verification on all CPUs, but don't start more threads than files.
+    // Report the number of threads that really ran, because some may fail to start.
+    StormInitLock(&Job.Lock);
+    Job.Stats.dwThreadCount = StormRunWorkers(VerifyWorker, &Job, STORMLIB_MIN(StormGetWorkerCount(), Job.dwFileCount));
+    StormFreeLock(&Job.Lock);
+    STORM_FREE(Job.ppFileEntries);
+
+    // Give the statistics to the caller
+    Job.Stats.dwElapsedTime = StormGetTickCount() - dwStartTime;
+    if(pStats != NULL)
+        *pStats = Job.Stats;
+
+    // If any file failed the verification, return false
+    if(Job.Stats.dwFailedCount != 0)
+    {
+        SetLastError(ERROR_FILE_CORRUPT);
+        return false;
+    }
+    return true;
+}
+
 // Verifies raw data of the archive Only works for MPQs version 4 or newer
 int WINAPI SFileVerifyRawData(HANDLE hMpq, DWORD dwWhatToVerify, const char * szFileName)
 {
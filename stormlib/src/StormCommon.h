@@ -61,6 +61,8 @@
 
 #define ID_MPQ_FILE            0x46494c45     // Used internally for checking TMPQFile ('FILE')
 
+#define HET_LOOKUP_BATCH       0x40           // Number of file names hashed at once by GetFileIndexes_Het
+
 // Prevent problems with CRT "min" and "max" functions,
 // as they are not defined on all platforms
 #define STORMLIB_MIN(a, b) ((a < b) ? a : b)
@@ -119,6 +121,44 @@ typedef struct _MPQ_SIGNATURE_INFO
 
 //#endif
 
+// Memory pool. Allocations are carved from big blocks and are never freed
+// one by one; the whole pool is released at once by FreeMemoryPool.
+#define MPQ_POOL_BLOCK_SIZE              0x10000
+
+void * AllocateFromPool(TMPQPoolBlock ** ppPool, size_t cbSize);
+char * StringDupFromPool(TMPQPoolBlock ** ppPool, const char * szString, size_t nLength);
+void FreeMemoryPool(TMPQPoolBlock ** ppPool);
+
+//-----------------------------------------------------------------------------
+// Locks and worker threads
+
+#ifdef PLATFORM_WINDOWS
+typedef CRITICAL_SECTION STORM_LOCK;
+typedef CONDITION_VARIABLE STORM_COND;
+#else
+#include <pthread.h>
+#include <time.h>
+typedef pthread_mutex_t STORM_LOCK;
+typedef pthread_cond_t STORM_COND;
+#endif
+
+// Maximum number of threads that work on one operation
+#define STORM_MAX_WORKERS               0x20
+
+typedef void (*STORM_WORKER)(void * pvContext);
+
+void  StormInitLock(STORM_LOCK * pLock);
+void  StormFreeLock(STORM_LOCK * pLock);
+void  StormLock(STORM_LOCK * pLock);
+void  StormUnlock(STORM_LOCK * pLock);
+void  StormInitCond(STORM_COND * pCond);
+void  StormFreeCond(STORM_COND * pCond);
+void  StormWaitCond(STORM_COND * pCond, STORM_LOCK * pLock);
+void  StormWakeAll(STORM_COND * pCond);
+DWORD StormGetWorkerCount();
+DWORD StormRunWorkers(STORM_WORKER pfnWorker, void * pvContext, DWORD dwWorkerCount);
+DWORD StormGetTickCount();
+
 //-----------------------------------------------------------------------------
 // StormLib internal global variables
 
@@ -152,9 +192,18 @@ void StringCat(TCHAR * szTarget, size_t cchTargetMax, const TCHAR * szSource);
 #define MPQ_HASH_FILE_KEY       0x300
 #define MPQ_HASH_KEY2_MIX       0x400
 
+// Precalculated hashes of a file name, as used by the hash table
+typedef struct _TMPQNameHash
+{
+    DWORD dwStartIndex;                         // Hash of the name with MPQ_HASH_TABLE_INDEX
+    DWORD dwName1;                              // Hash of the name with MPQ_HASH_NAME_A
+    DWORD dwName2;                              // Hash of the name with MPQ_HASH_NAME_B
+} TMPQNameHash;
+
 DWORD HashString(const char * szFileName, DWORD dwHashType);
 DWORD HashStringSlash(const char * szFileName, DWORD dwHashType);
 DWORD HashStringLower(const char * szFileName, DWORD dwHashType);
+void  HashFileName(TMPQArchive * ha, const char * szFileName, TMPQNameHash * pNameHash);
 
 void  InitializeMpqCryptography();
 
@@ -195,6 +244,7 @@ bool IsValidHashEntry(TMPQArchive * ha, TMPQHash * pHash);
 
 TMPQHash * FindFreeHashEntry(TMPQArchive * ha, DWORD dwStartIndex, DWORD dwName1, DWORD dwName2, LCID lcLocale);
 TMPQHash * GetFirstHashEntry(TMPQArchive * ha, const char * szFileName);
+TMPQHash * GetFirstHashEntryByHash(TMPQArchive * ha, TMPQNameHash * pNameHash);
 TMPQHash * GetNextHashEntry(TMPQArchive * ha, TMPQHash * pFirstHash, TMPQHash * pPrevHash);
 TMPQHash * AllocateHashEntry(TMPQArchive * ha, TFileEntry * pFileEntry, LCID lcLocale);
 
@@ -218,6 +268,9 @@ int  RebuildHetTable(TMPQArchive * ha);
 int  RebuildFileTable(TMPQArchive * ha, DWORD dwNewHashTableSize);
 int  SaveMPQTables(TMPQArchive * ha);
 
+TMPQHashIndex * CreateHashIndex(TMPQArchive * ha);
+bool IsNameInHashIndex(TMPQHashIndex * pHashIndex, DWORD dwName1, DWORD dwName2);
+
 TMPQHetTable * CreateHetTable(DWORD dwEntryCount, DWORD dwTotalCount, DWORD dwHashBitSize, LPBYTE pbSrcData);
 void FreeHetTable(TMPQHetTable * pHetTable);
 
@@ -228,6 +281,7 @@ void FreeBetTable(TMPQBetTable * pBetTable);
 TFileEntry * GetFileEntryLocale2(TMPQArchive * ha, const char * szFileName, LCID lcLocale, LPDWORD PtrHashIndex);
 TFileEntry * GetFileEntryLocale(TMPQArchive * ha, const char * szFileName, LCID lcLocale);
 TFileEntry * GetFileEntryExact(TMPQArchive * ha, const char * szFileName, LCID lcLocale, LPDWORD PtrHashIndex);
+void GetFileIndexes_Het(TMPQArchive * ha, const char ** szFileNames, DWORD dwNameCount, LPDWORD PtrFileIndexes);
 
 // Allocates file name in the file entry
 void AllocateFileName(TMPQArchive * ha, TFileEntry * pFileEntry, const char * szFileName);
@@ -240,6 +294,11 @@ int  DeleteFileEntry(TMPQArchive * ha, TMPQFile * hf);
 // Invalidates entries for (listfile) and (attributes)
 void InvalidateInternalFiles(TMPQArchive * ha);
 
+// Archives open with MPQ_OPEN_DEFER_LOAD load their (listfile) and (attributes)
+// by the first function that needs file names or file attributes
+void LoadDeferredListFile(TMPQArchive * ha);
+void LoadDeferredAttributes(TMPQArchive * ha);
+
 // Retrieves information about the strong signature
 bool QueryMpqSignatureInfo(TMPQArchive * ha, PMPQ_SIGNATURE_INFO pSignatureInfo);
 
@@ -262,6 +321,7 @@ int SCompDecompressMpk(void * pvOutBuffer, int * pcbOutBuffer, void * pvInBuffer
 TMPQFile * CreateFileHandle(TMPQArchive * ha, TFileEntry * pFileEntry);
 TMPQFile * CreateWritableHandle(TMPQArchive * ha, DWORD dwFileSize);
 void * LoadMpqTable(TMPQArchive * ha, ULONGLONG ByteOffset, DWORD dwCompressedSize, DWORD dwRealSize, DWORD dwKey, bool * pbTableIsCut);
+bool ReadMpqFileData(TMPQFile * hf, ULONGLONG RawFilePos, void * pvBuffer, DWORD dwBytesToRead);
 int  AllocateSectorBuffer(TMPQFile * hf);
 int  AllocatePatchInfo(TMPQFile * hf, bool bLoadFromFile);
 int  AllocateSectorOffsets(TMPQFile * hf, bool bLoadFromFile);
@@ -277,6 +337,10 @@ void FreeArchiveHandle(TMPQArchive *& ha);
 //-----------------------------------------------------------------------------
 // Patch functions
 
+// Maximum size of the patched data remembered by the base archive.
+// Files bigger than a quarter of this are always patched from scratch
+#define MPQ_PATCH_CACHE_SIZE    0x4000000
+
 // Structure used for the patching process
 typedef struct _TMPQPatcher
 {
@@ -290,6 +354,8 @@ typedef struct _TMPQPatcher
 } TMPQPatcher;
 
 bool IsIncrementalPatchFile(const void * pvData, DWORD cbData, LPDWORD pdwPatchedFileSize);
+bool Patch_LoadFromCache(TMPQFile * hf);
+void Patch_FreeCache(TMPQArchive * ha);
 int Patch_InitPatcher(TMPQPatcher * pPatcher, TMPQFile * hf);
 int Patch_Process(TMPQPatcher * pPatcher, TMPQFile * hf);
 void Patch_Finalize(TMPQPatcher * pPatcher);
@@ -298,8 +364,18 @@ void Patch_Finalize(TMPQPatcher * pPatcher);
 // Utility functions
 
 bool CheckWildCard(const char * szString, const char * szWildCard);
+void InvalidateNameIndex(TMPQArchive * ha);
 bool IsInternalMpqFileName(const char * szFileName);
 
+// Returns nonzero if any of the eight bytes in the value is zero.
+// There are no false positives, the returned value has bit 7 set in each zero byte
+inline ULONGLONG HasZeroByte64(ULONGLONG Value)
+{
+    ULONGLONG LowBits = 0x7F7F7F7F7F7F7F7FULL;
+
+    return ~(((Value & LowBits) + LowBits) | Value | LowBits);
+}
+
 template <typename XCHAR>
 const XCHAR * GetPlainFileName(const XCHAR * szFileName)
 {
@@ -197,6 +197,9 @@ extern "C" {
 #define MPQ_FLAG_ATTRIBUTES_NEW     0x00001000  // Set when (attributes) invalidated by InvalidateInternalFiles
 #define MPQ_FLAG_SIGNATURE_NONE     0x00002000  // Set when no (signature) was found in InvalidateInternalFiles
 #define MPQ_FLAG_SIGNATURE_NEW      0x00004000  // Set when (signature) invalidated by InvalidateInternalFiles
+#define MPQ_FLAG_LISTFILE_DEFERRED  0x00008000  // The (listfile) has not been loaded yet (MPQ_OPEN_DEFER_LOAD)
+#define MPQ_FLAG_ATTRIBUTES_DEFERRED 0x00010000 // The (attributes) have not been loaded yet (MPQ_OPEN_DEFER_LOAD)
+#define MPQ_FLAG_PARALLEL_COMPACT   0x00020000  // SFileCompactArchive copies the files on multiple threads (MPQ_OPEN_PARALLEL_COMPACT)
 
 // Values for TMPQArchive::dwSubType
 #define MPQ_SUBTYPE_MPQ             0x00000000  // The file is a MPQ file (Blizzard games)
@@ -322,6 +325,8 @@ extern "C" {
 #define MPQ_OPEN_FORCE_MPQ_V1       0x00080000  // Always open the archive as MPQ v 1.00, ignore the "wFormatVersion" variable in the header
 #define MPQ_OPEN_CHECK_SECTOR_CRC   0x00100000  // On files with MPQ_FILE_SECTOR_CRC, the CRC will be checked when reading file
 #define MPQ_OPEN_PATCH              0x00200000  // This archive is a patch MPQ. Used internally.
+#define MPQ_OPEN_DEFER_LOAD         0x00400000  // Load the (listfile) and (attributes) when first needed. Implies read-only access.
+#define MPQ_OPEN_PARALLEL_COMPACT   0x00800000  // SFileCompactArchive copies the files on all CPUs. The new archive is the same.
 #define MPQ_OPEN_READ_ONLY          STREAM_FLAG_READ_ONLY
 
 // Flags for SFileCreateArchive
@@ -473,6 +478,8 @@ typedef enum _SFileInfoClass
 typedef void (WINAPI * SFILE_DOWNLOAD_CALLBACK)(void * pvUserData, ULONGLONG ByteOffset, DWORD dwTotalBytes);
 typedef void (WINAPI * SFILE_ADDFILE_CALLBACK)(void * pvUserData, DWORD dwBytesWritten, DWORD dwTotalBytes, bool bFinalCall);
 typedef void (WINAPI * SFILE_COMPACT_CALLBACK)(void * pvUserData, DWORD dwWorkType, ULONGLONG BytesProcessed, ULONGLONG TotalBytes);
+typedef void (WINAPI * SFILE_VERIFY_CALLBACK)(void * pvUserData, DWORD dwFileIndex, const char * szFileName, DWORD dwVerifyResult, ULONGLONG BytesProcessed, ULONGLONG TotalBytes);
+typedef DWORD (WINAPI * SFILE_COMPRESSION_POLICY)(void * pvUserData, const char * szArchivedName, LPBYTE pbSample, DWORD cbSample, DWORD dwSectorSize);
 
 typedef struct TFileStream TFileStream;
 
@@ -768,6 +775,40 @@ typedef struct _TMPQHetTable
     DWORD      dwIndexSize;                     // Effective size of one entry in pBetIndexes (in bits)
 } TMPQHetTable;
 
+// Entry of the hash index
+typedef struct _TMPQHashIndexEntry
+{
+    DWORD      dwName1;                         // Copy of TMPQHash::dwName1
+    DWORD      dwName2;                         // Copy of TMPQHash::dwName2
+} TMPQHashIndexEntry;
+
+// In-memory index of the name hashes in the hash table. Only built for read-only archives.
+// Allows to find out that a file is not in the MPQ without walking the hash table
+typedef struct _TMPQHashIndex
+{
+    DWORD      dwIndexMask;                     // Number of entries - 1. The number of entries is a power of two
+    DWORD      dwEntryCount;                    // Number of occupied entries
+    TMPQHashIndexEntry Entries[1];              // Open-addressed array of name hashes. Empty entries are zeroed
+} TMPQHashIndex;
+
+// Item of the name index. Refers to one hash table entry, or to one file entry if there is no hash table
+typedef struct _TMPQNameIndexItem
+{
+    const char * szFileName;                    // File name without the patch prefix. NULL for files without name
+    DWORD      dwHashIndex;                     // Index of the hash table entry (HASH_ENTRY_FREE if there is no hash table)
+    DWORD      dwBlockIndex;                    // Index of the file entry
+} TMPQNameIndexItem;
+
+// File names of the archive, sorted case-insensitively. Built by the first file search
+// and dropped whenever the file table changes. Open searches hold a reference to it
+typedef struct _TMPQNameIndex
+{
+    DWORD      dwRefCount;                      // Number of references (the archive and all open searches)
+    DWORD      dwNamedCount;                    // Number of sorted items with file name
+    DWORD      dwUnnamedCount;                  // Number of items without file name, following the sorted ones
+    TMPQNameIndexItem Items[1];                 // Array of index items (variable length)
+} TMPQNameIndex;
+
 // Structure for parsed BET table
 typedef struct _TMPQBetTable
 {
@@ -813,6 +854,34 @@ typedef struct _TMPQNameCache
 
 } TMPQNameCache;
 
+// Block of a memory pool. Followed by cbBlockSize bytes of data
+typedef struct _TMPQPoolBlock
+{
+    struct _TMPQPoolBlock * pNext;              // Previously allocated block
+    size_t         cbBlockSize;                 // Size of the data in the block, in bytes
+    size_t         cbBlockUsed;                 // Number of bytes already given away
+} TMPQPoolBlock;
+
+// Cached result of the patching process. Followed by cbFileData bytes of patched data
+typedef struct _TMPQPatchCache
+{
+    struct _TMPQPatchCache * pNext;             // Next (less recently used) entry
+    BYTE           base_md5[MD5_DIGEST_SIZE];   // MD5 of the base file
+    BYTE           chain_md5[MD5_DIGEST_SIZE];  // MD5 of the identities of the base file and all its patches
+    DWORD          cbFileData;                  // Size of the patched file data
+} TMPQPatchCache;
+
+// File sector compressed in advance by SFileAddFiles. When the same sector is written
+// to the MPQ with the same compression, the compressed data are taken from here
+typedef struct _TMPQCompressedSector
+{
+    LPBYTE         pbCompressed;                // Compressed sector data. NULL if the sector has not been compressed
+    DWORD          cbCompressed;                // Size of the compressed data
+    DWORD          cbSector;                    // Size of the sector before compression
+    DWORD          dwFlags;                     // MPQ_FILE_IMPLODE or MPQ_FILE_COMPRESS
+    DWORD          dwCompression;               // Compression the sector has been compressed with (MPQ_FILE_COMPRESS only)
+} TMPQCompressedSector;
+
 // Archive handle structure
 typedef struct _TMPQArchive
 {
@@ -830,7 +899,12 @@ typedef struct _TMPQArchive
     TMPQHeader   * pHeader;                     // MPQ file header
     TMPQHash     * pHashTable;                  // Hash table
     TMPQHetTable * pHetTable;                   // HET table
+    TMPQHashIndex * pHashIndex;                 // Index of the name hashes from the hash table (read-only MPQs only)
+    TMPQNameIndex * pNameIndex;                 // Sorted file names for file searches. NULL if not built yet
     TFileEntry   * pFileTable;                  // File table
+    TMPQPoolBlock * pMemoryPool;                // Memory pool for the file table, file names and other tables. Freed at once
+    TMPQPatchCache * pPatchCache;               // Most recently used patched files, if the archive has patches
+    size_t         cbPatchCache;                // Total size of the patched data in pPatchCache
     HASH_STRING    pfnHashString;               // Hashing function that will convert the file name into hash
     
     TMPQUserData   UserData;                    // MPQ user data. Valid only when ID_MPQ_USERDATA has been found
@@ -852,6 +926,14 @@ typedef struct _TMPQArchive
     SFILE_ADDFILE_CALLBACK pfnAddFileCB;        // Callback function for adding files
     void         * pvAddFileUserData;           // User data thats passed to the callback
 
+    SFILE_COMPRESSION_POLICY pfnCompressionCB;  // Callback function choosing the compression of added files
+    void         * pvCompressionUserData;       // User data thats passed to the callback
+    ULONGLONG      AddedFileBytes;              // Bytes of file data added by SFileAddFileEx, before compression
+    ULONGLONG      AddedRawBytes;               // Bytes of file data added by SFileAddFileEx, as stored in the MPQ
+    ULONGLONG      AddedDecodeCost;             // Relative cost of decompressing the added files, as bytes multiplied by the cost per KB
+    DWORD          dwAddedFiles;                // Number of files added by SFileAddFileEx
+    DWORD          dwAddedStoredFiles;          // Number of added files that are stored without compression
+
     SFILE_COMPACT_CALLBACK pfnCompactCB;        // Callback function for compacting the archive
     ULONGLONG      CompactBytesProcessed;       // Amount of bytes that have been processed during a particular compact call
     ULONGLONG      CompactTotalBytes;           // Total amount of bytes to be compacted
@@ -879,6 +961,8 @@ typedef struct _TMPQFile
     LPDWORD        SectorChksums;               // Array of sector checksums (either ADLER32 or MD5) values for each file sector
     LPBYTE         pbFileData;                  // Data of the file (single unit files, patched files)
     DWORD          cbFileData;                  // Size of file data
+    LPBYTE         pbRawData;                   // Raw file data loaded in advance, starting at RawFilePos (not owned by the handle)
+    DWORD          cbRawData;                   // Size of the raw data loaded in advance
     DWORD          dwCompression0;              // Compression that will be used on the first file sector
     DWORD          dwSectorCount;               // Number of sectors in the file
     DWORD          dwPatchedFileSize;           // Size of patched file. Used when saving patch file to the MPQ
@@ -888,6 +972,9 @@ typedef struct _TMPQFile
     DWORD          dwSectorOffs;                // File position of currently loaded file sector
     DWORD          dwSectorSize;                // Size of the file sector. For single unit files, this is equal to the file size
 
+    TMPQCompressedSector * pCompressedSectors;  // Sectors compressed in advance. Only used when saving file to MPQ
+    DWORD          dwCompressedSectors;         // Number of entries in pCompressedSectors
+
     unsigned char  hctx[HASH_STATE_SIZE];       // Hash state for MD5. Used when saving file to MPQ
     DWORD          dwCrc32;                     // CRC32 value, used when saving file to MPQ
 
@@ -914,6 +1001,50 @@ typedef struct _SFILE_FIND_DATA
 
 } SFILE_FIND_DATA, *PSFILE_FIND_DATA;
 
+// Statistics of SFileVerifyAllFiles
+typedef struct _SFILE_VERIFY_STATS
+{
+    DWORD dwFileCount;                          // Number of verified files
+    DWORD dwFailedCount;                        // Number of files that failed the verification
+    ULONGLONG RawBytes;                         // Bytes of file data read from the MPQ
+    ULONGLONG FileBytes;                        // Bytes of file data after decompression
+    DWORD dwElapsedTime;                        // Duration of the verification, in milliseconds
+    DWORD dwThreadCount;                        // Number of threads that verified the files
+} SFILE_VERIFY_STATS, *PSFILE_VERIFY_STATS;
+
+// Statistics of the files added by SFileAddFileEx and SFileAddFiles
+typedef struct _SFILE_COMPRESSION_STATS
+{
+    DWORD dwFileCount;                          // Number of added files
+    DWORD dwStoredCount;                        // Number of files stored without compression
+    ULONGLONG FileBytes;                        // Bytes of file data before compression
+    ULONGLONG RawBytes;                         // Bytes of file data stored in the MPQ
+    DWORD dwRatio;                              // RawBytes in percent of FileBytes
+    DWORD dwDecodeCost;                         // Relative cost of decompressing all added files. Not a time; 100 = one KB of ZLIB data
+} SFILE_COMPRESSION_STATS, *PSFILE_COMPRESSION_STATS;
+
+// Settings for SFileAutoCompression. If pvUserData is NULL, the default settings are used
+#define SFILE_AUTO_COMPRESSION_CANDIDATES   8
+
+typedef struct _SFILE_AUTO_COMPRESSION
+{
+    DWORD dwCandidates[SFILE_AUTO_COMPRESSION_CANDIDATES];  // Compressions to try, terminated by zero (default: ZLIB, BZIP2)
+    DWORD dwMinSaving;                          // Files that don't shrink by at least this many percent are stored (default 5)
+    DWORD dwTolerance;                          // Compressions up to this many percent bigger than the best one are taken, if they decompress faster (default 3)
+    DWORD dwMaxDecodeCost;                      // Compressions that cost more to decompress per KB are not tried (ZLIB = 100). Zero = no limit
+} SFILE_AUTO_COMPRESSION, *PSFILE_AUTO_COMPRESSION;
+
+// One file for SFileAddFiles
+typedef struct _SFILE_ADD_FILE
+{
+    const TCHAR * szFileName;                   // Name of the local file
+    const char * szArchivedName;                // Name of the file in the MPQ
+    DWORD dwFlags;                              // MPQ_FILE_XXX, same like for SFileAddFileEx
+    DWORD dwCompression;                        // Compression of the first sector, same like for SFileAddFileEx
+    DWORD dwCompressionNext;                    // Compression of next sectors, same like for SFileAddFileEx
+    DWORD dwErrorCode;                          // [out] ERROR_SUCCESS if the file has been added
+} SFILE_ADD_FILE, *PSFILE_ADD_FILE;
+
 typedef struct _SFILE_CREATE_MPQ
 {
     DWORD cbSize;                               // Size of this structure, in bytes
@@ -947,6 +1078,16 @@ typedef struct _TStreamBitmap
 
 } TStreamBitmap;
 
+// One read request for FileStream_ReadBatch
+typedef struct _TStreamRead
+{
+    ULONGLONG ByteOffset;                       // Offset of the data in the stream
+    void * pvBuffer;                            // Buffer that receives the data
+    DWORD dwBytesToRead;                        // Number of bytes to read
+    DWORD dwErrCode;                            // Receives ERROR_SUCCESS or the error of this particular read (see FileStream_ReadBatch)
+
+} TStreamRead;
+
 // UNICODE versions of the file access functions
 TFileStream * FileStream_CreateFile(const TCHAR * szFileName, DWORD dwStreamFlags);
 TFileStream * FileStream_OpenFile(const TCHAR * szFileName, DWORD dwStreamFlags);
@@ -957,6 +1098,7 @@ bool FileStream_SetCallback(TFileStream * pStream, SFILE_DOWNLOAD_CALLBACK pfnCa
 
 bool FileStream_GetBitmap(TFileStream * pStream, void * pvBitmap, DWORD cbBitmap, LPDWORD pcbLengthNeeded);
 bool FileStream_Read(TFileStream * pStream, ULONGLONG * pByteOffset, void * pvBuffer, DWORD dwBytesToRead);
+bool FileStream_ReadBatch(TFileStream * pStream, TStreamRead * pReads, DWORD dwReadCount);
 bool FileStream_Write(TFileStream * pStream, ULONGLONG * pByteOffset, const void * pvBuffer, DWORD dwBytesToWrite);
 bool FileStream_SetSize(TFileStream * pStream, ULONGLONG NewFileSize);
 bool FileStream_GetSize(TFileStream * pStream, ULONGLONG * pFileSize);
@@ -1049,6 +1191,10 @@ bool   WINAPI SFileGetFileChecksums(HANDLE hMpq, const char * szFileName, LPDWOR
 // For dwFlags, use one or more of MPQ_ATTRIBUTE_MD5
 DWORD  WINAPI SFileVerifyFile(HANDLE hMpq, const char * szFileName, DWORD dwFlags);
 
+// Verifies all files in the archive on multiple threads, in the order of their position in the MPQ.
+// The callback receives the result of every file. Returns false if any file failed.
+bool   WINAPI SFileVerifyAllFiles(HANDLE hMpq, DWORD dwFlags, SFILE_VERIFY_CALLBACK VerifyCB, void * pvUserData, PSFILE_VERIFY_STATS pStats);
+
 // Verifies raw data of the archive. Only works for MPQs version 4 or newer
 int    WINAPI SFileVerifyRawData(HANDLE hMpq, DWORD dwWhatToVerify, const char * szFileName);
 
@@ -1079,11 +1225,15 @@ bool   WINAPI SFileFinishFile(HANDLE hFile);
 
 bool   WINAPI SFileAddFileEx(HANDLE hMpq, const TCHAR * szFileName, const char * szArchivedName, DWORD dwFlags, DWORD dwCompression, DWORD dwCompressionNext);
 bool   WINAPI SFileAddFile(HANDLE hMpq, const TCHAR * szFileName, const char * szArchivedName, DWORD dwFlags); 
+bool   WINAPI SFileAddFiles(HANDLE hMpq, PSFILE_ADD_FILE pAddFiles, DWORD dwFileCount);
 bool   WINAPI SFileAddWave(HANDLE hMpq, const TCHAR * szFileName, const char * szArchivedName, DWORD dwFlags, DWORD dwQuality); 
 bool   WINAPI SFileRemoveFile(HANDLE hMpq, const char * szFileName, DWORD dwSearchScope);
 bool   WINAPI SFileRenameFile(HANDLE hMpq, const char * szOldFileName, const char * szNewFileName);
 bool   WINAPI SFileSetFileLocale(HANDLE hFile, LCID lcNewLocale);
 bool   WINAPI SFileSetDataCompression(DWORD DataCompression);
+bool   WINAPI SFileSetCompressionPolicy(HANDLE hMpq, SFILE_COMPRESSION_POLICY CompressionCB, void * pvUserData);
+bool   WINAPI SFileGetCompressionStats(HANDLE hMpq, PSFILE_COMPRESSION_STATS pStats);
+DWORD  WINAPI SFileAutoCompression(void * pvUserData, const char * szArchivedName, LPBYTE pbSample, DWORD cbSample, DWORD dwSectorSize);
 
 bool   WINAPI SFileSetAddFileCallback(HANDLE hMpq, SFILE_ADDFILE_CALLBACK AddFileCB, void * pvUserData);
 